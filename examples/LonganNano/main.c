@@ -34,6 +34,7 @@
 #include "lib/gpio.h"
 #include "lib/stdio-usbacm.h"
 #include "lib/stdio-uart0.h"
+#include "lib/usbfs-msc.h"
 
 #include "LonganNano.h"
 #include "display.h"
@@ -141,6 +142,23 @@ listdir(struct term *term, const char *path)
 	return res;
 }
 
+static int
+sdmsc_read(uint32_t lba, void *buf)
+{
+	return sd_readblock(lba, buf) ? -1 : 0;
+}
+
+static int
+sdmsc_write(uint32_t lba, const void *buf)
+{
+	return sd_writeblock(lba, buf) ? -1 : 0;
+}
+
+static struct usbmsc_disk sdmsc = {
+	.read = sdmsc_read,
+	.write = sdmsc_write,
+};
+
 int main(void)
 {
 	struct term term;
@@ -184,11 +202,22 @@ int main(void)
 	term_init(&term, 0xfff, 0x000);
 
 	sd_init();
-	if (f_mount(&fs, "", 1) == FR_OK)
+	if (f_mount(&fs, "", 1) == FR_OK) {
 		listdir(&term, "");
+		/* the host owns the filesystem from now on */
+		f_mount(NULL, "", 0);
+		if (sd_getblocks(&sdmsc.blocks) == 0)
+			usbmsc_attach(&sdmsc);
+	}
 
 	while (1) {
-		int c = usbacm_getchar();
+		unsigned char c;
+
+		usbmsc_poll();
+		if (usbacm_read(&c, 1, 0) == 0) {
+			usbfs_idle();
+			continue;
+		}
 
 		switch (c) {
 		case '\r':
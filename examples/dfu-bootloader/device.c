@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2019, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#include <stdint.h>
+
+#include "lib/usbfs-core.h"
+
+#include "dfu.h"
+
+static const struct usb_descriptor_device usbfs_descriptor_device = {
+	.bLength            = 18,
+	.bDescriptorType    = 0x01, /* Device */
+	.bcdUSB             = 0x0200,
+	.bDeviceClass       = 0x00, /* 0x00 = per interface */
+	.bDeviceSubClass    = 0x00,
+	.bDeviceProtocol    = 0x00,
+	.bMaxPacketSize0    = USBFS_EP0_PACKETSIZE,
+	.idVendor           = 0x1d50, /* OpenMoko vendor id */
+	.idProduct          = 0x613e, /* GeckoBoot product id */
+	.bcdDevice          = 0x0200,
+	.iManufacturer      = 1,
+	.iProduct           = 2,
+	.iSerialNumber      = 3,
+	.bNumConfigurations = 1,
+};
+
+struct dfu_descriptor_functional {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bmAttributes;
+	uint16_t wDetachTimeOut;
+	uint16_t wTransferSize;
+	uint16_t bcdDFUVersion;
+} __attribute__((packed));
+
+struct dfu_descriptor_configuration {
+	struct usb_descriptor_configuration config;
+	struct usb_descriptor_interface dfu;
+	struct dfu_descriptor_functional dfu_functional;
+} __attribute__((packed));
+
+static const struct dfu_descriptor_configuration usbfs_descriptor_configuration1 = {
+	.config = USB_CONFIGURATION(struct dfu_descriptor_configuration,
+			1, 1, 0x00, 500),
+	/* only the control pipe is used */
+	.dfu = USB_INTERFACE(DFU_INTERFACE, 0,
+			0xFE,  /* application specific */
+			0x01,  /* device firmware upgrade */
+			0x02,  /* DFU mode protocol */
+			4),
+	.dfu_functional = {
+		.bLength         = sizeof(struct dfu_descriptor_functional),
+		.bDescriptorType = 0x21,   /* DFU Interface */
+		.bmAttributes    = 0x0f,   /* download, upload, detach and manifest tolerant */
+		.wDetachTimeOut  = 500,    /* 500ms */
+		.wTransferSize   = DFU_TRANSFERSIZE,
+		.bcdDFUVersion   = 0x0101, /* DFU v1.1 */
+	},
+};
+
+static const struct usb_descriptor_string usbfs_descriptor_string0 = {
+	.bLength         = 4,
+	.bDescriptorType = 0x03, /* String */
+	.wCodepoint = {
+		0x0409, /* English (US) */
+	},
+};
+
+static const struct usb_descriptor_string usbfs_descriptor_manufacturer =
+	USB_STRING(u"Labitat");
+
+static const struct usb_descriptor_string usbfs_descriptor_product =
+	USB_STRING(u"GD32VF103");
+
+/* must be at least 12 characters long and consist of only '0'-'9','A'-'B'
+ * at least according to the mass-storage bulk-only document */
+static const struct usb_descriptor_string usbfs_descriptor_serial =
+	USB_STRING(u"000000000001");
+
+static const struct usb_descriptor_string usbfs_descriptor_dfu =
+	USB_STRING(u"GeckoBoot");
+
+static const struct usb_descriptor_string *const usbfs_descriptor_string[] = {
+	&usbfs_descriptor_string0,
+	&usbfs_descriptor_manufacturer,
+	&usbfs_descriptor_product,
+	&usbfs_descriptor_serial,
+	&usbfs_descriptor_dfu,
+#ifdef DFU_STRING_STATUS
+	&dfu_descriptor_status,
+#endif
+};
+
+static uint32_t usbfs_ep0buf[DFU_TRANSFERSIZE/4];
+
+static const struct usbfs_class *const usbfs_classes[] = {
+	&dfu_class,
+};
+
+const struct usbfs_device usbfs_device = {
+	.device = &usbfs_descriptor_device,
+	.configuration = &usbfs_descriptor_configuration1.config,
+	.string = usbfs_descriptor_string,
+	.strings = ARRAY_SIZE(usbfs_descriptor_string),
+	.class = usbfs_classes,
+	.classes = ARRAY_SIZE(usbfs_classes),
+	.ep0buf = usbfs_ep0buf,
+	.ep0size = sizeof(usbfs_ep0buf),
+	.fifo = USBFS_FIFO(0, 0, 0),
+};
@@ -29,8 +29,13 @@
 
 #include "gd32vf103/info.h"
 
+#include "lib/eclic.h"
+#include "lib/mtimer.h"
+
 #include "dfu.h"
 #include "flash.h"
+#include "image.h"
+#include "lz.h"
 
 #ifdef NDEBUG
 #define debug(...)
@@ -79,7 +84,33 @@ static struct {
 	uint8_t iString;
 } dfu_status;
 
-int
+#ifdef DFU_STRING_STATUS
+/* pages skipped, programmed and erased by the last download */
+struct usb_descriptor_string dfu_descriptor_status =
+	USB_STRING(u"skip 000 prog 000 erase 000");
+
+static void
+dfu_status_number(unsigned int end, unsigned int n)
+{
+	uint16_t *p = &dfu_descriptor_status.wCodepoint[end];
+
+	for (unsigned int i = 0; i < 3; i++, n /= 10)
+		*--p = u'0' + n % 10;
+}
+
+static void
+dfu_status_update(void)
+{
+	dfu_status_number(8, flash_stats.skipped);
+	dfu_status_number(17, flash_stats.programmed);
+	dfu_status_number(27, flash_stats.erased);
+}
+#else
+/* the release build has no room for the string */
+#define dfu_status_update()
+#endif
+
+static int
 dfu_detach(const struct usb_setup_packet *p, const void **data)
 {
 	debug("DFU_DETACH\n");
@@ -89,28 +120,120 @@ dfu_detach(const struct usb_setup_packet *p, const void **data)
 	return 0;
 }
 
-int
+/*
+ * Downloaded data is collected in two page buffers. When one is
+ * full it is handed to dfu_poll() in the main loop, which programs
+ * it while the host sends the next page into the other buffer.
+ * Only when both buffers are full does GETSTATUS report dfuDNBUSY,
+ * with a poll timeout of the time left of the page being programmed.
+ *
+ * With DFU_LZ defined compressed images (see lz.h) are decoded into
+ * the page buffers by dfu_poll(), which then double as the window of
+ * the decoder. The input is read straight from the ep0 buffer. Here
+ * GETSTATUS reports dfuDNBUSY until the whole transfer is decoded,
+ * and the host can't send the next one before that.
+ */
+static union {
+	uint8_t bytes[LZ_RING];
+	uint32_t words[2][PAGE_SIZE/4];
+} dfu_buf;
+_Static_assert(LZ_RING == 2*PAGE_SIZE, "LZ window must match the page size");
+/* pages filled by dfu_dnload() and programmed by dfu_poll() */
+static volatile uint8_t dfu_head;
+static volatile uint8_t dfu_tail;
+static unsigned int dfu_offset;
+static uint32_t dfu_addr;
+/* size of the downloaded image */
+static uint32_t dfu_size;
+/* set when the image is complete until it is verified */
+static volatile bool dfu_manifest;
+/* mtime_lo when programming of the current page started */
+static volatile uint32_t dfu_page_start;
+/* mtimer ticks programming the last page took */
+static volatile uint32_t dfu_page_ticks = 60 * (MTIMER_FREQ/1000);
+/* the decoder of a compressed download, size is 0 for raw images */
+static struct lz dfu_lz;
+/* the transfer being decoded, still in the ep0 buffer */
+static const uint8_t *dfu_in;
+static volatile unsigned int dfu_in_len;
+static unsigned int dfu_in_pos;
+
+#ifdef DFU_LZ
+#define dfu_compressed() (dfu_lz.size > 0)
+#else
+/* lets the compiler drop the decoder */
+#define dfu_compressed() false
+#endif
+
+static unsigned int
+dfu_space(void)
+{
+	return (2 - (uint8_t)(dfu_head - dfu_tail)) * PAGE_SIZE - dfu_offset;
+}
+
+static void
+dfu_poll_timeout(uint32_t ms)
+{
+	dfu_status.bwPollTimeout[0] = ms;
+	dfu_status.bwPollTimeout[1] = ms >> 8;
+	dfu_status.bwPollTimeout[2] = ms >> 16;
+}
+
+/* update the state after a download and return true if still busy */
+static bool
+dfu_dnload_busy(unsigned int space)
+{
+	uint32_t elapsed;
+	uint32_t left;
+
+	if (dfu_status.bState == DFU_dfuERROR)
+		return false;
+	if ((!dfu_compressed() || dfu_in_len == 0) &&
+			!dfu_manifest && dfu_space() >= space) {
+		dfu_poll_timeout(0);
+		return false;
+	}
+
+	/* wait for the page being programmed or decoded */
+	elapsed = MTIMER->mtime_lo - dfu_page_start;
+	left = (elapsed < dfu_page_ticks) ? dfu_page_ticks - elapsed : 0;
+	dfu_poll_timeout(left / (MTIMER_FREQ/1000) + 1);
+	return true;
+}
+
+static int
 dfu_dnload(const struct usb_setup_packet *p, const void **data)
 {
-	static uint32_t addr;
-	static union {
-		uint8_t bytes[PAGE_SIZE];
-		uint32_t words[PAGE_SIZE/4];
-	} buf;
-	static uint8_t *bp;
-	const uint8_t *sp;
+	const uint8_t *sp = *data;
+	unsigned int len = p->wLength;
 
 	debug("DFU_DNLOAD: wValue = %hu, wLength = %hu\n",
 			p->wValue, p->wLength);
 
 	switch (dfu_status.bState) {
 	case DFU_dfuIDLE:
-#ifdef NDEBUG
-		addr = FLASH_BASE + 4*PAGE_SIZE;
-#else
-		addr = FLASH_BASE + 32*PAGE_SIZE;
+		/* a download must have data, see DFU 1.1 section 6.1.1 */
+		if (len == 0 || dfu_head != dfu_tail)
+			return -1;
+		dfu_addr = IMAGE_START;
+		dfu_size = 0;
+		dfu_offset = 0;
+		flash_stats.skipped = 0;
+		flash_stats.programmed = 0;
+		flash_stats.erased = 0;
+		dfu_status_update();
+		lz_init(&dfu_lz, 0);
+#ifdef DFU_LZ
+		if (len >= LZ_HEADER && ((const uint32_t *)sp)[0] == LZ_MAGIC) {
+			uint32_t size = ((const uint32_t *)sp)[1];
+
+			if (size == 0)
+				return -1;
+			lz_init(&dfu_lz, size);
+			sp += LZ_HEADER;
+			len -= LZ_HEADER;
+		}
 #endif
-		bp = &buf.bytes[0];
 		break;
 	case DFU_dfuDNLOAD_IDLE:
 		break;
@@ -119,46 +242,155 @@ dfu_dnload(const struct usb_setup_packet *p, const void **data)
 	}
 
 	if (p->wLength == 0) {
-		if (bp != &buf.bytes[0]) {
-			while (bp < ARRAY_END(buf.bytes))
-				*bp++ = 0xFFU;
-			if (addr >= FLASH_BASE + INFO->FLASH * PAGE_SIZE)
-				goto err_addr;
-			if (flash_page(addr, buf.words))
-				goto err_write;
+		if (dfu_compressed() && dfu_lz.done < dfu_lz.size) {
+			dfu_status.bStatus = DFU_errNOTDONE;
+			dfu_status.bState = DFU_dfuERROR;
+			return -1;
 		}
+		if (dfu_compressed())
+			dfu_size = dfu_lz.size;
+		if (dfu_offset > 0) {
+			uint8_t *bp = &dfu_buf.bytes[(dfu_head % 2) * PAGE_SIZE];
+
+			while (dfu_offset < PAGE_SIZE)
+				bp[dfu_offset++] = 0xFFU;
+			dfu_offset = 0;
+			dfu_head++;
+		}
+		dfu_manifest = true;
 		dfu_status.bState = DFU_dfuMANIFEST_SYNC;
 		return 0;
 	}
 
-	sp = *data;
-	for (unsigned int len = p->wLength; len > 0; len--) {
-		*bp++ = *sp++;
-		if (bp < ARRAY_END(buf.bytes))
-			continue;
-
-		if (addr >= FLASH_BASE + INFO->FLASH * PAGE_SIZE)
-			goto err_addr;
-		if (flash_page(addr, buf.words))
-			goto err_write;
+	if (dfu_compressed()) {
+		/* we only go to dfuDNLOAD_IDLE when dfu_in is decoded */
+		dfu_in = sp;
+		dfu_in_pos = 0;
+		dfu_in_len = len;
+		dfu_status.bState = DFU_dfuDNLOAD_SYNC;
+		return 0;
+	}
 
-		addr += ARRAY_SIZE(buf.bytes);
-		bp = &buf.bytes[0];
+	/* we only go to dfuDNLOAD_IDLE with room for a whole transfer */
+	dfu_size += len;
+	for (; len > 0; len--) {
+		dfu_buf.bytes[(dfu_head % 2) * PAGE_SIZE + dfu_offset++] = *sp++;
+		if (dfu_offset < PAGE_SIZE)
+			continue;
+		dfu_offset = 0;
+		dfu_head++;
 	}
 
 	dfu_status.bState = DFU_dfuDNLOAD_SYNC;
 	return 0;
-err_addr:
-	dfu_status.bStatus = DFU_errADDRESS;
-	dfu_status.bState = DFU_dfuERROR;
-	return 0;
-err_write:
-	dfu_status.bStatus = DFU_errWRITE;
+}
+
+/* report an error found by dfu_poll() and drop everything queued */
+static void
+dfu_error(uint8_t status)
+{
+	unsigned long mstatus = eclic_global_interrupt_disable_save();
+
+	flash_lock();
+	dfu_status.bStatus = status;
 	dfu_status.bState = DFU_dfuERROR;
-	return 0;
+	dfu_offset = 0;
+	dfu_in_len = 0;
+	dfu_tail = dfu_head;
+	dfu_manifest = false;
+	eclic_global_interrupt_restore(mstatus);
+}
+
+/* check the trailer of the new image, if it has one */
+static void
+dfu_finish(void)
+{
+	if (image_verify(dfu_size)) {
+		dfu_error(DFU_errVERIFY);
+		return;
+	}
+	dfu_manifest = false;
+}
+
+static void
+dfu_decode(void)
+{
+	const uint8_t *in = &dfu_in[dfu_in_pos];
+	unsigned int space = dfu_space();
+	int n = lz_decode(&dfu_lz, &in, &dfu_in[dfu_in_len], dfu_buf.bytes,
+			(dfu_head % 2) * PAGE_SIZE + dfu_offset, space);
+	bool done;
+
+	if (n < 0) {
+		dfu_error(DFU_errFILE);
+		return;
+	}
+	dfu_in_pos = in - dfu_in;
+
+	done = dfu_lz.done == dfu_lz.size ||
+		(dfu_in_pos == dfu_in_len && (unsigned int)n < space);
+
+	n += dfu_offset;
+	dfu_offset = n % PAGE_SIZE;
+	dfu_head += n / PAGE_SIZE;
+
+	/*
+	 * the transfer is done when the decoder runs out of input rather
+	 * than space, otherwise a match may still be pending. anything
+	 * after the end of the image is ignored. the next transfer may
+	 * arrive as soon as dfu_in_len is cleared, so do that last.
+	 */
+	if (done) {
+		__asm__ ("" ::: "memory");
+		dfu_in_len = 0;
+	}
+}
+
+bool
+dfu_poll(void)
+{
+	uint32_t start;
+	int ret;
+
+	if (dfu_compressed() && dfu_in_len > 0 && dfu_space() > 0) {
+		dfu_decode();
+		return true;
+	}
+
+	if (dfu_head == dfu_tail) {
+		if (!dfu_manifest)
+			return false;
+		if (dfu_size == 0)
+			dfu_error(DFU_errNOTDONE);
+		else
+			dfu_finish();
+		return true;
+	}
+
+	start = MTIMER->mtime_lo;
+	dfu_page_start = start;
+	if (dfu_addr >= FLASH_BASE + INFO->FLASH * PAGE_SIZE)
+		ret = DFU_errADDRESS;
+	else if (flash_unlock() || flash_page(dfu_addr, dfu_buf.words[dfu_tail % 2]))
+		ret = DFU_errWRITE;
+	else
+		ret = DFU_OK;
+	dfu_page_ticks = MTIMER->mtime_lo - start;
+	dfu_addr += PAGE_SIZE;
+	dfu_status_update();
+
+	if (ret != DFU_OK) {
+		dfu_error(ret);
+		return true;
+	}
+
+	/* keep the flash unlocked only while there are pages queued */
+	if (++dfu_tail == dfu_head)
+		flash_lock();
+	return true;
 }
 
-int
+static int
 dfu_upload(const struct usb_setup_packet *p, const void **data)
 {
 	static uint32_t offset;
@@ -169,11 +401,7 @@ dfu_upload(const struct usb_setup_packet *p, const void **data)
 
 	switch (dfu_status.bState) {
 	case DFU_dfuIDLE:
-#ifdef NDEBUG
-		offset = 4*PAGE_SIZE;
-#else
-		offset = 32*PAGE_SIZE;
-#endif
+		offset = IMAGE_START - FLASH_BASE;
 		break;
 	case DFU_dfuUPLOAD_IDLE:
 		break;
@@ -194,17 +422,27 @@ dfu_upload(const struct usb_setup_packet *p, const void **data)
 	return ret;
 }
 
-int
+static int
 dfu_getstatus(const struct usb_setup_packet *p, const void **data)
 {
 	debug("DFU_GETSTATUS\n");
 
 	switch (dfu_status.bState) {
 	case DFU_dfuDNLOAD_SYNC:
-		dfu_status.bState = DFU_dfuDNLOAD_IDLE;
+	case DFU_dfuDNBUSY:
+		if (dfu_dnload_busy(dfu_compressed() ? 0 : DFU_TRANSFERSIZE))
+			dfu_status.bState = DFU_dfuDNBUSY;
+		else
+			dfu_status.bState = DFU_dfuDNLOAD_IDLE;
 		break;
 	case DFU_dfuMANIFEST_SYNC:
-		dfu_status.bState = DFU_dfuIDLE;
+	case DFU_dfuMANIFEST:
+		/* manifestation is done when every page is programmed
+		 * and the image is verified */
+		if (dfu_dnload_busy(2 * PAGE_SIZE))
+			dfu_status.bState = DFU_dfuMANIFEST;
+		else
+			dfu_status.bState = DFU_dfuIDLE;
 		break;
 	}
 
@@ -212,7 +450,7 @@ dfu_getstatus(const struct usb_setup_packet *p, const void **data)
 	return sizeof(dfu_status);
 }
 
-int
+static int
 dfu_clrstatus(const struct usb_setup_packet *p, const void **data)
 {
 	debug("DFU_CLRSTATUS\n");
@@ -225,7 +463,7 @@ dfu_clrstatus(const struct usb_setup_packet *p, const void **data)
 	return 0;
 }
 
-int
+static int
 dfu_getstate(const struct usb_setup_packet *p, const void **data)
 {
 	debug("DFU_GETSTATE\n");
@@ -234,7 +472,7 @@ dfu_getstate(const struct usb_setup_packet *p, const void **data)
 	return 1;
 }
 
-int
+static int
 dfu_abort(const struct usb_setup_packet *p, const void **data)
 {
 	debug("DFU_ABORT\n");
@@ -251,8 +489,25 @@ dfu_abort(const struct usb_setup_packet *p, const void **data)
 	return -1;
 }
 
+static const struct usb_setup_handler dfu_setup_handlers[] = {
+	{ .req = 0x0021, .idx = DFU_INTERFACE, .len =  0, .fn = dfu_detach },
+	{ .req = 0x0121, .idx = DFU_INTERFACE, .len = -1, .fn = dfu_dnload },
+	{ .req = 0x02a1, .idx = DFU_INTERFACE, .len = -1, .fn = dfu_upload },
+	{ .req = 0x03a1, .idx = DFU_INTERFACE, .len = -1, .fn = dfu_getstatus },
+	{ .req = 0x0421, .idx = DFU_INTERFACE, .len =  0, .fn = dfu_clrstatus },
+	{ .req = 0x05a1, .idx = DFU_INTERFACE, .len = -1, .fn = dfu_getstate },
+	{ .req = 0x0621, .idx = DFU_INTERFACE, .len =  0, .fn = dfu_abort },
+};
+
+const struct usbfs_class dfu_class = {
+	USBFS_CLASS_HANDLERS(dfu_setup_handlers),
+};
+
 void
 dfu_init(void)
 {
 	dfu_status.bState = DFU_dfuIDLE;
+#ifdef DFU_STRING_STATUS
+	dfu_status.iString = DFU_STRING_STATUS;
+#endif
 }
@@ -27,19 +27,22 @@
 #ifndef DFU_H
 #define DFU_H
 
-#include "usbfs.h"
+#include "lib/usbfs-core.h"
 
 #define DFU_INTERFACE 0
 #define DFU_TRANSFERSIZE 1024
 //#define DFU_TRANSFERSIZE 64
+#ifndef NDEBUG
+/* index of the string with the flash counters of the last download */
+#define DFU_STRING_STATUS 5
+#endif
+
+extern const struct usbfs_class dfu_class;
+#ifdef DFU_STRING_STATUS
+extern struct usb_descriptor_string dfu_descriptor_status;
+#endif
 
-int dfu_detach(const struct usb_setup_packet *p, const void **data);
-int dfu_dnload(const struct usb_setup_packet *p, const void **data);
-int dfu_upload(const struct usb_setup_packet *p, const void **data);
-int dfu_getstatus(const struct usb_setup_packet *p, const void **data);
-int dfu_clrstatus(const struct usb_setup_packet *p, const void **data);
-int dfu_getstate(const struct usb_setup_packet *p, const void **data);
-int dfu_abort(const struct usb_setup_packet *p, const void **data);
 void dfu_init(void);
+bool dfu_poll(void);
 
 #endif
@@ -24,6 +24,7 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
  * OF SUCH DAMAGE.
  */
+#include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 
@@ -31,6 +32,10 @@
 #include "lib/gpio.h"
 #include "flash.h"
 
+#ifdef NDEBUG
+void USBFS_IRQHandler(void);
+#endif
+
 #ifdef NDEBUG
 #define debug(...)
 #else
@@ -38,46 +43,33 @@
 #define debug(...) printf(__VA_ARGS__)
 #endif
 
+/*
+ * the flash stalls instruction fetches while it is busy, so only
+ * the code starting an operation and waiting for it runs from RAM.
+ * ctl is either FMC_CTL_PER to erase the page at addr or
+ * FMC_CTL_PG to program word at addr.
+ */
 __attribute__((noclone))
 __attribute__((noinline))
-__attribute__((section(".ramtext.flash__page")))
-static int flash__page(uint32_t addr, const uint32_t data[PAGE_SIZE/4])
+__attribute__((section(".ramtext.flash__op")))
+static int flash__op(uint32_t ctl, volatile uint32_t *addr, uint32_t word)
 {
-	/* erase page */
-	FMC->CTL = (FMC->CTL & ~0x7U) | FMC_CTL_PER;
-	FMC->ADDR = addr;
-	FMC->CTL |= FMC_CTL_START;
+	FMC->CTL = (FMC->CTL & ~0x7U) | ctl;
+	if (ctl == FMC_CTL_PER) {
+		FMC->ADDR = (uint32_t)addr;
+		FMC->CTL |= FMC_CTL_START;
+	} else
+		*addr = word;
 	while (FMC->STAT & FMC_STAT_BUSY)
 		/* wait */;
 	if (FMC->STAT != FMC_STAT_ENDF)
 		return -1;
 	FMC->STAT = FMC_STAT_ENDF;
-
-	/* write data */
-	for (unsigned int i = 0; i < PAGE_SIZE/4; i++, addr += 4) {
-		uint32_t word = data[i];
-
-		if (word == 0xffffffffU)
-			continue;
-
-		FMC->CTL = (FMC->CTL & ~0x7U) | FMC_CTL_PG;
-		*(volatile uint32_t *)addr = word;
-		while (FMC->STAT & FMC_STAT_BUSY)
-			/* wait */;
-		if (FMC->STAT != FMC_STAT_ENDF)
-			return -2;
-		FMC->STAT = FMC_STAT_ENDF;
-	}
-
 	return 0;
 }
 
-int flash_page(uint32_t addr, const uint32_t data[PAGE_SIZE/4])
+int flash_unlock(void)
 {
-	int ret;
-
-	debug("  flashing at 0x%08lx\n", addr);
-
 	while (FMC->STAT & FMC_STAT_BUSY)
 		/* wait */;
 
@@ -87,7 +79,6 @@ int flash_page(uint32_t addr, const uint32_t data[PAGE_SIZE/4])
 		FMC_STAT_WPERR |
 		FMC_STAT_PGERR;
 
-	/* unlock flash */
 	debug("FMC->CTL = 0x%08lx\n", FMC->CTL);
 	if (FMC->CTL & FMC_CTL_LK) {
 		FMC->KEY = FMC_KEY_UNLOCK0;
@@ -96,12 +87,81 @@ int flash_page(uint32_t addr, const uint32_t data[PAGE_SIZE/4])
 		if (FMC->CTL & FMC_CTL_LK)
 			return -1;
 	}
+	return 0;
+}
+
+void flash_lock(void)
+{
+	FMC->CTL = FMC_CTL_LK;
+}
+
+int flash_erase(uint32_t addr)
+{
+	return flash__op(FMC_CTL_PER, (volatile uint32_t *)addr, 0);
+}
+
+int flash_program(uint32_t addr, const uint32_t *data, unsigned int words)
+{
+	volatile uint32_t *p = (volatile uint32_t *)addr;
+
+	/* words already holding the right value are left alone */
+	for (; words > 0; words--, p++, data++) {
+		if (*p == *data)
+			continue;
+		if (flash__op(FMC_CTL_PG, p, *data))
+			return -2;
+#ifdef NDEBUG
+		/*
+		 * the release build has no interrupts, so serve the USB
+		 * between words. the host can then send the next page
+		 * while this one is programmed, like in the debug build.
+		 */
+		USBFS_IRQHandler();
+#endif
+	}
+	return 0;
+}
+
+struct flash_stats flash_stats;
+
+int flash_page(uint32_t addr, const uint32_t data[PAGE_SIZE/4])
+{
+	const uint32_t *old = (const uint32_t *)addr;
+	bool same = true;
+	bool erase = false;
+	int ret = 0;
+
+	/*
+	 * the flash can only program words that are still erased,
+	 * so unless every changed word is 0xffffffff the page needs
+	 * to be erased first. identical pages are skipped entirely.
+	 */
+	for (unsigned int i = 0; i < PAGE_SIZE/4; i++) {
+		if (old[i] == data[i])
+			continue;
+		same = false;
+		if (old[i] != 0xffffffffU) {
+			erase = true;
+			break;
+		}
+	}
+	if (same) {
+		debug("  skipping 0x%08lx\n", addr);
+		flash_stats.skipped++;
+		return 0;
+	}
+
+	debug("  flashing at 0x%08lx%s\n", addr, erase ? "" : " without erase");
 
 	gpio_pin_set(LED);
-	ret = flash__page(addr, data);
+	if (erase) {
+		ret = flash_erase(addr);
+		flash_stats.erased++;
+	}
+	if (ret == 0)
+		ret = flash_program(addr, data, PAGE_SIZE/4);
 	gpio_pin_clear(LED);
 
-	/* lock flash again */
-	FMC->CTL = FMC_CTL_LK;
+	flash_stats.programmed++;
 	return ret;
 }
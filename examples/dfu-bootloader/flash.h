@@ -37,6 +37,33 @@
 
 #define PAGE_SIZE 1024U
 
+struct flash_stats {
+	uint16_t skipped;
+	uint16_t programmed;
+	uint16_t erased;
+};
+
+extern struct flash_stats flash_stats;
+
+/*
+ * flash_erase() and flash_program() expect the flash to be unlocked
+ * by flash_unlock(), so a whole image can be written with the FMC
+ * unlocked only once. flash_erase() erases the page at addr.
+ *
+ * Pages are erased one at a time by flash_page() as they arrive
+ * rather than erasing the whole image range up front. Pages that
+ * are unchanged, or only need bits cleared, are then not erased at
+ * all, and the host never waits for more than one page erase.
+ * Nothing would be gained by a range erase anyway: the FMC erases
+ * either a single page or the whole flash, bootloader included, so
+ * erasing a range takes one page erase per page all the same.
+ */
+int flash_unlock(void);
+void flash_lock(void);
+int flash_erase(uint32_t addr);
+int flash_program(uint32_t addr, const uint32_t *data, unsigned int words);
+
+/* erase if needed and program a page, the flash must be unlocked */
 int flash_page(uint32_t addr, const uint32_t data[PAGE_SIZE/4]);
 
 #endif
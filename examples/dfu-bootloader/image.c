@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gd32vf103/crc.h"
+#include "gd32vf103/info.h"
+#include "gd32vf103/rcu.h"
+
+#include "image.h"
+
+/*
+ * This is also run by _start before .data and .bss are set up,
+ * so it mustn't use either.
+ */
+uint32_t
+image_crc(const uint32_t *p, size_t words)
+{
+	uint32_t ahben = RCU->AHBEN;
+	uint32_t crc;
+
+	RCU->AHBEN = ahben | RCU_AHBEN_CRCEN;
+	CRC->CTL = CRC_CTL_RST;
+	for (; words > 0; words--)
+		CRC->DATA = *p++;
+	crc = CRC->DATA;
+	RCU->AHBEN = ahben;
+	return crc;
+}
+
+/*
+ * check the trailer of the image, if it has one. the trailer must be
+ * within the first limit bytes at IMAGE_START.
+ */
+int
+image_verify(uint32_t limit)
+{
+	const uint32_t *start = (const uint32_t *)IMAGE_START;
+	uint32_t length = start[IMAGE_LENGTH_WORD];
+	const struct image_trailer *t;
+
+	if (length == 0 || length == 0xffffffffU)
+		return 0;
+	if (length % 4 || length > limit ||
+			limit - length < sizeof(struct image_trailer))
+		return -1;
+
+	t = (const struct image_trailer *)&start[length/4];
+	if (t->length != length || t->magic != IMAGE_MAGIC ||
+			image_crc(start, length/4) != t->crc)
+		return -1;
+	return 0;
+}
+
+/* called by _start to decide if the image may be started */
+bool
+image_check(void)
+{
+	const uint32_t *start = (const uint32_t *)IMAGE_START;
+
+	/* don't jump to erased flash */
+	if (start[0] == 0xffffffffU)
+		return false;
+
+	return image_verify(FLASH_BASE + INFO->FLASH * PAGE_SIZE - IMAGE_START) == 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gd32vf103.h"
+
+#include "flash.h"
+
+#ifdef NDEBUG
+#define IMAGE_START (FLASH_BASE + 4*PAGE_SIZE)
+#else
+#define IMAGE_START (FLASH_BASE + 32*PAGE_SIZE)
+#endif
+
+/*
+ * Images may end with a trailer, as added by tools/dfu-pack.c. The
+ * crc covers the length bytes of the image before the trailer and is
+ * what the CRC unit calculates, see crc32.h for a software version.
+ * The length is also stored in word IMAGE_LENGTH_WORD of the image,
+ * which is a reserved entry of the vector table and 0 in images
+ * without a trailer. That way the trailer is found without looking
+ * at flash after the image, which may hold an older image or data of
+ * the program.
+ *
+ * When present the trailer is checked after a download and before
+ * the image is started. Images without a trailer are started as
+ * before.
+ */
+#define IMAGE_MAGIC 0x4d494447U /* "GDIM" */
+#define IMAGE_LENGTH_WORD 4
+
+struct image_trailer {
+	uint32_t length;
+	uint32_t crc;
+	uint32_t magic;
+};
+
+uint32_t image_crc(const uint32_t *p, size_t words);
+int image_verify(uint32_t limit);
+bool image_check(void);
+
+#endif
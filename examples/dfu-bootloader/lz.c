@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#include <stdint.h>
+
+#include "lz.h"
+
+enum lz_state {
+	LZ_TOKEN,
+	LZ_LITLEN,
+	LZ_LITERAL,
+	LZ_OFFSET0,
+	LZ_OFFSET1,
+	LZ_MATCHLEN,
+	LZ_MATCH,
+};
+
+void
+lz_init(struct lz *z, uint32_t size)
+{
+	z->size = size;
+	z->done = 0;
+	z->state = LZ_TOKEN;
+}
+
+int
+lz_decode(struct lz *z, const uint8_t **in, const uint8_t *end,
+		uint8_t out[LZ_RING], unsigned int pos, unsigned int space)
+{
+	const uint8_t *p = *in;
+	unsigned int n = 0;
+	uint8_t c;
+
+	while (z->done < z->size) {
+		switch (z->state) {
+		case LZ_TOKEN:
+			if (p == end)
+				goto out;
+			z->token = *p++;
+			z->len = z->token >> 4;
+			z->state = (z->len == 15) ? LZ_LITLEN : LZ_LITERAL;
+			break;
+		case LZ_LITLEN:
+		case LZ_MATCHLEN:
+			if (p == end)
+				goto out;
+			c = *p++;
+			z->len += c;
+			if (c != 255)
+				z->state++;
+			break;
+		case LZ_LITERAL:
+			if (z->len == 0) {
+				z->state = LZ_OFFSET0;
+				break;
+			}
+			if (p == end || n == space)
+				goto out;
+			out[(pos + n++) & (LZ_RING - 1)] = *p++;
+			z->len--;
+			z->done++;
+			break;
+		case LZ_OFFSET0:
+			if (p == end)
+				goto out;
+			z->dist = *p++;
+			z->state = LZ_OFFSET1;
+			break;
+		case LZ_OFFSET1:
+			if (p == end)
+				goto out;
+			z->dist |= *p++ << 8;
+			if (z->dist == 0 || z->dist > LZ_WINDOW || z->dist > z->done)
+				return -1;
+			z->len = (z->token & 0xfU) + LZ_MINMATCH;
+			z->state = ((z->token & 0xfU) == 15) ? LZ_MATCHLEN : LZ_MATCH;
+			break;
+		default: /* LZ_MATCH */
+			if (z->len == 0) {
+				z->state = LZ_TOKEN;
+				break;
+			}
+			if (n == space)
+				goto out;
+			out[(pos + n) & (LZ_RING - 1)] =
+				out[(pos + n - z->dist) & (LZ_RING - 1)];
+			n++;
+			z->len--;
+			z->done++;
+			break;
+		}
+	}
+out:
+	*in = p;
+	return n;
+}
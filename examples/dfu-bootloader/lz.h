@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+
+/*
+ * Compressed images start with an 8 byte header, the magic "GDZ1"
+ * and the size of the uncompressed image as a 32bit little endian
+ * number, followed by an LZ4 style block stream:
+ *
+ *   token      literal length in the high nibble, match length - 4
+ *              in the low nibble. 15 means more length bytes follow,
+ *              each added until one is less than 255
+ *   literals   copied as is
+ *   offset     16bit little endian match distance, 1 to LZ_WINDOW
+ *
+ * The stream ends when the uncompressed size is reached, so the last
+ * sequence may be literals only. Matches reach at most LZ_WINDOW
+ * back, so the decoder only needs a ring of twice that, which lets
+ * the bootloader decode straight into its two page buffers.
+ */
+#define LZ_MAGIC    0x315a4447U /* "GDZ1" */
+#define LZ_HEADER   8U
+#define LZ_WINDOW   1024U
+#define LZ_RING     (2U*LZ_WINDOW)
+#define LZ_MINMATCH 4U
+
+struct lz {
+	uint32_t size;
+	uint32_t done;
+	uint32_t len;
+	uint16_t dist;
+	uint8_t state;
+	uint8_t token;
+};
+
+void lz_init(struct lz *z, uint32_t size);
+
+/*
+ * Decode input from [*in, end) into the LZ_RING sized ring out,
+ * starting at pos and writing at most space bytes. *in is advanced
+ * past the consumed input. Returns the number of bytes written or
+ * -1 if the stream is corrupt.
+ */
+int lz_decode(struct lz *z, const uint8_t **in, const uint8_t *end,
+		uint8_t out[LZ_RING], unsigned int pos, unsigned int space);
+
+#endif
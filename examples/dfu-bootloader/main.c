@@ -25,13 +25,14 @@
  * OF SUCH DAMAGE.
  */
 #include "gd32vf103/rcu.h"
+#include "gd32vf103/usart.h"
 
 #include "lib/mtimer.h"
 #include "lib/eclic.h"
 #include "lib/rcu.h"
 #include "lib/gpio.h"
+#include "lib/usbfs-core.h"
 
-#include "usbfs.h"
 #include "dfu.h"
 #include "flash.h"
 
@@ -40,6 +41,10 @@
 #include "lib/stdio-uart0.h"
 #endif
 
+#ifdef NDEBUG
+void USBFS_IRQHandler(void);
+#endif
+
 int main(void)
 {
 	/* initialize system clock */
@@ -47,8 +52,12 @@ int main(void)
 
 	/* initialize eclic */
 	eclic_init();
+#ifdef NDEBUG
+	/* interrupts stay disabled in the release build, see below */
+#else
 	/* enable global interrupts */
 	eclic_global_interrupt_enable();
+#endif
 
 #ifdef NDEBUG
 	RCU->APB2EN |= RCU_APB2EN_PCEN;
@@ -63,13 +72,29 @@ int main(void)
 	gpio_pin_config(LED, GPIO_MODE_OD_2MHZ);
 
 	dfu_init();
-	usbfs_init();
+	usbfs_init(4);
 
 	while (1) {
 #ifdef NDEBUG
-		wait_for_interrupt();
+		/*
+		 * there is no room for the vector table in 4k, so call the
+		 * interrupt handler from here, and from flash_program()
+		 * while a page is programmed. the USB interrupt is still
+		 * enabled in the eclic, so it ends wfi even with interrupts
+		 * disabled.
+		 */
+		USBFS_IRQHandler();
+
+		/* program pending pages, otherwise sleep until the next event */
+		if (!dfu_poll())
+			wait_for_interrupt();
 #else
-		int c = uart0_getchar();
+		int c;
+
+		if (dfu_poll() || !(USART0->STAT & USART_STAT_RBNE))
+			continue;
+
+		c = uart0_getchar();
 
 		switch (c) {
 		case 't':
@@ -26,10 +26,10 @@
 set -e -o pipefail
 
 readonly file='test.bin'
-readonly size=4001
+readonly size=${1:-4001}
 
 dd if=/dev/urandom of="$file" bs=$size count=1
-dfu-util -R -D "$file"
+time dfu-util -R -D "$file"
 sleep 2
 dfu-util -s ":$((((size + 1023)/1024)*1024))" -U "${file}.dfu"
 diff -Naur <(xxd "$file") <(xxd "${file}.dfu") || true
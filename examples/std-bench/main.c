@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "riscv/bits.h"
+#include "gd32vf103/csr.h"
+
+#include "lib/eclic.h"
+#include "lib/rcu.h"
+#include "lib/stdio-uart0.h"
+
+/*
+ * Cycle counts for the mem* functions and the number formatting in
+ * lib/std.c, measured with mcycle and printed on uart0 at 115200 baud.
+ * Each number is the best of RUNS calls, so it is with warm caches
+ * and no interrupts. Compare with the older versions by building the
+ * tree before they were replaced.
+ */
+#define RUNS 16
+
+static uint32_t src[1024 + 2];
+static uint32_t dst[1024 + 2];
+
+static const unsigned int lengths[] = { 4, 16, 64, 256, 1024, 4096 };
+
+static inline uint32_t
+cycles(void)
+{
+	return csr_read(CSR_MCYCLE);
+}
+
+enum bench {
+	BENCH_MEMCPY,
+	BENCH_MEMCPY_DST1,
+	BENCH_MEMCPY_SRC1,
+	BENCH_MEMMOVE_UP,
+	BENCH_MEMSET,
+	BENCH_MEMSET_DST1,
+};
+
+/* padded by hand, printf has no %-24s */
+static const char *const bench_name[] = {
+	[BENCH_MEMCPY]      = "memcpy aligned        ",
+	[BENCH_MEMCPY_DST1] = "memcpy dst+1          ",
+	[BENCH_MEMCPY_SRC1] = "memcpy src+1          ",
+	[BENCH_MEMMOVE_UP]  = "memmove overlapping up",
+	[BENCH_MEMSET]      = "memset aligned        ",
+	[BENCH_MEMSET_DST1] = "memset dst+1          ",
+};
+
+static uint32_t
+bench_run(enum bench b, unsigned int len)
+{
+	unsigned char *s = (unsigned char *)src;
+	unsigned char *d = (unsigned char *)dst;
+	uint32_t best = UINT32_MAX;
+
+	for (unsigned int i = 0; i < RUNS; i++) {
+		uint32_t start = cycles();
+		uint32_t t;
+
+		switch (b) {
+		case BENCH_MEMCPY:
+			memcpy(d, s, len);
+			break;
+		case BENCH_MEMCPY_DST1:
+			memcpy(d + 1, s, len);
+			break;
+		case BENCH_MEMCPY_SRC1:
+			memcpy(d, s + 1, len);
+			break;
+		case BENCH_MEMMOVE_UP:
+			memmove(s + 4, s, len);
+			break;
+		case BENCH_MEMSET:
+			memset(d, i, len);
+			break;
+		case BENCH_MEMSET_DST1:
+			memset(d + 1, i, len);
+			break;
+		}
+		t = cycles() - start;
+		if (t < best)
+			best = t;
+	}
+	return best;
+}
+
+/* a mix of magnitudes, like counters and timestamps in a log line */
+static const uint64_t values[] = {
+	0, 7, 42, 100, 999, 4096, 65535, 123456,
+	1000000, 31415926, 1000000007, 4294967295U,
+	4294967296ULL, 1234567890123ULL, 98765432109876543ULL,
+	18446744073709551615ULL,
+};
+
+enum fmt_bench {
+	FMT_U,
+	FMT_D,
+	FMT_X,
+	FMT_LLU,
+	FMT_LINE,
+};
+
+static const char *const fmt_name[] = {
+	[FMT_U]    = "%u                    ",
+	[FMT_D]    = "%d                    ",
+	[FMT_X]    = "%x                    ",
+	[FMT_LLU]  = "%llu                  ",
+	[FMT_LINE] = "%llu %u %d %x         ",
+};
+
+/* conversions per value */
+static const unsigned int fmt_conversions[] = {
+	[FMT_U]    = 1,
+	[FMT_D]    = 1,
+	[FMT_X]    = 1,
+	[FMT_LLU]  = 1,
+	[FMT_LINE] = 4,
+};
+
+static char fmt_buf[64];
+
+/* best of RUNS for formatting every value in values[] with snprintf */
+static uint32_t
+fmt_run(enum fmt_bench b)
+{
+	uint32_t best = UINT32_MAX;
+
+	for (unsigned int i = 0; i < RUNS; i++) {
+		uint32_t start = cycles();
+		uint32_t t;
+
+		for (unsigned int j = 0; j < ARRAY_SIZE(values); j++) {
+			uint64_t v = values[j];
+
+			switch (b) {
+			case FMT_U:
+				snprintf(fmt_buf, sizeof(fmt_buf), "%u",
+						(unsigned int)v);
+				break;
+			case FMT_D:
+				snprintf(fmt_buf, sizeof(fmt_buf), "%d",
+						(int)v);
+				break;
+			case FMT_X:
+				snprintf(fmt_buf, sizeof(fmt_buf), "%x",
+						(unsigned int)v);
+				break;
+			case FMT_LLU:
+				snprintf(fmt_buf, sizeof(fmt_buf), "%llu",
+						(unsigned long long)v);
+				break;
+			case FMT_LINE:
+				snprintf(fmt_buf, sizeof(fmt_buf), "%llu %u %d %x",
+						(unsigned long long)v, (unsigned int)v,
+						(int)v, (unsigned int)v);
+				break;
+			}
+		}
+		t = cycles() - start;
+		if (t < best)
+			best = t;
+	}
+	return best;
+}
+
+int main(void)
+{
+	/* initialize system clock */
+	rcu_sysclk_init();
+
+	/* initialize eclic */
+	eclic_init();
+	/* enable global interrupts */
+	eclic_global_interrupt_enable();
+
+	uart0_init(CORECLOCK, 115200, 2);
+	stdout = uart0;
+
+	/* start.S stops the cycle counter to save power */
+	csr_clear(CSR_MCOUNTINHIBIT, CSR_MCOUNTINHIBIT_CY);
+
+	printf("\ncycles (cycles/byte * 100), best of %u\n", RUNS);
+	printf("bytes                 ");
+	for (unsigned int i = 0; i < ARRAY_SIZE(lengths); i++)
+		printf(" %12u", lengths[i]);
+	printf("\n");
+	for (unsigned int b = 0; b < ARRAY_SIZE(bench_name); b++) {
+		printf("%s", bench_name[b]);
+		for (unsigned int i = 0; i < ARRAY_SIZE(lengths); i++) {
+			unsigned int len = lengths[i];
+			uint32_t t = bench_run(b, len);
+
+			printf(" %5lu (%4lu)", t, 100 * t / len);
+		}
+		printf("\n");
+	}
+
+	printf("\nsnprintf cycles per conversion, best of %u\n", RUNS);
+	for (unsigned int b = 0; b < ARRAY_SIZE(fmt_name); b++) {
+		uint32_t n = ARRAY_SIZE(values) * fmt_conversions[b];
+		uint32_t t = fmt_run(b);
+
+		printf("%s %5lu\n", fmt_name[b], t / n);
+	}
+
+	while (1)
+		wait_for_interrupt();
+}
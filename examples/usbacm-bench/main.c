@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+
+#include "lib/mtimer.h"
+#include "lib/eclic.h"
+#include "lib/rcu.h"
+#include "lib/stdio-usbacm.h"
+#include "lib/stdio-uart0.h"
+#include "lib/usbfs-vendor.h"
+
+/*
+ * USB benchmark firmware. The ACM port understands three commands,
+ * a command byte followed by a 32bit little-endian byte count:
+ *
+ *   'e' n  echo the next n bytes back
+ *   's' n  sink the next n bytes and answer with a single 'k'
+ *   'o' n  source n bytes of the pattern 0, 1, 2, .., 255, 0, ..
+ *
+ * Any other byte outside a command is simply dropped, so just
+ * sending a stream of zeroes like bench.sh does is a sink too.
+ * Run tools/usbacm-bench on the host for throughput and round-trip
+ * latency over a range of transfer sizes. Throughput in each
+ * direction is reported on uart0 every second.
+ *
+ * At the same time everything sent to the vendor bulk interface is
+ * sent straight back. Run tools/usbvendor-loop on the host to test it.
+ *
+ * Without a board "make -C tests run-usbacm-bench" runs this firmware
+ * on the USBFS simulator and checks all of the above.
+ */
+
+/* give up on a write if the host doesn't read it within a second */
+#define BENCH_TIMEOUT 1000
+
+enum bench_mode {
+	BENCH_COMMAND,
+	BENCH_ECHO,
+	BENCH_SINK,
+	BENCH_SOURCE,
+};
+
+static uint32_t buf[1024];
+static uint32_t pattern[1024];
+
+static struct {
+	uint8_t mode;
+	uint8_t hdrlen;
+	uint8_t hdr[5];
+	uint32_t left;
+	uint32_t in;
+	uint32_t out;
+} bench;
+
+static void
+bench_start(void)
+{
+	bench.left = (uint32_t)bench.hdr[1] |
+		(uint32_t)bench.hdr[2] << 8 |
+		(uint32_t)bench.hdr[3] << 16 |
+		(uint32_t)bench.hdr[4] << 24;
+	bench.hdrlen = 0;
+
+	switch (bench.hdr[0]) {
+	case 'e':
+		bench.mode = BENCH_ECHO;
+		break;
+	case 's':
+		bench.mode = BENCH_SINK;
+		break;
+	case 'o':
+		bench.mode = BENCH_SOURCE;
+		break;
+	}
+	if (bench.left == 0) {
+		if (bench.mode == BENCH_SINK)
+			usbacm_write("k", 1, BENCH_TIMEOUT);
+		bench.mode = BENCH_COMMAND;
+	}
+}
+
+static void
+bench_input(const uint8_t *p, size_t len)
+{
+	const uint8_t *end = p + len;
+
+	bench.in += len;
+
+	while (p < end) {
+		size_t n = end - p;
+
+		switch (bench.mode) {
+		case BENCH_COMMAND:
+			if (bench.hdrlen == 0 &&
+					*p != 'e' && *p != 's' && *p != 'o') {
+				p++;
+				break;
+			}
+			bench.hdr[bench.hdrlen++] = *p++;
+			if (bench.hdrlen == sizeof(bench.hdr))
+				bench_start();
+			break;
+		case BENCH_ECHO:
+			if (n > bench.left)
+				n = bench.left;
+			bench.out += usbacm_write(p, n, BENCH_TIMEOUT);
+			p += n;
+			bench.left -= n;
+			if (bench.left == 0)
+				bench.mode = BENCH_COMMAND;
+			break;
+		case BENCH_SINK:
+			if (n > bench.left)
+				n = bench.left;
+			p += n;
+			bench.left -= n;
+			if (bench.left == 0) {
+				usbacm_write("k", 1, BENCH_TIMEOUT);
+				bench.mode = BENCH_COMMAND;
+			}
+			break;
+		case BENCH_SOURCE:
+			/* ignore input until we're done */
+			p = end;
+			break;
+		}
+	}
+}
+
+static void
+bench_source(void)
+{
+	size_t n = bench.left;
+
+	/* pattern is a multiple of 256 bytes, so it stays in phase */
+	if (n > sizeof(pattern))
+		n = sizeof(pattern);
+	n = usbacm_write(pattern, n, BENCH_TIMEOUT);
+	bench.out += n;
+	bench.left -= n;
+	/* a short write means the host went away */
+	if (bench.left == 0 || n < sizeof(pattern))
+		bench.mode = BENCH_COMMAND;
+}
+
+/*
+ * Loop back through two buffers, so the next transfer can be
+ * received while the last one is sent back.
+ */
+static uint32_t loop[2][1024];
+static unsigned int loop_cur;
+
+static uint32_t
+loopback_poll(void)
+{
+	int n = usbvendor_rx_done();
+
+	if (n < 0 || !usbvendor_tx_done())
+		return 0;
+
+	if (n > 0) {
+		usbvendor_tx_start(loop[loop_cur], n);
+		loop_cur ^= 1;
+	}
+	usbvendor_rx_start(loop[loop_cur], sizeof(loop[loop_cur]));
+	return n;
+}
+
+int main(void)
+{
+	uint64_t next;
+	uint32_t looped = 0;
+	uint32_t suspends = 0;
+	unsigned int i;
+
+	/* initialize system clock */
+	rcu_sysclk_init();
+
+	/* initialize eclic */
+	eclic_init();
+	/* enable global interrupts */
+	eclic_global_interrupt_enable();
+
+	uart0_init(CORECLOCK, 115200, 2);
+	usbacm_init(4);
+
+	for (i = 0; i < sizeof(pattern); i++)
+		((uint8_t *)pattern)[i] = i;
+
+	next = mtimer_mtime() + MTIMER_FREQ;
+	while (1) {
+		uint64_t now;
+
+		bench_input((const uint8_t *)buf,
+				usbacm_read(buf, sizeof(buf), 0));
+		if (bench.mode == BENCH_SOURCE)
+			bench_source();
+		looped += loopback_poll();
+		usbfs_idle();
+
+		if (suspends != usbfs_stats.suspends && !usbfs_suspended) {
+			suspends = usbfs_stats.suspends;
+			fprintf(uart0, "%lu suspends, %lu remote wakeups, "
+					"%lums suspended, resume %luus (max %luus)\n",
+					usbfs_stats.suspends,
+					usbfs_stats.remote_wakeups,
+					(uint32_t)(usbfs_stats.suspended_us / 1000),
+					usbfs_stats.resume_us,
+					usbfs_stats.resume_us_max);
+		}
+
+		now = mtimer_mtime();
+		if (now < next)
+			continue;
+
+		if (bench.in > 0 || bench.out > 0)
+			fprintf(uart0, "%lu bytes/s in, %lu bytes/s out\n",
+					bench.in, bench.out);
+		if (looped > 0)
+			fprintf(uart0, "%lu bytes/s looped back\n", looped);
+		bench.in = 0;
+		bench.out = 0;
+		looped = 0;
+		next += MTIMER_FREQ;
+		if (next < now)
+			next = now + MTIMER_FREQ;
+	}
+}
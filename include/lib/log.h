@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#ifndef LIB_LOG_H
+#define LIB_LOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Deferred binary logging.
+ *
+ *   LOG("irq %u: status 0x%08lx\n", n, status);
+ *
+ * records only the address of the format string and the raw 32-bit
+ * arguments in a ring buffer. The format string itself is placed in
+ * the .logstr section which is kept in the ELF file, but never loaded
+ * onto the chip. log_flush() later sends the records to a stream and
+ * tools/log-decode.c renders the text on the host.
+ *
+ * LOG() may be called from any context including nested interrupts.
+ * Arguments are truncated to 32 bits, so %ll conversions are not
+ * supported. Pointers must be cast to uintptr_t, and %s is only useful
+ * for strings in flash, which the decoder looks up in the ELF file.
+ */
+#define LOG_MAXARGS 8
+
+#define LOG(fmt, ...) do { \
+	static const char __log_fmt[] \
+		__attribute__((section(".logstr"), used)) = fmt; \
+	const uint32_t __log_args[] = { 0, ##__VA_ARGS__ }; \
+	_Static_assert(sizeof(__log_args)/sizeof(__log_args[0]) - 1 <= LOG_MAXARGS, \
+			"too many arguments to LOG()"); \
+	log_record((uintptr_t)__log_fmt, &__log_args[1], \
+			sizeof(__log_args)/sizeof(__log_args[0]) - 1); \
+} while (0)
+
+void log_record(uint32_t id, const uint32_t *args, unsigned int n);
+void log_flush(FILE *stream);
+uint32_t log_dropped(void);
+
+#endif
@@ -34,6 +34,8 @@
 void rcu_sysclk_reset(void);
 void rcu_sysclk_pll_irc8m(uint32_t cfg0);
 void rcu_sysclk_hxtal(uint32_t cfg0, uint32_t cfg1);
+uint32_t rcu_sysclk_irc8m(void);
+void rcu_sysclk_restore(uint32_t scs);
 
 void rcu_sysclk_init(void);
 
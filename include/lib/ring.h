@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#ifndef LIB_RING_H
+#define LIB_RING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Single producer, single consumer byte ring.
+ *
+ * head counts bytes pushed and is only written by the producer, tail
+ * counts bytes popped and is only written by the consumer. Both are
+ * free running, so a full ring needs no spare slot, and the buffer
+ * size must be a power of 2 so indices are just masked. Each side
+ * reads the other side's counter with acquire and publishes its own
+ * with release, so one side may run in an interrupt handler and the
+ * other in the main loop without any locking.
+ *
+ * The span functions return the contiguous part of the buffer that
+ * can be filled or drained right now, which is what a DMA channel or
+ * a hardware FIFO wants. Call the matching commit function once the
+ * bytes have actually been written or read.
+ *
+ * Declare a ring with eg.
+ *   static RING(1024) output;
+ */
+struct ring {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t hiwat;
+};
+
+#define RING(size) struct { \
+	struct ring r; \
+	_Static_assert(((size) & ((size) - 1)) == 0, \
+			"ring size must be a power of 2"); \
+	char buf[size]; \
+}
+
+#define RING_ARGS(x) &(x)->r, (x)->buf, sizeof((x)->buf)
+
+/* bytes available to the consumer */
+static inline uint32_t ring__used(const struct ring *r)
+{
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - r->tail;
+}
+
+/* bytes available to the producer */
+static inline uint32_t ring__free(const struct ring *r, uint32_t size)
+{
+	return size - (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+}
+
+static inline char *ring__push_span(struct ring *r, char *buf,
+		uint32_t size, uint32_t *len)
+{
+	uint32_t idx = r->head & (size - 1);
+	uint32_t n = size - idx;
+	uint32_t room = ring__free(r, size);
+
+	*len = (n < room) ? n : room;
+	return &buf[idx];
+}
+
+static inline void ring__push_commit(struct ring *r, uint32_t len)
+{
+	uint32_t head = r->head + len;
+	uint32_t used = head - __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+
+	if (used > r->hiwat)
+		r->hiwat = used;
+	__atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+}
+
+static inline const char *ring__pop_span(struct ring *r, const char *buf,
+		uint32_t size, uint32_t *len)
+{
+	uint32_t idx = r->tail & (size - 1);
+	uint32_t n = size - idx;
+	uint32_t used = ring__used(r);
+
+	*len = (n < used) ? n : used;
+	return &buf[idx];
+}
+
+static inline void ring__pop_commit(struct ring *r, uint32_t len)
+{
+	__atomic_store_n(&r->tail, r->tail + len, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t ring__push_n(struct ring *r, char *buf, uint32_t size,
+		const void *src, uint32_t len)
+{
+	const char *s = src;
+	uint32_t room = ring__free(r, size);
+	uint32_t idx = r->head & (size - 1);
+	uint32_t n;
+
+	if (len > room)
+		len = room;
+	n = size - idx;
+	if (n > len)
+		n = len;
+	memcpy(&buf[idx], s, n);
+	memcpy(buf, s + n, len - n);
+	ring__push_commit(r, len);
+	return len;
+}
+
+static inline uint32_t ring__pop_n(struct ring *r, const char *buf, uint32_t size,
+		void *dst, uint32_t len)
+{
+	char *d = dst;
+	uint32_t used = ring__used(r);
+	uint32_t idx = r->tail & (size - 1);
+	uint32_t n;
+
+	if (len > used)
+		len = used;
+	/* a producer that doesn't check for room, like a circular DMA
+	 * channel, may have lapped the consumer */
+	if (len > size)
+		len = size;
+	n = size - idx;
+	if (n > len)
+		n = len;
+	memcpy(d, &buf[idx], n);
+	memcpy(d + n, buf, len - n);
+	ring__pop_commit(r, len);
+	return len;
+}
+
+static inline bool ring__push(struct ring *r, char *buf, uint32_t size, char c)
+{
+	if (ring__free(r, size) == 0)
+		return false;
+	buf[r->head & (size - 1)] = c;
+	ring__push_commit(r, 1);
+	return true;
+}
+
+static inline int ring__pop(struct ring *r, const char *buf, uint32_t size)
+{
+	int c;
+
+	if (ring__used(r) == 0)
+		return -1;
+	c = (unsigned char)buf[r->tail & (size - 1)];
+	ring__pop_commit(r, 1);
+	return c;
+}
+
+#define ring_size(x) sizeof((x)->buf)
+#define ring_used(x) ring__used(&(x)->r)
+#define ring_free(x) ring__free(&(x)->r, sizeof((x)->buf))
+#define ring_hiwat(x) ((x)->r.hiwat)
+
+/* producer side */
+#define ring_push(x, c) ring__push(RING_ARGS(x), c)
+#define ring_push_n(x, src, len) ring__push_n(RING_ARGS(x), src, len)
+#define ring_push_span(x, len) ring__push_span(RING_ARGS(x), len)
+#define ring_push_commit(x, len) ring__push_commit(&(x)->r, len)
+
+/* consumer side */
+#define ring_pop(x) ring__pop(RING_ARGS(x))
+#define ring_pop_n(x, dst, len) ring__pop_n(RING_ARGS(x), dst, len)
+#define ring_pop_span(x, len) ring__pop_span(RING_ARGS(x), len)
+#define ring_pop_commit(x, len) ring__pop_commit(&(x)->r, len)
+
+#endif
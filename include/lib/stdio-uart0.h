@@ -27,13 +27,26 @@
 #ifndef LIB_STDIO_UART0_H
 #define LIB_STDIO_UART0_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
+#include "lib/stdio-usart.h"
+
 extern const FILE uart0_stream;
 static FILE *const uart0 = (FILE *)&uart0_stream;
 
-void uart0_init(uint32_t tlclk, uint32_t target, uint8_t priority);
+void uart0_init(uint32_t pclk, uint32_t target, uint8_t priority);
 int uart0_getchar(void);
 
+/* only available when built with UART0_ASYNC or UART0_DMA */
+uint32_t uart0_tx_hiwat(void);
+
+/* only available when built with UART0_RXDMA */
+size_t uart0_available(void);
+size_t uart0_read(void *buf, size_t len);
+uint32_t uart0_rx_overruns(void);
+uint32_t uart0_rx_errors(void);
+uint32_t uart0_rx_hiwat(void);
+
 #endif
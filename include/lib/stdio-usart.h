@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#ifndef LIB_STDIO_USART_H
+#define LIB_STDIO_USART_H
+
+#include "gd32vf103/usart.h"
+
+/*
+ * Frame formats for the <PORT>_FRAME build options of the
+ * stdio-uart0, stdio-usart1, stdio-usart2, stdio-uart3 and
+ * stdio-uart4 libraries, eg. CPPFLAGS += -DUSART1_FRAME=USART_FRAME_8E1
+ *
+ * The low half is or'ed into CTL0 and the high half written to CTL1.
+ * Note that the word length includes the parity bit.
+ */
+#define USART_FRAME(ctl0, ctl1) ((ctl0) | ((ctl1) << 16))
+
+#define USART_FRAME_8N1 USART_FRAME(0, USART_CTL1_STB_1)
+#define USART_FRAME_8N2 USART_FRAME(0, USART_CTL1_STB_2)
+#define USART_FRAME_7E1 USART_FRAME(USART_CTL0_PCEN, USART_CTL1_STB_1)
+#define USART_FRAME_7O1 USART_FRAME(USART_CTL0_PCEN | USART_CTL0_PM, USART_CTL1_STB_1)
+#define USART_FRAME_8E1 USART_FRAME(USART_CTL0_WL | USART_CTL0_PCEN, USART_CTL1_STB_1)
+#define USART_FRAME_8O1 USART_FRAME(USART_CTL0_WL | USART_CTL0_PCEN | USART_CTL0_PM, USART_CTL1_STB_1)
+
+#endif
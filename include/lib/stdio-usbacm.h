@@ -27,13 +27,40 @@
 #ifndef LIB_STDIO_USBACM_H
 #define LIB_STDIO_USBACM_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
+#include "lib/usbfs-core.h"
+
 extern const FILE usbacm_stream;
 static FILE *const usbacm = (FILE *)&usbacm_stream;
 
+/*
+ * The CDC ACM function uses interfaces 0 and 1 with the data on
+ * endpoint 1 and notifications on endpoint 2. Build with
+ * -DUSBACM_VENDOR and add usbfs-vendor to libs to also get the
+ * vendor bulk interface from lib/usbfs-vendor.h as interface 2 on
+ * endpoint 3, or -DUSBACM_MSC and usbfs-msc for the mass storage
+ * interface from lib/usbfs-msc.h in the same place. Applications defining their own usbfs_device add
+ * usbacm_class and usbacm_endpoint to it and call usbfs_init()
+ * instead of usbacm_init().
+ */
+extern const struct usbfs_class usbacm_class;
+extern const struct usbfs_endpoint usbacm_endpoint;
+
 void usbacm_init(uint8_t priority);
 int usbacm_getchar(void);
 
+/* read up to len bytes, waiting at most timeout milliseconds for them */
+size_t usbacm_read(void *buf, size_t len, uint32_t timeout);
+/*
+ * write len bytes without newline translation, waiting at most timeout
+ * milliseconds for buffer space. returns the number of bytes queued,
+ * which is short if the host hasn't opened the port (set DTR), has
+ * suspended the bus without allowing remote wakeup or doesn't read
+ * the data in time.
+ */
+size_t usbacm_write(const void *buf, size_t len, uint32_t timeout);
+
 #endif
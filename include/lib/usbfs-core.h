@@ -0,0 +1,363 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#ifndef LIB_USBFS_CORE_H
+#define LIB_USBFS_CORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "gd32vf103/usbfs.h"
+
+#define USB_WORD(x) ((x) & 0xFF),((x) >> 8)
+#define USB_TRIPLE(x) ((x) & 0xFF),(((x) >> 8) & 0xFF),((x) >> 16)
+#define USB_QUAD(x) ((x) & 0xFF),(((x) >> 8) & 0xFF),(((x) >> 16) & 0xFF),((x) >> 24)
+
+struct usb_setup_packet {
+	union {
+		struct {
+			uint8_t bmRequestType;
+			uint8_t bRequest;
+		};
+		uint16_t request;
+	};
+	uint16_t wValue;
+	uint16_t wIndex;
+	uint16_t wLength;
+};
+
+struct usb_descriptor_device {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint16_t bcdUSB;
+	uint8_t bDeviceClass;
+	uint8_t bDeviceSubClass;
+	uint8_t bDeviceProtocol;
+	uint8_t bMaxPacketSize0;
+	uint16_t idVendor;
+	uint16_t idProduct;
+	uint16_t bcdDevice;
+	uint8_t iManufacturer;
+	uint8_t iProduct;
+	uint8_t iSerialNumber;
+	uint8_t bNumConfigurations;
+};
+
+struct usb_descriptor_device_qualifier {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint16_t bcdUSB;
+	uint8_t bDeviceClass;
+	uint8_t bDeviceSubClass;
+	uint8_t bDeviceProtocol;
+	uint8_t bMaxPacketSize0;
+	uint8_t bNumConfigurations;
+	uint8_t bReserved;
+};
+
+struct usb_descriptor_configuration {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint16_t wTotalLength;
+	uint8_t bNumInterfaces;
+	uint8_t bConfigurationValue;
+	uint8_t iConfiguration;
+	uint8_t bmAttributes;
+	uint8_t bMaxPower;
+} __attribute__((packed));
+
+struct usb_descriptor_interface_association {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bFirstInterface;
+	uint8_t bInterfaceCount;
+	uint8_t bFunctionClass;
+	uint8_t bFunctionSubClass;
+	uint8_t bFunctionProtocol;
+	uint8_t iFunction;
+} __attribute__((packed));
+
+struct usb_descriptor_interface {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bInterfaceNumber;
+	uint8_t bAlternateSetting;
+	uint8_t bNumEndpoints;
+	uint8_t bInterfaceClass;
+	uint8_t bInterfaceSubClass;
+	uint8_t bInterfaceProtocol;
+	uint8_t iInterface;
+} __attribute__((packed));
+
+struct usb_descriptor_endpoint {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bEndpointAddress;
+	uint8_t bmAttributes;
+	uint16_t wMaxPacketSize;
+	uint8_t bInterval;
+} __attribute__((packed));
+
+struct usb_descriptor_string {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint16_t wCodepoint[];
+};
+
+/*
+ * Descriptor builders. A configuration descriptor is a packed
+ * struct starting with a struct usb_descriptor_configuration
+ * followed by the interface, endpoint and class specific
+ * descriptors in the order they're sent, so wTotalLength is simply
+ * its size and every bLength is the size of its member. The
+ * interface and endpoint numbers and packet sizes should come from
+ * the same macros the class driver and USBFS_FIFO() use.
+ */
+#define USB_CONFIGURATION(type, interfaces, value, attributes, ma) { \
+	.bLength              = sizeof(struct usb_descriptor_configuration), \
+	.bDescriptorType      = 0x02, /* Configuration */ \
+	.wTotalLength         = sizeof(type), \
+	.bNumInterfaces       = (interfaces), \
+	.bConfigurationValue  = (value), \
+	.iConfiguration       = 0, \
+	.bmAttributes         = 0x80 | (attributes), \
+	.bMaxPower            = (ma) / 2, \
+}
+
+#define USB_INTERFACE_ASSOCIATION(first, count, class, subclass, protocol) { \
+	.bLength              = sizeof(struct usb_descriptor_interface_association), \
+	.bDescriptorType      = 0x0B, /* Interface Association */ \
+	.bFirstInterface      = (first), \
+	.bInterfaceCount      = (count), \
+	.bFunctionClass       = (class), \
+	.bFunctionSubClass    = (subclass), \
+	.bFunctionProtocol    = (protocol), \
+	.iFunction            = 0, \
+}
+
+#define USB_INTERFACE(number, endpoints, class, subclass, protocol, string) { \
+	.bLength              = sizeof(struct usb_descriptor_interface), \
+	.bDescriptorType      = 0x04, /* Interface */ \
+	.bInterfaceNumber     = (number), \
+	.bAlternateSetting    = 0, \
+	.bNumEndpoints        = (endpoints), \
+	.bInterfaceClass      = (class), \
+	.bInterfaceSubClass   = (subclass), \
+	.bInterfaceProtocol   = (protocol), \
+	.iInterface           = (string), \
+}
+
+#define USB_ENDPOINT(address, attributes, packetsize, interval) { \
+	.bLength              = sizeof(struct usb_descriptor_endpoint), \
+	.bDescriptorType      = 0x05, /* Endpoint */ \
+	.bEndpointAddress     = (address), \
+	.bmAttributes         = (attributes), \
+	.wMaxPacketSize       = (packetsize), \
+	.bInterval            = (interval), \
+}
+#define USB_ENDPOINT_BULK_IN(ep, packetsize) \
+	USB_ENDPOINT(0x80 | (ep), 0x02, packetsize, 0)
+#define USB_ENDPOINT_BULK_OUT(ep, packetsize) \
+	USB_ENDPOINT(ep, 0x02, packetsize, 0)
+#define USB_ENDPOINT_INTERRUPT_IN(ep, packetsize, ms) \
+	USB_ENDPOINT(0x80 | (ep), 0x03, packetsize, ms)
+
+/* build a string descriptor from a u"" literal, leaving out the NUL */
+#define USB_STRING(str) { \
+	.bLength              = sizeof(str), \
+	.bDescriptorType      = 0x03, /* String */ \
+	.wCodepoint           = str, \
+}
+
+/*
+ * A setup handler is run for requests matching req (bRequest << 8 |
+ * bmRequestType) and the low byte of wIndex, or any wIndex if idx is
+ * 0xFF. If len isn't 0xFF wLength must match it too.
+ *
+ * For device to host requests the handler points *data at the reply
+ * and returns its length. Otherwise *data points to the OUT data, if
+ * any, and the handler returns 0 to ack the request. A negative
+ * return value stalls the request.
+ */
+struct usb_setup_handler {
+	uint16_t req;
+	uint8_t idx;
+	uint8_t len;
+	int (*fn)(const struct usb_setup_packet *p, const void **data);
+};
+
+/*
+ * A class driver handles the class and vendor requests for its
+ * interfaces and sets up its endpoints when the host selects the
+ * configuration. reset is called from the interrupt handler on a bus
+ * reset, after endpoints 1 to 3 are disabled, so transfers that will
+ * never complete can be dropped. It isn't called with USBFS_EP0_ONLY.
+ */
+struct usbfs_class {
+	const struct usb_setup_handler *handler;
+	uint8_t handlers;
+	void (*configure)(void);
+	void (*reset)(void);
+};
+
+#define USBFS_CLASS_HANDLERS(x) .handler = (x), .handlers = ARRAY_SIZE(x)
+
+/*
+ * Callbacks for endpoints 1 to 3. rx is called from the interrupt
+ * handler when a packet of len bytes for the endpoint is at the
+ * front of the rx fifo, and must read all of it. ep is called when
+ * the endpoint raises an IN or OUT endpoint interrupt.
+ * Devices using only the control pipe can build with -DUSBFS_EP0_ONLY
+ * to leave out the code for them, and then CLEAR_FEATURE(ENDPOINT_HALT)
+ * is stalled like any other unknown request.
+ */
+struct usbfs_endpoint {
+	void (*rx)(unsigned int len);
+	void (*ep)(void);
+};
+
+/*
+ * The 1280 bytes of fifo RAM are shared between the rx fifo and a
+ * tx fifo for each IN endpoint. USBFS_FIFO() takes the packet sizes
+ * of IN endpoints 1 to 3, 0 for unused endpoints, and gives
+ * endpoint 0 room for 2 packets and the others room for
+ * USBFS_FIFO_TXPACKETS packets, but at least the 16 words the
+ * hardware requires. The rx fifo gets the rest, and it is a compile
+ * time error if that is less than the core needs to receive setup
+ * packets and two full-speed bulk packets.
+ */
+/* the core always runs endpoint 0 with 64 byte packets */
+#define USBFS_EP0_PACKETSIZE 64
+
+#define USBFS_FIFO_RAM 1280
+#ifndef USBFS_FIFO_TXPACKETS
+#define USBFS_FIFO_TXPACKETS 4
+#endif
+#define USBFS_FIFO_WORDS(x) (((x) + 3) / 4)
+#define USBFS_FIFO_TX(packetsize, packets) \
+	((packetsize) == 0 ? 0 : \
+	 USBFS_FIFO_WORDS((packetsize) * (packets)) < 16 ? 16 : \
+	 USBFS_FIFO_WORDS((packetsize) * (packets)))
+#define USBFS_FIFO_TX0 USBFS_FIFO_TX(USBFS_EP0_PACKETSIZE, 2)
+#define USBFS_FIFO_TXN(in) USBFS_FIFO_TX(in, USBFS_FIFO_TXPACKETS)
+/* 10 words for setup packets, 2 packets of 64 bytes with status and 1 for global OUT NAK */
+#define USBFS_FIFO_RXMIN (10 + 2 * (64/4 + 1) + 1)
+#define USBFS_FIFO_RX(in1, in2, in3) \
+	(USBFS_FIFO_RAM/4 - USBFS_FIFO_TX0 - \
+	 USBFS_FIFO_TXN(in1) - USBFS_FIFO_TXN(in2) - USBFS_FIFO_TXN(in3))
+/* evaluates to 0, or fails to compile if cond is false */
+#define USBFS_FIFO_ASSERT(cond, msg) \
+	(0 * sizeof(struct { _Static_assert(cond, msg); int dummy; }))
+#define USBFS_FIFO(in1, in2, in3) { \
+	.grflen = USBFS_FIFO_RX(in1, in2, in3) + \
+		USBFS_FIFO_ASSERT(USBFS_FIFO_RX(in1, in2, in3) >= USBFS_FIFO_RXMIN, \
+				"USBFS fifo RAM overcommitted"), \
+	.tflen = { \
+		USBFS_FIFO_TX0 << 16 | \
+			USBFS_FIFO_RX(in1, in2, in3), \
+		USBFS_FIFO_TXN(in1) << 16 | \
+			(USBFS_FIFO_RX(in1, in2, in3) + USBFS_FIFO_TX0), \
+		USBFS_FIFO_TXN(in2) << 16 | \
+			(USBFS_FIFO_RX(in1, in2, in3) + USBFS_FIFO_TX0 + \
+			 USBFS_FIFO_TXN(in1)), \
+		USBFS_FIFO_TXN(in3) << 16 | \
+			(USBFS_FIFO_RX(in1, in2, in3) + USBFS_FIFO_TX0 + \
+			 USBFS_FIFO_TXN(in1) + USBFS_FIFO_TXN(in2)), \
+	}, \
+}
+
+struct usbfs_fifo {
+	uint32_t grflen;
+	uint32_t tflen[4];
+};
+
+/*
+ * Everything the core needs to know about the device. Exactly one
+ * of these named usbfs_device must be linked in, either from a
+ * library like stdio-usbacm or from the application itself.
+ *
+ * ep0buf receives the data stage of host to device control
+ * requests, so it must be large enough for the longest one.
+ */
+struct usbfs_device {
+	const struct usb_descriptor_device *device;
+	const struct usb_descriptor_configuration *configuration;
+	const struct usb_descriptor_string *const *string;
+	const struct usbfs_class *const *class;
+	uint32_t *ep0buf;
+	uint16_t ep0size;
+	uint8_t strings;
+	uint8_t classes;
+	const struct usbfs_endpoint *endpoint[3];
+	struct usbfs_fifo fifo;
+};
+
+extern const struct usbfs_device usbfs_device;
+
+/* reboot once the status stage of the current request is acked */
+extern bool usbfs_reboot_on_ack;
+
+/* word copies to and from the fifo of endpoint ep */
+void usbfs_fifo_read(unsigned int ep, void *dst, unsigned int len);
+void usbfs_fifo_write(unsigned int ep, const void *src, unsigned int len);
+
+void usbfs_init(uint8_t priority);
+
+/*
+ * While the host has suspended the bus the phy clock is stopped and
+ * the system runs from the 8MHz IRC8M oscillator with the PLL off,
+ * so everything clocked from it, mtimer included, runs 12 times
+ * slower (13.5 at 108MHz). The clocks are restored in the interrupt
+ * handler when the host resumes or resets the bus. Build with
+ * -DUSBFS_NO_SUSPEND to keep running at full speed. Such devices don't
+ * support remote wakeup either, so SET_FEATURE and CLEAR_FEATURE of
+ * DEVICE_REMOTE_WAKEUP are stalled too.
+ */
+extern volatile bool usbfs_suspended;
+
+/*
+ * Wake up the host if it suspended the bus and has enabled remote
+ * wakeup. Returns 0 when the bus is (being) resumed and -1 if the
+ * host doesn't allow us to wake it. Busy waits the 5ms of resume
+ * signaling, so called from an interrupt handler it just returns -1.
+ */
+int usbfs_remote_wakeup(void);
+
+/* call from the main loop when idle, sleeps while suspended */
+void usbfs_idle(void);
+
+struct usbfs_stats {
+	uint32_t suspends;
+	uint32_t remote_wakeups;
+	/* total time spent suspended */
+	uint64_t suspended_us;
+	/* time to restore the clocks on the last and slowest resume */
+	uint32_t resume_us;
+	uint32_t resume_us_max;
+};
+extern struct usbfs_stats usbfs_stats;
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#ifndef LIB_USBFS_MSC_H
+#define LIB_USBFS_MSC_H
+
+#include <stdint.h>
+
+#include "lib/usbfs-core.h"
+
+/*
+ * USB mass storage class, bulk-only transport with the SCSI
+ * transparent command set, exporting a single disk of 512 byte
+ * blocks.
+ *
+ * Disk access may be slow, so all of it happens in usbmsc_poll(),
+ * which must be called from the main loop. Reads and writes of
+ * several blocks are pipelined through two block buffers, so the
+ * next block is read from (or written to) the disk while the last
+ * one is on the bus.
+ */
+#define USBMSC_ENDPOINT 3
+/* 8, 16, 32 or 64 bytes for full-speed bulk eps */
+#define USBMSC_PACKETSIZE 64
+
+struct usbmsc_disk {
+	/* number of 512 byte blocks */
+	uint32_t blocks;
+	/* return 0 on success */
+	int (*read)(uint32_t lba, void *buf);
+	/* NULL for a write protected disk */
+	int (*write)(uint32_t lba, const void *buf);
+};
+
+extern const struct usbfs_class usbmsc_class;
+extern const struct usbfs_endpoint usbmsc_endpoint;
+
+/* insert a disk, or remove it with NULL */
+void usbmsc_attach(const struct usbmsc_disk *disk);
+void usbmsc_poll(void);
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#ifndef LIB_USBFS_VENDOR_H
+#define LIB_USBFS_VENDOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "lib/usbfs-core.h"
+
+/*
+ * Vendor specific interface with a bulk IN and a bulk OUT endpoint
+ * for raw binary data. Transfers go straight between the caller's
+ * buffer and the endpoint fifo without any copying in between, and
+ * may span many packets. Buffers should be word aligned to use the
+ * fast path.
+ */
+#define USBVENDOR_ENDPOINT 3
+/* 8, 16, 32 or 64 bytes for full-speed bulk eps */
+#define USBVENDOR_PACKETSIZE 64
+
+extern const struct usbfs_class usbvendor_class;
+extern const struct usbfs_endpoint usbvendor_endpoint;
+
+/*
+ * Start receiving into buf. len must be a multiple of the packet size
+ * and at most 1023 packets. The transfer ends when len bytes are
+ * received or the host sends a short packet.
+ */
+void usbvendor_rx_start(void *buf, size_t len);
+/* bytes received by the last transfer or -1 while it is running */
+int usbvendor_rx_done(void);
+
+/*
+ * Start sending len bytes from buf, which must not change until
+ * the transfer is done.
+ */
+void usbvendor_tx_start(const void *buf, size_t len);
+bool usbvendor_tx_done(void);
+
+#endif
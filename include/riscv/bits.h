@@ -76,7 +76,8 @@
 #define __naked __attribute__((__naked__))
 #endif
 
-#if __has_attribute(__interrupt__)
+/* x86 has an interrupt attribute too, but it means something else */
+#if defined(__riscv) && __has_attribute(__interrupt__)
 #define __interrupt __attribute__((__interrupt__))
 #endif
 
@@ -86,6 +87,7 @@
 #define __noreturn
 #endif
 
+#ifdef __riscv
 static inline void
 wait_for_interrupt(void)
 {
@@ -97,6 +99,11 @@ nop(void)
 {
 	__asm__ __volatile__ ("nop");
 }
+#else
+/* host builds of the drivers, see tests/usbfs-sim.c */
+void wait_for_interrupt(void);
+void nop(void);
+#endif
 
 #endif
 #endif
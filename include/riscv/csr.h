@@ -216,7 +216,16 @@
 #define CSR_MCOUNTINHIBIT_HPM(x) _BIT(x,UL)
 
 #ifndef __ASSEMBLER__
-#ifdef __OPTIMIZE__
+#ifndef __riscv
+/* host builds of the drivers, see tests/usbfs-sim.c, emulate these */
+unsigned long csr_swap(unsigned int csr, unsigned long val);
+unsigned long csr_read(unsigned int csr);
+unsigned long csr_read_set(unsigned int csr, unsigned long val);
+unsigned long csr_read_clear(unsigned int csr, unsigned long val);
+void csr_write(unsigned int csr, unsigned long val);
+void csr_set(unsigned int csr, unsigned long val);
+void csr_clear(unsigned int csr, unsigned long val);
+#elif defined(__OPTIMIZE__)
 /* this gives better type warnings */
 static inline unsigned long
 csr_swap(unsigned int csr, unsigned long val)
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "lib/log.h"
+
+#ifndef LOG_SIZE
+#define LOG_SIZE 1024
+#endif
+
+#if LOG_SIZE & (LOG_SIZE - 1)
+#error "LOG_SIZE must be a power of 2"
+#endif
+
+/*
+ * Records are sent as SLIP style frames so they can share a stream
+ * with plain text. Each frame holds the format string id followed by
+ * the arguments, all as little-endian base 128 varints. Besides the
+ * usual SLIP escapes '\n' and '\r' are escaped too, so the newline
+ * translation done by the uart0 and usbacm streams never touches a
+ * frame.
+ */
+#define SLIP_END     0xc0
+#define SLIP_ESC     0xdb
+#define SLIP_ESC_END 0xdc
+#define SLIP_ESC_ESC 0xdd
+#define SLIP_ESC_LF  0xde
+#define SLIP_ESC_CR  0xdf
+
+/*
+ * Writers reserve space by moving reserved forward with
+ * compare-and-swap, so no interrupts are ever disabled.
+ * There is only one hart, so writers nest strictly and
+ * once the outermost writer is done every reserved byte
+ * has been written and may be committed for the reader.
+ */
+static struct {
+	uint32_t reserved;
+	uint32_t committed;
+	uint32_t writers;
+	uint32_t read;
+	uint32_t dropped;
+	uint8_t buf[LOG_SIZE];
+} log_ring;
+
+static uint8_t *
+log_escape(uint8_t *p, uint8_t c)
+{
+	switch (c) {
+	case SLIP_END:
+		*p++ = SLIP_ESC;
+		c = SLIP_ESC_END;
+		break;
+	case SLIP_ESC:
+		*p++ = SLIP_ESC;
+		c = SLIP_ESC_ESC;
+		break;
+	case '\n':
+		*p++ = SLIP_ESC;
+		c = SLIP_ESC_LF;
+		break;
+	case '\r':
+		*p++ = SLIP_ESC;
+		c = SLIP_ESC_CR;
+		break;
+	}
+	*p++ = c;
+	return p;
+}
+
+static uint8_t *
+log_varint(uint8_t *p, uint32_t v)
+{
+	while (v >= 0x80U) {
+		p = log_escape(p, v | 0x80U);
+		v >>= 7;
+	}
+	return log_escape(p, v);
+}
+
+void log_record(uint32_t id, const uint32_t *args, unsigned int n)
+{
+	/* each varint is at most 5 bytes, twice that when escaped */
+	uint8_t frame[2 + 2*5*(1 + LOG_MAXARGS)];
+	uint8_t *p = frame;
+	uint32_t len;
+	uint32_t pos;
+	uint32_t end;
+
+	*p++ = SLIP_END;
+	p = log_varint(p, id);
+	for (; n > 0; n--)
+		p = log_varint(p, *args++);
+	*p++ = SLIP_END;
+	len = p - frame;
+
+	__atomic_add_fetch(&log_ring.writers, 1, __ATOMIC_ACQUIRE);
+
+	pos = __atomic_load_n(&log_ring.reserved, __ATOMIC_RELAXED);
+	do {
+		uint32_t read = __atomic_load_n(&log_ring.read, __ATOMIC_ACQUIRE);
+
+		if (pos + len - read > LOG_SIZE) {
+			__atomic_add_fetch(&log_ring.dropped, 1, __ATOMIC_RELAXED);
+			goto out;
+		}
+	} while (!__atomic_compare_exchange_n(&log_ring.reserved, &pos, pos + len,
+				true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	for (p = frame; len > 0; len--)
+		log_ring.buf[pos++ % LOG_SIZE] = *p++;
+
+out:
+	if (__atomic_sub_fetch(&log_ring.writers, 1, __ATOMIC_RELEASE) != 0)
+		return;
+
+	end = __atomic_load_n(&log_ring.reserved, __ATOMIC_RELAXED);
+	pos = __atomic_load_n(&log_ring.committed, __ATOMIC_RELAXED);
+	while ((int32_t)(end - pos) > 0 &&
+			!__atomic_compare_exchange_n(&log_ring.committed, &pos, end,
+				true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		/* retry */;
+}
+
+void log_flush(FILE *stream)
+{
+	uint32_t read = log_ring.read;
+	uint32_t end = __atomic_load_n(&log_ring.committed, __ATOMIC_ACQUIRE);
+
+	if (read == end)
+		return;
+
+	do {
+		const char *p = (const char *)&log_ring.buf[read % LOG_SIZE];
+		uint32_t n = LOG_SIZE - (read % LOG_SIZE);
+
+		if (n > end - read)
+			n = end - read;
+		read += n;
+
+		if (stream->write) {
+			stream->write(stream, p, n);
+			continue;
+		}
+		for (; n > 0; n--)
+			stream->putc(stream, *p++);
+	} while (read != end);
+
+	__atomic_store_n(&log_ring.read, read, __ATOMIC_RELEASE);
+	stream->done(stream);
+}
+
+uint32_t log_dropped(void)
+{
+	return __atomic_load_n(&log_ring.dropped, __ATOMIC_RELAXED);
+}
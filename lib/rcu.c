@@ -128,6 +128,47 @@ void rcu_sysclk_hxtal(uint32_t cfg0, uint32_t cfg1)
 	}
 }
 
+/*
+ * switch the system clock to IRC8M and stop the PLL, returning
+ * the old clock switch setting for rcu_sysclk_restore()
+ */
+uint32_t rcu_sysclk_irc8m(void)
+{
+	uint32_t scs = RCU->CFG0 & RCU_CFG0_SCS_Msk;
+
+	/* make sure IRC8M is running */
+	RCU->CTL |= RCU_CTL_IRC8MEN;
+	while (!(RCU->CTL & RCU_CTL_IRC8MSTB))
+		/* wait */;
+
+	/* select IRC8M as system clock */
+	RCU->CFG0 &= ~RCU_CFG0_SCS_Msk;
+	/* wait until IRC8M is selected as system clock */
+	while ((RCU->CFG0 & RCU_CFG0_SCSS_Msk) != RCU_CFG0_SCSS_IRC8M)
+		/* wait */;
+
+	/* stop PLL, its configuration is kept */
+	RCU->CTL &= ~RCU_CTL_PLLEN;
+	return scs;
+}
+
+void rcu_sysclk_restore(uint32_t scs)
+{
+	if (scs == RCU_CFG0_SCS_PLL) {
+		/* enable PLL */
+		RCU->CTL |= RCU_CTL_PLLEN;
+		/* wait until PLL is stable */
+		while (!(RCU->CTL & RCU_CTL_PLLSTB))
+			/* wait */;
+	}
+
+	/* select the old system clock */
+	RCU->CFG0 = (RCU->CFG0 & ~RCU_CFG0_SCS_Msk) | scs;
+	/* wait until it is selected */
+	while ((RCU->CFG0 & RCU_CFG0_SCSS_Msk) != RCU_CFG0_SCSS(scs))
+		/* wait */;
+}
+
 void rcu_sysclk_init(void)
 {
 #ifndef HXTAL
@@ -35,6 +35,7 @@
 #define PRINTF_O
 #define PRINTF_LL
 #define PRINTF_LLX
+#define STRING_SWAR
 */
 
 FILE *stdout;
@@ -59,57 +60,231 @@ int memcmp(const void *s1, const void *s2, size_t n)
 	return 0;
 }
 
+typedef uint32_t __attribute__((__may_alias__)) word_t;
+
+#define WORD_MASK (sizeof(word_t) - 1)
+
+static inline bool aligned(const void *p)
+{
+	return ((uintptr_t)p & WORD_MASK) == 0;
+}
+
 void *memset(void *s, int c, size_t n)
 {
-	if (n > 0) {
-		char *p = s;
-		char *end = p + n;
+	unsigned char *p = s;
 
-		do {
+	if (n >= 2*sizeof(word_t)) {
+		word_t v = 0x01010101U * (unsigned char)c;
+		word_t *wp;
+
+		while (!aligned(p)) {
 			*p++ = c;
-		} while (p < end);
+			n--;
+		}
+
+		wp = (word_t *)p;
+		for (; n >= 4*sizeof(word_t); n -= 4*sizeof(word_t)) {
+			wp[0] = v;
+			wp[1] = v;
+			wp[2] = v;
+			wp[3] = v;
+			wp += 4;
+		}
+		for (; n >= sizeof(word_t); n -= sizeof(word_t))
+			*wp++ = v;
+		p = (unsigned char *)wp;
 	}
 
+	for (; n > 0; n--)
+		*p++ = c;
+
 	return s;
 }
 
-void *memcpy(void *restrict dest, const void *restrict src, size_t n)
+/*
+ * Copy n bytes from s to d in ascending order. The destination is
+ * word aligned first and then either whole words are copied, or, if the
+ * source is still unaligned, aligned source words are shifted together.
+ * Loads never touch a word not containing at least one source byte.
+ * This is safe for overlapping buffers as long as d <= s.
+ */
+static unsigned char *
+copy_forward(unsigned char *d, const unsigned char *s, size_t n)
 {
-	if (n > 0) {
-		char *cdest = dest;
-		const char *csrc = src;
-		const char *cend = csrc + n;
+	if (n >= 2*sizeof(word_t)) {
+		unsigned int off;
+		word_t *wd;
 
-		do {
-			*cdest++ = *csrc++;
-		} while (csrc < cend);
+		while (!aligned(d)) {
+			*d++ = *s++;
+			n--;
+		}
+
+		wd = (word_t *)d;
+		off = (uintptr_t)s & WORD_MASK;
+		if (off == 0) {
+			const word_t *ws = (const word_t *)s;
+
+			for (; n >= 4*sizeof(word_t); n -= 4*sizeof(word_t)) {
+				word_t a = ws[0];
+				word_t b = ws[1];
+				word_t c = ws[2];
+				word_t e = ws[3];
+
+				wd[0] = a;
+				wd[1] = b;
+				wd[2] = c;
+				wd[3] = e;
+				ws += 4;
+				wd += 4;
+			}
+			for (; n >= sizeof(word_t); n -= sizeof(word_t))
+				*wd++ = *ws++;
+			s = (const unsigned char *)ws;
+		} else {
+			const word_t *ws = (const word_t *)(s - off);
+			unsigned int lsh = 8*(sizeof(word_t) - off);
+			unsigned int rsh = 8*off;
+			word_t lo = *ws++;
+
+			for (; n >= sizeof(word_t); n -= sizeof(word_t)) {
+				word_t hi = *ws++;
+
+				*wd++ = (lo >> rsh) | (hi << lsh);
+				lo = hi;
+				s += sizeof(word_t);
+			}
+		}
+		d = (unsigned char *)wd;
 	}
 
-	return dest;
+	for (; n > 0; n--)
+		*d++ = *s++;
+
+	return d;
 }
 
-void *memmove(void *dest, const void *src, size_t n)
+/*
+ * Like copy_forward(), but d and s point one past the end
+ * of the buffers and bytes are copied in descending order.
+ * This is safe for overlapping buffers as long as d >= s.
+ */
+static void
+copy_backward(unsigned char *d, const unsigned char *s, size_t n)
 {
-	if (n > 0) {
-		char *cdest = dest;
-		const char *csrc = src;
-		const char *cend = csrc + n;
-
-		if (cdest > csrc && cdest < cend) {
-			cdest += n;
-			do {
-				*--cdest = *--cend;
-			} while (csrc < cend);
+	if (n >= 2*sizeof(word_t)) {
+		unsigned int off;
+		word_t *wd;
+
+		while (!aligned(d)) {
+			*--d = *--s;
+			n--;
+		}
+
+		wd = (word_t *)d;
+		off = (uintptr_t)s & WORD_MASK;
+		if (off == 0) {
+			const word_t *ws = (const word_t *)s;
+
+			for (; n >= 4*sizeof(word_t); n -= 4*sizeof(word_t)) {
+				word_t a = ws[-1];
+				word_t b = ws[-2];
+				word_t c = ws[-3];
+				word_t e = ws[-4];
+
+				wd[-1] = a;
+				wd[-2] = b;
+				wd[-3] = c;
+				wd[-4] = e;
+				ws -= 4;
+				wd -= 4;
+			}
+			for (; n >= sizeof(word_t); n -= sizeof(word_t))
+				*--wd = *--ws;
+			s = (const unsigned char *)ws;
 		} else {
-			do {
-				*cdest++ = *csrc++;
-			} while (csrc < cend);
+			const word_t *ws = (const word_t *)(s - off);
+			unsigned int lsh = 8*(sizeof(word_t) - off);
+			unsigned int rsh = 8*off;
+			word_t hi = *ws;
+
+			for (; n >= sizeof(word_t); n -= sizeof(word_t)) {
+				word_t lo = *--ws;
+
+				*--wd = (lo >> rsh) | (hi << lsh);
+				hi = lo;
+				s -= sizeof(word_t);
+			}
 		}
+		d = (unsigned char *)wd;
 	}
 
+	for (; n > 0; n--)
+		*--d = *--s;
+}
+
+void *memcpy(void *restrict dest, const void *restrict src, size_t n)
+{
+	copy_forward(dest, src, n);
+	return dest;
+}
+
+void *memmove(void *dest, const void *src, size_t n)
+{
+	unsigned char *d = dest;
+	const unsigned char *s = src;
+
+	if (d > s && d < s + n)
+		copy_backward(d + n, s + n, n);
+	else if (d != s)
+		copy_forward(d, s, n);
+
 	return dest;
 }
 
+#ifdef STRING_SWAR
+#define ONES  0x01010101U
+#define HIGHS 0x80808080U
+
+/*
+ * Non-zero if any byte of v is zero. Bytes above the first zero byte
+ * may be flagged too, so the word must still be scanned byte by byte.
+ */
+static inline word_t haszero(word_t v)
+{
+	return (v - ONES) & ~v & HIGHS;
+}
+#endif
+
+#ifdef STRING_SWAR
+void *memchr(const void *s, int c, size_t n)
+{
+	const unsigned char *p = s;
+	unsigned char b = c;
+
+	for (; n > 0 && !aligned(p); n--, p++) {
+		if (*p == b)
+			return (void *)p;
+	}
+	if (n >= sizeof(word_t)) {
+		const word_t *wp = (const word_t *)p;
+		word_t cc = ONES * b;
+
+		for (; n >= sizeof(word_t); n -= sizeof(word_t)) {
+			if (haszero(*wp ^ cc))
+				break;
+			wp++;
+		}
+		p = (const unsigned char *)wp;
+	}
+	for (; n > 0; n--, p++) {
+		if (*p == b)
+			return (void *)p;
+	}
+
+	return NULL;
+}
+#else
 void *memchr(const void *s, int c, size_t n)
 {
 	if (n > 0) {
@@ -125,7 +300,37 @@ void *memchr(const void *s, int c, size_t n)
 
 	return NULL;
 }
+#endif
+
+#ifdef STRING_SWAR
+void *memrchr(const void *s, int c, size_t n)
+{
+	const unsigned char *p = (const unsigned char *)s + n;
+	unsigned char b = c;
+
+	for (; n > 0 && !aligned(p); n--) {
+		if (*--p == b)
+			return (void *)p;
+	}
+	if (n >= sizeof(word_t)) {
+		const word_t *wp = (const word_t *)p;
+		word_t cc = ONES * b;
+
+		for (; n >= sizeof(word_t); n -= sizeof(word_t)) {
+			if (haszero(wp[-1] ^ cc))
+				break;
+			wp--;
+		}
+		p = (const unsigned char *)wp;
+	}
+	for (; n > 0; n--) {
+		if (*--p == b)
+			return (void *)p;
+	}
 
+	return NULL;
+}
+#else
 void *memrchr(const void *s, int c, size_t n)
 {
 	if (n > 0) {
@@ -141,7 +346,32 @@ void *memrchr(const void *s, int c, size_t n)
 
 	return NULL;
 }
+#endif
 
+#ifdef STRING_SWAR
+void *rawmemchr(const void *s, int c)
+{
+	const unsigned char *p = s;
+	unsigned char b = c;
+
+	for (; !aligned(p); p++) {
+		if (*p == b)
+			return (void *)p;
+	}
+	{
+		const word_t *wp = (const word_t *)p;
+		word_t cc = ONES * b;
+
+		while (!haszero(*wp ^ cc))
+			wp++;
+		p = (const unsigned char *)wp;
+	}
+	while (*p != b)
+		p++;
+
+	return (void *)p;
+}
+#else
 void *rawmemchr(const void *s, int c)
 {
 	const char *p = s;
@@ -151,7 +381,30 @@ void *rawmemchr(const void *s, int c)
 
 	return (void *)p;
 }
+#endif
+
+#ifdef STRING_SWAR
+size_t strlen(const char *s)
+{
+	const char *p = s;
+
+	for (; !aligned(p); p++) {
+		if (*p == '\0')
+			return p - s;
+	}
+	{
+		const word_t *wp = (const word_t *)p;
+
+		while (!haszero(*wp))
+			wp++;
+		p = (const char *)wp;
+	}
+	while (*p != '\0')
+		p++;
 
+	return p - s;
+}
+#else
 size_t strlen(const char *s)
 {
 	const char *p = s;
@@ -163,20 +416,85 @@ size_t strlen(const char *s)
 
 	return (uintptr_t)p - (uintptr_t)s - 1;
 }
+#endif
 
+#ifdef STRING_SWAR
 size_t strnlen(const char *s, size_t maxlen)
 {
 	const char *p = s;
-	const char *end = s + maxlen;
-	char c;
+	size_t n = maxlen;
 
-	do {
-		c = *p++;
-	} while (c != '\0' && p < end);
+	for (; n > 0 && !aligned(p); n--, p++) {
+		if (*p == '\0')
+			return p - s;
+	}
+	if (n >= sizeof(word_t)) {
+		const word_t *wp = (const word_t *)p;
 
-	return (uintptr_t)p - (uintptr_t)s - 1;
+		for (; n >= sizeof(word_t); n -= sizeof(word_t)) {
+			if (haszero(*wp))
+				break;
+			wp++;
+		}
+		p = (const char *)wp;
+	}
+	for (; n > 0; n--, p++) {
+		if (*p == '\0')
+			break;
+	}
+
+	return p - s;
 }
+#else
+size_t strnlen(const char *s, size_t maxlen)
+{
+	const char *p = s;
+
+	for (; maxlen > 0; maxlen--, p++) {
+		if (*p == '\0')
+			break;
+	}
+
+	return p - s;
+}
+#endif
+
+#ifdef STRING_SWAR
+int strcmp(const char *s1, const char *s2)
+{
+	const unsigned char *p1 = (const unsigned char *)s1;
+	const unsigned char *p2 = (const unsigned char *)s2;
+	int a, b;
+
+	if ((((uintptr_t)p1 ^ (uintptr_t)p2) & WORD_MASK) == 0) {
+		const word_t *w1;
+		const word_t *w2;
+
+		for (; !aligned(p1); p1++, p2++) {
+			a = *p1;
+			b = *p2;
+			if (a != b || a == '\0')
+				return a - b;
+		}
 
+		w1 = (const word_t *)p1;
+		w2 = (const word_t *)p2;
+		while (*w1 == *w2 && !haszero(*w1)) {
+			w1++;
+			w2++;
+		}
+		p1 = (const unsigned char *)w1;
+		p2 = (const unsigned char *)w2;
+	}
+
+	do {
+		a = *p1++;
+		b = *p2++;
+	} while (a == b && a != '\0');
+
+	return a - b;
+}
+#else
 int strcmp(const char *s1, const char *s2)
 {
 	int a, b;
@@ -188,6 +506,7 @@ int strcmp(const char *s1, const char *s2)
 
 	return a - b;
 }
+#endif
 
 int strncmp(const char *s1, const char *s2, size_t n)
 {
@@ -302,19 +621,49 @@ out:
 	return dest;
 }
 
+#ifdef STRING_SWAR
+char *strchr(const char *s, int c)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	unsigned char b = c;
+
+	for (; !aligned(p); p++) {
+		if (*p == b)
+			return (char *)p;
+		if (*p == '\0')
+			return NULL;
+	}
+	{
+		const word_t *wp = (const word_t *)p;
+		word_t cc = ONES * b;
+
+		while (!haszero(*wp) && !haszero(*wp ^ cc))
+			wp++;
+		p = (const unsigned char *)wp;
+	}
+	while (1) {
+		if (*p == b)
+			return (char *)p;
+		if (*p == '\0')
+			return NULL;
+		p++;
+	}
+}
+#else
 char *strchr(const char *s, int c)
 {
 	int b;
 
 	do {
 		b = *s;
-		if (b == c)
+		if (b == (char)c)
 			return (char *)s;
 		s++;
 	} while (b != '\0');
 
 	return NULL;
 }
+#endif
 
 char *strrchr(const char *s, int c)
 {
@@ -323,7 +672,7 @@ char *strrchr(const char *s, int c)
 
 	do {
 		b = *s;
-		if (b == c)
+		if (b == (char)c)
 			ret = (char *)s;
 		s++;
 	} while (b != '\0');
@@ -331,6 +680,17 @@ char *strrchr(const char *s, int c)
 	return ret;
 }
 
+static void
+stream_write(FILE *stream, const char *buf, size_t len)
+{
+	if (stream->write) {
+		stream->write(stream, buf, len);
+		return;
+	}
+	for (; len > 0; len--)
+		stream->putc(stream, *buf++);
+}
+
 int fputc(int c, FILE *stream)
 {
 	stream->putc(stream, c);
@@ -339,127 +699,220 @@ int fputc(int c, FILE *stream)
 
 int fputs(const char *s, FILE *stream)
 {
-	char c;
-
-	while ((c = *s++) != '\0')
-		stream->putc(stream, c);
-
+	stream_write(stream, s, strlen(s));
 	stream->putc(stream, '\n');
 
 	return stream->done(stream);
 }
 
+/*
+ * vfprintf collects output in a small buffer
+ * on the stack and hands it to the stream in
+ * as few calls as possible
+ */
+struct printf_out {
+	FILE *stream;
+	char *p;
+	char buf[64];
+};
+
 static void
-printf_string(FILE *stream, const char *s)
+printf_flush(struct printf_out *out)
 {
-	char c;
+	size_t len = out->p - out->buf;
 
-	while ((c = *s++) != '\0')
-		stream->putc(stream, c);
+	if (len > 0) {
+		stream_write(out->stream, out->buf, len);
+		out->p = out->buf;
+	}
+}
+
+static inline void
+printf_putc(struct printf_out *out, char c)
+{
+	if (out->p == out->buf + sizeof(out->buf))
+		printf_flush(out);
+	*out->p++ = c;
 }
 
-#ifdef PRINTF_LL
 static void
-printf_llu(FILE *stream, int width, char pad, unsigned long long v)
+printf_pad(struct printf_out *out, int width, char pad)
 {
-	char buf[20];
-	char *p = buf;
+	for (; width > 0; width--)
+		printf_putc(out, pad);
+}
 
-	do {
-		*p++ = '0' + (v % 10);
-		v /= 10;
-		width--;
-	} while (v);
+static void
+printf_write(struct printf_out *out, const char *s, size_t len)
+{
+	if (len > (size_t)(out->buf + sizeof(out->buf) - out->p)) {
+		printf_flush(out);
+		if (len >= sizeof(out->buf)) {
+			stream_write(out->stream, s, len);
+			return;
+		}
+	}
+	memcpy(out->p, s, len);
+	out->p += len;
+}
 
-	for (; width > 0; width--)
-		stream->putc(stream, pad);
+static void
+printf_string(struct printf_out *out, const char *s)
+{
+	printf_write(out, s, strlen(s));
+}
 
-	do {
-		stream->putc(stream, *--p);
-	} while (p > buf);
+/*
+ * Output the number formatted in [p, end)
+ * padded to at least width characters
+ */
+static void
+printf_number(struct printf_out *out, int width, char pad,
+		const char *p, const char *end)
+{
+	printf_pad(out, width - (end - p), pad);
+	printf_write(out, p, end - p);
+}
+
+static const char digits2[200] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+/*
+ * v / 100 for any 32-bit v by multiplying with the
+ * reciprocal rather than relying on the compiler to
+ * do so, since it won't when optimizing for size
+ */
+static inline uint32_t div100(uint32_t v)
+{
+	return ((uint64_t)v * 0x51eb851fU) >> 37;
+}
+
+/*
+ * Write the decimal digits of v so they end just before end,
+ * two digits at a time, and return a pointer to the first digit.
+ */
+static char *
+utoa10(char *end, uint32_t v)
+{
+	while (v >= 100) {
+		uint32_t q = div100(v);
+		const char *d = &digits2[2*(v - 100*q)];
+
+		end -= 2;
+		end[0] = d[0];
+		end[1] = d[1];
+		v = q;
+	}
+	if (v >= 10) {
+		end -= 2;
+		end[0] = digits2[2*v];
+		end[1] = digits2[2*v + 1];
+	} else
+		*--end = '0' + v;
+
+	return end;
+}
+
+/*
+ * Like utoa10(), but split off 9 digits at a time with a 64-bit
+ * division until the rest fits in 32 bits. That is one call to
+ * __udivdi3 for all values below 2^32 * 10^9, rather than one
+ * per digit.
+ */
+static char *
+ulltoa10(char *end, unsigned long long v)
+{
+	while (v > UINT32_MAX) {
+		unsigned long long q = v / 1000000000U;
+		char *p = utoa10(end, v - q * 1000000000U);
+
+		end -= 9;
+		while (p > end)
+			*--p = '0';
+		v = q;
+	}
+	return utoa10(end, v);
+}
+
+static void
+printf_llu(struct printf_out *out, int width, char pad, unsigned long long v)
+{
+	char buf[20];
+	char *end = buf + sizeof(buf);
+
+	printf_number(out, width, pad, ulltoa10(end, v), end);
 }
 
 static void
-printf_lld(FILE *stream, int width, char pad, long long v)
+printf_lld(struct printf_out *out, int width, char pad, long long v)
 {
 	if (v < 0) {
-		stream->putc(stream, '-');
+		printf_putc(out, '-');
 		v = -v;
 	}
-	printf_llu(stream, width, pad, v);
+	printf_llu(out, width, pad, v);
 }
-#else
+
+#ifndef PRINTF_LL
 static void
-printf_u(FILE *stream, int width, char pad, unsigned int v)
+printf_u(struct printf_out *out, int width, char pad, unsigned int v)
 {
 	char buf[10];
-	char *p = buf;
-
-	do {
-		*p++ = '0' + (v % 10);
-		v /= 10;
-		width--;
-	} while (v);
-
-	for (; width > 0; width--)
-		stream->putc(stream, pad);
+	char *end = buf + sizeof(buf);
 
-	do {
-		stream->putc(stream, *--p);
-	} while (p > buf);
+	printf_number(out, width, pad, utoa10(end, v), end);
 }
 
 static void
-printf_d(FILE *stream, int width, char pad, int v)
+printf_d(struct printf_out *out, int width, char pad, int v)
 {
 	if (v < 0) {
-		stream->putc(stream, '-');
+		printf_putc(out, '-');
 		v = -v;
 	}
-	printf_u(stream, width, pad, v);
+	printf_u(out, width, pad, v);
 }
 #endif
 
 #ifdef PRINTF_O
 #ifdef PRINTF_LL
 static void
-printf_llo(FILE *stream, int width, char pad, unsigned long long v)
+printf_llo(struct printf_out *out, int width, char pad, unsigned long long v)
 {
 	char buf[22];
-	char *p = buf;
+	char *end = buf + sizeof(buf);
+	char *p = end;
 
 	do {
-		*p++ = '0' + (v & 0x7U);
+		*--p = '0' + (v & 0x7U);
 		v >>= 3;
-		width--;
 	} while (v);
 
-	for (; width > 0; width--)
-		stream->putc(stream, pad);
-
-	do {
-		stream->putc(stream, *--p);
-	} while (p > buf);
+	printf_number(out, width, pad, p, end);
 }
 #else
 static void
-printf_o(FILE *stream, int width, char pad, unsigned int v)
+printf_o(struct printf_out *out, int width, char pad, unsigned int v)
 {
 	char buf[11];
-	char *p = buf;
+	char *end = buf + sizeof(buf);
+	char *p = end;
 
 	do {
-		*p++ = '0' + (v & 0x7U);
+		*--p = '0' + (v & 0x7U);
 		v >>= 3;
-		width--;
 	} while (v);
 
-	for (; width > 0; width--)
-		stream->putc(stream, pad);
-
-	do {
-		stream->putc(stream, *--p);
-	} while (p > buf);
+	printf_number(out, width, pad, p, end);
 }
 #endif
 #endif
@@ -476,49 +929,40 @@ static const char xdigits[] = {
 
 #if defined(PRINTF_LL) || defined(PRINTF_LLX)
 static void
-printf_llx(FILE *stream, int width, char pad, const char *digits, unsigned long long v)
+printf_llx(struct printf_out *out, int width, char pad, const char *digits, unsigned long long v)
 {
 	char buf[16];
-	char *p = buf;
+	char *end = buf + sizeof(buf);
+	char *p = end;
 
 	do {
-		*p++ = digits[v & 0xfU];
+		*--p = digits[v & 0xfU];
 		v >>= 4;
-		width--;
 	} while (v);
 
-	for (; width > 0; width--)
-		stream->putc(stream, pad);
-
-	do {
-		stream->putc(stream, *--p);
-	} while (p > buf);
+	printf_number(out, width, pad, p, end);
 }
 #else
 static void
-printf_x(FILE *stream, int width, char pad, const char *digits, unsigned int v)
+printf_x(struct printf_out *out, int width, char pad, const char *digits, unsigned int v)
 {
 	char buf[8];
-	char *p = buf;
+	char *end = buf + sizeof(buf);
+	char *p = end;
 
 	do {
-		*p++ = digits[v & 0xfU];
+		*--p = digits[v & 0xfU];
 		v >>= 4;
-		width--;
 	} while (v);
 
-	for (; width > 0; width--)
-		stream->putc(stream, pad);
-
-	do {
-		stream->putc(stream, *--p);
-	} while (p > buf);
+	printf_number(out, width, pad, p, end);
 }
 #endif
 
 
 int vfprintf(FILE *stream, const char *fmt, va_list ap)
 {
+	struct printf_out out = { .stream = stream, .p = out.buf };
 	unsigned int size;
 	int width;
 	char pad;
@@ -537,7 +981,7 @@ fmt:
 		case '%':
 			goto arg;
 		}
-		stream->putc(stream, c);
+		printf_putc(&out, c);
 	}
 
 arg:
@@ -554,7 +998,7 @@ arg:
 		case '\0':
 			goto out;
 		case '%':
-			stream->putc(stream, '%');
+			printf_putc(&out, '%');
 			goto fmt;
 #ifdef PRINTF_ALT
 		case '#':
@@ -582,43 +1026,43 @@ arg:
 			size += 1;
 			break;
 		case 'c':
-			stream->putc(stream, va_arg(ap, int));
+			printf_putc(&out, va_arg(ap, int));
 			goto fmt;
 		case 's':
-			printf_string(stream, va_arg(ap, const char *));
+			printf_string(&out, va_arg(ap, const char *));
 			goto fmt;
 		case 'u':
 #ifdef PRINTF_LL
-			printf_llu(stream, width, pad,
+			printf_llu(&out, width, pad,
 					(size > 3) ?
 					va_arg(ap, unsigned long long) :
 					va_arg(ap, unsigned int));
 #else
-			printf_u(stream, width, pad,
+			printf_u(&out, width, pad,
 					va_arg(ap, unsigned int));
 #endif
 			goto fmt;
 		case 'd':
 		case 'i':
 #ifdef PRINTF_LL
-			printf_lld(stream, width, pad,
+			printf_lld(&out, width, pad,
 					(size > 3) ?
 					va_arg(ap, long long) :
 					va_arg(ap, int));
 #else
-			printf_d(stream, width, pad,
+			printf_d(&out, width, pad,
 					va_arg(ap, int));
 #endif
 			goto fmt;
 #ifdef PRINTF_O
 		case 'o':
 #ifdef PRINTF_LL
-			printf_llo(stream, width, pad,
+			printf_llo(&out, width, pad,
 					(size > 3) ?
 					va_arg(ap, unsigned long long) :
 					va_arg(ap, unsigned int));
 #else
-			printf_o(stream, width, pad,
+			printf_o(&out, width, pad,
 					va_arg(ap, unsigned int));
 #endif
 			goto fmt;
@@ -627,8 +1071,8 @@ arg:
 			digits = Xdigits;
 #ifdef PRINTF_ALT
 			if (alt) {
-				stream->putc(stream, '0');
-				stream->putc(stream, 'X');
+				printf_putc(&out, '0');
+				printf_putc(&out, 'X');
 			}
 #endif
 			goto common_x;
@@ -636,18 +1080,18 @@ arg:
 			digits = xdigits;
 #ifdef PRINTF_ALT
 			if (alt) {
-				stream->putc(stream, '0');
-				stream->putc(stream, 'x');
+				printf_putc(&out, '0');
+				printf_putc(&out, 'x');
 			}
 #endif
 		common_x:
 #if defined(PRINTF_LL) || defined(PRINTF_LLX)
-			printf_llx(stream, width, pad, digits,
+			printf_llx(&out, width, pad, digits,
 					(size > 3) ?
 					va_arg(ap, unsigned long long) :
 					va_arg(ap, unsigned int));
 #else
-			printf_x(stream, width, pad, digits,
+			printf_x(&out, width, pad, digits,
 					va_arg(ap, unsigned int));
 #endif
 			goto fmt;
@@ -656,9 +1100,68 @@ arg:
 		}
 	}
 out:
+	printf_flush(&out);
 	return stream->done(stream);
 }
 
+void __printf_static_write(FILE *stream, const char *s, size_t len)
+{
+	stream_write(stream, s, len);
+}
+
+void __printf_static_d(FILE *stream, int v, int width, char pad)
+{
+	struct printf_out out = { .stream = stream, .p = out.buf };
+
+#ifdef PRINTF_LL
+	printf_lld(&out, width, pad, v);
+#else
+	printf_d(&out, width, pad, v);
+#endif
+	printf_flush(&out);
+}
+
+void __printf_static_u(FILE *stream, unsigned int v, int width, char pad)
+{
+	struct printf_out out = { .stream = stream, .p = out.buf };
+
+#ifdef PRINTF_LL
+	printf_llu(&out, width, pad, v);
+#else
+	printf_u(&out, width, pad, v);
+#endif
+	printf_flush(&out);
+}
+
+void __printf_static_x(FILE *stream, unsigned int v, int width, char pad)
+{
+	struct printf_out out = { .stream = stream, .p = out.buf };
+
+#if defined(PRINTF_LL) || defined(PRINTF_LLX)
+	printf_llx(&out, width, pad, xdigits, v);
+#else
+	printf_x(&out, width, pad, xdigits, v);
+#endif
+	printf_flush(&out);
+}
+
+/* 64-bit values are always printed in full, even without PRINTF_LL */
+void __printf_static_lld(FILE *stream, long long v)
+{
+	struct printf_out out = { .stream = stream, .p = out.buf };
+
+	printf_lld(&out, 0, ' ', v);
+	printf_flush(&out);
+}
+
+void __printf_static_llu(FILE *stream, unsigned long long v)
+{
+	struct printf_out out = { .stream = stream, .p = out.buf };
+
+	printf_llu(&out, 0, ' ', v);
+	printf_flush(&out);
+}
+
 int fprintf(FILE *stream, const char *restrict fmt, ...)
 {
 	va_list ap;
@@ -711,6 +1214,18 @@ static void snprintf_putc(FILE *stream, char c)
 	snp->str++;
 }
 
+static void snprintf_write(FILE *stream, const char *buf, size_t len)
+{
+	struct snprintf *snp = (struct snprintf *)stream;
+
+	if (snp->str < snp->end) {
+		size_t room = snp->end - snp->str;
+
+		memcpy(snp->str, buf, (len < room) ? len : room);
+	}
+	snp->str += len;
+}
+
 static int snprintf_done(FILE *stream)
 {
 	struct snprintf *snp = (struct snprintf *)stream;
@@ -725,6 +1240,7 @@ int vsprintf(char *restrict str, const char *restrict fmt, va_list ap)
 {
 	struct snprintf snp = {
 		.stream.putc = snprintf_putc,
+		.stream.write = snprintf_write,
 		.stream.done = snprintf_done,
 		.str = str,
 		.end = (char *)~0UL,
@@ -749,12 +1265,16 @@ int vsnprintf(char *restrict str, size_t size, const char *restrict fmt, va_list
 {
 	struct snprintf snp = {
 		.stream.putc = snprintf_putc,
+		.stream.write = snprintf_write,
 		.stream.done = snprintf_done,
 		.str = str,
 		.end = str + size,
 	};
 
 	vfprintf(&snp.stream, fmt, ap);
+	/* terminate truncated output too */
+	if (size > 0 && snp.str >= snp.end)
+		snp.end[-1] = '\0';
 	return snp.str - str;
 }
 
@@ -24,127 +24,46 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
  * OF SUCH DAMAGE.
  */
-#include <stdint.h>
-#include <stdbool.h>
-#include <stdio.h>
-
-#include "gd32vf103/rcu.h"
-#include "gd32vf103/usart.h"
-
-#include "lib/eclic.h"
-#include "lib/gpio.h"
 #include "lib/stdio-uart0.h"
 
-int uart0_getchar(void)
-{
-	while (!(USART0->STAT & USART_STAT_RBNE))
-		/* wait */;
-
-	return USART0->DATA;
-}
+#define PORT_NAME       uart0
+#define PORT_USART      USART0
+#define PORT_IRQn       USART0_IRQn
+#define PORT_IRQHandler USART0_IRQHandler
+#define PORT_ENR        APB2EN
+#define PORT_EN         RCU_APB2EN_USART0EN
+#define PORT_RSTR       APB2RST
+#define PORT_RST        RCU_APB2RST_USART0RST
+#define PORT_GPIOEN     RCU_APB2EN_PAEN
+#define PORT_TX         GPIO_PA9
+#define PORT_RX         GPIO_PA10
+
+#define PORT_DMA        DMA0
+#define PORT_DMAEN      RCU_AHBEN_DMA0EN
+#define PORT_TXCH       3
+#define PORT_TXCH_IRQn  DMA0_Channel3_IRQn
+#define PORT_TXCH_IRQHandler DMA0_Channel3_IRQHandler
+#define PORT_RXCH       4
+#define PORT_RXCH_IRQn  DMA0_Channel4_IRQn
+#define PORT_RXCH_IRQHandler DMA0_Channel4_IRQHandler
 
 #ifdef UART0_ASYNC
-static struct {
-	volatile uint16_t first;
-	volatile uint16_t last;
-	char buf[2048];
-} uart0_output;
-
-void
-USART0_IRQHandler(void)
-{
-	unsigned int first = uart0_output.first;
-	unsigned int last = uart0_output.last;
-
-	while (first != last) {
-		if (!(USART0->STAT & USART_STAT_TBE))
-			goto out;
-		USART0->DATA = uart0_output.buf[first++];
-		first %= ARRAY_SIZE(uart0_output.buf);
-	}
-	USART0->CTL0 &= ~USART_CTL0_TBEIE;
-out:
-	uart0_output.first = first;
-}
-
-static void
-uart0_putc(FILE *stream, char c)
-{
-	static bool seenr;
-	unsigned int last = uart0_output.last;
-
-	if (c == '\n' && !seenr) {
-		uart0_output.buf[last++] = '\r';
-		last %= ARRAY_SIZE(uart0_output.buf);
-	}
-
-	seenr = (c == '\r');
-
-	uart0_output.buf[last++] = c;
-	uart0_output.last = last % ARRAY_SIZE(uart0_output.buf);
-}
-
-static int
-uart0_done(FILE *stream)
-{
-	USART0->CTL0 |= USART_CTL0_TBEIE;
-	return 0;
-}
-#else
-static void
-uart0_putc(FILE *stream, char c)
-{
-	static bool seenr;
-
-	if (c == '\n' && !seenr) {
-		while (!(USART0->STAT & USART_STAT_TBE))
-			/* wait */;
-		USART0->DATA = '\r';
-	}
-
-	seenr = (c == '\r');
-
-	while (!(USART0->STAT & USART_STAT_TBE))
-		/* wait */;
-	USART0->DATA = c;
-}
-
-static int uart0_done(FILE *stream)
-{
-	return 0;
-}
+#define PORT_ASYNC
 #endif
-
-const FILE uart0_stream = {
-	.putc = uart0_putc,
-	.done = uart0_done,
-};
-
-void uart0_init(uint32_t pclk, uint32_t target, uint8_t priority)
-{
-	/* enable GPIO clock */
-	RCU->APB2EN |= RCU_APB2EN_PAEN;
-	/* enable USART clock */
-	RCU->APB2EN |= RCU_APB2EN_USART0EN;
-
-	gpio_pin_config(GPIO_PA9,  GPIO_MODE_AF_PP_50MHZ);
-	gpio_pin_config(GPIO_PA10, GPIO_MODE_IN_FLOAT);
-
-	/* reset usart0 */
-	RCU->APB2RST |= RCU_APB2RST_USART0RST;
-	RCU->APB2RST &= ~RCU_APB2RST_USART0RST;
-
-	/* set baudrate */
-	USART0->BAUD = (2*pclk + target) / (2*target);
-	/* set 1 stop bit */
-	USART0->CTL1 = USART_CTL1_STB_1;
-	/* enable rx and tx */
-	USART0->CTL0 = USART_CTL0_TEN | USART_CTL0_REN;
-	/* enable usart0 */
-	USART0->CTL0 |= USART_CTL0_UEN;
-
-#ifdef UART0_ASYNC
-	eclic_config(USART0_IRQn, ECLIC_ATTR_TRIG_LEVEL, priority);
-	eclic_enable(USART0_IRQn);
+#ifdef UART0_DMA
+#define PORT_TXDMA
+#endif
+#ifdef UART0_RXDMA
+#define PORT_RXDMA
+#endif
+#ifdef UART0_TXSIZE
+#define PORT_TXSIZE UART0_TXSIZE
 #endif
-}
+#ifdef UART0_RXSIZE
+#define PORT_RXSIZE UART0_RXSIZE
+#endif
+#ifdef UART0_FRAME
+#define PORT_FRAME UART0_FRAME
+#endif
+
+#include "stdio-usart-template.h"
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#include "lib/stdio-uart3.h"
+
+#define PORT_NAME       uart3
+#define PORT_USART      UART3
+#define PORT_IRQn       UART3_IRQn
+#define PORT_IRQHandler UART3_IRQHandler
+#define PORT_ENR        APB1EN
+#define PORT_EN         RCU_APB1EN_UART3EN
+#define PORT_RSTR       APB1RST
+#define PORT_RST        RCU_APB1RST_UART3RST
+#define PORT_GPIOEN     RCU_APB2EN_PCEN
+#define PORT_TX         GPIO_PC10
+#define PORT_RX         GPIO_PC11
+
+#define PORT_DMA        DMA1
+#define PORT_DMAEN      RCU_AHBEN_DMA1EN
+#define PORT_TXCH       4
+#define PORT_TXCH_IRQn  DMA1_Channel4_IRQn
+#define PORT_TXCH_IRQHandler DMA1_Channel4_IRQHandler
+#define PORT_RXCH       2
+#define PORT_RXCH_IRQn  DMA1_Channel2_IRQn
+#define PORT_RXCH_IRQHandler DMA1_Channel2_IRQHandler
+
+#ifdef UART3_ASYNC
+#define PORT_ASYNC
+#endif
+#ifdef UART3_DMA
+#define PORT_TXDMA
+#endif
+#ifdef UART3_RXDMA
+#define PORT_RXDMA
+#endif
+#ifdef UART3_TXSIZE
+#define PORT_TXSIZE UART3_TXSIZE
+#endif
+#ifdef UART3_RXSIZE
+#define PORT_RXSIZE UART3_RXSIZE
+#endif
+#ifdef UART3_FRAME
+#define PORT_FRAME UART3_FRAME
+#endif
+
+#include "stdio-usart-template.h"
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#include "lib/stdio-uart4.h"
+
+#define PORT_NAME       uart4
+#define PORT_USART      UART4
+#define PORT_IRQn       UART4_IRQn
+#define PORT_IRQHandler UART4_IRQHandler
+#define PORT_ENR        APB1EN
+#define PORT_EN         RCU_APB1EN_UART4EN
+#define PORT_RSTR       APB1RST
+#define PORT_RST        RCU_APB1RST_UART4RST
+#define PORT_GPIOEN     (RCU_APB2EN_PCEN | RCU_APB2EN_PDEN)
+#define PORT_TX         GPIO_PC12
+#define PORT_RX         GPIO_PD2
+
+#ifdef UART4_ASYNC
+#define PORT_ASYNC
+#endif
+#ifdef UART4_DMA
+#define PORT_TXDMA
+#endif
+#ifdef UART4_RXDMA
+#define PORT_RXDMA
+#endif
+#ifdef UART4_TXSIZE
+#define PORT_TXSIZE UART4_TXSIZE
+#endif
+#ifdef UART4_RXSIZE
+#define PORT_RXSIZE UART4_RXSIZE
+#endif
+#ifdef UART4_FRAME
+#define PORT_FRAME UART4_FRAME
+#endif
+
+#include "stdio-usart-template.h"
@@ -0,0 +1,436 @@
+/*
+ * Copyright (c) 2019-2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * Shared implementation of the stdio-uart0, stdio-usart1,
+ * stdio-usart2, stdio-uart3 and stdio-uart4 libraries.
+ *
+ * Each of them defines the PORT_* parameters below and includes this
+ * file, so every port gets its own copy of the code specialized for
+ * its registers, buffers and options at compile time.
+ *
+ * Required parameters:
+ *   PORT_NAME             prefix of the public symbols, eg. usart1
+ *   PORT_USART            the peripheral, eg. USART1
+ *   PORT_IRQn             its interrupt number
+ *   PORT_IRQHandler       and handler
+ *   PORT_ENR, PORT_EN     RCU register and bit enabling its clock
+ *   PORT_RSTR, PORT_RST   RCU register and bit resetting it
+ *   PORT_GPIOEN           RCU_APB2EN bits enabling the gpio clocks
+ *   PORT_TX, PORT_RX      the tx and rx pins
+ *
+ * Only needed when the port supports DMA:
+ *   PORT_DMA, PORT_DMAEN  the DMA controller and its RCU_AHBEN bit
+ *   PORT_TXCH, PORT_TXCH_IRQn, PORT_TXCH_IRQHandler
+ *   PORT_RXCH, PORT_RXCH_IRQn, PORT_RXCH_IRQHandler
+ *
+ * Options:
+ *   PORT_ASYNC            interrupt driven output
+ *   PORT_TXDMA            DMA driven output
+ *   PORT_RXDMA            DMA driven input
+ *   PORT_TXSIZE           output buffer size, must be a power of 2
+ *   PORT_RXSIZE           input buffer size, must be a power of 2
+ *   PORT_FRAME            frame format, eg. USART_FRAME_8N1
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "gd32vf103/dma.h"
+#include "gd32vf103/rcu.h"
+#include "gd32vf103/usart.h"
+
+#include "lib/eclic.h"
+#include "lib/gpio.h"
+#include "lib/ring.h"
+#include "lib/stdio-usart.h"
+
+#define PORT_CAT_(a, b) a##b
+#define PORT_CAT(a, b) PORT_CAT_(a, b)
+#define PORT_SYM(x) PORT_CAT(PORT_NAME, x)
+
+#ifndef PORT_TXSIZE
+#define PORT_TXSIZE 2048
+#endif
+#ifndef PORT_RXSIZE
+#define PORT_RXSIZE 1024
+#endif
+#ifndef PORT_FRAME
+#define PORT_FRAME USART_FRAME_8N1
+#endif
+
+#if defined(PORT_ASYNC) && defined(PORT_TXDMA)
+#error "Only one of interrupt or DMA driven output can be selected"
+#endif
+#if (defined(PORT_TXDMA) || defined(PORT_RXDMA)) && !defined(PORT_DMA)
+#error "This port has no DMA channels"
+#endif
+
+#ifdef PORT_RXDMA
+/*
+ * The rx DMA channel runs in circular mode over the input ring, so
+ * received bytes are never dropped no matter how busy the CPU is.
+ * The DMA is the producer of the ring and its head is brought up to
+ * date from the channel counter. This happens on the half and full
+ * transfer interrupts, when the line goes idle after a burst, and
+ * whenever the reader asks. With interrupts every half buffer the
+ * position can never move more than a full lap between updates, so
+ * when head runs more than a buffer ahead of tail the oldest data was
+ * overwritten and is dropped as an overrun.
+ */
+static RING(PORT_RXSIZE) port_input;
+static uint32_t port_rx_overruns;
+static volatile uint32_t port_rx_errors;
+
+static void
+port_rx_update(void)
+{
+	uint32_t pos = ring_size(&port_input) - PORT_DMA->CH[PORT_RXCH].CNT;
+
+	ring_push_commit(&port_input,
+			(pos - port_input.r.head) & (ring_size(&port_input) - 1));
+}
+
+static void
+port_rx_handler(void)
+{
+	uint32_t stat = PORT_USART->STAT;
+
+	if (stat & (USART_STAT_ORERR | USART_STAT_NERR | USART_STAT_FERR))
+		port_rx_errors++;
+	if (stat & USART_STAT_IDLEF)
+		(void)PORT_USART->DATA; /* clear the idle flag */
+	port_rx_update();
+}
+
+void
+PORT_RXCH_IRQHandler(void)
+{
+	PORT_DMA->INTC = DMA_INTC_GIFC(PORT_RXCH);
+	port_rx_update();
+}
+
+static uint32_t
+port_rx_pending(void)
+{
+	unsigned long mstatus = eclic_global_interrupt_disable_save();
+	uint32_t ret;
+
+	port_rx_update();
+	ret = ring_used(&port_input);
+	if (ret > ring_size(&port_input)) {
+		port_rx_overruns++;
+		ring_pop_commit(&port_input, ret);
+		ret = 0;
+	}
+	eclic_global_interrupt_restore(mstatus);
+	return ret;
+}
+
+size_t PORT_SYM(_available)(void)
+{
+	return port_rx_pending();
+}
+
+size_t PORT_SYM(_read)(void *buf, size_t len)
+{
+	size_t n = port_rx_pending();
+
+	/*
+	 * the DMA may commit more after this, even past a full ring,
+	 * so only pop what was checked for an overrun above
+	 */
+	if (len > n)
+		len = n;
+	if (len == 0)
+		return 0;
+
+	return ring_pop_n(&port_input, buf, len);
+}
+
+uint32_t PORT_SYM(_rx_overruns)(void)
+{
+	return port_rx_overruns;
+}
+
+uint32_t PORT_SYM(_rx_errors)(void)
+{
+	return port_rx_errors;
+}
+
+uint32_t PORT_SYM(_rx_hiwat)(void)
+{
+	return ring_hiwat(&port_input);
+}
+
+int PORT_SYM(_getchar)(void)
+{
+	while (port_rx_pending() == 0)
+		/* wait */;
+
+	return ring_pop(&port_input);
+}
+#else
+int PORT_SYM(_getchar)(void)
+{
+	while (!(PORT_USART->STAT & USART_STAT_RBNE))
+		/* wait */;
+
+	return PORT_USART->DATA;
+}
+#endif
+
+#if defined(PORT_ASYNC) || defined(PORT_TXDMA)
+static RING(PORT_TXSIZE) port_output;
+static bool port_seenr;
+
+static void
+port_putc(FILE *stream, char c)
+{
+	if (c == '\n' && !port_seenr)
+		ring_push(&port_output, '\r');
+
+	port_seenr = (c == '\r');
+
+	ring_push(&port_output, c);
+}
+
+static void
+port_write(FILE *stream, const char *buf, size_t len)
+{
+	const char *end = buf + len;
+
+	while (buf < end) {
+		const char *nl = memchr(buf, '\n', end - buf);
+
+		if (nl == NULL) {
+			ring_push_n(&port_output, buf, end - buf);
+			port_seenr = (end[-1] == '\r');
+			break;
+		}
+		if (nl > buf) {
+			ring_push_n(&port_output, buf, nl - buf);
+			port_seenr = (nl[-1] == '\r');
+		}
+		ring_push_n(&port_output, port_seenr ? "\n" : "\r\n",
+				port_seenr ? 1 : 2);
+		port_seenr = false;
+		buf = nl + 1;
+	}
+}
+
+uint32_t PORT_SYM(_tx_hiwat)(void)
+{
+	return ring_hiwat(&port_output);
+}
+#endif
+
+#ifdef PORT_ASYNC
+static void
+port_tx_handler(void)
+{
+	while (1) {
+		uint32_t len;
+		const char *p = ring_pop_span(&port_output, &len);
+		uint32_t n = 0;
+
+		if (len == 0) {
+			PORT_USART->CTL0 &= ~USART_CTL0_TBEIE;
+			return;
+		}
+		while (n < len && (PORT_USART->STAT & USART_STAT_TBE))
+			PORT_USART->DATA = p[n++];
+		ring_pop_commit(&port_output, n);
+		if (n < len)
+			return;
+	}
+}
+
+static int
+port_done(FILE *stream)
+{
+	PORT_USART->CTL0 |= USART_CTL0_TBEIE;
+	return 0;
+}
+#elif defined(PORT_TXDMA)
+/*
+ * Each tx DMA transfer covers the contiguous span at the tail of the
+ * output ring. When it completes the interrupt handler pops the span
+ * and starts the next one, so a wrapped ring is sent as two chained
+ * transfers and the CPU is only bothered once per span.
+ */
+#define PORT_TXCTL (DMA_CHXCTL_PRIO_LOW | \
+		DMA_CHXCTL_MWIDTH_8BIT | DMA_CHXCTL_PWIDTH_8BIT | \
+		DMA_CHXCTL_MNAGA | DMA_CHXCTL_DIR | DMA_CHXCTL_FTFIE)
+
+static uint32_t port_dmalen;
+
+static void
+port_dma_start(void)
+{
+	uint32_t len;
+	const char *p = ring_pop_span(&port_output, &len);
+
+	port_dmalen = len;
+	if (len == 0)
+		return;
+
+	PORT_DMA->CH[PORT_TXCH].MADDR = (uintptr_t)p;
+	PORT_DMA->CH[PORT_TXCH].CNT = len;
+	PORT_DMA->CH[PORT_TXCH].CTL = PORT_TXCTL | DMA_CHXCTL_CHEN;
+}
+
+void
+PORT_TXCH_IRQHandler(void)
+{
+	PORT_DMA->INTC = DMA_INTC_GIFC(PORT_TXCH);
+	PORT_DMA->CH[PORT_TXCH].CTL = PORT_TXCTL;
+	ring_pop_commit(&port_output, port_dmalen);
+	port_dma_start();
+}
+
+static int
+port_done(FILE *stream)
+{
+	unsigned long mstatus = eclic_global_interrupt_disable_save();
+
+	if (port_dmalen == 0)
+		port_dma_start();
+	eclic_global_interrupt_restore(mstatus);
+	return 0;
+}
+#else
+static void
+port_putc(FILE *stream, char c)
+{
+	static bool seenr;
+
+	if (c == '\n' && !seenr) {
+		while (!(PORT_USART->STAT & USART_STAT_TBE))
+			/* wait */;
+		PORT_USART->DATA = '\r';
+	}
+
+	seenr = (c == '\r');
+
+	while (!(PORT_USART->STAT & USART_STAT_TBE))
+		/* wait */;
+	PORT_USART->DATA = c;
+}
+
+static void
+port_write(FILE *stream, const char *buf, size_t len)
+{
+	for (; len > 0; len--)
+		port_putc(stream, *buf++);
+}
+
+static int port_done(FILE *stream)
+{
+	return 0;
+}
+#endif
+
+#if defined(PORT_ASYNC) || defined(PORT_RXDMA)
+void
+PORT_IRQHandler(void)
+{
+#ifdef PORT_RXDMA
+	port_rx_handler();
+#endif
+#ifdef PORT_ASYNC
+	port_tx_handler();
+#endif
+}
+#endif
+
+const FILE PORT_SYM(_stream) = {
+	.putc = port_putc,
+	.write = port_write,
+	.done = port_done,
+};
+
+void PORT_SYM(_init)(uint32_t pclk, uint32_t target, uint8_t priority)
+{
+	/* enable GPIO clock */
+	RCU->APB2EN |= PORT_GPIOEN;
+	/* enable USART clock */
+	RCU->PORT_ENR |= PORT_EN;
+
+	gpio_pin_config(PORT_TX, GPIO_MODE_AF_PP_50MHZ);
+	gpio_pin_config(PORT_RX, GPIO_MODE_IN_FLOAT);
+
+	/* reset usart */
+	RCU->PORT_RSTR |= PORT_RST;
+	RCU->PORT_RSTR &= ~PORT_RST;
+
+	/* set baudrate */
+	PORT_USART->BAUD = (2*pclk + target) / (2*target);
+	/* set frame format */
+	PORT_USART->CTL1 = (PORT_FRAME) >> 16;
+	/* enable rx and tx */
+	PORT_USART->CTL0 = ((PORT_FRAME) & 0xffffU) | USART_CTL0_TEN | USART_CTL0_REN;
+	/* enable usart */
+	PORT_USART->CTL0 |= USART_CTL0_UEN;
+
+#if defined(PORT_TXDMA) || defined(PORT_RXDMA)
+	/* enable DMA clock */
+	RCU->AHBEN |= PORT_DMAEN;
+#endif
+#ifdef PORT_TXDMA
+	PORT_DMA->CH[PORT_TXCH].CTL = PORT_TXCTL;
+	PORT_DMA->CH[PORT_TXCH].PADDR = (uintptr_t)&PORT_USART->DATA;
+	PORT_DMA->INTC = DMA_INTC_GIFC(PORT_TXCH);
+	/* let the usart request dma transfers */
+	PORT_USART->CTL2 |= USART_CTL2_DENT;
+
+	eclic_config(PORT_TXCH_IRQn, ECLIC_ATTR_TRIG_LEVEL, priority);
+	eclic_enable(PORT_TXCH_IRQn);
+#endif
+#ifdef PORT_RXDMA
+	PORT_DMA->CH[PORT_RXCH].PADDR = (uintptr_t)&PORT_USART->DATA;
+	PORT_DMA->CH[PORT_RXCH].MADDR = (uintptr_t)port_input.buf;
+	PORT_DMA->CH[PORT_RXCH].CNT = ring_size(&port_input);
+	PORT_DMA->INTC = DMA_INTC_GIFC(PORT_RXCH);
+	PORT_DMA->CH[PORT_RXCH].CTL = DMA_CHXCTL_PRIO_HIGH |
+		DMA_CHXCTL_MWIDTH_8BIT | DMA_CHXCTL_PWIDTH_8BIT |
+		DMA_CHXCTL_MNAGA | DMA_CHXCTL_CMEN |
+		DMA_CHXCTL_HTFIE | DMA_CHXCTL_FTFIE |
+		DMA_CHXCTL_CHEN;
+	/* receive through dma and interrupt on errors and idle line */
+	PORT_USART->CTL2 |= USART_CTL2_DENR | USART_CTL2_ERRIE;
+	PORT_USART->CTL0 |= USART_CTL0_IDLEIE;
+
+	eclic_config(PORT_RXCH_IRQn, ECLIC_ATTR_TRIG_LEVEL, priority);
+	eclic_enable(PORT_RXCH_IRQn);
+#endif
+#if defined(PORT_ASYNC) || defined(PORT_RXDMA)
+	eclic_config(PORT_IRQn, ECLIC_ATTR_TRIG_LEVEL, priority);
+	eclic_enable(PORT_IRQn);
+#endif
+}
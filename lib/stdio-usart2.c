@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#include "lib/stdio-usart2.h"
+
+#define PORT_NAME       usart2
+#define PORT_USART      USART2
+#define PORT_IRQn       USART2_IRQn
+#define PORT_IRQHandler USART2_IRQHandler
+#define PORT_ENR        APB1EN
+#define PORT_EN         RCU_APB1EN_USART2EN
+#define PORT_RSTR       APB1RST
+#define PORT_RST        RCU_APB1RST_USART2RST
+#define PORT_GPIOEN     RCU_APB2EN_PBEN
+#define PORT_TX         GPIO_PB10
+#define PORT_RX         GPIO_PB11
+
+#define PORT_DMA        DMA0
+#define PORT_DMAEN      RCU_AHBEN_DMA0EN
+#define PORT_TXCH       1
+#define PORT_TXCH_IRQn  DMA0_Channel1_IRQn
+#define PORT_TXCH_IRQHandler DMA0_Channel1_IRQHandler
+#define PORT_RXCH       2
+#define PORT_RXCH_IRQn  DMA0_Channel2_IRQn
+#define PORT_RXCH_IRQHandler DMA0_Channel2_IRQHandler
+
+#ifdef USART2_ASYNC
+#define PORT_ASYNC
+#endif
+#ifdef USART2_DMA
+#define PORT_TXDMA
+#endif
+#ifdef USART2_RXDMA
+#define PORT_RXDMA
+#endif
+#ifdef USART2_TXSIZE
+#define PORT_TXSIZE USART2_TXSIZE
+#endif
+#ifdef USART2_RXSIZE
+#define PORT_RXSIZE USART2_RXSIZE
+#endif
+#ifdef USART2_FRAME
+#define PORT_FRAME USART2_FRAME
+#endif
+
+#include "stdio-usart-template.h"
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2019, Emil Renner Berthing
+ * Copyright (c) 2020, Emil Renner Berthing
  *
  * Redistribution and use in source and binary forms, with or without modification,
  * are permitted provided that the following conditions are met:
@@ -25,161 +25,101 @@
  * OF SUCH DAMAGE.
  */
 #include <stdint.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <string.h>
 
+#include "gd32vf103/csr.h"
 #include "gd32vf103/rcu.h"
 #include "gd32vf103/dbg.h"
+#include "gd32vf103/usbfs.h"
 
-#include "lib/mtimer.h"
-#include "lib/gpio.h"
 #include "lib/eclic.h"
+#include "lib/mtimer.h"
+#include "lib/rcu.h"
+#include "lib/usbfs-core.h"
 
-#include "usbfs.h"
-#include "dfu.h"
-
-#ifdef NDEBUG
-#define debug(...)
-#else
+#if defined(USBFS_DEBUG) && !defined(NDEBUG)
 #include <stdio.h>
 #define debug(...) printf(__VA_ARGS__)
+#else
+#define debug(...)
 #endif
 
-#define USBFS_FIFO_RXSIZE  512
-#define USBFS_FIFO_TX0SIZE 128
-#define USBFS_FIFO_TX1SIZE 0
-#define USBFS_FIFO_TX2SIZE 0
-#define USBFS_FIFO_TX3SIZE 0
-
-static const struct usb_descriptor_device usbfs_descriptor_device = {
-	.bLength            = 18,
-	.bDescriptorType    = 0x01, /* Device */
-	.bcdUSB             = 0x0200,
-	.bDeviceClass       = 0x00, /* 0x00 = per interface */
-	.bDeviceSubClass    = 0x00,
-	.bDeviceProtocol    = 0x00,
-	.bMaxPacketSize0    = 64,
-	.idVendor           = 0x1d50, /* OpenMoko vendor id */
-	.idProduct          = 0x613e, /* GeckoBoot product id */
-	.bcdDevice          = 0x0200,
-	.iManufacturer      = 1,
-	.iProduct           = 2,
-	.iSerialNumber      = 3,
-	.bNumConfigurations = 1,
-};
+static struct {
+	uint32_t *ep0out;
+	const unsigned char *ep0in;
+	uint32_t bytes;
+	uint32_t packetsize;
+} usbfs_state;
 
-static const struct usb_descriptor_configuration usbfs_descriptor_configuration1 = {
-	.bLength              = 9,
-	.bDescriptorType      = 0x02, /* Configuration */
-	.wTotalLength         = 9 + 9 + 9,
-	.bNumInterfaces       = 1,
-	.bConfigurationValue  = 1,
-	.iConfiguration       = 0,
-	.bmAttributes         = 0x80,
-	.bMaxPower            = 250,
-	.rest = {
-	/* Interface */
-	/* .bLength            */ 9,
-	/* .bDescriptorType    */ 0x04, /* Interface */
-	/* .bInterfaceNumber   */ DFU_INTERFACE,
-	/* .bAlternateSetting  */ 0,
-	/* .bNumEndpoints      */ 0,    /* only the control pipe is used */
-	/* .bInterfaceClass    */ 0xFE, /* application specific */
-	/* .bInterfaceSubClass */ 0x01, /* device firmware upgrade */
-	/* .bInterfaceProtocol */ 0x02, /* DFU mode protocol */
-	/* .iInterface         */ 4,
-	/* DFU Interface */
-	/* .bLength            */ 9,
-	/* .bDescriptorType    */ 0x21, /* DFU Interface */
-	/* .bmAttributes       */ 0x0f, /* download, upload, detach and manifest tolerant */
-	/* .wDetachTimeOut     */ USB_WORD(500), /* 500ms */
-	/* .wTransferSize      */ USB_WORD(DFU_TRANSFERSIZE),
-	/* .bcdDFUVersion      */ USB_WORD(0x0101), /* DFU v1.1 */
-	}
-};
+static union {
+	struct usb_setup_packet setup;
+	uint32_t v[2];
+} usbfs_setup;
 
-static const struct usb_descriptor_string usbfs_descriptor_string0 = {
-	.bLength         = 4,
-	.bDescriptorType = 0x03, /* String */
-	.wCodepoint = {
-		0x0409, /* English (US) */
-	},
-};
+/* GET_STATUS bits for the device */
+#define USBFS_STATUS_REMOTE_WAKEUP 0x0002U
 
-static const struct usb_descriptor_string usbfs_descriptor_manufacturer = {
-	.bLength         = 16,
-	.bDescriptorType = 0x03, /* String */
-	.wCodepoint = {
-		'L','a','b','i','t','a','t',
-	},
-};
+static uint16_t usbfs_status;
+/* SET_CONFIGURATION was received since the last reset */
+static bool usbfs_configured;
 
-static const struct usb_descriptor_string usbfs_descriptor_product = {
-	.bLength         = 20,
-	.bDescriptorType = 0x03, /* String */
-	.wCodepoint = {
-		'G','D','3','2','V','F','1','0','3',
-	},
-};
+bool usbfs_reboot_on_ack;
 
-/* must be at least 12 characters long and consist of only '0'-'9','A'-'B'
- * at least according to the mass-storage bulk-only document */
-static const struct usb_descriptor_string usbfs_descriptor_serial = {
-	.bLength         = 26,
-	.bDescriptorType = 0x03, /* String */
-	.wCodepoint = {
-		'0','0','0','0','0','0','0','0','0','0','0','1',
-	},
-};
+volatile bool usbfs_suspended;
+struct usbfs_stats usbfs_stats;
 
-static const struct usb_descriptor_string usbfs_descriptor_dfu = {
-	.bLength         = 20,
-	.bDescriptorType = 0x03, /* String */
-	.wCodepoint = {
-		'G','e','c','k','o','B','o','o','t',
-	},
-};
+#ifndef USBFS_NO_SUSPEND
+/* mtimer runs at a quarter of the 8MHz IRC8M clock while suspended */
+#define USBFS_SUSPEND_MTIMER_FREQ (8000000/4)
 
-static const struct usb_descriptor_string *const usbfs_descriptor_string[] = {
-	&usbfs_descriptor_string0,
-	&usbfs_descriptor_manufacturer,
-	&usbfs_descriptor_product,
-	&usbfs_descriptor_serial,
-	&usbfs_descriptor_dfu,
-};
+static uint32_t usbfs_sysclk;
+static uint64_t usbfs_suspend_start;
+#endif
 
-static struct {
-	uint32_t *ep0out;
-	const unsigned char *ep0in;
-	uint32_t bytes;
-} usbfs_state;
+void
+usbfs_fifo_read(unsigned int ep, void *dst, unsigned int len)
+{
+	uint8_t *p = dst;
 
-static struct {
-	union {
-		struct usb_setup_packet setup;
-		uint32_t v[2];
-	};
-	uint8_t data[DFU_TRANSFERSIZE];
-} usbfs_outbuf;
+	if (((uintptr_t)p & 3) == 0) {
+		for (; len >= 4; len -= 4, p += 4)
+			*(uint32_t *)p = USBFS->DFIFO[ep][0];
+	} else {
+		for (; len >= 4; len -= 4, p += 4) {
+			uint32_t v = USBFS->DFIFO[ep][0];
 
-static uint16_t usbfs_status;
+			memcpy(p, &v, 4);
+		}
+	}
+	if (len > 0) {
+		uint32_t v = USBFS->DFIFO[ep][0];
 
-bool usbfs_reboot_on_ack;
+		memcpy(p, &v, len);
+	}
+}
 
-static void
-dumpsetup(const struct usb_setup_packet *p)
+void
+usbfs_fifo_write(unsigned int ep, const void *src, unsigned int len)
 {
-	debug("{\n"
-	      "  bmRequestType 0x%02x\n"
-	      "  bRequest      0x%02x\n"
-	      "  wValue        0x%04x\n"
-	      "  wIndex        0x%04x\n"
-	      "  wLength       0x%04x\n"
-	      "}\n",
-		p->bmRequestType,
-		p->bRequest,
-		p->wValue,
-		p->wIndex,
-		p->wLength);
+	const uint8_t *p = src;
+	uint32_t v;
+
+	if (((uintptr_t)p & 3) == 0) {
+		for (; len >= 4; len -= 4, p += 4)
+			USBFS->DFIFO[ep][0] = *(const uint32_t *)p;
+	} else {
+		for (; len >= 4; len -= 4, p += 4) {
+			memcpy(&v, p, 4);
+			USBFS->DFIFO[ep][0] = v;
+		}
+	}
+	if (len > 0) {
+		v = 0;
+		memcpy(&v, p, len);
+		USBFS->DFIFO[ep][0] = v;
+	}
 }
 
 static void
@@ -189,8 +129,8 @@ usbfs_ep0in_transfer(void)
 	const unsigned char *p = usbfs_state.ep0in;
 	const unsigned char *end;
 
-	if (len > 64)
-		len = 64;
+	if (len > usbfs_state.packetsize)
+		len = usbfs_state.packetsize;
 
 	end = p + len;
 
@@ -208,17 +148,12 @@ usbfs_ep0in_transfer(void)
 	}
 }
 
-#if 0
 static void
 usbfs_ep0in_transfer_empty(void)
 {
 	USBFS->DIEP[0].LEN = USBFS_DIEPLEN_PCNT(1U);
 	USBFS->DIEP[0].CTL |= USBFS_DIEPCTL_EPEN | USBFS_DIEPCTL_CNAK;
 }
-#else
-static inline void
-usbfs_ep0in_transfer_empty(void) { usbfs_ep0in_transfer(); }
-#endif
 
 static inline void
 usbfs_ep0in_stall(void)
@@ -242,33 +177,112 @@ usbfs_ep0out_prepare_out(void)
 	USBFS->DOEP[0].LEN =
 		USBFS_DOEPLEN_STPCNT(3U) |
 		USBFS_DOEPLEN_PCNT(1U) |
-		USBFS_DOEPLEN_TLEN(64);
+		USBFS_DOEPLEN_TLEN(usbfs_state.packetsize);
 	USBFS->DOEP[0].CTL |= USBFS_DOEPCTL_EPEN | USBFS_DOEPCTL_CNAK;
 }
 
+/*
+ * The host suspends the bus after 3ms without traffic. Stop the phy
+ * clock and drop the system clock to IRC8M until the host resumes
+ * or resets the bus, or we signal a remote wakeup. The PLL also
+ * feeds the 48MHz USB clock, so it is stopped too. An unconfigured
+ * device is also suspended when plugged into a charger or while the
+ * host is still booting, so keep running at full speed then.
+ */
 static void
 usbfs_suspend(void)
 {
-	/*
-	usbfs_phy_stop();
-	USBFS->GINTEN =
-		USBFS_GINTEN_WUIM |
-		USBFS_GINTEN_USBRST;
-	*/
+#ifndef USBFS_NO_SUSPEND
+	if (usbfs_suspended || !usbfs_configured ||
+			!(USBFS->DSTAT & USBFS_DSTAT_SPST))
+		return;
+
+	USBFS->PWRCLKCTL |= USBFS_PWRCLKCTL_SUCLK;
+	usbfs_sysclk = rcu_sysclk_irc8m();
+	usbfs_suspend_start = mtimer_mtime();
+	usbfs_suspended = true;
+	usbfs_stats.suspends++;
+#endif
+}
+
+/* restore clocks, must be called with interrupts disabled */
+static void
+usbfs_resume(void)
+{
+#ifndef USBFS_NO_SUSPEND
+	uint64_t start;
+	uint32_t us;
+
+	if (!usbfs_suspended)
+		return;
+
+	start = mtimer_mtime();
+	rcu_sysclk_restore(usbfs_sysclk);
+	USBFS->PWRCLKCTL &= ~(USBFS_PWRCLKCTL_SUCLK | USBFS_PWRCLKCTL_SHCLK);
+	/* mtimer ran slow until just now, so this is close enough */
+	us = (mtimer_mtime() - start) / (USBFS_SUSPEND_MTIMER_FREQ/1000000);
+	usbfs_stats.suspended_us += (start - usbfs_suspend_start) /
+		(USBFS_SUSPEND_MTIMER_FREQ/1000000);
+	usbfs_stats.resume_us = us;
+	if (us > usbfs_stats.resume_us_max)
+		usbfs_stats.resume_us_max = us;
+	usbfs_suspended = false;
+#endif
 }
 
 static void
 usbfs_wakeup(void)
 {
-	/*
-	usbfs_phy_start();
-	USBFS->GINTEN =
-		USBFS_GINTEN_ENUMDNEM |
-		USBFS_GINTEN_USBRST |
-		USBFS_GINTEN_USBSUSPM |
-		USBFS_GINTEN_OEPINT |
-		USBFS_GINTEN_IEPINT;
-	*/
+	usbfs_resume();
+}
+
+int
+usbfs_remote_wakeup(void)
+{
+	unsigned long mstatus;
+
+	if (!usbfs_suspended)
+		return 0;
+	if (!(usbfs_status & USBFS_STATUS_REMOTE_WAKEUP))
+		return -1;
+	/* the resume signaling below is too long for an interrupt handler */
+	if (csr_read(CSR_MINTSTATUS) & CSR_MINTSTATUS_MIL_Msk)
+		return -1;
+#ifndef USBFS_NO_SUSPEND
+	/* the bus must be idle for 5ms before we may signal resume, and
+	 * the host suspended us after 3ms, so wait until 2ms after that.
+	 * mtimer runs slow while suspended */
+	while (usbfs_suspended && mtimer_mtime() - usbfs_suspend_start <
+			2 * (USBFS_SUSPEND_MTIMER_FREQ/1000))
+		/* wait */;
+#endif
+
+	mstatus = eclic_global_interrupt_disable_save();
+	if (!usbfs_suspended) {
+		/* the host beat us to it */
+		eclic_global_interrupt_restore(mstatus);
+		return 0;
+	}
+	usbfs_resume();
+	usbfs_stats.remote_wakeups++;
+	USBFS->DCTL |= USBFS_DCTL_RWKUP;
+	eclic_global_interrupt_restore(mstatus);
+
+	/* signal resume for 1 to 15ms */
+	mtimer_udelay(5000);
+	USBFS->DCTL &= ~USBFS_DCTL_RWKUP;
+	return 0;
+}
+
+void
+usbfs_idle(void)
+{
+	unsigned long mstatus = eclic_global_interrupt_disable_save();
+
+	/* a pending interrupt still ends wfi with interrupts disabled */
+	if (usbfs_suspended)
+		wait_for_interrupt();
+	eclic_global_interrupt_restore(mstatus);
 }
 
 static void
@@ -285,7 +299,9 @@ usbfs_txfifos_flush(void)
 static void
 usbfs_ep_reset(void)
 {
+#ifndef USBFS_EP0_ONLY
 	unsigned int i;
+#endif
 
 	USBFS->DIEP[0].CTL =
 		USBFS_DIEPCTL_STALL |
@@ -297,6 +313,7 @@ usbfs_ep_reset(void)
 		USBFS_DIEPINTF_CITO |
 		USBFS_DIEPINTF_EPDIS |
 		USBFS_DIEPINTF_TF;
+#ifndef USBFS_EP0_ONLY
 	for (i = 1; i < 4; i++) {
 		/*
 		if (USBFS->DIEP[i].CTL & USBFS_DIEPCTL_EPEN)
@@ -312,6 +329,7 @@ usbfs_ep_reset(void)
 			USBFS_DIEPINTF_TF;
 		USBFS->DIEP[i].LEN = 0;
 	}
+#endif
 
 	USBFS->DOEP[0].CTL =
 		USBFS_DOEPCTL_STALL |
@@ -323,6 +341,7 @@ usbfs_ep_reset(void)
 		USBFS_DOEPINTF_STPF |
 		USBFS_DOEPINTF_EPDIS |
 		USBFS_DOEPINTF_TF;
+#ifndef USBFS_EP0_ONLY
 	for (i = 1; i < 4; i++) {
 		/*
 		if (USBFS->DOEP[i].CTL & USBFS_DOEPCTL_EPEN)
@@ -338,16 +357,31 @@ usbfs_ep_reset(void)
 			USBFS_DOEPINTF_TF;
 		USBFS->DOEP[i].LEN = 0;
 	}
+#endif
 }
 
 static void
 usbfs_reset(void)
 {
+	/* a reset also ends suspend */
+	usbfs_resume();
+
+	/* clear the remote wakeup signaling */
+	USBFS->DCTL &= ~USBFS_DCTL_RWKUP;
+	usbfs_status &= ~USBFS_STATUS_REMOTE_WAKEUP;
+	usbfs_configured = false;
+
 	/* flush all tx fifos */
 	usbfs_txfifos_flush();
 
 	/* reset endpoint registers */
 	usbfs_ep_reset();
+#ifndef USBFS_EP0_ONLY
+	for (unsigned int i = 0; i < usbfs_device.classes; i++) {
+		if (usbfs_device.class[i]->reset)
+			usbfs_device.class[i]->reset();
+	}
+#endif
 
 	/* reset address */
 	USBFS->DCFG &= ~USBFS_DCFG_DAR_Msk;
@@ -360,13 +394,14 @@ usbfs_reset(void)
 		USBFS_DOEPINTEN_STPFEN |
 		/* USBFS_DOEPINTEN_EPDISEN | */
 		USBFS_DOEPINTEN_TFEN;
-	USBFS->DIEPINTEN = 
+	USBFS->DIEPINTEN =
 		/* USBFS_DIEPINTEN_CITOEN | */
 		/* USBFS_DIEPINTEN_EPDISEN | */
 		USBFS_DIEPINTEN_TFEN;
 
 	/* reset internal state */
 	usbfs_state.bytes = 0;
+	usbfs_state.packetsize = USBFS_EP0_PACKETSIZE;
 }
 
 static void
@@ -375,13 +410,18 @@ usbfs_enumdone(void)
 	USBFS->DCTL |= USBFS_DCTL_CGINAK;
 
 	if ((USBFS->DSTAT & USBFS_DSTAT_ES_Msk) == USBFS_DSTAT_ES_FULL) {
-		/* prepare to receive setup package */
-		usbfs_ep0out_prepare_setup();
-
+		/* we already set 64 byte packages at reset */
 		debug("full speed.. ");
 	} else {
+		/* use 8 byte packages */
+		USBFS->DIEP[0].CTL |= USBFS_DIEP0CTL_MPL_8B;
+		USBFS->DOEP[0].CTL |= USBFS_DOEP0CTL_MPL_8B;
+		usbfs_state.packetsize = 8;
 		debug("low speed.. ");
 	}
+
+	/* prepare to receive setup package */
+	usbfs_ep0out_prepare_setup();
 }
 
 static int
@@ -392,10 +432,38 @@ usbfs_handle_get_status_device(const struct usb_setup_packet *p, const void **da
 	return 2;
 }
 
+#ifndef USBFS_NO_SUSPEND
+static int
+usbfs_handle_set_feature_device(const struct usb_setup_packet *p, const void **data)
+{
+	debug("SET_FEATURE: device %hu\n", p->wValue);
+
+	/* DEVICE_REMOTE_WAKEUP, if the configuration says we support it */
+	if (p->wValue != 1 || !(usbfs_device.configuration->bmAttributes & 0x20U))
+		return -1;
+	usbfs_status |= USBFS_STATUS_REMOTE_WAKEUP;
+	return 0;
+}
+
+static int
+usbfs_handle_clear_feature_device(const struct usb_setup_packet *p, const void **data)
+{
+	debug("CLEAR_FEATURE: device %hu\n", p->wValue);
+
+	if (p->wValue != 1)
+		return -1;
+	usbfs_status &= ~USBFS_STATUS_REMOTE_WAKEUP;
+	return 0;
+}
+#endif
+
 static int
 usbfs_handle_set_address(const struct usb_setup_packet *p, const void **data)
 {
 	debug("SET_ADDRESS: wValue = %hu\n", p->wValue);
+	/* a larger value would spill into the frame interval bits */
+	if (p->wValue > 127)
+		return -1;
 	USBFS->DCFG = (USBFS->DCFG & ~USBFS_DCFG_DAR_Msk) |
 		USBFS_DCFG_DAR((uint32_t)p->wValue);
 	return 0;
@@ -408,8 +476,8 @@ usbfs_handle_get_descriptor_device(const void **data, uint8_t index)
 		debug("GET_DESCRIPTOR: type = 0x01, but index = 0x%02x\n", index);
 		return -1;
 	}
-	*data = &usbfs_descriptor_device;
-	return sizeof(usbfs_descriptor_device);
+	*data = usbfs_device.device;
+	return sizeof(*usbfs_device.device);
 }
 
 static int
@@ -419,8 +487,8 @@ usbfs_handle_get_descriptor_configuration(const void **data, uint8_t index)
 		debug("GET_DESCRIPTOR: unknown configuration %hu\n", index);
 		return -1;
 	}
-	*data = &usbfs_descriptor_configuration1;
-	return usbfs_descriptor_configuration1.wTotalLength;
+	*data = usbfs_device.configuration;
+	return usbfs_device.configuration->wTotalLength;
 }
 
 static int
@@ -428,11 +496,11 @@ usbfs_handle_get_descriptor_string(const void **data, uint8_t index)
 {
 	const struct usb_descriptor_string *desc;
 
-	if (index >= ARRAY_SIZE(usbfs_descriptor_string)) {
+	if (index >= usbfs_device.strings) {
 		debug("GET_DESCRIPTOR: unknown string %hu\n", index);
 		return -1;
 	}
-	desc = usbfs_descriptor_string[index];
+	desc = usbfs_device.string[index];
 	*data = desc;
 	return desc->bLength;
 }
@@ -461,7 +529,6 @@ usbfs_handle_get_descriptor(const struct usb_setup_packet *p, const void **data)
 		break;
 	default:
 		debug("GET_DESCRIPTOR: unknown type 0x%02x\n", type);
-		dumpsetup(p);
 		break;
 #endif
 	}
@@ -472,7 +539,7 @@ static int
 usbfs_handle_get_configuration(const struct usb_setup_packet *p, const void **data)
 {
 	debug("GET_CONFIGURATION\n");
-	*data = &usbfs_descriptor_configuration1.bConfigurationValue;
+	*data = &usbfs_device.configuration->bConfigurationValue;
 	return 1;
 }
 
@@ -481,14 +548,19 @@ usbfs_handle_set_configuration(const struct usb_setup_packet *p, const void **da
 {
 	debug("SET_CONFIGURATION: wValue = %hu\n", p->wValue);
 
-	if (p->wValue != usbfs_descriptor_configuration1.bConfigurationValue)
+	if (p->wValue != usbfs_device.configuration->bConfigurationValue)
 		return -1;
 
+	for (unsigned int i = 0; i < usbfs_device.classes; i++) {
+		if (usbfs_device.class[i]->configure)
+			usbfs_device.class[i]->configure();
+	}
+	usbfs_configured = true;
 	return 0;
 }
 
 static int
-usbfs_handle_set_interface0(const struct usb_setup_packet *p, const void **data)
+usbfs_handle_set_interface(const struct usb_setup_packet *p, const void **data)
 {
 	debug("SET_INTERFACE: wIndex = %hu, wValue = %hu\n", p->wIndex, p->wValue);
 
@@ -498,54 +570,94 @@ usbfs_handle_set_interface0(const struct usb_setup_packet *p, const void **data)
 	return 0;
 }
 
+#ifndef USBFS_EP0_ONLY
 static int
 usbfs_handle_clear_feature_endpoint(const struct usb_setup_packet *p, const void **data)
 {
+	unsigned int ep = p->wIndex & 0x7FU;
+
 	debug("CLEAR_FEATURE endpoint %hu\n", p->wIndex);
-	return -1;
+
+	/* ENDPOINT_HALT is the only endpoint feature */
+	if (p->wValue != 0 || ep > 3)
+		return -1;
+	if (ep == 0)
+		return 0;
+
+	/* clear the stall and restart the data toggle at DATA0 */
+	if (p->wIndex & 0x80U)
+		USBFS->DIEP[ep].CTL = (USBFS->DIEP[ep].CTL & ~USBFS_DIEPCTL_STALL) | USBFS_DIEPCTL_SD0PID;
+	else
+		USBFS->DOEP[ep].CTL = (USBFS->DOEP[ep].CTL & ~USBFS_DOEPCTL_STALL) | USBFS_DOEPCTL_SD0PID;
+	return 0;
 }
+#endif
 
 static const struct usb_setup_handler usbfs_setup_handlers[] = {
 	{ .req = 0x0080, .idx =  0, .len = -1, .fn = usbfs_handle_get_status_device },
+#ifndef USBFS_NO_SUSPEND
+	{ .req = 0x0100, .idx =  0, .len =  0, .fn = usbfs_handle_clear_feature_device },
+	{ .req = 0x0300, .idx =  0, .len =  0, .fn = usbfs_handle_set_feature_device },
+#endif
 	{ .req = 0x0500, .idx =  0, .len =  0, .fn = usbfs_handle_set_address },
 	{ .req = 0x0680, .idx = -1, .len = -1, .fn = usbfs_handle_get_descriptor },
 	{ .req = 0x0880, .idx =  0, .len = -1, .fn = usbfs_handle_get_configuration },
 	{ .req = 0x0900, .idx =  0, .len =  0, .fn = usbfs_handle_set_configuration },
-	{ .req = 0x0102, .idx =  0, .len =  0, .fn = usbfs_handle_clear_feature_endpoint },
-	{ .req = 0x0b01, .idx = DFU_INTERFACE, .len =  0, .fn = usbfs_handle_set_interface0 },
-	{ .req = 0x0021, .idx = DFU_INTERFACE, .len =  0, .fn = dfu_detach },
-	{ .req = 0x0121, .idx = DFU_INTERFACE, .len = -1, .fn = dfu_dnload },
-	{ .req = 0x02a1, .idx = DFU_INTERFACE, .len = -1, .fn = dfu_upload },
-	{ .req = 0x03a1, .idx = DFU_INTERFACE, .len = -1, .fn = dfu_getstatus },
-	{ .req = 0x0421, .idx = DFU_INTERFACE, .len =  0, .fn = dfu_clrstatus },
-	{ .req = 0x05a1, .idx = DFU_INTERFACE, .len = -1, .fn = dfu_getstate },
-	{ .req = 0x0621, .idx = DFU_INTERFACE, .len =  0, .fn = dfu_abort },
+#ifndef USBFS_EP0_ONLY
+	{ .req = 0x0102, .idx = -1, .len =  0, .fn = usbfs_handle_clear_feature_endpoint },
+#endif
+	{ .req = 0x0b01, .idx = -1, .len =  0, .fn = usbfs_handle_set_interface },
 };
 
+static const struct usb_setup_handler *
+usbfs_setup_handler_find(const struct usb_setup_handler *h, unsigned int n,
+		const struct usb_setup_packet *p)
+{
+	uint8_t idx = p->wIndex;
+
+	for (; n > 0; n--, h++) {
+		if (h->req == p->request && (h->idx == 0xFFU || h->idx == idx))
+			return h;
+	}
+	return NULL;
+}
+
 static int
 usbfs_setup_handler_run(const struct usb_setup_packet *p, const void **data)
 {
-	uint8_t idx = p->wIndex;
 	const struct usb_setup_handler *h;
 
-	for (h = usbfs_setup_handlers; h < ARRAY_END(usbfs_setup_handlers); h++) {
-		if (h->req == p->request && (h->idx == 0xFFU || h->idx == idx)) {
-			if (h->len != 0xFFU && h->len != p->wLength)
-				break;
-			return h->fn(p, data);
-		}
+	h = usbfs_setup_handler_find(usbfs_setup_handlers,
+			ARRAY_SIZE(usbfs_setup_handlers), p);
+	for (unsigned int i = 0; h == NULL && i < usbfs_device.classes; i++) {
+		const struct usbfs_class *class = usbfs_device.class[i];
+
+		h = usbfs_setup_handler_find(class->handler, class->handlers, p);
 	}
 
-	debug("unknown request 0x%04x\n", p->request);
-	dumpsetup(p);
+	if (h != NULL && (h->len == 0xFFU || h->len == p->wLength))
+		return h->fn(p, data);
+
+	debug("unknown request:\n"
+	      "  bmRequestType 0x%02x\n"
+	      "  bRequest      0x%02x\n"
+	      "  wValue        0x%04x\n"
+	      "  wIndex        0x%04x\n"
+	      "  wLength       0x%04x\n",
+		p->bmRequestType,
+		p->bRequest,
+		p->wValue,
+		p->wIndex,
+		p->wLength);
 	return -1;
 }
 
 static void
 usbfs_handle_setup(void)
 {
-	const struct usb_setup_packet *p = &usbfs_outbuf.setup;
+	const struct usb_setup_packet *p = &usbfs_setup.setup;
 
+	usbfs_state.ep0out = usbfs_device.ep0buf;
 	usbfs_state.bytes = 0;
 
 	if (p->bmRequestType & 0x80U) {
@@ -573,7 +685,7 @@ usbfs_handle_setup(void)
 			usbfs_ep0out_prepare_setup();
 			return;
 		}
-	} else if (p->wLength <= ARRAY_SIZE(usbfs_outbuf.data)) {
+	} else if (p->wLength <= usbfs_device.ep0size) {
 		/* receive OUT data */
 		usbfs_ep0out_prepare_out();
 		usbfs_state.bytes = p->wLength;
@@ -586,6 +698,24 @@ usbfs_handle_setup(void)
 	usbfs_ep0out_prepare_setup();
 }
 
+static void
+usbfs_handle_rx0(bool setup, unsigned int len)
+{
+	if (setup) {
+		for (; len > 8; len -= 4)
+			(void)USBFS->DFIFO[0][0];
+		usbfs_setup.v[0] = USBFS->DFIFO[0][0];
+		usbfs_setup.v[1] = USBFS->DFIFO[0][0];
+	} else {
+		while (1) {
+			*usbfs_state.ep0out++ = USBFS->DFIFO[0][0];
+			if (len <= 4)
+				break;
+			len -= 4;
+		}
+	}
+}
+
 static void
 usbfs_handle_ep0(void)
 {
@@ -596,8 +726,6 @@ usbfs_handle_ep0(void)
 	USBFS->DOEP[0].INTF = oflags;
 	USBFS->DIEP[0].INTF = iflags;
 
-	//debug("EP0 %04lx %04lx %lu\n", oflags, iflags, usbfs_state.bytes);
-
 	if (oflags & USBFS_DOEPINTF_STPF) {
 		usbfs_handle_setup();
 		return;
@@ -616,25 +744,25 @@ usbfs_handle_ep0(void)
 
 	if (iflags & USBFS_DIEPINTF_TF) {
 		/* data IN */
-		if (bytes > 64) {
+		if (bytes > usbfs_state.packetsize) {
 			/* send next package */
-			usbfs_state.ep0in += 64;
-			usbfs_state.bytes = bytes - 64;
+			usbfs_state.ep0in += usbfs_state.packetsize;
+			usbfs_state.bytes = bytes - usbfs_state.packetsize;
 			usbfs_ep0in_transfer();
 		} else
 			usbfs_state.bytes = 0;
 	} else if (oflags & USBFS_DOEPINTF_TF) {
 		/* data OUT */
-		bytes = 64 - (USBFS->DOEP[0].LEN & USBFS_DOEPLEN_TLEN_Msk);
+		bytes = usbfs_state.packetsize - (USBFS->DOEP[0].LEN & USBFS_DOEPLEN_TLEN_Msk);
 		if (usbfs_state.bytes > bytes) {
 			usbfs_state.bytes -= bytes;
 			/* prepare for more OUT data */
 			usbfs_ep0out_prepare_out();
 		} else {
-			const void *data = usbfs_outbuf.data;
+			const void *data = usbfs_device.ep0buf;
 
 			usbfs_state.bytes = 0;
-			if (!usbfs_setup_handler_run(&usbfs_outbuf.setup, &data)) {
+			if (!usbfs_setup_handler_run(&usbfs_setup.setup, &data)) {
 				/* send empty ack package */
 				usbfs_ep0in_transfer_empty();
 			} else
@@ -645,44 +773,48 @@ usbfs_handle_ep0(void)
 }
 
 static void
-usbfs_handle_endpoints(void)
+usbfs_handle_rxdata(void)
 {
-	uint32_t flags = USBFS->DAEPINT;
+	uint32_t grstat = USBFS->GRSTATP;
+	unsigned int len = (grstat & USBFS_GRSTAT_BCOUNT_Msk) >> USBFS_GRSTAT_BCOUNT_Pos;
+	unsigned int ep;
 
-	if (flags & 0x10001U)
-		usbfs_handle_ep0();
+	if (len == 0)
+		return;
+
+	ep = grstat & USBFS_GRSTAT_EPNUM_Msk;
+	if (ep == 0) {
+		usbfs_handle_rx0((grstat & USBFS_GRSTAT_RPCKST_Msk) == USBFS_GRSTAT_RPCKST_STP, len);
+		return;
+	}
+#ifndef USBFS_EP0_ONLY
+	if (ep <= ARRAY_SIZE(usbfs_device.endpoint) && usbfs_device.endpoint[ep - 1]) {
+		usbfs_device.endpoint[ep - 1]->rx(len);
+		return;
+	}
+#endif
+
+	debug("RXDATA: received data for endpoint %u\n", ep);
+	for (; len > 0; len -= (len < 4) ? len : 4)
+		(void)USBFS->DFIFO[0][0];
 }
 
 static void
-usbfs_handle_rxdata(void)
+usbfs_handle_endpoints(void)
 {
-	uint32_t grstat = USBFS->GRSTATP;
-	unsigned int ep = grstat & USBFS_GRSTAT_EPNUM_Msk;
-	unsigned int len;
+	uint32_t flags = USBFS->DAEPINT;
 
-	if (ep != 0) {
-		debug("RXDATA: received data for endpoint %u\n", ep);
-		return;
-	}
+	if (flags & 0x10001U)
+		usbfs_handle_ep0();
 
-	len = (grstat & USBFS_GRSTAT_BCOUNT_Msk) >> USBFS_GRSTAT_BCOUNT_Pos;
-	if (len == 0)
-		return;
+#ifndef USBFS_EP0_ONLY
+	uint32_t mask = 0x20002U;
 
-	if ((grstat & USBFS_GRSTAT_RPCKST_Msk) == USBFS_GRSTAT_RPCKST_STP) {
-		for (; len > 8; len -= 4)
-			(void)USBFS->DFIFO[0][0];
-		usbfs_state.ep0out = usbfs_outbuf.v;
-		*usbfs_state.ep0out++ = USBFS->DFIFO[0][0];
-		*usbfs_state.ep0out++ = USBFS->DFIFO[0][0];
-	} else {
-		while (1) {
-			*usbfs_state.ep0out++ = USBFS->DFIFO[0][0];
-			if (len <= 4)
-				break;
-			len -= 4;
-		}
+	for (unsigned int i = 0; i < ARRAY_SIZE(usbfs_device.endpoint); i++, mask <<= 1) {
+		if ((flags & mask) && usbfs_device.endpoint[i])
+			usbfs_device.endpoint[i]->ep();
 	}
+#endif
 }
 
 void
@@ -690,8 +822,6 @@ USBFS_IRQHandler(void)
 {
 	uint32_t flags = USBFS->GINTF;
 
-	//debug("flags = %08lx\n", flags);
-
 	/* read all incoming packets */
 	while ((flags & USBFS_GINTF_RXFNEIF)) {
 		usbfs_handle_rxdata();
@@ -701,15 +831,6 @@ USBFS_IRQHandler(void)
 	if (flags & (USBFS_GINTF_OEPIF | USBFS_GINTF_IEPIF))
 		usbfs_handle_endpoints();
 
-	/*
-	if (!(flags & (
-			USBFS_GINTF_SP |
-			USBFS_GINTF_WKUPIF |
-			USBFS_GINTF_RST |
-			USBFS_GINTF_ENUMF)))
-		return;
-	*/
-
 	if (flags & USBFS_GINTF_SP) {
 		debug("SUSPEND.. ");
 		usbfs_suspend();
@@ -737,25 +858,8 @@ USBFS_IRQHandler(void)
 	}
 }
 
-static void
-usbfs_allocate_buffers(uint32_t rx,
-		uint32_t tx0, uint32_t tx1, uint32_t tx2, uint32_t tx3)
-{
-	/* round up to number of 32bit words */
-	rx  = (rx  + 3) >> 2;
-	tx0 = (tx0 + 3) >> 2;
-	tx1 = (tx1 + 3) >> 2;
-	tx2 = (tx2 + 3) >> 2;
-	tx3 = (tx3 + 3) >> 2;
-	USBFS->GRFLEN = rx;
-	USBFS->DIEP0TFLEN = (tx0 << 16) | rx;
-	USBFS->DIEP1TFLEN = (tx1 << 16) | (rx + tx0);
-	USBFS->DIEP2TFLEN = (tx2 << 16) | (rx + tx0 + tx1);
-	USBFS->DIEP3TFLEN = (tx3 << 16) | (rx + tx0 + tx1 + tx2);
-}
-
 void
-usbfs_init(void)
+usbfs_init(uint8_t priority)
 {
 	/* turn on USBFS clock */
 	RCU->AHBEN |= RCU_AHBEN_USBFSEN;
@@ -807,11 +911,11 @@ usbfs_init(void)
 		USBFS_GCCFG_PWRON;
 
 	/* setup fifo allocation */
-	usbfs_allocate_buffers(USBFS_FIFO_RXSIZE,
-			USBFS_FIFO_TX0SIZE,
-			USBFS_FIFO_TX1SIZE,
-			USBFS_FIFO_TX2SIZE,
-			USBFS_FIFO_TX3SIZE);
+	USBFS->GRFLEN = usbfs_device.fifo.grflen;
+	USBFS->DIEP0TFLEN = usbfs_device.fifo.tflen[0];
+	USBFS->DIEP1TFLEN = usbfs_device.fifo.tflen[1];
+	USBFS->DIEP2TFLEN = usbfs_device.fifo.tflen[2];
+	USBFS->DIEP3TFLEN = usbfs_device.fifo.tflen[3];
 
 	/* flush all tx fifos */
 	usbfs_txfifos_flush();
@@ -858,7 +962,7 @@ usbfs_init(void)
 		USBFS_GINTEN_SPIE;
 
 	/* enable eclic interrupt */
-	eclic_config(USBFS_IRQn, ECLIC_ATTR_TRIG_LEVEL, 4);
+	eclic_config(USBFS_IRQn, ECLIC_ATTR_TRIG_LEVEL, priority);
 	eclic_enable(USBFS_IRQn);
 
 	/* set usb global interrupt flag */
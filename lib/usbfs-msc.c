@@ -0,0 +1,748 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "gd32vf103/usbfs.h"
+
+#include "lib/eclic.h"
+#include "lib/usbfs-core.h"
+#include "lib/usbfs-msc.h"
+
+#define MSC_ENDPOINT USBMSC_ENDPOINT
+#define MSC_PACKETSIZE USBMSC_PACKETSIZE
+#define MSC_BLOCKSIZE 512
+
+#define MSC_CBW_SIGNATURE 0x43425355U
+#define MSC_CSW_SIGNATURE 0x53425355U
+
+/* sense keys */
+#define SENSE_NONE            0x00
+#define SENSE_NOT_READY       0x02
+#define SENSE_MEDIUM_ERROR    0x03
+#define SENSE_ILLEGAL_REQUEST 0x05
+#define SENSE_UNIT_ATTENTION  0x06
+#define SENSE_DATA_PROTECT    0x07
+
+/* additional sense codes */
+#define ASC_NONE               0x00
+#define ASC_WRITE_ERROR        0x0C
+#define ASC_READ_ERROR         0x11
+#define ASC_INVALID_COMMAND    0x20
+#define ASC_LBA_OUT_OF_RANGE   0x21
+#define ASC_INVALID_FIELD      0x24
+#define ASC_WRITE_PROTECTED    0x27
+#define ASC_MEDIUM_CHANGED     0x28
+#define ASC_MEDIUM_NOT_PRESENT 0x3A
+
+/* command status */
+#define CSW_PASSED      0x00
+#define CSW_FAILED      0x01
+#define CSW_PHASE_ERROR 0x02
+
+struct msc_cbw {
+	uint32_t dCBWSignature;
+	uint32_t dCBWTag;
+	uint32_t dCBWDataTransferLength;
+	uint8_t bmCBWFlags;
+	uint8_t bCBWLUN;
+	uint8_t bCBWCBLength;
+	uint8_t CBWCB[16];
+};
+
+struct msc_csw {
+	uint32_t dCSWSignature;
+	uint32_t dCSWTag;
+	uint32_t dCSWDataResidue;
+	uint8_t bCSWStatus;
+};
+
+enum msc_state {
+	MSC_IDLE,
+	MSC_CBW,   /* waiting for a command */
+	MSC_REPLY, /* sending msc_reply */
+	MSC_READ,  /* streaming blocks from the disk */
+	MSC_WRITE, /* streaming blocks to the disk */
+	MSC_DRAIN, /* throwing away OUT data we didn't ask for */
+	MSC_HALT,  /* Bulk-In stalled until the host clears it */
+	MSC_CSW,   /* sending the command status */
+	MSC_INVALID, /* both endpoints stalled until reset recovery */
+};
+
+/*
+ * Endpoint transfers, started from usbmsc_poll() and
+ * completed by the interrupt handler.
+ */
+static uint8_t *msc_rxbuf;
+static uint8_t *msc_rxpos;
+static volatile bool msc_rxbusy;
+
+static const uint8_t *msc_txpos;
+static unsigned int msc_txleft;
+static volatile bool msc_txbusy;
+
+/* set by the interrupt handler to restart the command state machine */
+static volatile bool msc_restart;
+
+static union {
+	struct msc_cbw cbw;
+	uint32_t word[MSC_PACKETSIZE/4];
+} msc_cbw;
+
+static union {
+	struct msc_csw csw;
+	uint32_t word[4];
+} msc_csw;
+
+static union {
+	uint8_t byte[MSC_PACKETSIZE];
+	uint32_t word[MSC_PACKETSIZE/4];
+} msc_reply;
+
+static uint32_t msc_buf[2][MSC_BLOCKSIZE/4];
+
+static struct {
+	const struct usbmsc_disk *disk;
+	bool changed;
+	uint8_t state;
+	uint8_t status;
+	uint8_t sense;
+	uint8_t asc;
+	/* bytes of the host's data phase not yet transferred */
+	uint32_t left;
+	/* bytes in the last drain transfer */
+	uint32_t last;
+	/* OUT bytes to receive and throw away */
+	uint32_t drain;
+	/* block streaming */
+	uint32_t lba;
+	uint32_t disk_blocks;
+	uint32_t usb_blocks;
+	uint8_t head;
+	uint8_t tail;
+	bool busy;
+} msc;
+
+static void
+msc_rx_start(void *buf, unsigned int len)
+{
+	unsigned int packets = len / MSC_PACKETSIZE;
+
+	msc_rxbuf = buf;
+	msc_rxpos = buf;
+	msc_rxbusy = true;
+	USBFS->DOEP[MSC_ENDPOINT].LEN =
+		USBFS_DOEPLEN_PCNT(packets) |
+		packets * MSC_PACKETSIZE;
+	USBFS->DOEP[MSC_ENDPOINT].CTL |= USBFS_DOEPCTL_EPEN | USBFS_DOEPCTL_CNAK;
+}
+
+static int
+msc_rx_done(void)
+{
+	if (msc_rxbusy)
+		return -1;
+	return msc_rxpos - msc_rxbuf;
+}
+
+static void
+msc_tx_fill(void)
+{
+	const uint8_t *p = msc_txpos;
+	unsigned int left = msc_txleft;
+
+	while (left > 0) {
+		unsigned int len = (left < MSC_PACKETSIZE) ? left : MSC_PACKETSIZE;
+
+		if ((USBFS->DIEP[MSC_ENDPOINT].TFSTAT & USBFS_DIEPTFSTAT_IEPTFS_Msk)
+				< (len + 3) / 4) {
+			msc_txpos = p;
+			msc_txleft = left;
+			USBFS->DIEPFEINTEN |= USBFS_DIEPFEINTEN_IEPTXFEIE(1U << MSC_ENDPOINT);
+			return;
+		}
+		usbfs_fifo_write(MSC_ENDPOINT, p, len);
+		p += len;
+		left -= len;
+	}
+	msc_txleft = 0;
+	USBFS->DIEPFEINTEN &= ~USBFS_DIEPFEINTEN_IEPTXFEIE(1U << MSC_ENDPOINT);
+}
+
+static void
+msc_tx_start(const void *buf, unsigned int len)
+{
+	unsigned int packets = (len + MSC_PACKETSIZE - 1) / MSC_PACKETSIZE;
+	unsigned long mstatus;
+
+	/* an empty transfer is a single zero length packet */
+	if (packets == 0)
+		packets = 1;
+
+	msc_txpos = buf;
+	msc_txleft = len;
+	msc_txbusy = true;
+	USBFS->DIEP[MSC_ENDPOINT].LEN = USBFS_DIEPLEN_PCNT(packets) | len;
+	USBFS->DIEP[MSC_ENDPOINT].CTL |= USBFS_DIEPCTL_EPEN | USBFS_DIEPCTL_CNAK;
+	/* DIEPFEINTEN is shared with the interrupt handler */
+	mstatus = eclic_global_interrupt_disable_save();
+	msc_tx_fill();
+	eclic_global_interrupt_restore(mstatus);
+}
+
+static inline bool
+msc_tx_done(void)
+{
+	return !msc_txbusy;
+}
+
+/*
+ * Stop both bulk endpoints and throw away anything still queued, so
+ * nothing of an aborted command reaches the host after a reset. The
+ * controller wants a NAK in effect before an endpoint is disabled,
+ * and for OUT endpoints that has to be the global OUT NAK.
+ */
+static void
+msc_abort(void)
+{
+	USBFS->DIEPFEINTEN &= ~USBFS_DIEPFEINTEN_IEPTXFEIE(1U << MSC_ENDPOINT);
+	if (USBFS->DIEP[MSC_ENDPOINT].CTL & USBFS_DIEPCTL_EPEN) {
+		USBFS->DIEP[MSC_ENDPOINT].CTL |= USBFS_DIEPCTL_SNAK;
+		while (!(USBFS->DIEP[MSC_ENDPOINT].INTF & USBFS_DIEPINTF_IEPNE))
+			/* wait */;
+		/* the transfer may have completed in the meantime */
+		if (USBFS->DIEP[MSC_ENDPOINT].CTL & USBFS_DIEPCTL_EPEN) {
+			USBFS->DIEP[MSC_ENDPOINT].CTL |= USBFS_DIEPCTL_EPD | USBFS_DIEPCTL_SNAK;
+			while (!(USBFS->DIEP[MSC_ENDPOINT].INTF & USBFS_DIEPINTF_EPDIS))
+				/* wait */;
+		}
+	}
+	USBFS->GRSTCTL = USBFS_GRSTCTL_TXFNUM(MSC_ENDPOINT) | USBFS_GRSTCTL_TXFF;
+	while (USBFS->GRSTCTL & USBFS_GRSTCTL_TXFF)
+		/* wait */;
+	USBFS->DIEP[MSC_ENDPOINT].INTF =
+		USBFS_DIEPINTF_IEPNE |
+		USBFS_DIEPINTF_EPDIS |
+		USBFS_DIEPINTF_TF;
+
+	if (USBFS->DOEP[MSC_ENDPOINT].CTL & USBFS_DOEPCTL_EPEN) {
+		USBFS->DCTL |= USBFS_DCTL_SGONAK;
+		while (!(USBFS->GINTF & USBFS_GINTF_GONAK))
+			/* wait */;
+		if (USBFS->DOEP[MSC_ENDPOINT].CTL & USBFS_DOEPCTL_EPEN) {
+			USBFS->DOEP[MSC_ENDPOINT].CTL |= USBFS_DOEPCTL_EPD | USBFS_DOEPCTL_SNAK;
+			while (!(USBFS->DOEP[MSC_ENDPOINT].INTF & USBFS_DOEPINTF_EPDIS))
+				/* wait */;
+		}
+		USBFS->DCTL |= USBFS_DCTL_CGONAK;
+	}
+	USBFS->DOEP[MSC_ENDPOINT].INTF =
+		USBFS_DOEPINTF_EPDIS |
+		USBFS_DOEPINTF_TF;
+
+	msc_rxbusy = false;
+	msc_txbusy = false;
+	msc_txleft = 0;
+}
+
+static uint32_t
+msc_get_be32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+		(uint32_t)p[2] << 8 | p[3];
+}
+
+static void
+msc_put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void
+msc_fail(uint8_t sense, uint8_t asc)
+{
+	msc.status = CSW_FAILED;
+	msc.sense = sense;
+	msc.asc = asc;
+}
+
+static void
+msc_csw_send(void)
+{
+	msc_csw.csw.dCSWSignature = MSC_CSW_SIGNATURE;
+	msc_csw.csw.dCSWTag = msc_cbw.cbw.dCBWTag;
+	msc_csw.csw.dCSWDataResidue = msc.left;
+	msc_csw.csw.bCSWStatus = msc.status;
+	msc_tx_start(msc_csw.word, 13);
+	msc.state = MSC_CSW;
+}
+
+static void
+msc_cbw_receive(void)
+{
+	msc_rx_start(msc_cbw.word, sizeof(msc_cbw));
+	msc.state = MSC_CBW;
+}
+
+static void
+msc_drain(void)
+{
+	unsigned int len = msc.drain;
+
+	if (len > MSC_BLOCKSIZE)
+		len = MSC_BLOCKSIZE;
+	else
+		len = (len + MSC_PACKETSIZE - 1) & ~(MSC_PACKETSIZE - 1U);
+
+	msc_rx_start(msc_buf[0], len);
+	msc.last = len;
+	msc.state = MSC_DRAIN;
+}
+
+/*
+ * Our data phase is done, but the host may expect more. OUT data
+ * is received and thrown away before the status is sent. For IN
+ * data the Bulk-In endpoint is stalled, and the status is sent once
+ * the host has cleared it (BOT 6.7.2 and 6.7.3).
+ */
+static void
+msc_data_end(void)
+{
+	if (msc.left == 0) {
+		msc_csw_send();
+		return;
+	}
+	if (!(msc_cbw.cbw.bmCBWFlags & 0x80U)) {
+		msc.drain = msc.left;
+		msc_drain();
+		return;
+	}
+	USBFS->DIEP[MSC_ENDPOINT].CTL |= USBFS_DIEPCTL_STALL;
+	msc.state = MSC_HALT;
+}
+
+/*
+ * After an invalid CBW both endpoints stay stalled until the host
+ * does a reset recovery (BOT 6.6.1), ie. a Bulk-Only Mass Storage
+ * Reset followed by clearing the halts. Clearing them without the
+ * reset doesn't count, so the stalls are set again until then.
+ */
+static void
+msc_invalid_poll(void)
+{
+	if (!(USBFS->DIEP[MSC_ENDPOINT].CTL & USBFS_DIEPCTL_STALL))
+		USBFS->DIEP[MSC_ENDPOINT].CTL |= USBFS_DIEPCTL_STALL;
+	if (!(USBFS->DOEP[MSC_ENDPOINT].CTL & USBFS_DOEPCTL_STALL))
+		USBFS->DOEP[MSC_ENDPOINT].CTL |= USBFS_DOEPCTL_STALL;
+}
+
+static void
+msc_reply_send(unsigned int len)
+{
+	if (!(msc_cbw.cbw.bmCBWFlags & 0x80U) || msc.left < len) {
+		/* host doesn't want the data we have */
+		msc.status = CSW_PHASE_ERROR;
+		len = 0;
+	}
+	if (len == 0) {
+		msc_data_end();
+		return;
+	}
+	msc_tx_start(msc_reply.word, len);
+	msc.left -= len;
+	msc.state = MSC_REPLY;
+}
+
+static void
+msc_blocks_start(bool in)
+{
+	const uint8_t *cb = msc_cbw.cbw.CBWCB;
+	uint32_t lba = msc_get_be32(&cb[2]);
+	uint32_t blocks = (uint32_t)cb[7] << 8 | cb[8];
+
+	if (lba > msc.disk->blocks || blocks > msc.disk->blocks - lba) {
+		msc_fail(SENSE_ILLEGAL_REQUEST, ASC_LBA_OUT_OF_RANGE);
+		blocks = 0;
+	} else if (!in && msc.disk->write == NULL) {
+		msc_fail(SENSE_DATA_PROTECT, ASC_WRITE_PROTECTED);
+		blocks = 0;
+	} else if (!(msc_cbw.cbw.bmCBWFlags & 0x80U) != !in ||
+			msc.left < blocks * MSC_BLOCKSIZE) {
+		msc.status = CSW_PHASE_ERROR;
+		blocks = 0;
+	}
+
+	msc.lba = lba;
+	msc.disk_blocks = blocks;
+	msc.usb_blocks = blocks;
+	msc.head = 0;
+	msc.tail = 0;
+	msc.busy = false;
+	msc.state = in ? MSC_READ : MSC_WRITE;
+}
+
+static void
+msc_read_poll(void)
+{
+	if (msc.busy && msc_tx_done()) {
+		msc.busy = false;
+		msc.tail++;
+		msc.usb_blocks--;
+		msc.left -= MSC_BLOCKSIZE;
+	}
+
+	/* start sending the next block before reading another */
+	if (!msc.busy && msc.head != msc.tail) {
+		msc_tx_start(msc_buf[msc.tail % 2], MSC_BLOCKSIZE);
+		msc.busy = true;
+	}
+
+	if (msc.disk_blocks > 0 && (uint8_t)(msc.head - msc.tail) < 2) {
+		if (msc.disk->read(msc.lba, msc_buf[msc.head % 2])) {
+			msc_fail(SENSE_MEDIUM_ERROR, ASC_READ_ERROR);
+			msc.usb_blocks = msc.head - msc.tail;
+			msc.disk_blocks = 0;
+			return;
+		}
+		msc.head++;
+		msc.lba++;
+		msc.disk_blocks--;
+		return;
+	}
+
+	if (!msc.busy && msc.usb_blocks == 0)
+		msc_data_end();
+}
+
+static void
+msc_write_poll(void)
+{
+	int len;
+
+	if (msc.busy && (len = msc_rx_done()) >= 0) {
+		msc.busy = false;
+		msc.left -= len;
+		if (len == MSC_BLOCKSIZE) {
+			msc.head++;
+			msc.usb_blocks--;
+		} else {
+			/* the host ended the transfer early */
+			msc.status = CSW_PHASE_ERROR;
+			msc.usb_blocks = 0;
+		}
+	}
+
+	/* start receiving the next block before writing another */
+	if (!msc.busy && msc.usb_blocks > 0 && (uint8_t)(msc.head - msc.tail) < 2) {
+		msc_rx_start(msc_buf[msc.head % 2], MSC_BLOCKSIZE);
+		msc.busy = true;
+	}
+
+	if (msc.head != msc.tail) {
+		/* after an error just receive and drop the rest */
+		if (msc.status == CSW_PASSED &&
+				msc.disk->write(msc.lba, msc_buf[msc.tail % 2]))
+			msc_fail(SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR);
+		msc.tail++;
+		msc.lba++;
+		return;
+	}
+
+	if (!msc.busy && msc.usb_blocks == 0)
+		msc_data_end();
+}
+
+static void
+msc_command(void)
+{
+	const uint8_t *cb = msc_cbw.cbw.CBWCB;
+	uint8_t *r = msc_reply.byte;
+	uint32_t blocks = msc.disk ? msc.disk->blocks : 0;
+
+	msc.left = msc_cbw.cbw.dCBWDataTransferLength;
+	msc.status = CSW_PASSED;
+
+	switch (cb[0]) {
+	case 0x12: /* INQUIRY */
+	case 0x03: /* REQUEST SENSE */
+		break;
+	default:
+		if (msc.disk == NULL) {
+			msc_fail(SENSE_NOT_READY, ASC_MEDIUM_NOT_PRESENT);
+			msc_data_end();
+			return;
+		}
+		if (msc.changed) {
+			msc.changed = false;
+			msc_fail(SENSE_UNIT_ATTENTION, ASC_MEDIUM_CHANGED);
+			msc_data_end();
+			return;
+		}
+	}
+
+	switch (cb[0]) {
+	case 0x00: /* TEST UNIT READY */
+	case 0x1B: /* START STOP UNIT */
+	case 0x1E: /* PREVENT ALLOW MEDIUM REMOVAL */
+	case 0x2F: /* VERIFY (10) */
+	case 0x35: /* SYNCHRONIZE CACHE (10) */
+		msc_data_end();
+		return;
+	case 0x03: /* REQUEST SENSE */
+		memset(r, 0, 18);
+		r[0]  = 0x70; /* current errors, fixed format */
+		r[2]  = msc.sense;
+		r[7]  = 10;   /* additional sense length */
+		r[12] = msc.asc;
+		msc.sense = SENSE_NONE;
+		msc.asc = ASC_NONE;
+		msc_reply_send(cb[4] < 18 ? cb[4] : 18);
+		return;
+	case 0x12: /* INQUIRY */
+		if (cb[1] & 0x01U) {
+			/* no vital product data pages */
+			msc_fail(SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD);
+			msc_data_end();
+			return;
+		}
+		r[0] = 0x00; /* direct access block device */
+		r[1] = 0x80; /* removable */
+		r[2] = 0x04; /* SPC-2 */
+		r[3] = 0x02; /* response data format */
+		r[4] = 36 - 5;
+		r[5] = 0;
+		r[6] = 0;
+		r[7] = 0;
+		memcpy(&r[8], "GD32VF  ", 8);
+		memcpy(&r[16], "Mass Storage    ", 16);
+		memcpy(&r[32], "1.0 ", 4);
+		msc_reply_send(cb[4] < 36 ? cb[4] : 36);
+		return;
+	case 0x1A: /* MODE SENSE (6) */
+		r[0] = 3; /* mode data length */
+		r[1] = 0; /* medium type */
+		r[2] = (msc.disk->write == NULL) ? 0x80 : 0x00;
+		r[3] = 0; /* block descriptor length */
+		msc_reply_send(cb[4] < 4 ? cb[4] : 4);
+		return;
+	case 0x23: /* READ FORMAT CAPACITIES */
+		memset(r, 0, 12);
+		r[3] = 8; /* capacity list length */
+		msc_put_be32(&r[4], blocks);
+		msc_put_be32(&r[8], MSC_BLOCKSIZE);
+		r[8] = 0x02; /* formatted media */
+		msc_reply_send(msc.left < 12 ? msc.left : 12);
+		return;
+	case 0x25: /* READ CAPACITY (10) */
+		msc_put_be32(&r[0], blocks - 1);
+		msc_put_be32(&r[4], MSC_BLOCKSIZE);
+		msc_reply_send(8);
+		return;
+	case 0x28: /* READ (10) */
+		msc_blocks_start(true);
+		return;
+	case 0x2A: /* WRITE (10) */
+		msc_blocks_start(false);
+		return;
+	}
+
+	msc_fail(SENSE_ILLEGAL_REQUEST, ASC_INVALID_COMMAND);
+	msc_data_end();
+}
+
+static bool
+msc_cbw_valid(int len)
+{
+	return len == 31 &&
+		msc_cbw.cbw.dCBWSignature == MSC_CBW_SIGNATURE &&
+		msc_cbw.cbw.bCBWLUN == 0 &&
+		msc_cbw.cbw.bCBWCBLength >= 1 &&
+		msc_cbw.cbw.bCBWCBLength <= 16;
+}
+
+void
+usbmsc_poll(void)
+{
+	int len;
+
+	if (msc_restart) {
+		unsigned long mstatus;
+
+		/* the main loop may have started a transfer since the reset */
+		mstatus = eclic_global_interrupt_disable_save();
+		msc_restart = false;
+		msc_abort();
+		eclic_global_interrupt_restore(mstatus);
+		msc.sense = SENSE_NONE;
+		msc.asc = ASC_NONE;
+		msc_cbw_receive();
+		return;
+	}
+
+	switch (msc.state) {
+	case MSC_CBW:
+		len = msc_rx_done();
+		if (len < 0)
+			break;
+		if (msc_cbw_valid(len))
+			msc_command();
+		else {
+			msc.state = MSC_INVALID;
+			msc_invalid_poll();
+		}
+		break;
+	case MSC_REPLY:
+		if (msc_tx_done())
+			msc_data_end();
+		break;
+	case MSC_READ:
+		msc_read_poll();
+		break;
+	case MSC_WRITE:
+		msc_write_poll();
+		break;
+	case MSC_DRAIN:
+		len = msc_rx_done();
+		if (len < 0)
+			break;
+		if ((unsigned int)len < msc.drain && (unsigned int)len == msc.last) {
+			msc.drain -= len;
+			msc_drain();
+		} else
+			msc_csw_send();
+		break;
+	case MSC_HALT:
+		if (!(USBFS->DIEP[MSC_ENDPOINT].CTL & USBFS_DIEPCTL_STALL))
+			msc_csw_send();
+		break;
+	case MSC_CSW:
+		if (msc_tx_done())
+			msc_cbw_receive();
+		break;
+	case MSC_INVALID:
+		msc_invalid_poll();
+		break;
+	}
+}
+
+void
+usbmsc_attach(const struct usbmsc_disk *disk)
+{
+	msc.disk = disk;
+	msc.changed = true;
+}
+
+static int
+msc_reset(const struct usb_setup_packet *p, const void **data)
+{
+	msc_abort();
+	msc_restart = true;
+	return 0;
+}
+
+static int
+msc_get_max_lun(const struct usb_setup_packet *p, const void **data)
+{
+	static const uint8_t max_lun = 0;
+
+	*data = &max_lun;
+	return 1;
+}
+
+static const struct usb_setup_handler msc_setup_handlers[] = {
+	{ .req = 0xff21, .idx = -1, .len = 0, .fn = msc_reset },
+	{ .req = 0xfea1, .idx = -1, .len = 1, .fn = msc_get_max_lun },
+};
+
+static void
+msc_configure(void)
+{
+	USBFS->DIEP[MSC_ENDPOINT].CTL =
+		USBFS_DIEPCTL_SNAK |
+		USBFS_DIEPCTL_TXFNUM(MSC_ENDPOINT) |
+		USBFS_DIEPCTL_EPTYPE_BULK |
+		USBFS_DIEPCTL_EPACT |
+		MSC_PACKETSIZE;
+	USBFS->DOEP[MSC_ENDPOINT].CTL =
+		USBFS_DOEPCTL_SNAK |
+		USBFS_DOEPCTL_EPTYPE_BULK |
+		USBFS_DOEPCTL_EPACT |
+		MSC_PACKETSIZE;
+
+	USBFS->DAEPINTEN |=
+		(1U << (MSC_ENDPOINT + USBFS_DAEPINTEN_IEPIE_Pos)) |
+		(1U << (MSC_ENDPOINT + USBFS_DAEPINTEN_OEPIE_Pos));
+	USBFS->DIEPFEINTEN &= ~USBFS_DIEPFEINTEN_IEPTXFEIE(1U << MSC_ENDPOINT);
+
+	msc_rxbusy = false;
+	msc_txbusy = false;
+	msc_txleft = 0;
+	msc_restart = true;
+}
+
+const struct usbfs_class usbmsc_class = {
+	USBFS_CLASS_HANDLERS(msc_setup_handlers),
+	.configure = msc_configure,
+};
+
+static void
+msc_handle_rx(unsigned int len)
+{
+	usbfs_fifo_read(MSC_ENDPOINT, msc_rxpos, len);
+	msc_rxpos += len;
+}
+
+static void
+msc_handle_ep(void)
+{
+	uint32_t flags = USBFS->DOEP[MSC_ENDPOINT].INTF;
+
+	USBFS->DOEP[MSC_ENDPOINT].INTF = flags;
+
+	if (flags & USBFS_DOEPINTF_TF)
+		msc_rxbusy = false;
+
+	flags = USBFS->DIEP[MSC_ENDPOINT].INTF;
+
+	USBFS->DIEP[MSC_ENDPOINT].INTF = flags;
+
+	if (flags & USBFS_DIEPINTF_TF)
+		msc_txbusy = false;
+	else if ((flags & USBFS_DIEPINTF_TXFE) &&
+			(USBFS->DIEPFEINTEN & USBFS_DIEPFEINTEN_IEPTXFEIE(1U << MSC_ENDPOINT)))
+		msc_tx_fill();
+}
+
+const struct usbfs_endpoint usbmsc_endpoint = {
+	.rx = msc_handle_rx,
+	.ep = msc_handle_ep,
+};
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "gd32vf103/usbfs.h"
+
+#include "lib/eclic.h"
+#include "lib/usbfs-core.h"
+#include "lib/usbfs-vendor.h"
+
+#define VENDOR_ENDPOINT USBVENDOR_ENDPOINT
+#define VENDOR_PACKETSIZE USBVENDOR_PACKETSIZE
+
+static uint8_t *vendor_rxbuf;
+static uint8_t *vendor_rxpos;
+static volatile bool vendor_rxbusy;
+
+static const uint8_t *vendor_txpos;
+static unsigned int vendor_txleft;
+static volatile bool vendor_txbusy;
+
+void
+usbvendor_rx_start(void *buf, size_t len)
+{
+	unsigned int packets = len / VENDOR_PACKETSIZE;
+
+	vendor_rxbuf = buf;
+	vendor_rxpos = buf;
+	vendor_rxbusy = true;
+	USBFS->DOEP[VENDOR_ENDPOINT].LEN =
+		USBFS_DOEPLEN_PCNT(packets) |
+		packets * VENDOR_PACKETSIZE;
+	USBFS->DOEP[VENDOR_ENDPOINT].CTL |= USBFS_DOEPCTL_EPEN | USBFS_DOEPCTL_CNAK;
+}
+
+int
+usbvendor_rx_done(void)
+{
+	if (vendor_rxbusy)
+		return -1;
+	return vendor_rxpos - vendor_rxbuf;
+}
+
+/*
+ * Write whole packets to the fifo while there is room for them and
+ * let the fifo empty interrupt continue with the rest. The state must
+ * be saved before that interrupt is enabled.
+ */
+static void
+vendor_tx_fill(void)
+{
+	const uint8_t *p = vendor_txpos;
+	unsigned int left = vendor_txleft;
+
+	while (left > 0) {
+		unsigned int len = (left < VENDOR_PACKETSIZE) ? left : VENDOR_PACKETSIZE;
+
+		if ((USBFS->DIEP[VENDOR_ENDPOINT].TFSTAT & USBFS_DIEPTFSTAT_IEPTFS_Msk)
+				< (len + 3) / 4) {
+			vendor_txpos = p;
+			vendor_txleft = left;
+			USBFS->DIEPFEINTEN |= USBFS_DIEPFEINTEN_IEPTXFEIE(1U << VENDOR_ENDPOINT);
+			return;
+		}
+		usbfs_fifo_write(VENDOR_ENDPOINT, p, len);
+		p += len;
+		left -= len;
+	}
+	vendor_txleft = 0;
+	USBFS->DIEPFEINTEN &= ~USBFS_DIEPFEINTEN_IEPTXFEIE(1U << VENDOR_ENDPOINT);
+}
+
+void
+usbvendor_tx_start(const void *buf, size_t len)
+{
+	unsigned int packets = (len + VENDOR_PACKETSIZE - 1) / VENDOR_PACKETSIZE;
+	unsigned long mstatus;
+
+	/* an empty transfer is a single zero length packet */
+	if (packets == 0)
+		packets = 1;
+
+	vendor_txpos = buf;
+	vendor_txleft = len;
+	vendor_txbusy = true;
+	USBFS->DIEP[VENDOR_ENDPOINT].LEN = USBFS_DIEPLEN_PCNT(packets) | len;
+	USBFS->DIEP[VENDOR_ENDPOINT].CTL |= USBFS_DIEPCTL_EPEN | USBFS_DIEPCTL_CNAK;
+	/* DIEPFEINTEN is shared with the interrupt handler */
+	mstatus = eclic_global_interrupt_disable_save();
+	vendor_tx_fill();
+	eclic_global_interrupt_restore(mstatus);
+}
+
+bool
+usbvendor_tx_done(void)
+{
+	return !vendor_txbusy;
+}
+
+static void
+vendor_configure(void)
+{
+	USBFS->DIEP[VENDOR_ENDPOINT].CTL =
+		USBFS_DIEPCTL_SNAK |
+		USBFS_DIEPCTL_TXFNUM(VENDOR_ENDPOINT) |
+		USBFS_DIEPCTL_EPTYPE_BULK |
+		USBFS_DIEPCTL_EPACT |
+		VENDOR_PACKETSIZE;
+	USBFS->DOEP[VENDOR_ENDPOINT].CTL =
+		USBFS_DOEPCTL_SNAK |
+		USBFS_DOEPCTL_EPTYPE_BULK |
+		USBFS_DOEPCTL_EPACT |
+		VENDOR_PACKETSIZE;
+
+	USBFS->DAEPINTEN |=
+		(1U << (VENDOR_ENDPOINT + USBFS_DAEPINTEN_IEPIE_Pos)) |
+		(1U << (VENDOR_ENDPOINT + USBFS_DAEPINTEN_OEPIE_Pos));
+	USBFS->DIEPFEINTEN &= ~USBFS_DIEPFEINTEN_IEPTXFEIE(1U << VENDOR_ENDPOINT);
+
+	vendor_rxbuf = NULL;
+	vendor_rxpos = NULL;
+	vendor_rxbusy = false;
+	vendor_txleft = 0;
+	vendor_txbusy = false;
+}
+
+const struct usbfs_class usbvendor_class = {
+	.configure = vendor_configure,
+};
+
+static void
+vendor_handle_rx(unsigned int len)
+{
+	usbfs_fifo_read(VENDOR_ENDPOINT, vendor_rxpos, len);
+	vendor_rxpos += len;
+}
+
+static void
+vendor_handle_ep(void)
+{
+	uint32_t flags = USBFS->DOEP[VENDOR_ENDPOINT].INTF;
+
+	USBFS->DOEP[VENDOR_ENDPOINT].INTF = flags;
+
+	if (flags & USBFS_DOEPINTF_TF)
+		vendor_rxbusy = false;
+
+	flags = USBFS->DIEP[VENDOR_ENDPOINT].INTF;
+
+	USBFS->DIEP[VENDOR_ENDPOINT].INTF = flags;
+
+	if (flags & USBFS_DIEPINTF_TF)
+		vendor_txbusy = false;
+	else if ((flags & USBFS_DIEPINTF_TXFE) &&
+			(USBFS->DIEPFEINTEN & USBFS_DIEPFEINTEN_IEPTXFEIE(1U << VENDOR_ENDPOINT)))
+		vendor_tx_fill();
+}
+
+const struct usbfs_endpoint usbvendor_endpoint = {
+	.rx = vendor_handle_rx,
+	.ep = vendor_handle_ep,
+};
@@ -33,10 +33,16 @@
 typedef struct __file FILE;
 
 typedef void __putc_t(FILE *stream, char c);
+typedef void __write_t(FILE *stream, const char *buf, size_t len);
 typedef int __done_t(FILE *stream);
 
+/*
+ * write is optional. If set it must behave exactly
+ * as calling putc for each of the len characters.
+ */
 struct __file {
 	__putc_t *putc;
+	__write_t *write;
 	__done_t *done;
 };
 
@@ -49,20 +55,150 @@ int fputs(const char *s, FILE *stream);
 int putchar(int c);
 int puts(const char *s);
 
-__attribute__((format(printf, 2, 3)))
+__attribute__((format(__printf__, 2, 3)))
 int fprintf(FILE *stream, const char *format, ...);
 int vfprintf(FILE *stream, const char *format, va_list ap);
 
-__attribute__((format(printf, 1, 2)))
+__attribute__((format(__printf__, 1, 2)))
 int printf(const char *restrict, ...);
 int vprintf(const char *restrict, va_list ap);
 
-__attribute__((format(printf, 2, 3)))
+__attribute__((format(__printf__, 2, 3)))
 int sprintf(char *restrict str, const char *restrict, ...);
 int vsprintf(char *restrict str, const char *restrict, va_list ap);
 
-__attribute__((format(printf, 3, 4)))
+__attribute__((format(__printf__, 3, 4)))
 int snprintf(char *restrict str, size_t size, const char *restrict, ...);
 int vsnprintf(char *restrict str, size_t size, const char *restrict, va_list ap);
 
+/*
+ * PRINTF_STATIC(stream, ...) prints each of its arguments in turn
+ * without parsing a format string at runtime. The arguments are
+ * picked apart at compile time by their type:
+ *
+ *   strings               printed as is (like %s)
+ *   char                  printed as a character (like %c), but
+ *                         note that 'x' has type int, so use "x"
+ *   signed integers       printed in decimal (like %d and %lld)
+ *   unsigned integers     printed in decimal (like %u and %llu)
+ *   bool                  printed as 0 or 1
+ *   PF_D(v, w) etc.       printed as %wd, %wu, %wx, %0wd, %0wu and %0wx
+ *
+ * so
+ *   printf("addr=0x%08lx len=%u\n", addr, len);
+ * becomes
+ *   PRINTF_STATIC(stdout, "addr=0x", PF_0X(addr, 8), " len=", len, "\n");
+ *
+ * Up to 16 arguments are supported. Like fprintf it returns the
+ * result of the stream's done callback.
+ */
+struct __printf_static_num {
+	unsigned int v;
+	unsigned char width;
+	char pad;
+};
+struct __printf_static_d { struct __printf_static_num n; };
+struct __printf_static_u { struct __printf_static_num n; };
+struct __printf_static_x { struct __printf_static_num n; };
+
+#define PF_D(v, w)  ((struct __printf_static_d){{ (v), (w), ' ' }})
+#define PF_U(v, w)  ((struct __printf_static_u){{ (v), (w), ' ' }})
+#define PF_X(v, w)  ((struct __printf_static_x){{ (v), (w), ' ' }})
+#define PF_0D(v, w) ((struct __printf_static_d){{ (v), (w), '0' }})
+#define PF_0U(v, w) ((struct __printf_static_u){{ (v), (w), '0' }})
+#define PF_0X(v, w) ((struct __printf_static_x){{ (v), (w), '0' }})
+
+void __printf_static_write(FILE *stream, const char *s, size_t len);
+void __printf_static_d(FILE *stream, int v, int width, char pad);
+void __printf_static_u(FILE *stream, unsigned int v, int width, char pad);
+void __printf_static_x(FILE *stream, unsigned int v, int width, char pad);
+void __printf_static_lld(FILE *stream, long long v);
+void __printf_static_llu(FILE *stream, unsigned long long v);
+
+static inline void __pf_str(FILE *stream, const char *s)
+{
+	__printf_static_write(stream, s, __builtin_strlen(s));
+}
+static inline void __pf_chr(FILE *stream, char c)
+{
+	stream->putc(stream, c);
+}
+static inline void __pf_int(FILE *stream, long v)
+{
+	__printf_static_d(stream, v, 0, ' ');
+}
+static inline void __pf_uint(FILE *stream, unsigned long v)
+{
+	__printf_static_u(stream, v, 0, ' ');
+}
+static inline void __pf_llint(FILE *stream, long long v)
+{
+	__printf_static_lld(stream, v);
+}
+static inline void __pf_ullint(FILE *stream, unsigned long long v)
+{
+	__printf_static_llu(stream, v);
+}
+static inline void __pf_d(FILE *stream, struct __printf_static_d d)
+{
+	__printf_static_d(stream, d.n.v, d.n.width, d.n.pad);
+}
+static inline void __pf_u(FILE *stream, struct __printf_static_u u)
+{
+	__printf_static_u(stream, u.n.v, u.n.width, u.n.pad);
+}
+static inline void __pf_x(FILE *stream, struct __printf_static_x x)
+{
+	__printf_static_x(stream, x.n.v, x.n.width, x.n.pad);
+}
+
+#define __PF_EMIT(stream, x) _Generic((x), \
+	char *: __pf_str, \
+	const char *: __pf_str, \
+	char: __pf_chr, \
+	signed char: __pf_int, \
+	short: __pf_int, \
+	int: __pf_int, \
+	long: __pf_int, \
+	long long: __pf_llint, \
+	_Bool: __pf_uint, \
+	unsigned char: __pf_uint, \
+	unsigned short: __pf_uint, \
+	unsigned int: __pf_uint, \
+	unsigned long: __pf_uint, \
+	unsigned long long: __pf_ullint, \
+	struct __printf_static_d: __pf_d, \
+	struct __printf_static_u: __pf_u, \
+	struct __printf_static_x: __pf_x)((stream), (x));
+
+#define __PF_1(s, x)      __PF_EMIT(s, x)
+#define __PF_2(s, x, ...) __PF_EMIT(s, x) __PF_1(s, __VA_ARGS__)
+#define __PF_3(s, x, ...) __PF_EMIT(s, x) __PF_2(s, __VA_ARGS__)
+#define __PF_4(s, x, ...) __PF_EMIT(s, x) __PF_3(s, __VA_ARGS__)
+#define __PF_5(s, x, ...) __PF_EMIT(s, x) __PF_4(s, __VA_ARGS__)
+#define __PF_6(s, x, ...) __PF_EMIT(s, x) __PF_5(s, __VA_ARGS__)
+#define __PF_7(s, x, ...) __PF_EMIT(s, x) __PF_6(s, __VA_ARGS__)
+#define __PF_8(s, x, ...) __PF_EMIT(s, x) __PF_7(s, __VA_ARGS__)
+#define __PF_9(s, x, ...) __PF_EMIT(s, x) __PF_8(s, __VA_ARGS__)
+#define __PF_10(s, x, ...) __PF_EMIT(s, x) __PF_9(s, __VA_ARGS__)
+#define __PF_11(s, x, ...) __PF_EMIT(s, x) __PF_10(s, __VA_ARGS__)
+#define __PF_12(s, x, ...) __PF_EMIT(s, x) __PF_11(s, __VA_ARGS__)
+#define __PF_13(s, x, ...) __PF_EMIT(s, x) __PF_12(s, __VA_ARGS__)
+#define __PF_14(s, x, ...) __PF_EMIT(s, x) __PF_13(s, __VA_ARGS__)
+#define __PF_15(s, x, ...) __PF_EMIT(s, x) __PF_14(s, __VA_ARGS__)
+#define __PF_16(s, x, ...) __PF_EMIT(s, x) __PF_15(s, __VA_ARGS__)
+
+#define __PF_COUNT(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, \
+		_11, _12, _13, _14, _15, _16, n, ...) n
+#define __PF_NARGS(...) __PF_COUNT(__VA_ARGS__, \
+		16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1)
+#define __PF_CAT(a, b) __PF_CAT_(a, b)
+#define __PF_CAT_(a, b) a##b
+
+#define PRINTF_STATIC(stream, ...) ({ \
+	FILE *__pf_stream = (stream); \
+	__PF_CAT(__PF_, __PF_NARGS(__VA_ARGS__))(__pf_stream, __VA_ARGS__) \
+	__pf_stream->done(__pf_stream); \
+})
+
 #endif
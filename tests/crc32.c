@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+/*
+ * Test of crc32_update() from examples/dfu-bootloader/crc32.c, the
+ * software version of the CRC unit used by tools/dfu-pack.c.
+ *
+ * It is checked against results of the CRC unit, and against a plain
+ * bit at a time CRC-32/MPEG-2, which is what the unit calculates when
+ * each word is fed to it msb first. That reference is itself checked
+ * with the catalogue value of CRC-32/MPEG-2 for "123456789".
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32.h"
+
+#include "test.h"
+
+/*
+ * CRC unit results after a reset and writing these words to DATA.
+ * 0x12345678 -> 0xdf8a8a2b is also the example value for the
+ * identical CRC unit of the STM32F1 series.
+ */
+static const struct {
+	uint32_t words[4];
+	size_t len;
+	uint32_t crc;
+} vectors[] = {
+	{ { 0 }, 0, 0xffffffffU },
+	{ { 0x00000000U }, 1, 0xc704dd7bU },
+	{ { 0xffffffffU }, 1, 0x00000000U },
+	{ { 0x12345678U }, 1, 0xdf8a8a2bU },
+	{ { 0x12345678U, 0x9abcdef0U }, 2, 0x7d24a31bU },
+	/* "GD32VF103 image!" read as little endian words */
+	{ { 0x32334447U, 0x30314656U, 0x6d692033U, 0x21656761U }, 4, 0x129b2ca2U },
+};
+
+/* CRC-32/MPEG-2 of bytes, one bit at a time */
+static uint32_t
+crc_bits(uint32_t crc, const uint8_t *p, size_t len)
+{
+	for (; len > 0; len--) {
+		crc ^= (uint32_t)*p++ << 24;
+		for (unsigned int i = 0; i < 8; i++)
+			crc = (crc & 0x80000000U) ? (crc << 1) ^ 0x04c11db7U : crc << 1;
+	}
+	return crc;
+}
+
+/* the CRC unit takes each word msb first */
+static uint32_t
+crc_words(uint32_t crc, const uint32_t *p, size_t words)
+{
+	for (; words > 0; words--, p++) {
+		uint8_t b[4] = { *p >> 24, *p >> 16, *p >> 8, *p };
+
+		crc = crc_bits(crc, b, 4);
+	}
+	return crc;
+}
+
+int main(void)
+{
+	static uint32_t buf[1024];
+
+	check(crc_bits(0xffffffffU, (const uint8_t *)"123456789", 9) == 0x0376e6e7U,
+			"reference CRC-32/MPEG-2 check value");
+
+	for (size_t i = 0; i < sizeof(vectors)/sizeof(vectors[0]); i++) {
+		uint32_t crc = crc32_update(0xffffffffU, vectors[i].words, vectors[i].len);
+
+		check(crc == vectors[i].crc, "vector %zu: 0x%08x, want 0x%08x",
+				i, crc, vectors[i].crc);
+		crc = crc_words(0xffffffffU, vectors[i].words, vectors[i].len);
+		check(crc == vectors[i].crc, "vector %zu: reference 0x%08x, want 0x%08x",
+				i, crc, vectors[i].crc);
+	}
+
+	/* random data, any start value and split into several updates */
+	for (unsigned int i = 0; i < 2000; i++) {
+		size_t len = test_rand() % 1024;
+		size_t split = len ? test_rand() % len : 0;
+		uint32_t init = (i & 1) ? test_rand() : 0xffffffffU;
+		uint32_t want;
+		uint32_t crc;
+
+		test_fill(buf, len * 4);
+		want = crc_words(init, buf, len);
+		crc = crc32_update(init, buf, split);
+		crc = crc32_update(crc, buf + split, len - split);
+		check(crc == want, "%zu words split at %zu: 0x%08x, want 0x%08x",
+				len, split, crc, want);
+	}
+
+	/* a word holding the crc of what came before gives 0, as for the unit */
+	test_fill(buf, 64);
+	buf[16] = crc32_update(0xffffffffU, buf, 16);
+	check(crc32_update(0xffffffffU, buf, 17) == 0, "residue");
+
+	return test_done("crc32");
+}
@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "test.h"
+#include "usbfs-sim.h"
+
+#include "gd32vf103/info.h"
+#include "lib/eclic.h"
+#include "lib/usbfs-core.h"
+
+#include "dfu.h"
+#include "flash.h"
+#include "image.h"
+
+/*
+ * Run examples/dfu-bootloader/dfu.c on the USBFS simulator and check
+ * the bwPollTimeout it reports while pages are being programmed. The
+ * flash is replaced by a buffer, and programming a page takes as long
+ * as the test wants it to.
+ */
+
+#define DFU_DNLOAD    0x01
+#define DFU_GETSTATUS 0x03
+
+#define dfuIDLE        2
+#define dfuDNBUSY      4
+#define dfuDNLOAD_IDLE 5
+
+#define PAGES 3
+
+/* flash_page() holds page n until flash_release > n */
+static volatile unsigned int flash_started;
+static volatile unsigned int flash_done;
+static volatile unsigned int flash_release;
+/* host time in microseconds page n started and finished */
+static volatile uint64_t flash_start[PAGES + 1];
+static volatile uint64_t flash_end[PAGES + 1];
+static uint8_t flash[PAGES * PAGE_SIZE];
+
+struct flash_stats flash_stats;
+
+static uint64_t
+now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000U + now.tv_nsec / 1000;
+}
+
+int
+flash_unlock(void)
+{
+	return 0;
+}
+
+void
+flash_lock(void)
+{
+}
+
+int
+flash_page(uint32_t addr, const uint32_t data[PAGE_SIZE/4])
+{
+	unsigned int n = flash_started;
+
+	if (n < PAGES) {
+		flash_start[n] = now_us();
+		flash_started = n + 1;
+	}
+	while (flash_release <= n)
+		/* wait */;
+	if (addr - IMAGE_START < sizeof(flash))
+		memcpy(&flash[addr - IMAGE_START], data, PAGE_SIZE);
+	if (n < PAGES)
+		flash_end[n] = now_us();
+	flash_stats.programmed++;
+	flash_done = n + 1;
+	return 0;
+}
+
+int
+image_verify(uint32_t limit)
+{
+	return 0;
+}
+
+static void
+device(void)
+{
+	eclic_global_interrupt_enable();
+	dfu_init();
+	usbfs_init(4);
+
+	while (1) {
+		if (!dfu_poll())
+			wait_for_interrupt();
+	}
+}
+
+static void
+sleep_us(unsigned int us)
+{
+	struct timespec ts = {
+		.tv_sec = us / 1000000,
+		.tv_nsec = (us % 1000000) * 1000L,
+	};
+
+	nanosleep(&ts, NULL);
+}
+
+static void
+wait_until(volatile unsigned int *counter, unsigned int n)
+{
+	uint64_t deadline = now_us() + 1000000;
+
+	while (*counter < n && now_us() < deadline)
+		sleep_us(100);
+	check(*counter >= n, "timed out waiting for page %u", n);
+}
+
+static int
+dnload(uint16_t block, const void *data, uint16_t len)
+{
+	return host_request(0x21, DFU_DNLOAD, block, DFU_INTERFACE, len, (void *)data);
+}
+
+struct status {
+	int ret;
+	uint8_t state;
+	uint32_t timeout;
+	/* microseconds into the page being programmed before and after */
+	uint64_t before;
+	uint64_t after;
+};
+
+static struct status
+getstatus(unsigned int page)
+{
+	struct status s;
+	uint8_t buf[6];
+
+	s.before = now_us() - flash_start[page];
+	s.ret = host_request(0xa1, DFU_GETSTATUS, 0, DFU_INTERFACE, sizeof(buf), buf);
+	s.after = now_us() - flash_start[page];
+	s.state = buf[4];
+	s.timeout = buf[1] | buf[2] << 8 | buf[3] << 16;
+	return s;
+}
+
+/*
+ * dfu.c reports the time left of the page being programmed, rounded
+ * down to whole milliseconds plus one, given the last page took ticks
+ * microseconds. the host only knows roughly when GETSTATUS was
+ * handled and how long the page took, so allow a millisecond of slack
+ * either way.
+ */
+static void
+check_timeout(const struct status *s, uint64_t ticks, const char *what)
+{
+	int64_t lo = ((int64_t)ticks - (int64_t)s->after) / 1000;
+	int64_t hi = ((int64_t)ticks - (int64_t)s->before) / 1000 + 2;
+
+	if (lo < 0)
+		lo = 0;
+	if (hi < 1)
+		hi = 1;
+	check(s->ret == 6 && s->state == dfuDNBUSY,
+			"%s: GETSTATUS returned %d, state %u", what, s->ret, s->state);
+	check((int64_t)s->timeout >= lo && (int64_t)s->timeout <= hi,
+			"%s: bwPollTimeout = %u, expected %lld to %lld",
+			what, s->timeout, (long long)lo, (long long)hi);
+}
+
+static void
+test_poll_timeout(void)
+{
+	static uint8_t image[PAGES * PAGE_SIZE];
+	struct host_device dev;
+	struct status s;
+	uint64_t held;
+	int ret;
+
+	ret = host_enumerate(&dev);
+	check(ret == 0, "enumeration failed: %d", ret);
+	test_fill(image, sizeof(image));
+
+	/* the first page is programmed while the host sends the second */
+	ret = dnload(0, &image[0], PAGE_SIZE);
+	check(ret == PAGE_SIZE, "DNLOAD of page 0: %d", ret);
+	wait_until(&flash_started, 1);
+	s = getstatus(0);
+	check(s.ret == 6 && s.state == dfuDNLOAD_IDLE && s.timeout == 0,
+			"page 0: GETSTATUS returned %d, state %u, bwPollTimeout %u",
+			s.ret, s.state, s.timeout);
+
+	/* with both buffers full the estimate is the 60ms default */
+	ret = dnload(1, &image[PAGE_SIZE], PAGE_SIZE);
+	check(ret == PAGE_SIZE, "DNLOAD of page 1: %d", ret);
+	s = getstatus(0);
+	check_timeout(&s, 60000, "default estimate");
+
+	/* let page 0 take 20ms, and the estimate is what it took */
+	while (now_us() - flash_start[0] < 20000)
+		sleep_us(100);
+	flash_release = 1;
+	wait_until(&flash_started, 2);
+	held = flash_end[0] - flash_start[0];
+	s = getstatus(1);
+	check(s.ret == 6 && s.state == dfuDNLOAD_IDLE && s.timeout == 0,
+			"page 1: GETSTATUS returned %d, state %u, bwPollTimeout %u",
+			s.ret, s.state, s.timeout);
+	ret = dnload(2, &image[2 * PAGE_SIZE], PAGE_SIZE);
+	check(ret == PAGE_SIZE, "DNLOAD of page 2: %d", ret);
+	s = getstatus(1);
+	check_timeout(&s, held, "measured estimate");
+
+	/* a page taking longer than the estimate asks for 1ms at a time */
+	while (now_us() - flash_start[1] < held + 5000)
+		sleep_us(100);
+	s = getstatus(1);
+	check(s.ret == 6 && s.state == dfuDNBUSY && s.timeout == 1,
+			"overdue page: GETSTATUS returned %d, state %u, bwPollTimeout %u",
+			s.ret, s.state, s.timeout);
+
+	/* once everything is programmed the download is idle again */
+	flash_release = PAGES;
+	wait_until(&flash_done, PAGES);
+	s = getstatus(2);
+	check(s.ret == 6 && s.state == dfuDNLOAD_IDLE && s.timeout == 0,
+			"after programming: GETSTATUS returned %d, state %u, bwPollTimeout %u",
+			s.ret, s.state, s.timeout);
+
+	ret = dnload(3, NULL, 0);
+	check(ret == 0, "final DNLOAD: %d", ret);
+	for (unsigned int i = 0; i < 100; i++) {
+		s = getstatus(2);
+		if (s.ret != 6 || s.state == dfuIDLE)
+			break;
+		sleep_us(s.timeout * 1000);
+	}
+	check(s.ret == 6 && s.state == dfuIDLE,
+			"manifestation: GETSTATUS returned %d, state %u", s.ret, s.state);
+	check(memcmp(flash, image, sizeof(image)) == 0, "flash differs from the image");
+}
+
+int main(void)
+{
+	/* dfu_poll() checks the flash size */
+	struct gd32vf103_info *info = mmap((void *)(INFO_BASE & ~0xfffUL), 0x1000,
+			PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+
+	if (info != (void *)(INFO_BASE & ~0xfffUL)) {
+		perror("dfu: mmap");
+		return EXIT_FAILURE;
+	}
+	*(uint16_t *)&INFO->FLASH = 128;
+
+	sim_start(device);
+	test_poll_timeout();
+
+	check(sim_errors() == 0, "%u simulator errors", sim_errors());
+	return test_done("dfu");
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+/*
+ * Host test for the decimal and hex conversions in vfprintf, compared
+ * against the host C library through snprintf. Built once as fmt with
+ * the 32-bit conversions and once as fmt-ll with PRINTF_LL.
+ *
+ * Values are every power of ten and its neighbours, the limits of
+ * each type, and random values of random magnitude. Widths are only
+ * used on non-negative values, as the sign is written before the
+ * padding rather than after it like the C library does.
+ */
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "test.h"
+
+/* truncation is tested on purpose */
+#pragma GCC diagnostic ignored "-Wformat-truncation"
+
+int std_snprintf(char *restrict str, size_t size, const char *restrict fmt, ...);
+
+static char want[64];
+static char got[64];
+
+#define compare(fmt, ...) do { \
+	snprintf(want, sizeof(want), fmt, __VA_ARGS__); \
+	std_snprintf(got, sizeof(got), fmt, __VA_ARGS__); \
+	check(strcmp(got, want) == 0, "\"%s\": \"%s\", want \"%s\"", \
+			fmt, got, want); \
+} while (0)
+
+static void
+test_u(unsigned int v)
+{
+	int width = test_rand() % 14;
+
+	compare("%u", v);
+	compare("%x", v);
+	compare("%X", v);
+	compare("[%*u]", width, v);
+	compare("[%0*u]", width, v);
+	compare("[%0*x]", width, v);
+	compare("%d", (int)v);
+	if ((int)v >= 0) {
+		compare("[%*d]", width, (int)v);
+		compare("[%0*d]", width, (int)v);
+	}
+}
+
+#ifdef PRINTF_LL
+static void
+test_llu(unsigned long long v)
+{
+	int width = test_rand() % 24;
+
+	compare("%llu", v);
+	compare("%llx", v);
+	compare("[%*llu]", width, v);
+	compare("[%0*llu]", width, v);
+	compare("%lld", (long long)v);
+	if ((long long)v >= 0)
+		compare("[%0*lld]", width, (long long)v);
+	/* a 32-bit value after a 64-bit one must still find its argument */
+	compare("%llu %u", v, (unsigned int)v);
+}
+#endif
+
+static uint64_t
+random_magnitude(void)
+{
+	uint64_t v = ((uint64_t)test_rand() << 32) | test_rand();
+
+	return v >> (test_rand() % 64);
+}
+
+int main(void)
+{
+	unsigned long long p = 1;
+
+	for (unsigned int i = 0; i < 20; i++, p *= 10) {
+		for (int d = -1; d <= 1; d++) {
+			test_u(p + d);
+#ifdef PRINTF_LL
+			test_llu(p + d);
+			test_llu(-(p + d));
+			/* the 10^9 splits in ulltoa10() */
+			test_llu((p + d) * 1000000000ULL);
+			test_llu((UINT64_C(1) << 32) * 1000000000ULL + (p + d));
+#endif
+		}
+	}
+
+	test_u(0);
+	test_u(INT_MAX);
+	test_u(INT_MIN);
+	test_u(UINT_MAX);
+#ifdef PRINTF_LL
+	test_llu(0);
+	test_llu(UINT32_MAX);
+	test_llu(UINT32_MAX + 1ULL);
+	test_llu(LLONG_MAX);
+	test_llu(LLONG_MIN);
+	test_llu(ULLONG_MAX);
+#endif
+
+	for (unsigned int i = 0; i < 100000; i++) {
+		uint64_t v = random_magnitude();
+
+		test_u(v);
+#ifdef PRINTF_LL
+		test_llu(v);
+#endif
+	}
+
+	compare("%u%%%d%c%s", 42U, -7, 'x', "end");
+
+	/* longer than the buffers here and in vfprintf */
+	compare("%*u%*u", 40, 1U, 40, 2U);
+	check(std_snprintf(got, sizeof(got), "%*u%*u", 40, 1U, 40, 2U) == 80,
+			"truncated length");
+	got[0] = 'x';
+	check(std_snprintf(got, 0, "%u", 1U) == 1 && got[0] == 'x',
+			"zero size");
+
+#ifdef PRINTF_LL
+	return test_done("fmt (PRINTF_LL)");
+#else
+	return test_done("fmt");
+#endif
+}
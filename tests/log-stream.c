@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+/*
+ * The part of the log test that uses the stdio.h of this tree rather
+ * than the host's, so it can hand lib/log.c one of its own streams.
+ * Like the uart and usbacm streams it turns "\n" into "\r\n", which
+ * would break any frame that isn't escaped properly.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "lib/log.h"
+
+size_t log_capture(char *buf, size_t size, bool use_write);
+
+static struct {
+	FILE stream;
+	char *p;
+	char *end;
+	bool seenr;
+	unsigned int done;
+} capture;
+
+static void
+capture_putc(FILE *stream, char c)
+{
+	if (c == '\n' && !capture.seenr && capture.p < capture.end)
+		*capture.p++ = '\r';
+	capture.seenr = (c == '\r');
+	if (capture.p < capture.end)
+		*capture.p++ = c;
+}
+
+static void
+capture_write(FILE *stream, const char *buf, size_t len)
+{
+	for (; len > 0; len--)
+		capture_putc(stream, *buf++);
+}
+
+static int
+capture_done(FILE *stream)
+{
+	capture.done++;
+	return 0;
+}
+
+/*
+ * Flush the log into buf through a stream with or without a write
+ * function and return the number of bytes written. Returns size + 1
+ * if the stream's done function wasn't called exactly once.
+ */
+size_t log_capture(char *buf, size_t size, bool use_write)
+{
+	capture.stream.putc = capture_putc;
+	capture.stream.write = use_write ? capture_write : NULL;
+	capture.stream.done = capture_done;
+	capture.p = buf;
+	capture.end = buf + size;
+	capture.done = 0;
+
+	log_flush(&capture.stream);
+
+	if (capture.done > 1 || (capture.done == 0 && capture.p != buf))
+		return size + 1;
+	return capture.p - buf;
+}
@@ -0,0 +1,367 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+/*
+ * Round trip test for lib/log.c and tools/log-decode.c.
+ *
+ *   build/log build/log-decode build/log
+ *
+ * records log entries, flushes them between plain text and writes the
+ * result to build/log.bin. It also writes build/log.elf, a minimal ELF
+ * file with the format strings in .logstr and a loaded section with
+ * strings for %s. Then it runs the decoder on both and compares its
+ * output with the same records formatted by the host's printf.
+ *
+ * Format string ids are chosen so their varints contain the bytes the
+ * framing escapes, and the arguments are random with those bytes mixed
+ * in. Some bursts are larger than the ring buffer, so records are
+ * dropped too, and dropped records must not show up in the output.
+ */
+#include <elf.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "test.h"
+
+#define LOG_MAXARGS 8
+
+void log_record(uint32_t id, const uint32_t *args, unsigned int n);
+uint32_t log_dropped(void);
+size_t log_capture(char *buf, size_t size, bool use_write);
+
+/*
+ * .logstr lives at address 0, so the offset of a format string is its
+ * id. The varint of 0x1db starts with SLIP_ESC, the one of 0x4c0 with
+ * SLIP_END, and the ones of 0x500 and 0x680 end with '\n' and '\r'.
+ */
+enum {
+	FMT_BOOT,
+	FMT_IRQ,
+	FMT_TEMP,
+	FMT_STRINGS,
+	FMT_EIGHT,
+	FMT_MIXED,
+	FMTS,
+};
+
+static const struct {
+	uint32_t id;
+	unsigned int nargs;
+	const char *fmt;
+} fmts[FMTS] = {
+	[FMT_BOOT]    = { 0x0000, 0, "boot\n" },
+	[FMT_IRQ]     = { 0x0500, 2, "irq %u: status 0x%08x\n" },
+	[FMT_TEMP]    = { 0x0680, 3, "temp %d.%u C, state %c\n" },
+	[FMT_STRINGS] = { 0x01db, 6, "%s: %s %5u|%-5d|%*u\n" },
+	[FMT_EIGHT]   = { 0x04c0, 8, "eight %u %u %u %u %u %u %u %u\n" },
+	[FMT_MIXED]   = { 0x3ffd, 5, "%u %d %x %X %o 100%%\n" },
+};
+
+#define LOGSTR_SIZE 0x4040
+#define RODATA_ADDR 0x08000100U
+
+static const char *const strings[] = { "usb", "reset", "" };
+
+static char logstr[LOGSTR_SIZE];
+static char rodata[64];
+static uint32_t string_addr[3];
+
+static char capture[1 << 20];
+static size_t capture_len;
+static char expect[1 << 20];
+static size_t expect_len;
+static char output[1 << 20];
+
+static void
+expect_printf(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	expect_len += vsnprintf(expect + expect_len,
+			sizeof(expect) - expect_len, fmt, ap);
+	va_end(ap);
+}
+
+static void
+expect_record(unsigned int f, const uint32_t *a)
+{
+	switch (f) {
+	case FMT_BOOT:
+		expect_printf(fmts[f].fmt);
+		break;
+	case FMT_IRQ:
+		expect_printf(fmts[f].fmt, a[0], a[1]);
+		break;
+	case FMT_TEMP:
+		expect_printf(fmts[f].fmt, (int32_t)a[0], a[1], (int)(a[2] & 0xffU));
+		break;
+	case FMT_STRINGS:
+		if (a[1] >= RODATA_ADDR && a[1] < RODATA_ADDR + sizeof(rodata))
+			expect_printf("%s: %s %5u|%-5d|%*u\n",
+					&rodata[a[0] - RODATA_ADDR],
+					&rodata[a[1] - RODATA_ADDR],
+					a[2], (int32_t)a[3], (int32_t)a[4], a[5]);
+		else
+			expect_printf("%s: <0x%08x> %5u|%-5d|%*u\n",
+					&rodata[a[0] - RODATA_ADDR], a[1],
+					a[2], (int32_t)a[3], (int32_t)a[4], a[5]);
+		break;
+	case FMT_EIGHT:
+		expect_printf(fmts[f].fmt, a[0], a[1], a[2], a[3],
+				a[4], a[5], a[6], a[7]);
+		break;
+	case FMT_MIXED:
+		expect_printf(fmts[f].fmt, a[0], (int32_t)a[1], a[2], a[3], a[4]);
+		break;
+	}
+}
+
+/* random values, often made of bytes the framing has to escape */
+static uint32_t
+random_arg(void)
+{
+	static const uint8_t special[] = { 0xc0, 0xdb, 0xdc, 0xdd, '\n', '\r', 0x80, 0x00 };
+	uint32_t v = test_rand();
+
+	if (test_rand() & 1)
+		return v >> (v % 32);
+	for (unsigned int i = 0; i < 4; i++) {
+		if (test_rand() & 1)
+			v = (v & ~(0xffU << 8*i)) |
+				(uint32_t)special[test_rand() % sizeof(special)] << 8*i;
+	}
+	return v;
+}
+
+static void
+random_record(void)
+{
+	unsigned int f = test_rand() % FMTS;
+	uint32_t a[LOG_MAXARGS];
+	uint32_t dropped = log_dropped();
+
+	for (unsigned int i = 0; i < LOG_MAXARGS; i++)
+		a[i] = random_arg();
+
+	switch (f) {
+	case FMT_TEMP:
+		a[2] = 'A' + a[2] % 26;
+		break;
+	case FMT_STRINGS:
+		a[0] = string_addr[test_rand() % 3];
+		/* sometimes a string the decoder can't find */
+		if (test_rand() % 4 == 0)
+			a[1] = 0x20000000U + (test_rand() & 0xffcU);
+		else
+			a[1] = string_addr[test_rand() % 3];
+		a[4] %= 12;
+		break;
+	}
+
+	log_record(fmts[f].id, a, fmts[f].nargs);
+	if (log_dropped() == dropped)
+		expect_record(f, a);
+}
+
+static void
+flush(bool use_write)
+{
+	size_t len = log_capture(capture + capture_len,
+			sizeof(capture) - capture_len, use_write);
+
+	check(len <= sizeof(capture) - capture_len, "log_flush(): done not called once");
+	if (len <= sizeof(capture) - capture_len)
+		capture_len += len;
+}
+
+/* plain text on the same stream, which the decoder passes through */
+static void
+text(const char *s)
+{
+	size_t len = strlen(s);
+
+	for (size_t i = 0; i < len; i++) {
+		if (s[i] == '\n')
+			capture[capture_len++] = '\r';
+		capture[capture_len++] = s[i];
+	}
+	memcpy(expect + expect_len, s, len);
+	expect_len += len;
+}
+
+static int
+write_file(const char *path, const void *data, size_t len)
+{
+	FILE *f = fopen(path, "wb");
+
+	if (f == NULL || fwrite(data, 1, len, f) != len || fclose(f)) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+static const char shstrtab[] = "\0.logstr\0.rodata\0.shstrtab";
+
+struct elf_file {
+	Elf32_Ehdr eh;
+	char logstr[LOGSTR_SIZE];
+	char rodata[sizeof(rodata)];
+	char shstrtab[sizeof(shstrtab)];
+	Elf32_Shdr sh[4];
+} __attribute__((packed, aligned(4)));
+
+static int
+write_elf(const char *path)
+{
+	struct elf_file elf = {
+		.eh = {
+			.e_ident = {
+				ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3,
+				ELFCLASS32, ELFDATA2LSB, EV_CURRENT,
+			},
+			.e_type = ET_EXEC,
+			.e_machine = EM_RISCV,
+			.e_version = EV_CURRENT,
+			.e_shoff = offsetof(struct elf_file, sh),
+			.e_ehsize = sizeof(Elf32_Ehdr),
+			.e_shentsize = sizeof(Elf32_Shdr),
+			.e_shnum = 4,
+			.e_shstrndx = 3,
+		},
+		.sh = {
+			[1] = {
+				.sh_name = 1,
+				.sh_type = SHT_PROGBITS,
+				.sh_offset = offsetof(struct elf_file, logstr),
+				.sh_size = LOGSTR_SIZE,
+			},
+			[2] = {
+				.sh_name = 9,
+				.sh_type = SHT_PROGBITS,
+				.sh_flags = SHF_ALLOC,
+				.sh_addr = RODATA_ADDR,
+				.sh_offset = offsetof(struct elf_file, rodata),
+				.sh_size = sizeof(rodata),
+			},
+			[3] = {
+				.sh_name = 17,
+				.sh_type = SHT_STRTAB,
+				.sh_offset = offsetof(struct elf_file, shstrtab),
+				.sh_size = sizeof(shstrtab),
+			},
+		},
+	};
+
+	memcpy(elf.logstr, logstr, sizeof(logstr));
+	memcpy(elf.rodata, rodata, sizeof(rodata));
+	memcpy(elf.shstrtab, shstrtab, sizeof(shstrtab));
+	return write_file(path, &elf, sizeof(elf));
+}
+
+int main(int argc, char *argv[])
+{
+	char elf_path[256];
+	char bin_path[256];
+	char cmd[1024];
+	size_t output_len;
+	uint32_t unknown[1] = { 1 };
+	size_t pos = 0;
+	FILE *f;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <log-decode> <output prefix>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	snprintf(elf_path, sizeof(elf_path), "%s.elf", argv[2]);
+	snprintf(bin_path, sizeof(bin_path), "%s.bin", argv[2]);
+
+	for (unsigned int i = 0; i < FMTS; i++)
+		strcpy(&logstr[fmts[i].id], fmts[i].fmt);
+	for (unsigned int i = 0; i < 3; i++) {
+		string_addr[i] = RODATA_ADDR + pos;
+		strcpy(&rodata[pos], strings[i]);
+		pos += strlen(strings[i]) + 1;
+	}
+
+	/* nothing logged yet, so nothing is written */
+	flush(true);
+	check(capture_len == 0, "empty flush wrote %zu bytes", capture_len);
+
+	text("plain text before any record\n");
+	log_record(fmts[FMT_BOOT].id, NULL, 0);
+	expect_record(FMT_BOOT, NULL);
+	flush(false);
+
+	/* an id outside .logstr */
+	log_record(LOGSTR_SIZE + 0x123, unknown, 1);
+	expect_printf("<unknown log record 0x%08x>\n", LOGSTR_SIZE + 0x123);
+	flush(true);
+
+	for (unsigned int round = 0; round < 400; round++) {
+		/* every 10th burst overflows the 1k ring */
+		unsigned int n = (round % 10 == 9) ? 200 : test_rand() % 16;
+
+		for (unsigned int i = 0; i < n; i++)
+			random_record();
+		flush(round & 1);
+		if (round % 3 == 0)
+			text("some text between frames\n");
+	}
+	check(log_dropped() > 0, "no records were dropped");
+
+	if (write_elf(elf_path) || write_file(bin_path, capture, capture_len))
+		return EXIT_FAILURE;
+
+	snprintf(cmd, sizeof(cmd), "%s %s %s", argv[1], elf_path, bin_path);
+	f = popen(cmd, "r");
+	if (f == NULL) {
+		perror(cmd);
+		return EXIT_FAILURE;
+	}
+	output_len = fread(output, 1, sizeof(output), f);
+	check(pclose(f) == 0, "%s failed", cmd);
+
+	check(output_len == expect_len, "decoded %zu bytes, want %zu",
+			output_len, expect_len);
+	for (size_t i = 0; i < output_len && i < expect_len; i++) {
+		if (output[i] != expect[i]) {
+			size_t line = i;
+
+			while (line > 0 && expect[line - 1] != '\n')
+				line--;
+			check(false, "output differs at byte %zu:\n  %.60s\nwant\n  %.60s",
+					i, &output[line], &expect[line]);
+			break;
+		}
+	}
+
+	return test_done("log");
+}
@@ -0,0 +1,358 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+/*
+ * Round trip test for the compressed DFU images.
+ *
+ *   build/lz build/dfu-pack build/lz
+ *
+ * packs images of different kinds with tools/dfu-pack, both compressed
+ * and with -r, and decodes the result again with the bootloader's
+ * lz_decode(). The input arrives in chunks of random size and the
+ * output space is random too, so every state of the decoder gets to
+ * stop and resume. The decoded image must be the input with the
+ * length word, padding and trailer that dfu-pack adds.
+ *
+ * Corrupt and truncated streams must not decode to a full image, and
+ * random garbage must never make the decoder read past its input or
+ * write more than it was given room for.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+#include "crc32.h"
+
+#include "test.h"
+
+/* the image layout from examples/dfu-bootloader/image.h */
+#define IMAGE_MAGIC       0x4d494447U /* "GDIM" */
+#define IMAGE_LENGTH_WORD 4
+#define TRANSFERSIZE      1024U
+
+#define MAXIMAGE (160U << 10)
+
+static uint8_t image[MAXIMAGE];
+static uint8_t expect[MAXIMAGE + 16];
+static size_t expect_len;
+static uint8_t packed[2*MAXIMAGE];
+static size_t packed_len;
+static uint8_t decoded[MAXIMAGE + 16];
+
+static const char *dfu_pack;
+static char bin_path[256];
+static char dfz_path[256];
+
+static void
+put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/* what dfu-pack should turn image into before compressing it */
+static void
+make_expect(size_t size)
+{
+	uint32_t crc = 0xffffffffU;
+
+	memcpy(expect, image, size);
+	while (size % 4)
+		expect[size++] = 0xff;
+	put_le32(&expect[4*IMAGE_LENGTH_WORD], size);
+	for (size_t i = 0; i < size; i += 4) {
+		uint32_t word = expect[i] | expect[i + 1] << 8 |
+			expect[i + 2] << 16 | (uint32_t)expect[i + 3] << 24;
+
+		crc = crc32_update(crc, &word, 1);
+	}
+	put_le32(&expect[size], size);
+	put_le32(&expect[size + 4], crc);
+	put_le32(&expect[size + 8], IMAGE_MAGIC);
+	expect_len = size + 12;
+}
+
+static int
+run_pack(const char *name, size_t size, bool raw)
+{
+	char cmd[1024];
+	FILE *f;
+
+	f = fopen(bin_path, "wb");
+	if (f == NULL || fwrite(image, 1, size, f) != size || fclose(f)) {
+		perror(bin_path);
+		exit(EXIT_FAILURE);
+	}
+	snprintf(cmd, sizeof(cmd), "%s %s%s %s >/dev/null",
+			dfu_pack, raw ? "-r " : "", bin_path, dfz_path);
+	if (system(cmd) != 0) {
+		check(false, "%s: %s failed", name, cmd);
+		return -1;
+	}
+	f = fopen(dfz_path, "rb");
+	if (f == NULL) {
+		perror(dfz_path);
+		exit(EXIT_FAILURE);
+	}
+	packed_len = fread(packed, 1, sizeof(packed), f);
+	fclose(f);
+	return 0;
+}
+
+/*
+ * Decode packed into decoded through an LZ_RING sized ring, with
+ * input chunks of 1 to maxin bytes and room for 1 to maxout bytes in
+ * each call. Anything up to LZ_WINDOW bytes of room keeps the window
+ * of earlier output intact in the ring. Returns the decoded length
+ * or -1 if the decoder failed.
+ */
+static long
+decode(const uint8_t *in, size_t len, uint32_t size,
+		unsigned int maxin, unsigned int maxout)
+{
+	static uint8_t ring[LZ_RING];
+	const uint8_t *p = in;
+	const uint8_t *end = in + len;
+	unsigned int pos = 0;
+	struct lz z;
+
+	lz_init(&z, size);
+	while (z.done < z.size) {
+		const uint8_t *tend = p + 1 + test_rand() % maxin;
+		unsigned int space = 1 + test_rand() % maxout;
+		const uint8_t *start = p;
+		int n;
+
+		if (tend > end)
+			tend = end;
+		n = lz_decode(&z, &p, tend, ring, pos % LZ_RING, space);
+		if (n < 0)
+			return -1;
+		check((unsigned int)n <= space, "wrote %d bytes into %u", n, space);
+		check(p >= start && p <= tend, "input pointer moved to %td",
+				p - start);
+		for (int i = 0; i < n; i++)
+			decoded[pos + i] = ring[(pos + i) % LZ_RING];
+		pos += n;
+		/* out of input */
+		if (p == end && n == 0 && start == p)
+			break;
+	}
+	check(z.done == pos, "done %u, but %u bytes written", z.done, pos);
+	return pos;
+}
+
+static void
+test_image(const char *name, size_t size)
+{
+	static const unsigned int chunks[][2] = {
+		{ TRANSFERSIZE, LZ_WINDOW },
+		{ 1, 1 },
+		{ 7, 3 },
+		{ 64, 1000 },
+		{ 3*TRANSFERSIZE, LZ_WINDOW },
+	};
+	uint32_t usize;
+
+	/* the reserved vector table entry must be free */
+	memset(&image[4*IMAGE_LENGTH_WORD], 0, 4);
+	make_expect(size);
+
+	if (run_pack(name, size, true) == 0) {
+		check(packed_len == expect_len &&
+				memcmp(packed, expect, expect_len) == 0,
+				"%s: raw image differs", name);
+	}
+
+	if (run_pack(name, size, false))
+		return;
+	check(packed_len >= LZ_HEADER && memcmp(packed, "GDZ1", 4) == 0,
+			"%s: no GDZ1 header", name);
+	usize = packed[4] | packed[5] << 8 | packed[6] << 16 |
+		(uint32_t)packed[7] << 24;
+	check(usize == expect_len, "%s: header size %u, want %zu",
+			name, usize, expect_len);
+
+	for (unsigned int i = 0; i < sizeof(chunks)/sizeof(chunks[0]); i++) {
+		long n = decode(packed + LZ_HEADER, packed_len - LZ_HEADER,
+				usize, chunks[i][0], chunks[i][1]);
+
+		check(n == (long)expect_len &&
+				memcmp(decoded, expect, expect_len) == 0,
+				"%s: decoded %ld bytes with chunks %u/%u, want %zu",
+				name, n, chunks[i][0], chunks[i][1], expect_len);
+	}
+
+	/* any truncation must leave the image incomplete */
+	for (size_t len = 0; len < packed_len - LZ_HEADER;
+			len += 1 + (packed_len > 4096) * test_rand() % 64) {
+		long n = decode(packed + LZ_HEADER, len, usize, 256, LZ_WINDOW);
+
+		check(n < (long)expect_len, "%s: truncated to %zu bytes decoded",
+				name, len);
+	}
+}
+
+/* random text made of a small vocabulary, like strings in firmware */
+static void
+fill_words(uint8_t *p, size_t size)
+{
+	static const char *const words[] = {
+		"usb ", "reset ", "GD32VF103 ", "\n", "0x", "error: ",
+		"printf ", "DFU ", "bootloader ", "page ", "%u ",
+	};
+
+	while (size > 0) {
+		const char *w = words[test_rand() % (sizeof(words)/sizeof(words[0]))];
+		size_t n = strlen(w);
+
+		if (n > size)
+			n = size;
+		memcpy(p, w, n);
+		p += n;
+		size -= n;
+	}
+}
+
+static void
+test_images(void)
+{
+	size_t n;
+
+	test_fill(image, 4001);
+	test_image("random", 4001);
+
+	test_fill(image, 20);
+	test_image("smallest", 20);
+
+	memset(image, 0, 70001);
+	test_image("zeros", 70001);
+
+	memset(image, 0xff, 131072);
+	test_image("erased", 131072);
+
+	/* repeats exactly at and just beyond the window */
+	test_fill(image, LZ_WINDOW);
+	for (size_t i = LZ_WINDOW; i < 9000; i++)
+		image[i] = image[i - LZ_WINDOW];
+	test_image("period 1024", 9000);
+	test_fill(image, LZ_WINDOW + 1);
+	for (size_t i = LZ_WINDOW + 1; i < 9000; i++)
+		image[i] = image[i - LZ_WINDOW - 1];
+	test_image("period 1025", 9000);
+
+	fill_words(image, 30000);
+	test_image("words", 30000);
+
+	/*
+	 * literal runs and matches around the lengths where the token
+	 * nibble saturates and extra length bytes start
+	 */
+	n = 0;
+	for (unsigned int i = 0; i < 40 && n < MAXIMAGE - 600; i++) {
+		static const unsigned int lens[] = {
+			1, 4, 14, 15, 16, 18, 19, 20, 269, 270, 271, 273, 274, 525,
+		};
+		unsigned int lit = lens[test_rand() % 14];
+		unsigned int match = lens[test_rand() % 14];
+
+		test_fill(&image[n], lit);
+		n += lit;
+		for (unsigned int j = 0; j < match; j++, n++)
+			image[n] = image[n - lit];
+	}
+	test_image("lengths", n);
+}
+
+static size_t
+put_len(uint8_t *buf, size_t len, size_t n)
+{
+	for (; n >= 255; n -= 255)
+		buf[len++] = 255;
+	buf[len++] = n;
+	return len;
+}
+
+static void
+test_corrupt(void)
+{
+	/* no literals and a match at distance 0 */
+	static const uint8_t dist0[] = { 0x00, 0x00, 0x00 };
+	/* one literal and a match at distance 2 */
+	static const uint8_t before[] = { 0x10, 'a', 0x02, 0x00 };
+	static uint8_t far[2*LZ_WINDOW];
+	uint8_t *g = test_guarded(1);
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+	size_t len = 0;
+
+	check(decode(dist0, sizeof(dist0), 100, 64, 64) < 0,
+			"distance 0 accepted");
+	check(decode(before, sizeof(before), 100, 64, 64) < 0,
+			"distance before the start accepted");
+
+	/* 1100 literals, then a match just beyond the window */
+	far[len++] = 0xf0;
+	len = put_len(far, len, 1100 - 15);
+	test_fill(&far[len], 1100);
+	len += 1100;
+	far[len++] = (LZ_WINDOW + 1) & 0xff;
+	far[len++] = (LZ_WINDOW + 1) >> 8;
+	check(decode(far, len, 2000, 64, LZ_WINDOW) < 0,
+			"distance beyond the window accepted");
+	far[len - 2] = LZ_WINDOW & 0xff;
+	far[len - 1] = LZ_WINDOW >> 8;
+	check(decode(far, len, 1104, 64, LZ_WINDOW) == 1104,
+			"distance of the whole window rejected");
+
+	/* garbage right before a guard page */
+	for (unsigned int i = 0; i < 200000; i++) {
+		size_t n = 1 + test_rand() % 64;
+		uint8_t *p = g + pagesize - n;
+
+		test_fill(p, n);
+		decode(p, n, test_rand() % 4096, 1 + test_rand() % 16,
+				1 + test_rand() % LZ_WINDOW);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <dfu-pack> <output prefix>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	dfu_pack = argv[1];
+	snprintf(bin_path, sizeof(bin_path), "%s.bin", argv[2]);
+	snprintf(dfz_path, sizeof(dfz_path), "%s.dfz", argv[2]);
+
+	test_images();
+	test_corrupt();
+
+	return test_done("lz");
+}
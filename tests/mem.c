@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+/*
+ * Host test for memcpy, memmove, memset and memcmp from lib/std.c.
+ *
+ * Every source and destination alignment within two words and every
+ * length up to MAXLEN is compared against the host C library, with
+ * the bytes around the destination checked too. The same copies are
+ * then done with the buffers right next to guard pages, so reading
+ * or writing past either end faults.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "test.h"
+
+void *std_memcpy(void *dest, const void *src, size_t n);
+void *std_memmove(void *dest, const void *src, size_t n);
+void *std_memset(void *s, int c, size_t n);
+int std_memcmp(const void *s1, const void *s2, size_t n);
+
+#define MAXLEN 300
+#define EDGE   16
+#define AREA   (EDGE + 8 + MAXLEN + EDGE)
+
+static unsigned char src[AREA];
+static unsigned char dst[AREA];
+static unsigned char ref[AREA];
+
+static void
+test_memcpy(unsigned int da, unsigned int sa, unsigned int len)
+{
+	void *ret;
+
+	test_fill(src, sizeof(src));
+	test_fill(dst, sizeof(dst));
+	memcpy(ref, dst, sizeof(ref));
+	memcpy(ref + EDGE + da, src + EDGE + sa, len);
+
+	ret = std_memcpy(dst + EDGE + da, src + EDGE + sa, len);
+	check(ret == dst + EDGE + da, "memcpy returned %p", ret);
+	check(memcmp(dst, ref, sizeof(dst)) == 0,
+			"memcpy da=%u sa=%u len=%u", da, sa, len);
+}
+
+static void
+test_memmove(unsigned int sa, int delta, unsigned int len)
+{
+	unsigned int s = EDGE + 24 + sa;
+	unsigned int d = s + delta;
+	static unsigned char buf[AREA + 48];
+	static unsigned char want[AREA + 48];
+	void *ret;
+
+	test_fill(buf, sizeof(buf));
+	memcpy(want, buf, sizeof(want));
+	memmove(want + d, want + s, len);
+
+	ret = std_memmove(buf + d, buf + s, len);
+	check(ret == buf + d, "memmove returned %p", ret);
+	check(memcmp(buf, want, sizeof(buf)) == 0,
+			"memmove sa=%u delta=%d len=%u", sa, delta, len);
+}
+
+static void
+test_memset(unsigned int da, int c, unsigned int len)
+{
+	void *ret;
+
+	test_fill(dst, sizeof(dst));
+	memcpy(ref, dst, sizeof(ref));
+	memset(ref + EDGE + da, c, len);
+
+	ret = std_memset(dst + EDGE + da, c, len);
+	check(ret == dst + EDGE + da, "memset returned %p", ret);
+	check(memcmp(dst, ref, sizeof(dst)) == 0,
+			"memset da=%u c=%d len=%u", da, c, len);
+}
+
+static int
+sign(int v)
+{
+	return (v > 0) - (v < 0);
+}
+
+static void
+test_memcmp(unsigned int a1, unsigned int a2, unsigned int len)
+{
+	unsigned char *p1 = src + EDGE + a1;
+	unsigned char *p2 = dst + EDGE + a2;
+	int want, got;
+
+	test_fill(p1, len);
+	memcpy(p2, p1, len);
+	if (len > 0 && (test_rand() & 1))
+		p2[test_rand() % len] ^= 1 + test_rand() % 255;
+
+	want = sign(memcmp(p1, p2, len));
+	got = sign(std_memcmp(p1, p2, len));
+	check(got == want, "memcmp a1=%u a2=%u len=%u: %d, want %d",
+			a1, a2, len, got, want);
+}
+
+/*
+ * Source and destination at the very start and end of pages with
+ * guard pages around them. Only the result is checked, the point is
+ * that nothing faults.
+ */
+static void
+test_guards(void)
+{
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+	unsigned char *a = test_guarded(1);
+	unsigned char *b = test_guarded(1);
+	unsigned char *aend = a + pagesize;
+	unsigned char *bend = b + pagesize;
+
+	test_fill(a, pagesize);
+	for (unsigned int len = 0; len <= MAXLEN; len++) {
+		for (unsigned int off = 0; off < 8; off++) {
+			/* source ends at the guard page */
+			std_memcpy(b + off, aend - len, len);
+			check(memcmp(b + off, aend - len, len) == 0,
+					"memcpy from page end len=%u", len);
+			/* destination ends at the guard page */
+			std_memcpy(bend - len, a + off, len);
+			check(memcmp(bend - len, a + off, len) == 0,
+					"memcpy to page end len=%u", len);
+			std_memset(bend - len, off, len);
+			std_memset(b + off, off, len);
+		}
+
+		/* source and destination start at the guard page */
+		std_memcpy(b, a, len);
+		check(memcmp(b, a, len) == 0, "memcpy at page start len=%u", len);
+
+		/* backwards copies, overlapping and not */
+		memcpy(b, a, pagesize);
+		for (unsigned int delta = 1; delta < 8 && len + delta <= pagesize; delta++) {
+			std_memmove(b + delta, b, len);
+			check(memcmp(b + delta, a, len) == 0,
+					"memmove up from page start len=%u", len);
+			memcpy(b, a, pagesize);
+			std_memmove(bend - len, bend - len - delta, len);
+			check(memcmp(bend - len, a + pagesize - len - delta, len) == 0,
+					"memmove up to page end len=%u", len);
+			memcpy(b, a, pagesize);
+		}
+	}
+}
+
+int main(void)
+{
+	for (unsigned int da = 0; da < 8; da++) {
+		for (unsigned int sa = 0; sa < 8; sa++) {
+			for (unsigned int len = 0; len <= MAXLEN; len++) {
+				test_memcpy(da, sa, len);
+				test_memcmp(da, sa, len);
+			}
+		}
+	}
+
+	for (unsigned int sa = 0; sa < 8; sa++) {
+		for (int delta = -24; delta <= 24; delta++) {
+			for (unsigned int len = 0; len <= MAXLEN; len++)
+				test_memmove(sa, delta, len);
+		}
+	}
+
+	for (unsigned int da = 0; da < 8; da++) {
+		for (unsigned int len = 0; len <= MAXLEN; len++) {
+			test_memset(da, 0, len);
+			test_memset(da, 0xa5, len);
+			test_memset(da, (int)test_rand(), len);
+		}
+	}
+
+	test_guards();
+
+	return test_done("mem");
+}
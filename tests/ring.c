@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+/*
+ * Stress test for the single producer, single consumer ring in
+ * include/lib/ring.h. A producer and a consumer thread move a
+ * pseudo-random byte stream through rings of a few sizes, each side
+ * picking one of the byte, block and span calls at random with random
+ * lengths, and the consumer checks every byte it gets. The counters
+ * start just below 2^32, so they wrap early in every run.
+ *
+ * Also built as ring-tsan with -fsanitize=thread, which reports any
+ * buffer access the acquire/release pairs in ring.h don't order.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lib/ring.h"
+
+#include "test.h"
+
+#ifndef TOTAL
+#define TOTAL (16U << 20)
+#endif
+
+static RING(16) ring16;
+static RING(256) ring256;
+static RING(4096) ring4096;
+
+struct stream {
+	struct ring *r;
+	char *buf;
+	uint32_t size;
+	unsigned long errors;
+	unsigned long spins;
+};
+
+/* byte i of the stream */
+static inline char
+stream_byte(uint32_t i)
+{
+	return (i * 2654435761U) >> 24;
+}
+
+/* a private xorshift32 per thread, test_rand() isn't thread safe */
+static inline uint32_t
+thread_rand(uint32_t *x)
+{
+	*x ^= *x << 13;
+	*x ^= *x >> 17;
+	*x ^= *x << 5;
+	return *x;
+}
+
+static void *
+producer(void *arg)
+{
+	struct stream *s = arg;
+	uint32_t seed = 0x12345678U;
+	uint32_t i = 0;
+	char block[64];
+
+	while (i < TOTAL) {
+		uint32_t r = thread_rand(&seed);
+		uint32_t len = 1 + (r >> 8) % sizeof(block);
+		uint32_t n;
+		char *p;
+
+		if (len > TOTAL - i)
+			len = TOTAL - i;
+
+		switch (r % 3) {
+		case 0:
+			n = ring__push(s->r, s->buf, s->size, stream_byte(i));
+			break;
+		case 1:
+			for (uint32_t j = 0; j < len; j++)
+				block[j] = stream_byte(i + j);
+			n = ring__push_n(s->r, s->buf, s->size, block, len);
+			break;
+		default:
+			p = ring__push_span(s->r, s->buf, s->size, &n);
+			if (n > len)
+				n = len;
+			for (uint32_t j = 0; j < n; j++)
+				p[j] = stream_byte(i + j);
+			ring__push_commit(s->r, n);
+			break;
+		}
+		i += n;
+		if (n == 0) {
+			s->spins++;
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+static void *
+consumer(void *arg)
+{
+	struct stream *s = arg;
+	uint32_t seed = 0x87654321U;
+	uint32_t i = 0;
+	char block[64];
+
+	while (i < TOTAL) {
+		uint32_t r = thread_rand(&seed);
+		uint32_t len = 1 + (r >> 8) % sizeof(block);
+		uint32_t n;
+		const char *p;
+		int c;
+
+		switch (r % 3) {
+		case 0:
+			c = ring__pop(s->r, s->buf, s->size);
+			n = 0;
+			if (c >= 0) {
+				if ((char)c != stream_byte(i))
+					s->errors++;
+				n = 1;
+			}
+			break;
+		case 1:
+			n = ring__pop_n(s->r, s->buf, s->size, block, len);
+			for (uint32_t j = 0; j < n; j++) {
+				if (block[j] != stream_byte(i + j))
+					s->errors++;
+			}
+			break;
+		default:
+			p = ring__pop_span(s->r, s->buf, s->size, &n);
+			if (n > len)
+				n = len;
+			for (uint32_t j = 0; j < n; j++) {
+				if (p[j] != stream_byte(i + j))
+					s->errors++;
+			}
+			ring__pop_commit(s->r, n);
+			break;
+		}
+		i += n;
+		if (n == 0)
+			sched_yield();
+	}
+	return NULL;
+}
+
+static void
+test_threads(const char *name, struct ring *r, char *buf, uint32_t size)
+{
+	struct stream s = { .r = r, .buf = buf, .size = size };
+	pthread_t p, c;
+
+	r->head = r->tail = UINT32_MAX - 1000;
+	r->hiwat = 0;
+
+	pthread_create(&c, NULL, consumer, &s);
+	pthread_create(&p, NULL, producer, &s);
+	pthread_join(p, NULL);
+	pthread_join(c, NULL);
+
+	check(s.errors == 0, "%s: %lu bytes out of order", name, s.errors);
+	check(r->head == r->tail, "%s: ring not empty", name);
+	check(r->head == UINT32_MAX - 1000 + TOTAL, "%s: head %u", name, r->head);
+	check(r->hiwat <= size, "%s: hiwat %u", name, r->hiwat);
+	/* the producer ran into a full ring at some point */
+	check(size > 16 || s.spins > 0, "%s: never full", name);
+}
+
+/* the edge cases, from a single thread */
+static void
+test_limits(void)
+{
+	char out[32];
+	uint32_t len;
+
+	ring16.r.head = ring16.r.tail = UINT32_MAX - 4;
+	ring16.r.hiwat = 0;
+
+	check(ring_pop(&ring16) == -1, "pop from empty ring");
+	check(ring_pop_n(&ring16, out, sizeof(out)) == 0, "pop_n from empty ring");
+	ring_pop_span(&ring16, &len);
+	check(len == 0, "pop_span of empty ring is %u", len);
+	check(ring_free(&ring16) == 16, "free %u", ring_free(&ring16));
+
+	/* fill it across the wrap of both the buffer and the counter */
+	check(ring_push_n(&ring16, "0123456789abcdefXYZ", 19) == 16, "push_n to full");
+	check(ring_used(&ring16) == 16 && ring_free(&ring16) == 0,
+			"used %u free %u", ring_used(&ring16), ring_free(&ring16));
+	check(!ring_push(&ring16, 'x'), "push to full ring");
+	ring_push_span(&ring16, &len);
+	check(len == 0, "push_span of full ring is %u", len);
+	check(ring_hiwat(&ring16) == 16, "hiwat %u", ring_hiwat(&ring16));
+
+	/* the span stops at the end of the buffer */
+	ring_pop_span(&ring16, &len);
+	check(len == 5, "pop_span before the buffer end is %u", len);
+	check(ring_pop(&ring16) == '0', "pop");
+	check(ring_pop_n(&ring16, out, sizeof(out)) == 15 &&
+			memcmp(out, "123456789abcdef", 15) == 0, "pop_n");
+	check(ring_used(&ring16) == 0, "used %u", ring_used(&ring16));
+}
+
+/*
+ * The circular rx DMA of the usarts commits without checking for
+ * room, so the consumer may find more than a full ring. pop_n must
+ * still never read outside the buffer, which sits right in front of
+ * a guard page here.
+ */
+static void
+test_lapped(void)
+{
+	static struct ring r;
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+	char *buf = (char *)test_guarded(1) + pagesize - 16;
+	char out[64];
+
+	memset(buf, 'a', 16);
+	r.head = r.tail = UINT32_MAX - 4;
+	ring__push_commit(&r, 24);
+	check(ring__used(&r) == 24, "used %u", ring__used(&r));
+	check(ring__pop_n(&r, buf, 16, out, sizeof(out)) == 16,
+			"pop_n from a lapped ring");
+	check(ring__used(&r) == 8, "used %u after pop_n", ring__used(&r));
+	check(ring__pop_n(&r, buf, 16, out, sizeof(out)) == 8,
+			"pop_n of the rest");
+}
+
+int main(void)
+{
+	test_limits();
+	test_lapped();
+	test_threads("RING(16)", &ring16.r, ring16.buf, sizeof(ring16.buf));
+	test_threads("RING(256)", &ring256.r, ring256.buf, sizeof(ring256.buf));
+	test_threads("RING(4096)", &ring4096.r, ring4096.buf, sizeof(ring4096.buf));
+
+	return test_done("ring");
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+/*
+ * Included first when building lib/std.c for the host tests, so its
+ * functions get names of their own instead of replacing the ones in
+ * the host C library. The tests declare the ones they call.
+ */
+#define memcmp    std_memcmp
+#define memset    std_memset
+#define memcpy    std_memcpy
+#define memmove   std_memmove
+#define memchr    std_memchr
+#define memrchr   std_memrchr
+#define rawmemchr std_rawmemchr
+#define strlen    std_strlen
+#define strnlen   std_strnlen
+#define strcmp    std_strcmp
+#define strncmp   std_strncmp
+#define strcpy    std_strcpy
+#define strncpy   std_strncpy
+#define stpcpy    std_stpcpy
+#define stpncpy   std_stpncpy
+#define strcat    std_strcat
+#define strncat   std_strncat
+#define strchr    std_strchr
+#define strrchr   std_strrchr
+#define fputc     std_fputc
+#define fputs     std_fputs
+#define putchar   std_putchar
+#define puts      std_puts
+#define fprintf   std_fprintf
+#define vfprintf  std_vfprintf
+#define printf    std_printf
+#define vprintf   std_vprintf
+#define sprintf   std_sprintf
+#define vsprintf  std_vsprintf
+#define snprintf  std_snprintf
+#define vsnprintf std_vsnprintf
+#define stdout    std_stdout
+#define stderr    std_stderr
@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+/*
+ * Host test for the string scanning functions in lib/std.c, built
+ * once with the byte at a time versions and once with STRING_SWAR,
+ * and compared against the host C library in both cases.
+ *
+ * Strings are random non-zero bytes, mostly 0x01, 0x80 and 0xff which
+ * look most like zero to the word tricks, at every alignment within
+ * two words and every length up to MAXLEN. The same calls are then
+ * made with the strings right before or after a guard page, so a
+ * version reading past the end of a buffer faults.
+ */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+
+#include "test.h"
+
+void *std_memchr(const void *s, int c, size_t n);
+void *std_memrchr(const void *s, int c, size_t n);
+void *std_rawmemchr(const void *s, int c);
+size_t std_strlen(const char *s);
+size_t std_strnlen(const char *s, size_t maxlen);
+int std_strcmp(const char *s1, const char *s2);
+int std_strncmp(const char *s1, const char *s2, size_t n);
+char *std_strchr(const char *s, int c);
+char *std_strrchr(const char *s, int c);
+
+#define MAXLEN 130
+
+static char buf1[MAXLEN + 64];
+static char buf2[MAXLEN + 64];
+
+static unsigned char
+random_byte(void)
+{
+	static const unsigned char tricky[] = { 0x01, 0x80, 0xff, 0x7f, 0xfe };
+	uint32_t r = test_rand();
+
+	if (r & 1)
+		return tricky[(r >> 1) % sizeof(tricky)];
+	return 1 + (r >> 8) % 255;
+}
+
+/* fill buf with a string of len bytes followed by garbage */
+static char *
+random_string(char *buf, size_t size, unsigned int align, size_t len)
+{
+	char *s = buf + align;
+
+	for (size_t i = 0; i < size; i++)
+		buf[i] = test_rand();
+	for (size_t i = 0; i < len; i++)
+		s[i] = random_byte();
+	s[len] = '\0';
+	return s;
+}
+
+static int
+sign(int v)
+{
+	return (v > 0) - (v < 0);
+}
+
+static void
+test_scan(const char *s, size_t len)
+{
+	size_t n = len ? test_rand() % (len + 1) : 0;
+	int c = len ? (unsigned char)s[test_rand() % len] : 0x01;
+	int absent = 0;
+
+	/* find a byte not in the string, if there is one */
+	for (int i = 1; i < 256 && absent == 0; i++) {
+		if (memchr(s, i, len) == NULL)
+			absent = i;
+	}
+
+	check(std_strlen(s) == len, "strlen len=%zu", len);
+	check(std_strnlen(s, n) == n, "strnlen len=%zu n=%zu", len, n);
+	check(std_strnlen(s, len + 1) == len, "strnlen len=%zu", len);
+	check(std_strnlen(s, SIZE_MAX) == len, "strnlen len=%zu", len);
+
+	check(std_strchr(s, c) == strchr(s, c), "strchr len=%zu c=%d", len, c);
+	check(std_strchr(s, c + 256) == strchr(s, c + 256),
+			"strchr len=%zu c=%d", len, c + 256);
+	check(std_strchr(s, 0) == s + len, "strchr len=%zu c=0", len);
+	check(std_strrchr(s, c) == strrchr(s, c), "strrchr len=%zu c=%d", len, c);
+	check(std_strrchr(s, c + 256) == strrchr(s, c + 256),
+			"strrchr len=%zu c=%d", len, c + 256);
+
+	check(std_memchr(s, c, n) == memchr(s, c, n),
+			"memchr len=%zu c=%d n=%zu", len, c, n);
+	check(std_memchr(s, 0, len + 1) == s + len, "memchr len=%zu c=0", len);
+	check(std_memrchr(s, c, n) == memrchr(s, c, n),
+			"memrchr len=%zu c=%d n=%zu", len, c, n);
+	if (len > 0)
+		check(std_rawmemchr(s, c) == rawmemchr(s, c),
+				"rawmemchr len=%zu c=%d", len, c);
+	check(std_rawmemchr(s, 0) == s + len, "rawmemchr len=%zu c=0", len);
+
+	if (absent) {
+		check(std_strchr(s, absent) == NULL,
+				"strchr len=%zu absent c=%d", len, absent);
+		check(std_memchr(s, absent, len) == NULL,
+				"memchr len=%zu absent c=%d", len, absent);
+		check(std_memrchr(s, absent, len) == NULL,
+				"memrchr len=%zu absent c=%d", len, absent);
+	}
+}
+
+static void
+test_compare(unsigned int a1, unsigned int a2, size_t len)
+{
+	char *s1 = random_string(buf1, sizeof(buf1), a1, len);
+	char *s2 = buf2 + a2;
+	size_t n = test_rand() % (len + 2);
+	int want, got;
+
+	memset(buf2, 0x55, sizeof(buf2));
+	memcpy(s2, s1, len + 1);
+
+	switch (test_rand() % 4) {
+	case 0: /* equal */
+		break;
+	case 1: /* differ somewhere */
+		if (len > 0)
+			s2[test_rand() % len] = random_byte();
+		break;
+	case 2: /* s2 is shorter */
+		if (len > 0)
+			s2[test_rand() % len] = '\0';
+		break;
+	case 3: /* s2 is longer */
+		s2[len] = random_byte();
+		s2[len + 1] = '\0';
+		break;
+	}
+
+	want = sign(strcmp(s1, s2));
+	got = sign(std_strcmp(s1, s2));
+	check(got == want, "strcmp a1=%u a2=%u len=%zu: %d, want %d",
+			a1, a2, len, got, want);
+	got = sign(std_strcmp(s2, s1));
+	check(got == -want, "strcmp a1=%u a2=%u len=%zu: %d, want %d",
+			a2, a1, len, got, -want);
+
+	want = sign(strncmp(s1, s2, n));
+	got = sign(std_strncmp(s1, s2, n));
+	check(got == want, "strncmp a1=%u a2=%u len=%zu n=%zu: %d, want %d",
+			a1, a2, len, n, got, want);
+}
+
+static void
+test_guards(void)
+{
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+	char *a = (char *)test_guarded(1);
+	char *b = (char *)test_guarded(1);
+	char *aend = a + pagesize;
+	char *bend = b + pagesize;
+
+	for (size_t len = 0; len <= MAXLEN; len++) {
+		/* the terminating zero is the last byte before the guard */
+		char *s = aend - len - 1;
+		char *t = bend - len - 1;
+
+		for (size_t i = 0; i < len; i++)
+			s[i] = random_byte();
+		s[len] = '\0';
+		memcpy(t, s, len + 1);
+
+		test_scan(s, len);
+		check(std_strcmp(s, t) == 0, "strcmp at page end len=%zu", len);
+		check(std_strncmp(s, t, len + 10) == 0,
+				"strncmp at page end len=%zu", len);
+
+		/* buffers without a terminating zero */
+		memset(aend - len, 0x80, len);
+		check(std_memchr(aend - len, 0, len) == NULL,
+				"memchr at page end len=%zu", len);
+		check(std_strnlen(aend - len, len) == len,
+				"strnlen at page end len=%zu", len);
+
+		/* memrchr runs backwards, so start at the guard page */
+		memset(a, 0x80, len);
+		check(std_memrchr(a, 0, len) == NULL,
+				"memrchr at page start len=%zu", len);
+	}
+}
+
+int main(void)
+{
+	for (unsigned int align = 0; align < 8; align++) {
+		for (size_t len = 0; len <= MAXLEN; len++) {
+			for (unsigned int i = 0; i < 8; i++)
+				test_scan(random_string(buf1, sizeof(buf1), align, len), len);
+		}
+	}
+
+	for (unsigned int a1 = 0; a1 < 8; a1++) {
+		for (unsigned int a2 = 0; a2 < 8; a2++) {
+			for (size_t len = 0; len <= MAXLEN; len++) {
+				for (unsigned int i = 0; i < 4; i++)
+					test_compare(a1, a2, len);
+			}
+		}
+	}
+
+	test_guards();
+
+#ifdef STRING_SWAR
+	return test_done("str (STRING_SWAR)");
+#else
+	return test_done("str");
+#endif
+}
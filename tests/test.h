@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * Helpers shared by the host tests. A test calls check() for every
+ * condition and returns test_done() from main(), which prints the
+ * number of checks and fails if any of them did.
+ */
+static unsigned long test_checks;
+static unsigned long test_failures;
+
+#define check(cond, ...) do { \
+	test_checks++; \
+	if (!(cond)) { \
+		if (test_failures++ < 20) { \
+			fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+			fprintf(stderr, __VA_ARGS__); \
+			fputc('\n', stderr); \
+		} \
+	} \
+} while (0)
+
+static inline int test_done(const char *name)
+{
+	printf("%s: %lu checks, %lu failed\n", name, test_checks, test_failures);
+	return test_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* xorshift32, so every run tests the same values */
+static uint32_t test_seed = 2463534242U;
+
+static inline uint32_t test_rand(void)
+{
+	uint32_t x = test_seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return test_seed = x;
+}
+
+static inline void test_fill(void *p, size_t len)
+{
+	unsigned char *b = p;
+
+	while (len-- > 0)
+		*b++ = test_rand();
+}
+
+/*
+ * Return pages of memory with an inaccessible page on both sides, so
+ * a buffer placed at either end faults on any access past it.
+ */
+static inline unsigned char *test_guarded(size_t pages)
+{
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+	unsigned char *p = mmap(NULL, (pages + 2) * pagesize,
+			PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	mprotect(p, pagesize, PROT_NONE);
+	mprotect(p + (pages + 1) * pagesize, pagesize, PROT_NONE);
+	return p + pagesize;
+}
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+/*
+ * The part of the usbacm-bench test that uses the stdio.h of this
+ * tree, so the benchmark firmware can print its reports on a uart0
+ * that just collects them.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "lib/stdio-uart0.h"
+
+size_t uart0_capture(char *buf, size_t size);
+
+static struct {
+	char buf[4096];
+	volatile size_t len;
+} capture;
+
+static void
+capture_putc(FILE *stream, char c)
+{
+	size_t len = capture.len;
+
+	if (len >= sizeof(capture.buf))
+		return;
+	/* the test reads this from another thread */
+	capture.buf[len] = c;
+	__asm__ ("" ::: "memory");
+	capture.len = len + 1;
+}
+
+static int
+capture_done(FILE *stream)
+{
+	return 0;
+}
+
+const FILE uart0_stream = {
+	.putc = capture_putc,
+	.done = capture_done,
+};
+
+void
+uart0_init(uint32_t pclk, uint32_t target, uint8_t priority)
+{
+}
+
+/* copy out what was printed so far */
+size_t uart0_capture(char *buf, size_t size)
+{
+	size_t len = capture.len;
+
+	if (len > size)
+		len = size;
+	for (size_t i = 0; i < len; i++)
+		buf[i] = capture.buf[i];
+	return len;
+}
@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "test.h"
+#include "usbfs-sim.h"
+
+#include "lib/usbfs-core.h"
+#include "lib/usbfs-vendor.h"
+
+/*
+ * Run the usbacm-bench firmware from examples/usbacm-bench on the
+ * USBFS simulator and drive its echo, sink and source commands and
+ * the vendor loopback like tools/usbacm-bench and tools/usbvendor-loop
+ * would, so the ACM and vendor transfer code is exercised without a
+ * board. Only main() is renamed, everything else is the firmware as
+ * it is built for the chip.
+ */
+
+int bench_main(void);
+size_t uart0_capture(char *buf, size_t size);
+
+#define ACM_ENDPOINT   1
+#define ACM_PACKETSIZE 64
+#define CDC_INTERFACE  0
+
+/* the firmware brings up the clocks and the eclic on the chip */
+void
+rcu_sysclk_init(void)
+{
+}
+
+void
+eclic_init(void)
+{
+}
+
+static void
+device(void)
+{
+	bench_main();
+}
+
+static void
+sleep_ms(unsigned int ms)
+{
+	struct timespec ts = {
+		.tv_sec = ms / 1000,
+		.tv_nsec = (ms % 1000) * 1000000L,
+	};
+
+	nanosleep(&ts, NULL);
+}
+
+/* the device may answer in several transfers, so collect them */
+static int
+receive(uint8_t *buf, unsigned int len)
+{
+	unsigned int done = 0;
+
+	while (done < len) {
+		int ret = host_bulk_in(ACM_ENDPOINT, buf + done, len - done,
+				ACM_PACKETSIZE);
+
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+static int
+send(const void *data, unsigned int len)
+{
+	return host_bulk_out(ACM_ENDPOINT, data, len, ACM_PACKETSIZE, false);
+}
+
+static int
+command(uint8_t cmd, uint32_t n)
+{
+	const uint8_t hdr[5] = { cmd, n, n >> 8, n >> 16, n >> 24 };
+
+	return send(hdr, sizeof(hdr));
+}
+
+/* nothing more must come from the device */
+static void
+check_quiet(const char *what)
+{
+	uint8_t buf[ACM_PACKETSIZE];
+	unsigned int timeout = host_timeout;
+	int ret;
+
+	host_timeout = 20;
+	ret = host_in(ACM_ENDPOINT, buf, sizeof(buf));
+	host_timeout = timeout;
+	check(ret == HOST_TIMEOUT, "%s: unexpected data from the device: %d", what, ret);
+}
+
+static void
+test_enumerate(void)
+{
+	static const uint8_t coding[7] = { 0x00, 0xc2, 0x01, 0x00, 0, 0, 8 };
+	struct host_device dev;
+	int ret;
+
+	ret = host_enumerate(&dev);
+	check(ret == 0, "enumeration failed: %d", ret);
+	check(dev.config[4] == 3, "%u interfaces, expected ACM and vendor", dev.config[4]);
+
+	ret = host_request(0x21, 0x20, 0, CDC_INTERFACE, 7, (void *)coding);
+	check(ret == 7, "SET_LINE_CODING: %d", ret);
+	ret = host_request(0x21, 0x22, 0x0003, CDC_INTERFACE, 0, NULL);
+	check(ret == 0, "SET_CONTROL_LINE_STATE: %d", ret);
+}
+
+static void
+sink(uint32_t len)
+{
+	static uint8_t data[8192];
+	uint8_t ack[ACM_PACKETSIZE];
+	int ret;
+
+	test_fill(data, len);
+	ret = command('s', len);
+	check(ret == 5, "sink of %u bytes: command returned %d", len, ret);
+	ret = send(data, len);
+	check(ret == (int)len, "sink of %u bytes: sent %d", len, ret);
+	ret = host_bulk_in(ACM_ENDPOINT, ack, sizeof(ack), ACM_PACKETSIZE);
+	check(ret == 1 && ack[0] == 'k', "sink of %u bytes: answer %d '%c'",
+			len, ret, ret > 0 ? ack[0] : ' ');
+}
+
+static void
+test_sink(void)
+{
+	static const uint32_t sizes[] = { 0, 1, 5, 63, 64, 65, 512, 1000, 4096, 8192 };
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(sizes); i++)
+		sink(sizes[i]);
+	for (unsigned int i = 0; i < 20; i++)
+		sink(test_rand() % 2048);
+	check_quiet("sink");
+
+	/* bytes outside a command are dropped, like bench.sh relies on */
+	{
+		static const uint8_t zeroes[100];
+
+		send(zeroes, sizeof(zeroes));
+		sink(10);
+	}
+}
+
+/*
+ * The host here can't send and receive at the same time, so echo in
+ * parts the device can take in before it has to send them back.
+ */
+static void
+echo(uint32_t len)
+{
+	static uint8_t out[8192];
+	static uint8_t in[8192];
+	uint32_t done;
+	int ret;
+
+	test_fill(out, len);
+	memset(in, 0, len);
+	ret = command('e', len);
+	check(ret == 5, "echo of %u bytes: command returned %d", len, ret);
+	for (done = 0; done < len; ) {
+		unsigned int n = (len - done < 512) ? len - done : 512;
+
+		ret = send(out + done, n);
+		check(ret == (int)n, "echo of %u bytes: sent %d", len, ret);
+		ret = receive(in + done, n);
+		check(ret == (int)n, "echo of %u bytes: received %d", len, ret);
+		if (ret != (int)n)
+			return;
+		done += n;
+	}
+	check(memcmp(in, out, len) == 0, "echo of %u bytes: data differs", len);
+}
+
+static void
+test_echo(void)
+{
+	static const uint32_t sizes[] = { 1, 63, 64, 65, 512, 1000, 4096, 8192 };
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(sizes); i++)
+		echo(sizes[i]);
+	for (unsigned int i = 0; i < 20; i++)
+		echo(1 + test_rand() % 2048);
+	check_quiet("echo");
+}
+
+static void
+source(uint32_t len)
+{
+	static uint8_t in[16384];
+	bool ok = true;
+	int ret;
+
+	ret = command('o', len);
+	check(ret == 5, "source of %u bytes: command returned %d", len, ret);
+	ret = receive(in, len);
+	check(ret == (int)len, "source of %u bytes: received %d", len, ret);
+	for (int i = 0; i < ret; i++)
+		ok &= in[i] == (uint8_t)i;
+	check(ok, "source of %u bytes: wrong pattern", len);
+}
+
+static void
+test_source(void)
+{
+	static const uint32_t sizes[] = { 1, 64, 255, 256, 4095, 4096, 4097, 16384 };
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(sizes); i++)
+		source(sizes[i]);
+	check_quiet("source");
+	/* a command after the source still works */
+	sink(100);
+}
+
+static void
+loop(unsigned int len)
+{
+	static uint8_t out[4096];
+	static uint8_t in[4096];
+	int ret;
+
+	test_fill(out, len);
+	memset(in, 0, len);
+	ret = host_bulk_out(USBVENDOR_ENDPOINT, out, len, USBVENDOR_PACKETSIZE, true);
+	check(ret == (int)len, "vendor loop of %u bytes: sent %d", len, ret);
+	ret = host_bulk_in(USBVENDOR_ENDPOINT, in, len, USBVENDOR_PACKETSIZE);
+	check(ret == (int)len, "vendor loop of %u bytes: received %d", len, ret);
+	check(memcmp(in, out, len) == 0, "vendor loop of %u bytes: data differs", len);
+}
+
+static void
+test_vendor(void)
+{
+	static const unsigned int sizes[] = { 1, 63, 64, 65, 1000, 4095, 4096 };
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(sizes); i++)
+		loop(sizes[i]);
+	for (unsigned int i = 0; i < 20; i++)
+		loop(1 + test_rand() % 4096);
+	/* the ACM port is unaffected */
+	echo(100);
+}
+
+/* the throughput is reported on uart0 every second */
+static void
+test_report(void)
+{
+	char buf[4096];
+	size_t len = 0;
+
+	for (unsigned int i = 0; i < 30; i++) {
+		sink(100);
+		len = uart0_capture(buf, sizeof(buf) - 1);
+		buf[len] = '\0';
+		/* wait for the whole line, not just the start of it */
+		if (strstr(buf, " bytes/s looped back\n"))
+			break;
+		sleep_ms(100);
+	}
+	check(strstr(buf, " bytes/s in, ") != NULL, "no throughput report on uart0");
+	check(strstr(buf, " bytes/s looped back\n") != NULL, "no loopback report on uart0");
+}
+
+int main(void)
+{
+	sim_start(device);
+
+	test_enumerate();
+	test_sink();
+	test_echo();
+	test_source();
+	test_vendor();
+	test_report();
+
+	check(sim_errors() == 0, "%u simulator errors", sim_errors());
+	return test_done("usbacm-bench");
+}
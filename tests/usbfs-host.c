@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "lib/usbfs-core.h"
+
+#include "usbfs-sim.h"
+
+unsigned int host_timeout = 1000;
+
+/* the next data pid of each endpoint, IN and OUT */
+static uint8_t host_pid[2][16];
+
+static uint64_t
+host_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* give the firmware thread a chance to run between retries */
+static void
+host_backoff(unsigned int tries)
+{
+	struct timespec ts = { .tv_nsec = (tries < 10) ? 1000 : 50000 };
+
+	nanosleep(&ts, NULL);
+}
+
+int
+host_in(unsigned int ep, void *buf, unsigned int size)
+{
+	uint64_t deadline = host_now() + host_timeout;
+
+	for (unsigned int tries = 0; ; tries++) {
+		unsigned int pid;
+		int ret = sim_in(ep, buf, size, &pid);
+
+		if (ret >= 0) {
+			/* a repeated packet is acked again, but dropped */
+			if (pid != host_pid[0][ep]) {
+				sim_error("IN endpoint %u sent DATA%u, expected DATA%u",
+						ep, pid, host_pid[0][ep]);
+				if (host_now() > deadline)
+					return HOST_TIMEOUT;
+				continue;
+			}
+			host_pid[0][ep] ^= 1;
+			return ret;
+		}
+		if (ret != SIM_NAK)
+			return ret;
+		if (host_now() > deadline)
+			return HOST_TIMEOUT;
+		host_backoff(tries);
+	}
+}
+
+int
+host_out(unsigned int ep, const void *data, unsigned int len)
+{
+	uint64_t deadline = host_now() + host_timeout;
+
+	for (unsigned int tries = 0; ; tries++) {
+		int ret = sim_out(ep, data, len, host_pid[1][ep]);
+
+		if (ret >= 0) {
+			host_pid[1][ep] ^= 1;
+			return ret;
+		}
+		if (ret != SIM_NAK)
+			return ret;
+		if (host_now() > deadline)
+			return HOST_TIMEOUT;
+		host_backoff(tries);
+	}
+}
+
+int
+host_control(const struct usb_setup_packet *setup, void *data)
+{
+	uint64_t deadline = host_now() + host_timeout;
+	uint8_t *p = data;
+	unsigned int len = 0;
+	int ret;
+
+	for (unsigned int tries = 0; (ret = sim_setup(setup)) == SIM_NAK; tries++) {
+		if (host_now() > deadline)
+			return HOST_TIMEOUT;
+		host_backoff(tries);
+	}
+	host_pid[0][0] = 1;
+	host_pid[1][0] = 1;
+
+	if (setup->wLength > 0 && (setup->bmRequestType & 0x80)) {
+		while (len < setup->wLength) {
+			unsigned int size = setup->wLength - len;
+
+			if (size > 64)
+				size = 64;
+			ret = host_in(0, p + len, size);
+			if (ret < 0)
+				return ret;
+			len += ret;
+			if ((unsigned int)ret < size || ret < 64)
+				break;
+		}
+		ret = host_out(0, NULL, 0);
+	} else {
+		while (len < setup->wLength) {
+			unsigned int size = setup->wLength - len;
+
+			if (size > 64)
+				size = 64;
+			ret = host_out(0, p + len, size);
+			if (ret < 0)
+				return ret;
+			len += size;
+		}
+		ret = host_in(0, NULL, 0);
+	}
+	if (ret < 0)
+		return ret;
+
+	/* the device starts over with DATA0 after these */
+	if (setup->request == 0x0900)
+		memset(host_pid, 0, sizeof(host_pid));
+	else if (setup->request == 0x0102 && setup->wValue == 0)
+		host_pid[(setup->wIndex & 0x80U) ? 0 : 1][setup->wIndex & 0xfU] = 0;
+	return len;
+}
+
+int
+host_request(uint8_t type, uint8_t request, uint16_t value,
+		uint16_t index, uint16_t length, void *data)
+{
+	const struct usb_setup_packet setup = {
+		.bmRequestType = type,
+		.bRequest = request,
+		.wValue = value,
+		.wIndex = index,
+		.wLength = length,
+	};
+
+	return host_control(&setup, data);
+}
+
+int
+host_bulk_in(unsigned int ep, void *buf, unsigned int len, unsigned int packetsize)
+{
+	uint8_t *p = buf;
+	unsigned int done = 0;
+
+	while (done < len) {
+		unsigned int size = len - done;
+		int ret;
+
+		if (size > packetsize)
+			size = packetsize;
+		ret = host_in(ep, p + done, size);
+		if (ret < 0)
+			return ret;
+		done += ret;
+		if ((unsigned int)ret < packetsize)
+			break;
+	}
+	return done;
+}
+
+int
+host_bulk_out(unsigned int ep, const void *data, unsigned int len,
+		unsigned int packetsize, bool zlp)
+{
+	const uint8_t *p = data;
+	unsigned int done = 0;
+	int ret;
+
+	while (done < len) {
+		unsigned int size = len - done;
+
+		if (size > packetsize)
+			size = packetsize;
+		ret = host_out(ep, p + done, size);
+		if (ret < 0)
+			return ret;
+		done += size;
+	}
+	if (zlp && len % packetsize == 0) {
+		ret = host_out(ep, NULL, 0);
+		if (ret < 0)
+			return ret;
+	}
+	return done;
+}
+
+int
+host_enumerate(struct host_device *dev)
+{
+	int ret;
+
+	memset(host_pid, 0, sizeof(host_pid));
+	sim_bus_reset();
+
+	ret = host_request(0x80, 0x06, 0x0100, 0, 64, dev->device);
+	if (ret != sizeof(dev->device))
+		return (ret < 0) ? ret : HOST_TIMEOUT;
+	ret = host_request(0x00, 0x05, 1, 0, 0, NULL);
+	if (ret < 0)
+		return ret;
+	ret = host_request(0x80, 0x06, 0x0200, 0, 9, dev->config);
+	if (ret != 9)
+		return (ret < 0) ? ret : HOST_TIMEOUT;
+	dev->config_len = dev->config[2] | dev->config[3] << 8;
+	if (dev->config_len > sizeof(dev->config))
+		return HOST_TIMEOUT;
+	ret = host_request(0x80, 0x06, 0x0200, 0, dev->config_len, dev->config);
+	if (ret != (int)dev->config_len)
+		return (ret < 0) ? ret : HOST_TIMEOUT;
+	return host_request(0x00, 0x09, dev->config[5], 0, 0, NULL);
+}
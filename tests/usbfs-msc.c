@@ -0,0 +1,586 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "test.h"
+#include "usbfs-sim.h"
+
+#include "lib/eclic.h"
+#include "lib/usbfs-core.h"
+#include "lib/usbfs-msc.h"
+
+/*
+ * Run lib/usbfs-msc.c, as the third interface of lib/stdio-usbacm.c,
+ * with a RAM disk on the USBFS simulator and talk SCSI over the
+ * bulk-only transport to it, including the error cases of BOT 6.6
+ * and 6.7 where the device must stall its endpoints.
+ */
+
+/* lib/stdio-usbacm.h wants the stdio.h of this tree */
+void usbacm_init(uint8_t priority);
+
+#define MSC_IN  (0x80 | USBMSC_ENDPOINT)
+#define MSC_OUT USBMSC_ENDPOINT
+#define MSC_INTERFACE 2
+
+#define DISK_BLOCKS 64
+/* reading this block fails */
+#define BAD_BLOCK   13
+
+static uint8_t disk[DISK_BLOCKS][512];
+static uint8_t shadow[DISK_BLOCKS][512];
+
+static int
+disk_read(uint32_t lba, void *buf)
+{
+	if (lba >= DISK_BLOCKS)
+		sim_error("disk read of block %u", lba);
+	if (lba == BAD_BLOCK || lba >= DISK_BLOCKS)
+		return -1;
+	memcpy(buf, disk[lba], 512);
+	return 0;
+}
+
+static int
+disk_write(uint32_t lba, const void *buf)
+{
+	if (lba >= DISK_BLOCKS) {
+		sim_error("disk write of block %u", lba);
+		return -1;
+	}
+	memcpy(disk[lba], buf, 512);
+	return 0;
+}
+
+static const struct usbmsc_disk ramdisk = {
+	.blocks = DISK_BLOCKS,
+	.read = disk_read,
+	.write = disk_write,
+};
+
+static void
+device(void)
+{
+	eclic_global_interrupt_enable();
+	usbmsc_attach(&ramdisk);
+	usbacm_init(4);
+
+	while (1) {
+		usbmsc_poll();
+		usbfs_idle();
+	}
+}
+
+static void
+sleep_ms(unsigned int ms)
+{
+	struct timespec ts = {
+		.tv_sec = ms / 1000,
+		.tv_nsec = (ms % 1000) * 1000000L,
+	};
+
+	nanosleep(&ts, NULL);
+}
+
+struct cbw {
+	uint32_t dCBWSignature;
+	uint32_t dCBWTag;
+	uint32_t dCBWDataTransferLength;
+	uint8_t bmCBWFlags;
+	uint8_t bCBWLUN;
+	uint8_t bCBWCBLength;
+	uint8_t CBWCB[16];
+} __attribute__((packed));
+
+struct csw {
+	uint32_t dCSWSignature;
+	uint32_t dCSWTag;
+	uint32_t dCSWDataResidue;
+	uint8_t bCSWStatus;
+} __attribute__((packed));
+
+struct bot {
+	/* the command */
+	const uint8_t *cb;
+	unsigned int cblen;
+	bool in;
+	uint32_t length;
+	void *data;
+	/* what happened */
+	unsigned int transferred;
+	bool stalled;
+	struct csw csw;
+};
+
+static uint32_t bot_tag = 0x1000;
+
+static void
+clear_halt(uint8_t ep)
+{
+	int ret = host_request(0x02, 0x01, 0, ep, 0, NULL);
+
+	check(ret == 0, "CLEAR_FEATURE(ENDPOINT_HALT) of 0x%02x: %d", ep, ret);
+}
+
+/* a command transport, data transport and status transport per BOT 5 */
+static int
+bot(struct bot *b)
+{
+	struct cbw cbw = {
+		.dCBWSignature = 0x43425355U,
+		.dCBWTag = ++bot_tag,
+		.dCBWDataTransferLength = b->length,
+		.bmCBWFlags = b->in ? 0x80 : 0x00,
+		.bCBWCBLength = b->cblen,
+	};
+	uint8_t *p = b->data;
+	int ret;
+
+	memcpy(cbw.CBWCB, b->cb, b->cblen);
+	b->transferred = 0;
+	b->stalled = false;
+
+	ret = host_out(MSC_OUT, &cbw, sizeof(cbw));
+	if (ret < 0)
+		return ret;
+
+	if (b->length > 0 && b->in) {
+		while (b->transferred < b->length) {
+			unsigned int size = b->length - b->transferred;
+
+			if (size > USBMSC_PACKETSIZE)
+				size = USBMSC_PACKETSIZE;
+			ret = host_in(USBMSC_ENDPOINT, p + b->transferred, size);
+			if (ret == SIM_STALL) {
+				b->stalled = true;
+				clear_halt(MSC_IN);
+				break;
+			}
+			if (ret < 0)
+				return ret;
+			b->transferred += ret;
+			if (ret < USBMSC_PACKETSIZE)
+				break;
+		}
+	} else if (b->length > 0) {
+		while (b->transferred < b->length) {
+			unsigned int size = b->length - b->transferred;
+
+			if (size > USBMSC_PACKETSIZE)
+				size = USBMSC_PACKETSIZE;
+			ret = host_out(USBMSC_ENDPOINT, p + b->transferred, size);
+			if (ret == SIM_STALL) {
+				b->stalled = true;
+				clear_halt(MSC_OUT);
+				break;
+			}
+			if (ret < 0)
+				return ret;
+			b->transferred += size;
+		}
+	}
+
+	/* a stalled status transport is retried once after clearing the halt */
+	ret = host_in(USBMSC_ENDPOINT, &b->csw, sizeof(b->csw));
+	if (ret == SIM_STALL) {
+		b->stalled = true;
+		clear_halt(MSC_IN);
+		ret = host_in(USBMSC_ENDPOINT, &b->csw, sizeof(b->csw));
+	}
+	if (ret < 0)
+		return ret;
+	check(ret == sizeof(b->csw), "CSW of %d bytes", ret);
+	check(b->csw.dCSWSignature == 0x53425355U, "bad CSW signature 0x%08x",
+			b->csw.dCSWSignature);
+	check(b->csw.dCSWTag == bot_tag, "CSW tag 0x%x, expected 0x%x",
+			b->csw.dCSWTag, bot_tag);
+	return b->csw.bCSWStatus;
+}
+
+static int
+scsi(const uint8_t *cb, unsigned int cblen, bool in, uint32_t length, void *data)
+{
+	struct bot b = {
+		.cb = cb,
+		.cblen = cblen,
+		.in = in,
+		.length = length,
+		.data = data,
+	};
+	int ret = bot(&b);
+
+	/* OUT data the device drops counts as residue too, see below */
+	check(ret < 0 || !in || b.csw.dCSWDataResidue == length - b.transferred,
+			"command 0x%02x: residue %u after %u of %u bytes",
+			cb[0], b.csw.dCSWDataResidue, b.transferred, length);
+	return ret;
+}
+
+static void
+sense(uint8_t key, uint8_t asc, const char *what)
+{
+	const uint8_t cb[6] = { 0x03, 0, 0, 0, 18, 0 };
+	uint8_t buf[18];
+	int ret;
+
+	memset(buf, 0xff, sizeof(buf));
+	ret = scsi(cb, sizeof(cb), true, sizeof(buf), buf);
+	check(ret == 0, "REQUEST SENSE after %s: %d", what, ret);
+	check(buf[0] == 0x70 && buf[2] == key && buf[12] == asc,
+			"%s: sense %02x/%02x, expected %02x/%02x",
+			what, buf[2], buf[12], key, asc);
+}
+
+static int
+read10(uint32_t lba, uint16_t blocks, uint32_t length, void *buf)
+{
+	const uint8_t cb[10] = {
+		0x28, 0, lba >> 24, lba >> 16, lba >> 8, lba, 0, blocks >> 8, blocks, 0,
+	};
+
+	return scsi(cb, sizeof(cb), true, length, buf);
+}
+
+static int
+write10(uint32_t lba, uint16_t blocks, uint32_t length, const void *buf)
+{
+	const uint8_t cb[10] = {
+		0x2a, 0, lba >> 24, lba >> 16, lba >> 8, lba, 0, blocks >> 8, blocks, 0,
+	};
+
+	return scsi(cb, sizeof(cb), false, length, (void *)buf);
+}
+
+static void
+test_enumerate(void)
+{
+	struct host_device dev;
+	uint8_t lun = 0xff;
+	int ret;
+
+	ret = host_enumerate(&dev);
+	check(ret == 0, "enumeration failed: %d", ret);
+	check(dev.config[4] == 3, "%u interfaces", dev.config[4]);
+
+	ret = host_request(0xa1, 0xfe, 0, MSC_INTERFACE, 1, &lun);
+	check(ret == 1 && lun == 0, "GET_MAX_LUN: %d, %u", ret, lun);
+}
+
+static void
+test_commands(void)
+{
+	static const uint8_t tur[6] = { 0x00 };
+	static const uint8_t inquiry[6] = { 0x12, 0, 0, 0, 36, 0 };
+	static const uint8_t capacity[10] = { 0x25 };
+	static const uint8_t mode_sense[6] = { 0x1a, 0, 0x3f, 0, 4, 0 };
+	static const uint8_t unknown[6] = { 0xe7 };
+	uint8_t buf[64];
+	int ret;
+
+	/* the disk was just inserted */
+	ret = scsi(tur, sizeof(tur), false, 0, NULL);
+	check(ret == 1, "first TEST UNIT READY: %d", ret);
+	sense(0x06, 0x28, "medium change");
+	ret = scsi(tur, sizeof(tur), false, 0, NULL);
+	check(ret == 0, "TEST UNIT READY: %d", ret);
+
+	ret = scsi(inquiry, sizeof(inquiry), true, 36, buf);
+	check(ret == 0 && memcmp(&buf[8], "GD32VF  ", 8) == 0, "INQUIRY: %d", ret);
+
+	ret = scsi(capacity, sizeof(capacity), true, 8, buf);
+	check(ret == 0, "READ CAPACITY: %d", ret);
+	check(buf[3] == DISK_BLOCKS - 1 && buf[6] == 0x02 && buf[7] == 0x00,
+			"capacity %02x%02x%02x%02x", buf[0], buf[1], buf[2], buf[3]);
+
+	ret = scsi(mode_sense, sizeof(mode_sense), true, 4, buf);
+	check(ret == 0 && buf[0] == 3 && buf[2] == 0, "MODE SENSE: %d", ret);
+
+	ret = scsi(unknown, sizeof(unknown), false, 0, NULL);
+	check(ret == 1, "unknown command: %d", ret);
+	sense(0x05, 0x20, "unknown command");
+
+	ret = read10(DISK_BLOCKS - 1, 2, 1024, buf);
+	check(ret == 1, "READ past the end: %d", ret);
+	sense(0x05, 0x21, "READ past the end");
+}
+
+static void
+test_data(void)
+{
+	static uint8_t buf[8 * 512];
+	static const uint16_t counts[] = { 1, 2, 3, 8 };
+	int ret;
+
+	for (unsigned int i = 0; i < 40; i++) {
+		uint16_t blocks = counts[test_rand() % ARRAY_SIZE(counts)];
+		uint32_t lba = test_rand() % (DISK_BLOCKS - blocks + 1);
+		bool bad = lba <= BAD_BLOCK && BAD_BLOCK < lba + blocks;
+
+		if (test_rand() % 2) {
+			test_fill(buf, blocks * 512);
+			ret = write10(lba, blocks, blocks * 512, buf);
+			check(ret == 0, "WRITE of %u blocks at %u: %d", blocks, lba, ret);
+			memcpy(shadow[lba], buf, blocks * 512);
+			check(memcmp(disk[lba], buf, blocks * 512) == 0,
+					"WRITE of %u blocks at %u: disk differs", blocks, lba);
+		} else if (!bad) {
+			ret = read10(lba, blocks, blocks * 512, buf);
+			check(ret == 0, "READ of %u blocks at %u: %d", blocks, lba, ret);
+			check(memcmp(shadow[lba], buf, blocks * 512) == 0,
+					"READ of %u blocks at %u: data differs", blocks, lba);
+		}
+	}
+
+	/* a failing read ends the data phase early with a stall */
+	{
+		struct bot b = {
+			.cb = (const uint8_t[10]){ 0x28, 0, 0, 0, 0, BAD_BLOCK - 1, 0, 0, 2, 0 },
+			.cblen = 10,
+			.in = true,
+			.length = 1024,
+			.data = buf,
+		};
+
+		ret = bot(&b);
+		check(ret == 1, "READ of a bad block: %d", ret);
+		check(b.transferred == 512 && b.stalled,
+				"READ of a bad block: %u bytes, %sstalled",
+				b.transferred, b.stalled ? "" : "not ");
+		check(b.csw.dCSWDataResidue == 512, "READ of a bad block: residue %u",
+				b.csw.dCSWDataResidue);
+		sense(0x03, 0x11, "READ of a bad block");
+	}
+}
+
+/* BOT 6.7.2, Hi > Di: the device stalls Bulk-In after its data */
+static void
+test_hi_gt_di(void)
+{
+	static const uint8_t inquiry[6] = { 0x12, 0, 0, 0, 36, 0 };
+	static uint8_t buf[1024];
+	struct bot b = {
+		.cb = inquiry,
+		.cblen = sizeof(inquiry),
+		.in = true,
+		.length = 64,
+		.data = buf,
+	};
+	int ret;
+
+	ret = bot(&b);
+	check(ret == 0, "INQUIRY with Hi > Di: %d", ret);
+	check(b.transferred == 36 && b.stalled,
+			"INQUIRY with Hi > Di: %u bytes, %sstalled",
+			b.transferred, b.stalled ? "" : "not ");
+	check(b.csw.dCSWDataResidue == 64 - 36, "INQUIRY with Hi > Di: residue %u",
+			b.csw.dCSWDataResidue);
+
+	/* ending on a whole packet, where a zero length packet would have been sent */
+	b.cb = (const uint8_t[10]){ 0x28, 0, 0, 0, 0, 1, 0, 0, 1, 0 };
+	b.cblen = 10;
+	b.length = sizeof(buf);
+	ret = bot(&b);
+	check(ret == 0, "READ with Hi > Di: %d", ret);
+	check(b.transferred == 512 && b.stalled,
+			"READ with Hi > Di: %u bytes, %sstalled",
+			b.transferred, b.stalled ? "" : "not ");
+	check(b.csw.dCSWDataResidue == 512, "READ with Hi > Di: residue %u",
+			b.csw.dCSWDataResidue);
+	check(memcmp(buf, shadow[1], 512) == 0, "READ with Hi > Di: data differs");
+
+	/* Ho > Do: the extra OUT data is taken and dropped */
+	test_fill(buf, sizeof(buf));
+	b.cb = (const uint8_t[10]){ 0x2a, 0, 0, 0, 0, 2, 0, 0, 1, 0 };
+	b.in = false;
+	ret = bot(&b);
+	check(ret == 0, "WRITE with Ho > Do: %d", ret);
+	check(b.transferred == sizeof(buf) && !b.stalled,
+			"WRITE with Ho > Do: %u bytes, %sstalled",
+			b.transferred, b.stalled ? "" : "not ");
+	check(b.csw.dCSWDataResidue == 512, "WRITE with Ho > Do: residue %u",
+			b.csw.dCSWDataResidue);
+	memcpy(shadow[2], buf, 512);
+	check(memcmp(disk[2], buf, 512) == 0 && memcmp(disk[3], shadow[3], 512) == 0,
+			"WRITE with Ho > Do: disk differs");
+
+	/* and everything is in sync afterwards */
+	ret = read10(2, 2, 1024, buf);
+	check(ret == 0 && memcmp(buf, shadow[2], 1024) == 0, "READ after Hi > Di: %d", ret);
+}
+
+/* BOT 6.6.1: an invalid CBW stalls both endpoints until reset recovery */
+static void
+test_invalid_cbw(void)
+{
+	static const uint8_t tur[6] = { 0x00 };
+	struct cbw cbw = {
+		.dCBWSignature = 0x43425355U,
+		.dCBWTag = 0x4242,
+		.bCBWCBLength = 6,
+	};
+	uint8_t buf[64];
+	int ret;
+
+	for (unsigned int i = 0; i < 3; i++) {
+		unsigned int len = sizeof(cbw);
+
+		switch (i) {
+		case 0: cbw.dCBWSignature = 0x12345678U; break;
+		case 1: cbw.dCBWSignature = 0x43425355U; len = 30; break;
+		case 2: cbw.bCBWLUN = 1; break;
+		}
+		ret = host_out(MSC_OUT, &cbw, len);
+		check(ret == 0, "invalid CBW %u: %d", i, ret);
+
+		ret = host_in(USBMSC_ENDPOINT, buf, sizeof(buf));
+		check(ret == SIM_STALL, "Bulk-In after invalid CBW %u: %d", i, ret);
+		ret = host_out(MSC_OUT, &cbw, sizeof(cbw));
+		check(ret == SIM_STALL, "Bulk-Out after invalid CBW %u: %d", i, ret);
+
+		/* clearing the halts alone isn't enough */
+		clear_halt(MSC_IN);
+		clear_halt(MSC_OUT);
+		sleep_ms(5);
+		ret = host_in(USBMSC_ENDPOINT, buf, sizeof(buf));
+		check(ret == SIM_STALL, "Bulk-In without reset recovery %u: %d", i, ret);
+		ret = host_out(MSC_OUT, &cbw, sizeof(cbw));
+		check(ret == SIM_STALL, "Bulk-Out without reset recovery %u: %d", i, ret);
+
+		/* reset recovery */
+		ret = host_request(0x21, 0xff, 0, MSC_INTERFACE, 0, NULL);
+		check(ret == 0, "Bulk-Only Mass Storage Reset: %d", ret);
+		clear_halt(MSC_IN);
+		clear_halt(MSC_OUT);
+
+		ret = scsi(tur, sizeof(tur), false, 0, NULL);
+		check(ret == 0, "TEST UNIT READY after reset recovery %u: %d", i, ret);
+	}
+}
+
+/* a Bulk-Only Mass Storage Reset, then clearing both halts (BOT 5.3.4) */
+static void
+reset_recovery(const char *what)
+{
+	int ret = host_request(0x21, 0xff, 0, MSC_INTERFACE, 0, NULL);
+
+	check(ret == 0, "Bulk-Only Mass Storage Reset %s: %d", what, ret);
+	clear_halt(MSC_IN);
+	clear_halt(MSC_OUT);
+}
+
+/*
+ * Hosts usually reset after timing out in the middle of a data phase.
+ * Nothing of the aborted command may reach the host afterwards.
+ */
+static void
+test_reset_data(void)
+{
+	static const uint8_t tur[6] = { 0x00 };
+	static uint8_t buf[8 * 512];
+	struct cbw cbw = {
+		.dCBWSignature = 0x43425355U,
+		.dCBWTag = ++bot_tag,
+		.dCBWDataTransferLength = sizeof(buf),
+		.bmCBWFlags = 0x80,
+		.bCBWCBLength = 10,
+		.CBWCB = { 0x28, 0, 0, 0, 0, 0, 0, 0, 8, 0 },
+	};
+	int ret;
+
+	/* READ(10) of 8 blocks, given up after one */
+	ret = host_out(MSC_OUT, &cbw, sizeof(cbw));
+	check(ret == 0, "READ CBW: %d", ret);
+	ret = host_bulk_in(USBMSC_ENDPOINT, buf, 512, USBMSC_PACKETSIZE);
+	check(ret == 512 && memcmp(buf, shadow[0], 512) == 0,
+			"first block of the aborted READ: %d", ret);
+	/* let the device queue up more */
+	sleep_ms(5);
+	reset_recovery("during READ");
+
+	ret = scsi(tur, sizeof(tur), false, 0, NULL);
+	check(ret == 0, "TEST UNIT READY after reset during READ: %d", ret);
+	memset(buf, 0, 512);
+	ret = read10(20, 1, 512, buf);
+	check(ret == 0 && memcmp(buf, shadow[20], 512) == 0,
+			"READ after reset during READ: %d", ret);
+
+	/* WRITE(10) of 8 blocks, given up after two */
+	test_fill(buf, sizeof(buf));
+	cbw.dCBWTag = ++bot_tag;
+	cbw.bmCBWFlags = 0x00;
+	cbw.CBWCB[0] = 0x2a;
+	cbw.CBWCB[5] = 30;
+	ret = host_out(MSC_OUT, &cbw, sizeof(cbw));
+	check(ret == 0, "WRITE CBW: %d", ret);
+	ret = host_bulk_out(USBMSC_ENDPOINT, buf, 1024, USBMSC_PACKETSIZE, false);
+	check(ret == 1024, "first blocks of the aborted WRITE: %d", ret);
+	sleep_ms(5);
+	reset_recovery("during WRITE");
+
+	ret = scsi(tur, sizeof(tur), false, 0, NULL);
+	check(ret == 0, "TEST UNIT READY after reset during WRITE: %d", ret);
+	/* only what the host sent may have been written */
+	for (unsigned int i = 0; i < 8; i++) {
+		check(memcmp(disk[30 + i], shadow[30 + i], 512) == 0 ||
+				(i < 2 && memcmp(disk[30 + i], &buf[i * 512], 512) == 0),
+				"block %u after reset during WRITE", 30 + i);
+		memcpy(shadow[30 + i], disk[30 + i], 512);
+	}
+	ret = write10(40, 1, 512, &buf[4 * 512]);
+	check(ret == 0 && memcmp(disk[40], &buf[4 * 512], 512) == 0,
+			"WRITE after reset during WRITE: %d", ret);
+	memcpy(shadow[40], disk[40], 512);
+	ret = read10(30, 2, 1024, buf);
+	check(ret == 0 && memcmp(buf, shadow[30], 1024) == 0,
+			"READ after reset during WRITE: %d", ret);
+}
+
+int main(void)
+{
+	sim_start(device);
+
+	for (unsigned int i = 0; i < DISK_BLOCKS; i++) {
+		test_fill(disk[i], 512);
+		memcpy(shadow[i], disk[i], 512);
+	}
+
+	test_enumerate();
+	test_commands();
+	test_data();
+	test_hi_gt_di();
+	test_invalid_cbw();
+	test_reset_data();
+	test_data();
+
+	check(sim_errors() == 0, "%u simulator errors", sim_errors());
+	return test_done("usbfs-msc");
+}
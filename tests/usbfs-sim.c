@@ -0,0 +1,1271 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <ucontext.h>
+
+#include "gd32vf103/csr.h"
+#include "gd32vf103/dbg.h"
+#include "gd32vf103/eclic.h"
+#include "gd32vf103/mtimer.h"
+#include "gd32vf103/rcu.h"
+#include "gd32vf103/usbfs.h"
+
+#include "lib/usbfs-core.h"
+
+#include "usbfs-sim.h"
+
+#if !defined(__x86_64__) || !defined(__linux__)
+#error "the USBFS simulator only runs on x86-64 Linux"
+#endif
+
+/* lib/usbfs-core.c */
+void USBFS_IRQHandler(void);
+
+#define SIM_PAGE       4096UL
+#define SIM_TRAP_FLAG  0x100UL
+#define SIM_IRQ_SIGNAL SIGUSR1
+
+/* register offsets */
+#define R(reg) (offsetof(struct gd32vf103_usbfs, reg) / 4)
+#define R_DIEP(n, reg) (R(DIEP[0].reg) + (n) * sizeof(struct gd32vf103_usbfs_diep) / 4)
+#define R_DOEP(n, reg) (R(DOEP[0].reg) + (n) * sizeof(struct gd32vf103_usbfs_doep) / 4)
+
+/* bits of GINTF the firmware clears by writing 1 */
+#define GINTF_W1C ( \
+	USBFS_GINTF_WKUPIF | USBFS_GINTF_SESIF | USBFS_GINTF_DISCIF | \
+	USBFS_GINTF_IDPSC | USBFS_GINTF_ISOONCIF | USBFS_GINTF_ISOINCIF | \
+	USBFS_GINTF_EOPFIF | USBFS_GINTF_ISOOPDIF | USBFS_GINTF_ENUMF | \
+	USBFS_GINTF_RST | USBFS_GINTF_SP | USBFS_GINTF_ESP | \
+	USBFS_GINTF_SOF | USBFS_GINTF_MFIF)
+/* endpoint control bits that are actions or status, not storage */
+#define DIEPCTL_ACTIONS ( \
+	USBFS_DIEPCTL_EPEN | USBFS_DIEPCTL_EPD | \
+	USBFS_DIEPCTL_SD1PID | USBFS_DIEPCTL_SD0PID | \
+	USBFS_DIEPCTL_SNAK | USBFS_DIEPCTL_CNAK | \
+	USBFS_DIEPCTL_NAKS | USBFS_DIEPCTL_DPID)
+
+/* mtimer ticks per us at full speed, and at IRC8M/4 while suspended */
+#define MTIME_FAST (MTIMER_FREQ / 1000000)
+#define MTIME_SLOW 2
+
+/* the bus is idle for 3ms before the suspend interrupt, and must be
+ * idle for 5ms before the device may signal remote wakeup */
+#define RWKUP_AFTER_NS 2000000
+
+#define RX_WORDS 1024 /* must be a power of 2 */
+#define TX_WORDS 512
+
+struct sim_region {
+	uintptr_t base;
+	size_t size;
+	uint32_t (*read)(uintptr_t offset, bool peek);
+	void (*write)(uintptr_t offset, uint32_t val);
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_t device;
+	void (*main)(void);
+	struct timespec start;
+
+	uint32_t reg[SIM_PAGE / 4];
+	/* rx fifo of status words, each followed by its data */
+	uint32_t rx[RX_WORDS];
+	unsigned int rxhead;
+	unsigned int rxtail;
+	/* words of the popped packet still to be read from DFIFO */
+	unsigned int rxdata;
+	/* a tx fifo for each IN endpoint */
+	uint32_t tx[4][TX_WORDS];
+	unsigned int txlen[4];
+	/* endpoint state not kept in the registers */
+	bool in_nak[4];
+	bool out_nak[4];
+	/* global OUT NAK, set and cleared through DCTL */
+	bool gonak;
+	/* the next OUT transfer completes without its completion entry */
+	bool drop_tf;
+	uint8_t in_pid[4];
+	uint8_t out_pid[4];
+
+	uint32_t dbg_key;
+	bool reset;
+	bool rwkup;
+	/* host time of the last suspend */
+	uint64_t suspend_ns;
+	/* the interrupt handler is running */
+	bool handling;
+
+	struct sim_stats stats;
+	unsigned int errors;
+
+	/* the access being single stepped */
+	struct {
+		const struct sim_region *region;
+		uintptr_t offset;
+		bool write;
+		bool unblock;
+	} step;
+
+	/* emulated core state, only touched by the firmware thread */
+	unsigned long mstatus;
+	unsigned int level;
+	/* mtime runs at mtime_rate ticks per us since mtime_ns */
+	uint64_t mtime;
+	uint64_t mtime_ns;
+	unsigned int mtime_rate;
+} sim = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+void
+sim_error(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (sim.errors++ >= 20)
+		return;
+	fputs("usbfs-sim: ", stderr);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+unsigned int
+sim_errors(void)
+{
+	unsigned int ret;
+
+	pthread_mutex_lock(&sim.lock);
+	ret = sim.errors;
+	pthread_mutex_unlock(&sim.lock);
+	return ret;
+}
+
+static uint64_t
+sim_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)(now.tv_sec - sim.start.tv_sec) * 1000000000U +
+		now.tv_nsec - sim.start.tv_nsec;
+}
+
+static uint64_t
+sim_mtime(void)
+{
+	return sim.mtime + (sim_ns() - sim.mtime_ns) * sim.mtime_rate / 1000;
+}
+
+/* the mtimer is clocked by the system clock, so it slows down with it */
+static void
+sim_mtime_rate(unsigned int rate)
+{
+	sim.mtime = sim_mtime();
+	sim.mtime_ns = sim_ns();
+	sim.mtime_rate = rate;
+}
+
+/* rx fifo */
+
+static unsigned int
+rx_used(void)
+{
+	return sim.rxhead - sim.rxtail;
+}
+
+static bool
+rx_room(unsigned int words)
+{
+	unsigned int size = sim.reg[R(GRFLEN)] & 0xffffU;
+
+	return rx_used() + words <= size && rx_used() + words <= RX_WORDS;
+}
+
+static void
+rx_push(uint32_t word)
+{
+	sim.rx[sim.rxhead++ % RX_WORDS] = word;
+}
+
+static uint32_t
+rx_pop(void)
+{
+	return sim.rx[sim.rxtail++ % RX_WORDS];
+}
+
+static void
+rx_push_packet(uint32_t status, const void *data, unsigned int len)
+{
+	const uint8_t *p = data;
+
+	rx_push(status | USBFS_GRSTAT_BCOUNT(len));
+	for (; len > 0; len -= (len < 4) ? len : 4, p += 4) {
+		uint32_t v = 0;
+
+		memcpy(&v, p, (len < 4) ? len : 4);
+		rx_push(v);
+	}
+}
+
+static void
+rx_flush(void)
+{
+	sim.rxtail = sim.rxhead;
+	sim.rxdata = 0;
+}
+
+static uint32_t
+rx_status_pop(void)
+{
+	uint32_t status;
+	unsigned int ep;
+
+	if (sim.rxdata > 0) {
+		sim_error("GRSTATP popped with %u words of the last packet unread",
+				sim.rxdata);
+		sim.rxtail += sim.rxdata;
+		sim.rxdata = 0;
+	}
+	if (rx_used() == 0) {
+		sim_error("GRSTATP popped from an empty rx fifo");
+		return 0;
+	}
+
+	status = rx_pop();
+	ep = status & USBFS_GRSTAT_EPNUM_Msk;
+	sim.rxdata = (((status & USBFS_GRSTAT_BCOUNT_Msk) >> USBFS_GRSTAT_BCOUNT_Pos) + 3) / 4;
+
+	/* the completion entries raise their interrupt when popped */
+	switch (status & USBFS_GRSTAT_RPCKST_Msk) {
+	case USBFS_GRSTAT_RPCKST_TF:
+		sim.reg[R_DOEP(ep, INTF)] |= USBFS_DOEPINTF_TF;
+		break;
+	case USBFS_GRSTAT_RPCKST_STPF:
+		sim.reg[R_DOEP(ep, INTF)] |= USBFS_DOEPINTF_STPF;
+		break;
+	}
+	return status;
+}
+
+/* tx fifos */
+
+static unsigned int
+tx_size(unsigned int ep)
+{
+	uint32_t tflen = (ep == 0) ? sim.reg[R(DIEP0TFLEN)] : sim.reg[R(DIEP1TFLEN) + ep - 1];
+	unsigned int size = tflen >> 16;
+
+	return (size < TX_WORDS) ? size : TX_WORDS;
+}
+
+static void
+tx_flush(unsigned int ep)
+{
+	sim.txlen[ep] = 0;
+}
+
+static bool
+tx_empty_flag(unsigned int ep)
+{
+	/* GAHBCS.TXFTH selects completely instead of half empty */
+	if (sim.reg[R(GAHBCS)] & USBFS_GAHBCS_TXFTH)
+		return sim.txlen[ep] == 0;
+	return sim.txlen[ep] <= tx_size(ep) / 2;
+}
+
+/* interrupts */
+
+static uint32_t
+daepint(void)
+{
+	uint32_t ret = 0;
+
+	for (unsigned int ep = 0; ep < 4; ep++) {
+		uint32_t in = sim.reg[R_DIEP(ep, INTF)] & sim.reg[R(DIEPINTEN)];
+
+		if ((sim.reg[R(DIEPFEINTEN)] & USBFS_DIEPFEINTEN_IEPTXFEIE(1U << ep)) &&
+				tx_empty_flag(ep))
+			in |= USBFS_DIEPINTF_TXFE;
+		if (in)
+			ret |= 1U << ep;
+		if (sim.reg[R_DOEP(ep, INTF)] & sim.reg[R(DOEPINTEN)])
+			ret |= 1U << (16 + ep);
+	}
+	return ret;
+}
+
+static uint32_t
+gintf(void)
+{
+	uint32_t ret = sim.reg[R(GINTF)] & GINTF_W1C;
+	uint32_t daep = daepint() & sim.reg[R(DAEPINTEN)];
+
+	if (!(sim.reg[R(GUSBCS)] & USBFS_GUSBCS_FDM))
+		ret |= USBFS_GINTF_COPM;
+	if (rx_used() > sim.rxdata)
+		ret |= USBFS_GINTF_RXFNEIF;
+	if (sim.gonak)
+		ret |= USBFS_GINTF_GONAK;
+	if (daep & 0xffffU)
+		ret |= USBFS_GINTF_IEPIF;
+	if (daep >> 16)
+		ret |= USBFS_GINTF_OEPIF;
+	return ret;
+}
+
+static bool
+irq_line(void)
+{
+	return (sim.reg[R(GAHBCS)] & USBFS_GAHBCS_GINTEN) &&
+		(gintf() & sim.reg[R(GINTEN)]) &&
+		ECLIC->clicint[USBFS_IRQn].ie;
+}
+
+/*
+ * Called from the host side after changing the model. The firmware
+ * takes microseconds to handle an interrupt, while the host sends at
+ * most a few packets per frame, so let the firmware catch up before
+ * the next transaction. Without that the firmware may see events in
+ * an order the real bus never produces.
+ */
+static void
+irq_kick(void)
+{
+	struct timespec ts = { .tv_nsec = 10000 };
+	bool kicked = false;
+
+	for (unsigned int i = 0; i < 10000; i++) {
+		bool line, busy;
+
+		pthread_mutex_lock(&sim.lock);
+		line = irq_line();
+		busy = sim.handling;
+		pthread_mutex_unlock(&sim.lock);
+		if (!line && !busy)
+			return;
+		if (line && !busy && !kicked) {
+			pthread_kill(sim.device, SIM_IRQ_SIGNAL);
+			kicked = true;
+		}
+		nanosleep(&ts, NULL);
+	}
+}
+
+/* register model */
+
+static void
+core_reset(void)
+{
+	memset(sim.reg, 0, sizeof(sim.reg));
+	sim.reg[R(GRSTCTL)] = USBFS_GRSTCTL_DMAIDL;
+	sim.reg[R(CID)] = 0x00001000U;
+	rx_flush();
+	for (unsigned int ep = 0; ep < 4; ep++) {
+		tx_flush(ep);
+		sim.in_nak[ep] = true;
+		sim.out_nak[ep] = true;
+		sim.in_pid[ep] = 0;
+		sim.out_pid[ep] = 0;
+	}
+	sim.gonak = false;
+}
+
+static unsigned int
+ep0_packetsize(uint32_t ctl)
+{
+	return 64U >> (ctl & USBFS_DIEP0CTL_MPL_Msk);
+}
+
+static uint32_t
+usbfs_read(uintptr_t offset, bool peek)
+{
+	unsigned int r = offset / 4;
+	unsigned int ep;
+
+	if (offset >= USBFS_DATA_FIFO_OFFSET) {
+		if (peek)
+			return 0;
+		if (sim.rxdata == 0) {
+			sim_error("DFIFO read without a packet");
+			return 0;
+		}
+		sim.rxdata--;
+		return rx_pop();
+	}
+
+	sim.stats.reads += !peek;
+
+	if (r == R(GINTF))
+		return gintf();
+	if (r == R(GRSTATR))
+		return (rx_used() > sim.rxdata) ? sim.rx[(sim.rxtail + sim.rxdata) % RX_WORDS] : 0;
+	if (r == R(GRSTATP))
+		return peek ? 0 : rx_status_pop();
+	if (r == R(DAEPINT))
+		return daepint();
+
+	for (ep = 0; ep < 4; ep++) {
+		if (r == R_DIEP(ep, CTL))
+			return sim.reg[r] |
+				(sim.in_nak[ep] ? USBFS_DIEPCTL_NAKS : 0) |
+				(sim.in_pid[ep] ? USBFS_DIEPCTL_DPID : 0);
+		if (r == R_DIEP(ep, INTF))
+			return sim.reg[r] | (tx_empty_flag(ep) ? USBFS_DIEPINTF_TXFE : 0);
+		if (r == R_DIEP(ep, TFSTAT))
+			return tx_size(ep) - sim.txlen[ep];
+		if (r == R_DOEP(ep, CTL))
+			return sim.reg[r] |
+				(sim.out_nak[ep] ? USBFS_DOEPCTL_NAKS : 0) |
+				(sim.out_pid[ep] ? USBFS_DOEPCTL_DPID : 0);
+	}
+	return sim.reg[r];
+}
+
+static void
+ep_ctl_write(unsigned int r, uint32_t val, bool *nak, uint8_t *pid,
+		unsigned int intf, uint32_t epdis, bool setpid)
+{
+	uint32_t old = sim.reg[r];
+	uint32_t en = (old | val) & USBFS_DIEPCTL_EPEN;
+
+	if ((val & USBFS_DIEPCTL_EPD) && (old & USBFS_DIEPCTL_EPEN)) {
+		en = 0;
+		sim.reg[intf] |= epdis;
+	}
+	if (val & USBFS_DIEPCTL_SNAK)
+		*nak = true;
+	if (val & USBFS_DIEPCTL_CNAK)
+		*nak = false;
+	/* endpoint 0 doesn't have the pid bits */
+	if (setpid && (val & USBFS_DIEPCTL_SD0PID))
+		*pid = 0;
+	if (setpid && (val & USBFS_DIEPCTL_SD1PID))
+		*pid = 1;
+	sim.reg[r] = (val & ~DIEPCTL_ACTIONS) | en;
+}
+
+static void
+usbfs_write(uintptr_t offset, uint32_t val)
+{
+	unsigned int r = offset / 4;
+	unsigned int ep;
+
+	if (offset >= USBFS_DATA_FIFO_OFFSET) {
+		ep = (offset - USBFS_DATA_FIFO_OFFSET) / USBFS_DATA_FIFO_SIZE;
+		if (sim.txlen[ep] >= tx_size(ep)) {
+			sim_error("tx fifo %u overflow", ep);
+			return;
+		}
+		sim.tx[ep][sim.txlen[ep]++] = val;
+		return;
+	}
+
+	sim.stats.writes++;
+
+	if (r == R(GINTF)) {
+		sim.reg[r] &= ~(val & GINTF_W1C);
+		return;
+	}
+	if (r == R(GRSTCTL)) {
+		if (val & USBFS_GRSTCTL_CSRST) {
+			core_reset();
+			return;
+		}
+		if (val & USBFS_GRSTCTL_TXFF) {
+			unsigned int n = (val & USBFS_GRSTCTL_TXFNUM_Msk) >> USBFS_GRSTCTL_TXFNUM_Pos;
+
+			if (n >= 0x10)
+				for (ep = 0; ep < 4; ep++)
+					tx_flush(ep);
+			else if (n < 4)
+				tx_flush(n);
+		}
+		if (val & USBFS_GRSTCTL_RXFF)
+			rx_flush();
+		sim.reg[r] = (val & ~(USBFS_GRSTCTL_TXFF | USBFS_GRSTCTL_RXFF)) |
+			USBFS_GRSTCTL_DMAIDL;
+		return;
+	}
+	if (r == R(GRSTATR) || r == R(GRSTATP) || r == R(DAEPINT) ||
+			r == R(CID) || r == R(DSTAT))
+		return;
+	if (r == R(DCTL)) {
+		if ((val & USBFS_DCTL_RWKUP) && (sim.reg[R(DSTAT)] & USBFS_DSTAT_SPST)) {
+			uint64_t ns = sim_ns() - sim.suspend_ns;
+
+			if (ns < RWKUP_AFTER_NS)
+				sim_error("remote wakeup %lu us after suspend",
+						(unsigned long)(ns / 1000));
+			/* the host answers by resuming the bus */
+			sim.rwkup = true;
+			sim.reg[R(DSTAT)] &= ~USBFS_DSTAT_SPST;
+		}
+		/* the global OUT NAK takes effect right away */
+		if (val & USBFS_DCTL_SGONAK)
+			sim.gonak = true;
+		if (val & USBFS_DCTL_CGONAK)
+			sim.gonak = false;
+		sim.reg[r] = (val & (USBFS_DCTL_POIF | USBFS_DCTL_SD | USBFS_DCTL_RWKUP)) |
+			(sim.gonak ? USBFS_DCTL_GONS : 0);
+		return;
+	}
+
+	for (ep = 0; ep < 4; ep++) {
+		if (r == R_DIEP(ep, CTL)) {
+			ep_ctl_write(r, val, &sim.in_nak[ep], &sim.in_pid[ep],
+					R_DIEP(ep, INTF), USBFS_DIEPINTF_EPDIS, ep > 0);
+			/* and so does the NAK of an IN endpoint */
+			if (val & USBFS_DIEPCTL_SNAK)
+				sim.reg[R_DIEP(ep, INTF)] |= USBFS_DIEPINTF_IEPNE;
+			return;
+		}
+		if (r == R_DOEP(ep, CTL)) {
+			ep_ctl_write(r, val, &sim.out_nak[ep], &sim.out_pid[ep],
+					R_DOEP(ep, INTF), USBFS_DOEPINTF_EPDIS, ep > 0);
+			return;
+		}
+		if (r == R_DIEP(ep, INTF) || r == R_DOEP(ep, INTF)) {
+			sim.reg[r] &= ~val;
+			return;
+		}
+		if (r == R_DIEP(ep, TFSTAT))
+			return;
+	}
+	sim.reg[r] = val;
+}
+
+static uint32_t
+mtimer_read(uintptr_t offset, bool peek)
+{
+	volatile uint32_t *reg = (volatile uint32_t *)(MTIMER_BASE + offset);
+
+	switch (offset) {
+	case MTIMER_MTIME_LO:
+		return sim_mtime();
+	case MTIMER_MTIME_HI:
+		return sim_mtime() >> 32;
+	}
+	return *reg;
+}
+
+static void
+mtimer_write(uintptr_t offset, uint32_t val)
+{
+	/* mtime can't be set and the rest is plain memory */
+	if (offset == MTIMER_MTIME_LO || offset == MTIMER_MTIME_HI)
+		sim_error("mtime written");
+}
+
+static uint32_t
+dbg_read(uintptr_t offset, bool peek)
+{
+	return 0;
+}
+
+static void
+dbg_write(uintptr_t offset, uint32_t val)
+{
+	switch (offset) {
+	case offsetof(struct gd32vf103_dbg, KEY):
+		sim.dbg_key = val;
+		break;
+	case offsetof(struct gd32vf103_dbg, CMD):
+		if (sim.dbg_key == DBG_KEY_UNLOCK && (val & DBG_CMD_RESET))
+			sim.reset = true;
+		break;
+	}
+}
+
+static const struct sim_region sim_regions[] = {
+	{ USBFS_BASE, USBFS_DATA_FIFO_OFFSET + 4 * USBFS_DATA_FIFO_SIZE, usbfs_read, usbfs_write },
+	{ MTIMER_BASE, SIM_PAGE, mtimer_read, mtimer_write },
+	{ DBG_BASE & ~(SIM_PAGE - 1), SIM_PAGE, dbg_read, dbg_write },
+};
+
+/* plain memory */
+static const struct {
+	uintptr_t base;
+	size_t size;
+} sim_memory[] = {
+	{ RCU_BASE, SIM_PAGE },
+	{ ECLIC_BASE, 2 * SIM_PAGE },
+};
+
+uint32_t
+sim_reg(unsigned int offset)
+{
+	uint32_t ret;
+
+	pthread_mutex_lock(&sim.lock);
+	ret = usbfs_read(offset & ~3U, true);
+	pthread_mutex_unlock(&sim.lock);
+	return ret;
+}
+
+void
+sim_stats(struct sim_stats *stats)
+{
+	pthread_mutex_lock(&sim.lock);
+	*stats = sim.stats;
+	pthread_mutex_unlock(&sim.lock);
+}
+
+bool
+sim_reset_requested(void)
+{
+	bool ret;
+
+	pthread_mutex_lock(&sim.lock);
+	ret = sim.reset;
+	pthread_mutex_unlock(&sim.lock);
+	return ret;
+}
+
+bool
+sim_remote_wakeup(void)
+{
+	bool ret;
+
+	pthread_mutex_lock(&sim.lock);
+	ret = sim.rwkup;
+	pthread_mutex_unlock(&sim.lock);
+	return ret;
+}
+
+/* access trapping */
+
+static void
+sim_halted(void)
+{
+	/* after a software reset the firmware thread just sleeps */
+	while (1)
+		pause();
+}
+
+static void
+sim_segv(int sig, siginfo_t *si, void *ctx)
+{
+	ucontext_t *uc = ctx;
+	uintptr_t addr = (uintptr_t)si->si_addr;
+	const struct sim_region *region = NULL;
+	uintptr_t offset;
+	void *page;
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(sim_regions); i++) {
+		if (addr >= sim_regions[i].base &&
+				addr < sim_regions[i].base + sim_regions[i].size)
+			region = &sim_regions[i];
+	}
+	if (region == NULL || pthread_self() != sim.device) {
+		/* a real crash, let it happen */
+		signal(SIGSEGV, SIG_DFL);
+		return;
+	}
+
+	offset = (addr - region->base) & ~3UL;
+	page = (void *)((addr & ~(SIM_PAGE - 1)));
+
+	/* released again when the access has been stepped */
+	pthread_mutex_lock(&sim.lock);
+	sim.step.region = region;
+	sim.step.offset = offset;
+	/* bit 1 of the page fault error code is set for writes */
+	sim.step.write = uc->uc_mcontext.gregs[REG_ERR] & 2;
+
+	mprotect(page, SIM_PAGE, PROT_READ | PROT_WRITE);
+	/*
+	 * a read sees the value of the register, while a write starts
+	 * from it, since it may be a read-modify-write instruction.
+	 */
+	*(volatile uint32_t *)(region->base + offset) =
+		region->read(offset, sim.step.write);
+
+	/* no interrupts until the access is done */
+	sim.step.unblock = !sigismember(&uc->uc_sigmask, SIM_IRQ_SIGNAL);
+	sigaddset(&uc->uc_sigmask, SIM_IRQ_SIGNAL);
+	uc->uc_mcontext.gregs[REG_EFL] |= SIM_TRAP_FLAG;
+}
+
+static void
+sim_trap(int sig, siginfo_t *si, void *ctx)
+{
+	ucontext_t *uc = ctx;
+	const struct sim_region *region = sim.step.region;
+	uintptr_t offset = sim.step.offset;
+	uintptr_t addr = region->base + offset;
+	bool line;
+
+	uc->uc_mcontext.gregs[REG_EFL] &= ~SIM_TRAP_FLAG;
+
+	if (sim.step.write)
+		region->write(offset, *(volatile uint32_t *)addr);
+	mprotect((void *)(addr & ~(SIM_PAGE - 1)), SIM_PAGE, PROT_NONE);
+
+	if (sim.reset) {
+		/* stop the firmware where it is */
+		greg_t sp = uc->uc_mcontext.gregs[REG_RSP];
+
+		uc->uc_mcontext.gregs[REG_RSP] = ((sp - 256) & ~15L) - 8;
+		uc->uc_mcontext.gregs[REG_RIP] = (greg_t)sim_halted;
+		pthread_mutex_unlock(&sim.lock);
+		return;
+	}
+
+	line = irq_line();
+	pthread_mutex_unlock(&sim.lock);
+
+	if (sim.step.unblock)
+		sigdelset(&uc->uc_sigmask, SIM_IRQ_SIGNAL);
+	if (line)
+		pthread_kill(sim.device, SIM_IRQ_SIGNAL);
+}
+
+static void
+sim_irq(int sig)
+{
+	unsigned long mstatus = sim.mstatus;
+	unsigned int n;
+
+	/* like a trap on the chip this disables interrupts */
+	sim.mstatus &= ~CSR_MSTATUS_MIE;
+	sim.level++;
+	for (n = 0; ; n++) {
+		bool line;
+
+		pthread_mutex_lock(&sim.lock);
+		line = irq_line();
+		if (line && n == 1000) {
+			sim_error("interrupt storm, GINTF = 0x%08x, DAEPINT = 0x%08x",
+					gintf(), daepint());
+			ECLIC->clicint[USBFS_IRQn].ie = 0;
+			line = false;
+		}
+		if (line)
+			sim.stats.irqs++;
+		sim.handling = line;
+		pthread_mutex_unlock(&sim.lock);
+		if (!line)
+			break;
+		USBFS_IRQHandler();
+	}
+	sim.level--;
+	sim.mstatus = mstatus;
+}
+
+/* core emulation for the firmware thread */
+
+static void
+sim_mstatus_update(void)
+{
+	sigset_t set;
+
+	/* the signal mask is restored when the handler returns */
+	if (sim.level > 0)
+		return;
+	sigemptyset(&set);
+	sigaddset(&set, SIM_IRQ_SIGNAL);
+	pthread_sigmask((sim.mstatus & CSR_MSTATUS_MIE) ? SIG_UNBLOCK : SIG_BLOCK,
+			&set, NULL);
+}
+
+unsigned long
+csr_read(unsigned int csr)
+{
+	switch (csr) {
+	case CSR_MSTATUS:
+		return sim.mstatus;
+	case CSR_MINTSTATUS:
+		return sim.level ? CSR_MINTSTATUS_MIL(0xffUL) : 0;
+	}
+	return 0;
+}
+
+unsigned long
+csr_swap(unsigned int csr, unsigned long val)
+{
+	unsigned long ret = csr_read(csr);
+
+	csr_write(csr, val);
+	return ret;
+}
+
+unsigned long
+csr_read_set(unsigned int csr, unsigned long val)
+{
+	unsigned long ret = csr_read(csr);
+
+	csr_write(csr, ret | val);
+	return ret;
+}
+
+unsigned long
+csr_read_clear(unsigned int csr, unsigned long val)
+{
+	unsigned long ret = csr_read(csr);
+
+	csr_write(csr, ret & ~val);
+	return ret;
+}
+
+void
+csr_write(unsigned int csr, unsigned long val)
+{
+	if (csr != CSR_MSTATUS)
+		return;
+	sim.mstatus = val;
+	sim_mstatus_update();
+}
+
+void
+csr_set(unsigned int csr, unsigned long val)
+{
+	csr_read_set(csr, val);
+}
+
+void
+csr_clear(unsigned int csr, unsigned long val)
+{
+	csr_read_clear(csr, val);
+}
+
+void
+wait_for_interrupt(void)
+{
+	struct timespec ts = { .tv_nsec = 100000 };
+	sigset_t set, old;
+	bool line;
+
+	/* a pending interrupt ends wfi even with interrupts disabled */
+	sigemptyset(&set);
+	sigaddset(&set, SIM_IRQ_SIGNAL);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	pthread_mutex_lock(&sim.lock);
+	line = irq_line();
+	pthread_mutex_unlock(&sim.lock);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (!line)
+		nanosleep(&ts, NULL);
+}
+
+void
+nop(void)
+{
+}
+
+void
+mtimer_delay(uint32_t ticks)
+{
+	uint64_t end = sim_mtime() + ticks;
+	uint64_t now;
+
+	while ((now = sim_mtime()) < end) {
+		struct timespec ts = {
+			.tv_nsec = (end - now) * 1000 / sim.mtime_rate,
+		};
+
+		nanosleep(&ts, NULL);
+	}
+}
+
+void
+eclic_config(unsigned int irq, uint8_t type, uint8_t priority)
+{
+	ECLIC->clicint[irq].attr = type;
+	ECLIC->clicint[irq].ctl = priority;
+}
+
+uint32_t
+rcu_sysclk_irc8m(void)
+{
+	sim_mtime_rate(MTIME_SLOW);
+	return 2;
+}
+
+void
+rcu_sysclk_restore(uint32_t scs)
+{
+	sim_mtime_rate(MTIME_FAST);
+}
+
+/* host side */
+
+static void *
+sim_device(void *arg)
+{
+	sim.main();
+	sim_halted();
+	return NULL;
+}
+
+void
+sim_start(void (*device)(void))
+{
+	struct sigaction sa = {
+		.sa_flags = SA_SIGINFO,
+	};
+	sigset_t set;
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(sim_regions); i++) {
+		void *p = mmap((void *)sim_regions[i].base, sim_regions[i].size,
+				PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+
+		if (p != (void *)sim_regions[i].base) {
+			perror("usbfs-sim: mmap");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (unsigned int i = 0; i < ARRAY_SIZE(sim_memory); i++) {
+		void *p = mmap((void *)sim_memory[i].base, sim_memory[i].size,
+				PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+
+		if (p != (void *)sim_memory[i].base) {
+			perror("usbfs-sim: mmap");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &sim.start);
+	sim.mtime_rate = MTIME_FAST;
+	core_reset();
+
+	/* the interrupt must not nest inside an access */
+	sigemptyset(&sa.sa_mask);
+	sigaddset(&sa.sa_mask, SIM_IRQ_SIGNAL);
+	sa.sa_sigaction = sim_segv;
+	sigaction(SIGSEGV, &sa, NULL);
+	sa.sa_sigaction = sim_trap;
+	sigaction(SIGTRAP, &sa, NULL);
+	sa.sa_flags = 0;
+	sa.sa_handler = sim_irq;
+	sigaction(SIM_IRQ_SIGNAL, &sa, NULL);
+
+	/* the firmware starts with interrupts disabled, like on reset */
+	sigemptyset(&set);
+	sigaddset(&set, SIM_IRQ_SIGNAL);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	sim.mstatus = 0;
+
+	sim.main = device;
+	pthread_mutex_lock(&sim.lock);
+	if (pthread_create(&sim.device, NULL, sim_device, NULL)) {
+		perror("usbfs-sim: pthread_create");
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_unlock(&sim.lock);
+}
+
+static void
+sim_wait_cleared(uint32_t flag, const char *name)
+{
+	struct timespec ts = { .tv_nsec = 20000 };
+
+	for (unsigned int i = 0; i < 50000; i++) {
+		uint32_t flags;
+
+		pthread_mutex_lock(&sim.lock);
+		flags = sim.reg[R(GINTF)];
+		pthread_mutex_unlock(&sim.lock);
+		if (!(flags & flag))
+			return;
+		irq_kick();
+		nanosleep(&ts, NULL);
+	}
+	pthread_mutex_lock(&sim.lock);
+	sim_error("%s interrupt never cleared", name);
+	sim.reg[R(GINTF)] &= ~flag;
+	pthread_mutex_unlock(&sim.lock);
+}
+
+static void
+sim_raise(uint32_t flag, const char *name)
+{
+	pthread_mutex_lock(&sim.lock);
+	sim.reg[R(GINTF)] |= flag;
+	pthread_mutex_unlock(&sim.lock);
+	irq_kick();
+	sim_wait_cleared(flag, name);
+}
+
+/* the host only sees the device once it has powered the phy and connected */
+static void
+sim_wait_connected(void)
+{
+	struct timespec ts = { .tv_nsec = 100000 };
+
+	for (unsigned int i = 0; i < 10000; i++) {
+		bool connected;
+
+		pthread_mutex_lock(&sim.lock);
+		connected = (sim.reg[R(GCCFG)] & USBFS_GCCFG_PWRON) &&
+			(sim.reg[R(GAHBCS)] & USBFS_GAHBCS_GINTEN) &&
+			!(sim.reg[R(DCTL)] & USBFS_DCTL_SD);
+		pthread_mutex_unlock(&sim.lock);
+		if (connected)
+			return;
+		nanosleep(&ts, NULL);
+	}
+	sim_error("the device never connected");
+}
+
+void
+sim_bus_reset(void)
+{
+	sim_wait_connected();
+	pthread_mutex_lock(&sim.lock);
+	/* model choice: a bus reset disables all endpoints */
+	for (unsigned int ep = 0; ep < 4; ep++) {
+		sim.reg[R_DIEP(ep, CTL)] &= ~USBFS_DIEPCTL_EPEN;
+		sim.reg[R_DOEP(ep, CTL)] &= ~USBFS_DOEPCTL_EPEN;
+		sim.in_nak[ep] = true;
+		sim.out_nak[ep] = true;
+		sim.in_pid[ep] = 0;
+		sim.out_pid[ep] = 0;
+	}
+	sim.reg[R(DSTAT)] = 0;
+	sim.rwkup = false;
+	pthread_mutex_unlock(&sim.lock);
+	sim_raise(USBFS_GINTF_RST, "reset");
+
+	pthread_mutex_lock(&sim.lock);
+	sim.reg[R(DSTAT)] = USBFS_DSTAT_ES_FULL;
+	pthread_mutex_unlock(&sim.lock);
+	sim_raise(USBFS_GINTF_ENUMF, "enumeration done");
+}
+
+void
+sim_suspend(void)
+{
+	pthread_mutex_lock(&sim.lock);
+	sim.reg[R(DSTAT)] |= USBFS_DSTAT_SPST;
+	sim.rwkup = false;
+	sim.suspend_ns = sim_ns();
+	pthread_mutex_unlock(&sim.lock);
+	sim_raise(USBFS_GINTF_SP, "suspend");
+}
+
+void
+sim_resume(void)
+{
+	pthread_mutex_lock(&sim.lock);
+	sim.reg[R(DSTAT)] &= ~USBFS_DSTAT_SPST;
+	pthread_mutex_unlock(&sim.lock);
+	sim_raise(USBFS_GINTF_WKUPIF, "wakeup");
+}
+
+int
+sim_setup(const void *packet)
+{
+	uint32_t len;
+
+	pthread_mutex_lock(&sim.lock);
+	/* setup packets are never NAKed, but dropped if there's no room */
+	if (!rx_room(1 + 2 + 1)) {
+		pthread_mutex_unlock(&sim.lock);
+		return SIM_NAK;
+	}
+
+	/* a setup packet clears the stalls and NAKs both directions */
+	sim.reg[R_DIEP(0, CTL)] &= ~USBFS_DIEPCTL_STALL;
+	sim.reg[R_DOEP(0, CTL)] &= ~USBFS_DOEPCTL_STALL;
+	sim.in_nak[0] = true;
+	sim.out_nak[0] = true;
+	/* the data and status stages start with DATA1 */
+	sim.in_pid[0] = 1;
+	sim.out_pid[0] = 1;
+
+	len = sim.reg[R_DOEP(0, LEN)];
+	if (!(len & USBFS_DOEPLEN_STPCNT_Msk))
+		sim_error("setup packet with STPCNT = 0");
+	else
+		sim.reg[R_DOEP(0, LEN)] = len - USBFS_DOEPLEN_STPCNT(1U);
+
+	/*
+	 * the core only adds the setup done entry when the host moves
+	 * on to the data or status stage, but nothing here depends on
+	 * that, so add it right away.
+	 */
+	rx_push_packet(USBFS_GRSTAT_RPCKST_STP, packet, 8);
+	rx_push_packet(USBFS_GRSTAT_RPCKST_STPF, NULL, 0);
+	pthread_mutex_unlock(&sim.lock);
+	irq_kick();
+	return 0;
+}
+
+int
+sim_out(unsigned int ep, const void *data, unsigned int len, unsigned int pid)
+{
+	unsigned int r = R_DOEP(ep, CTL);
+	uint32_t ctl, doeplen;
+	unsigned int packetsize, pcnt, tlen;
+	int ret = 0;
+
+	pthread_mutex_lock(&sim.lock);
+	ctl = sim.reg[r];
+	packetsize = (ep == 0) ? ep0_packetsize(ctl) : (ctl & USBFS_DOEPCTL_MPL_Msk);
+	if (ctl & USBFS_DOEPCTL_STALL) {
+		ret = SIM_STALL;
+		goto out;
+	}
+	if (!(ctl & USBFS_DOEPCTL_EPEN) || sim.out_nak[ep] || sim.gonak ||
+			!rx_room(1 + (len + 3) / 4 + 1)) {
+		ret = SIM_NAK;
+		goto out;
+	}
+	if (len > packetsize) {
+		sim_error("host sent %u bytes to OUT endpoint %u with %u byte packets",
+				len, ep, packetsize);
+		ret = SIM_STALL;
+		goto out;
+	}
+	if (pid != sim.out_pid[ep])
+		goto out;
+	sim.out_pid[ep] ^= 1;
+
+	doeplen = sim.reg[R_DOEP(ep, LEN)];
+	pcnt = (doeplen & USBFS_DOEPLEN_PCNT_Msk) >> USBFS_DOEPLEN_PCNT_Pos;
+	tlen = doeplen & USBFS_DOEPLEN_TLEN_Msk;
+	if (pcnt == 0 || len > tlen) {
+		sim_error("OUT endpoint %u enabled for %u packets, %u bytes, but got %u bytes",
+				ep, pcnt, tlen, len);
+		ret = SIM_STALL;
+		goto out;
+	}
+	pcnt--;
+	tlen -= len;
+	sim.reg[R_DOEP(ep, LEN)] = (doeplen & USBFS_DOEPLEN_STPCNT_Msk) |
+		USBFS_DOEPLEN_PCNT(pcnt) | tlen;
+
+	rx_push_packet(USBFS_GRSTAT_RPCKST_PKT | USBFS_GRSTAT_EPNUM(ep) |
+			USBFS_GRSTAT_DPID(pid ? 2U : 0U), data, len);
+	/* a short packet also ends the transfer */
+	if (pcnt == 0 || len < packetsize) {
+		sim.reg[r] &= ~USBFS_DOEPCTL_EPEN;
+		if (sim.drop_tf)
+			sim.drop_tf = false;
+		else
+			rx_push_packet(USBFS_GRSTAT_RPCKST_TF | USBFS_GRSTAT_EPNUM(ep), NULL, 0);
+	}
+out:
+	pthread_mutex_unlock(&sim.lock);
+	irq_kick();
+	return ret;
+}
+
+void
+sim_drop_out_complete(void)
+{
+	pthread_mutex_lock(&sim.lock);
+	sim.drop_tf = true;
+	pthread_mutex_unlock(&sim.lock);
+}
+
+int
+sim_in(unsigned int ep, void *buf, unsigned int size, unsigned int *pid)
+{
+	unsigned int r = R_DIEP(ep, CTL);
+	uint32_t ctl, dieplen;
+	unsigned int packetsize, pcnt, tlen, len, words;
+	uint8_t *p = buf;
+	int ret;
+
+	pthread_mutex_lock(&sim.lock);
+	ctl = sim.reg[r];
+	packetsize = (ep == 0) ? ep0_packetsize(ctl) : (ctl & USBFS_DIEPCTL_MPL_Msk);
+	dieplen = sim.reg[R_DIEP(ep, LEN)];
+	pcnt = (dieplen & USBFS_DIEPLEN_PCNT_Msk) >> USBFS_DIEPLEN_PCNT_Pos;
+	tlen = dieplen & USBFS_DIEPLEN_TLEN_Msk;
+	len = (tlen < packetsize) ? tlen : packetsize;
+	words = (len + 3) / 4;
+
+	if (ctl & USBFS_DIEPCTL_STALL) {
+		ret = SIM_STALL;
+		goto out;
+	}
+	/* a packet is only sent once it is all in the fifo */
+	if (!(ctl & USBFS_DIEPCTL_EPEN) || sim.in_nak[ep] || sim.txlen[ep] < words) {
+		ret = SIM_NAK;
+		goto out;
+	}
+	if (pcnt == 0) {
+		sim_error("IN endpoint %u enabled without packets", ep);
+		ret = SIM_NAK;
+		goto out;
+	}
+	if (ep > 0 && ((ctl & USBFS_DIEPCTL_TXFNUM_Msk) >> USBFS_DIEPCTL_TXFNUM_Pos) != ep)
+		sim_error("IN endpoint %u uses tx fifo %u", ep,
+				(ctl & USBFS_DIEPCTL_TXFNUM_Msk) >> USBFS_DIEPCTL_TXFNUM_Pos);
+	if (len > size) {
+		sim_error("IN endpoint %u sent %u bytes, the host asked for %u",
+				ep, len, size);
+		len = size;
+	}
+
+	for (unsigned int i = 0; i < words; i++) {
+		uint32_t v = sim.tx[ep][i];
+		unsigned int n = len - 4 * i;
+
+		if (n > 4)
+			n = 4;
+		memcpy(p + 4 * i, &v, n);
+	}
+	sim.txlen[ep] -= words;
+	memmove(sim.tx[ep], sim.tx[ep] + words, 4 * sim.txlen[ep]);
+
+	*pid = sim.in_pid[ep];
+	sim.in_pid[ep] ^= 1;
+	pcnt--;
+	tlen -= (len < tlen) ? len : tlen;
+	sim.reg[R_DIEP(ep, LEN)] = (dieplen & USBFS_DIEPLEN_MCPF_Msk) |
+		USBFS_DIEPLEN_PCNT(pcnt) | tlen;
+	if (pcnt == 0) {
+		sim.reg[r] &= ~USBFS_DIEPCTL_EPEN;
+		sim.reg[R_DIEP(ep, INTF)] |= USBFS_DIEPINTF_TF;
+		if (sim.txlen[ep] > 0)
+			sim_error("IN endpoint %u finished with %u words left in the fifo",
+					ep, sim.txlen[ep]);
+	}
+	ret = len;
+out:
+	pthread_mutex_unlock(&sim.lock);
+	irq_kick();
+	return ret;
+}
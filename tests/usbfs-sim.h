@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#ifndef USBFS_SIM_H
+#define USBFS_SIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * A register level model of the USBFS controller in device mode, so
+ * lib/usbfs-core.c and the class drivers run unmodified on the host.
+ *
+ * The firmware runs in a thread of its own. The USBFS, MTIMER and DBG
+ * register blocks are mapped at their real addresses but kept
+ * inaccessible, and every access the firmware makes faults and is
+ * single stepped through the model. That way reading GRSTATP pops the
+ * rx fifo, writing DFIFO pushes to a tx fifo, interrupt flags are
+ * write-1-to-clear and so on, just like on the chip. The USB
+ * interrupt is a signal sent to the firmware thread, which is blocked
+ * while the firmware has interrupts disabled. RCU and ECLIC are plain
+ * memory, and mtime follows the host's monotonic clock.
+ *
+ * Trapping single accesses relies on the page fault error code and
+ * the trap flag, so this only works on x86-64 Linux.
+ *
+ * The host side is everything else: the test calls the sim_*
+ * functions below to do bus resets and single transactions, which
+ * answer like the controller would on the bus, and the host_*
+ * functions to do whole control and bulk transfers with them.
+ */
+
+/* handshakes other than ACK */
+#define SIM_NAK      (-1)
+#define SIM_STALL    (-2)
+/* the device never answered, only from the host_* functions */
+#define HOST_TIMEOUT (-3)
+
+/* map the registers and start the firmware thread running device() */
+void sim_start(void (*device)(void));
+
+/* the number of errors seen, they're also printed to stderr */
+unsigned int sim_errors(void);
+void sim_error(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+
+/* the firmware did a software reset through DBG and has stopped */
+bool sim_reset_requested(void);
+
+/* register value as the firmware would read it, minus side effects */
+uint32_t sim_reg(unsigned int offset);
+
+struct sim_stats {
+	/* register accesses by the firmware */
+	uint32_t reads;
+	uint32_t writes;
+	/* runs of the interrupt handler */
+	uint32_t irqs;
+};
+void sim_stats(struct sim_stats *stats);
+
+/*
+ * Bus events. They return once the firmware has handled (cleared)
+ * the interrupt they raise, or after an error if it never does.
+ */
+void sim_bus_reset(void);
+void sim_suspend(void);
+void sim_resume(void);
+/* true once the firmware signalled remote wakeup while suspended */
+bool sim_remote_wakeup(void);
+
+/*
+ * Single transactions with DATA0/1 pid. They return 0 or the IN packet
+ * length for ACK, or SIM_NAK or SIM_STALL. An OUT packet with the
+ * wrong pid is acked, but dropped like the hardware does.
+ */
+int sim_setup(const void *packet);
+int sim_out(unsigned int ep, const void *data, unsigned int len, unsigned int pid);
+/*
+ * Drop the completion entry of the next OUT transfer, as if the host
+ * reset the bus right after its last packet. The data is still received.
+ */
+void sim_drop_out_complete(void);
+int sim_in(unsigned int ep, void *buf, unsigned int size, unsigned int *pid);
+
+/*
+ * The scripted host. Transactions are retried while the device NAKs
+ * for up to host_timeout milliseconds and data toggles are checked.
+ * host_control() returns the length of the data stage or one of the
+ * negative values above.
+ */
+extern unsigned int host_timeout;
+
+struct usb_setup_packet;
+
+int host_in(unsigned int ep, void *buf, unsigned int size);
+int host_out(unsigned int ep, const void *data, unsigned int len);
+int host_control(const struct usb_setup_packet *setup, void *data);
+int host_request(uint8_t type, uint8_t request, uint16_t value,
+		uint16_t index, uint16_t length, void *data);
+
+/* receive up to len bytes, stopping early at a short packet */
+int host_bulk_in(unsigned int ep, void *buf, unsigned int len, unsigned int packetsize);
+/*
+ * send len bytes, followed by a zero length packet if zlp is set and
+ * len is a multiple of packetsize
+ */
+int host_bulk_out(unsigned int ep, const void *data, unsigned int len,
+		unsigned int packetsize, bool zlp);
+
+/* reset the bus, set address 1 and the first configuration */
+struct host_device {
+	uint8_t device[18];
+	uint8_t config[512];
+	unsigned int config_len;
+};
+int host_enumerate(struct host_device *dev);
+
+#endif
@@ -0,0 +1,513 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "test.h"
+#include "usbfs-sim.h"
+
+#include "gd32vf103/usbfs.h"
+#include "lib/eclic.h"
+#include "lib/usbfs-core.h"
+
+/*
+ * Run lib/usbfs-core.c and lib/stdio-usbacm.c on the USBFS simulator,
+ * enumerate them, move data through the ACM endpoints and fuzz the
+ * control endpoint with random SETUP packets.
+ */
+
+/* lib/stdio-usbacm.h wants the stdio.h of this tree */
+void usbacm_init(uint8_t priority);
+size_t usbacm_read(void *buf, size_t len, uint32_t timeout);
+size_t usbacm_write(const void *buf, size_t len, uint32_t timeout);
+
+#define ACM_ENDPOINT   1
+#define ACM_PACKETSIZE 64
+#define CDC_INTERFACE  0
+
+/* the device echoes everything back, and sends a '!' when asked */
+static volatile bool device_wake;
+/* milliseconds usbacm_read() waits, and the number of reads done */
+static volatile uint32_t device_timeout;
+static volatile unsigned int device_reads;
+
+static void
+device(void)
+{
+	static uint8_t buf[512];
+
+	eclic_global_interrupt_enable();
+	usbacm_init(4);
+
+	while (1) {
+		size_t len = usbacm_read(buf, sizeof(buf), device_timeout);
+
+		device_reads++;
+		if (len > 0)
+			usbacm_write(buf, len, 1000);
+		if (device_wake) {
+			device_wake = false;
+			usbacm_write("!", 1, 1000);
+		}
+		usbfs_idle();
+	}
+}
+
+static void
+sleep_ms(unsigned int ms)
+{
+	struct timespec ts = {
+		.tv_sec = ms / 1000,
+		.tv_nsec = (ms % 1000) * 1000000L,
+	};
+
+	nanosleep(&ts, NULL);
+}
+
+/* the device may echo in several transfers, so collect them */
+static int
+echo_receive(uint8_t *buf, unsigned int len)
+{
+	unsigned int done = 0;
+
+	while (done < len) {
+		int ret = host_bulk_in(ACM_ENDPOINT, buf + done, len - done,
+				ACM_PACKETSIZE);
+
+		if (ret < 0)
+			return ret;
+		done += ret;
+	}
+	return done;
+}
+
+/*
+ * The host here can't send and receive at the same time, so send no
+ * more than the device can read into its buffer before reading it back.
+ */
+static bool
+echo(unsigned int len)
+{
+	static uint8_t out[4096];
+	static uint8_t in[4096];
+	unsigned int done;
+
+	test_fill(out, len);
+	memset(in, 0, len);
+	for (done = 0; done < len; ) {
+		unsigned int n = (len - done < 512) ? len - done : 512;
+		int ret;
+
+		ret = host_bulk_out(ACM_ENDPOINT, out + done, n, ACM_PACKETSIZE, false);
+		check(ret == (int)n, "echo of %u bytes: sent %d", len, ret);
+		ret = echo_receive(in + done, n);
+		check(ret == (int)n, "echo of %u bytes: received %d", len, ret);
+		if (ret != (int)n)
+			return false;
+		done += n;
+	}
+	check(memcmp(in, out, len) == 0, "echo of %u bytes: data differs", len);
+	return memcmp(in, out, len) == 0;
+}
+
+static void
+test_enumerate(void)
+{
+	struct host_device dev;
+	uint8_t buf[64];
+	int ret;
+
+	ret = host_enumerate(&dev);
+	check(ret == 0, "enumeration failed: %d", ret);
+
+	check(dev.device[0] == 18 && dev.device[1] == 0x01,
+			"bad device descriptor header %02x %02x",
+			dev.device[0], dev.device[1]);
+	check(dev.device[7] == USBFS_EP0_PACKETSIZE,
+			"bMaxPacketSize0 = %u", dev.device[7]);
+	check((dev.device[8] | dev.device[9] << 8) == 0x1d50 &&
+			(dev.device[10] | dev.device[11] << 8) == 0x613f,
+			"unexpected vendor/product id");
+	check(dev.config[1] == 0x02 && dev.config[4] == 2,
+			"bad configuration descriptor %02x, %u interfaces",
+			dev.config[1], dev.config[4]);
+	check((sim_reg(USBFS_DCFG) & USBFS_DCFG_DAR_Msk) == USBFS_DCFG_DAR(1U),
+			"address not set, DCFG = 0x%08x", sim_reg(USBFS_DCFG));
+
+	/* a wLength shorter than the descriptor cuts it short */
+	ret = host_request(0x80, 0x06, 0x0100, 0, 8, buf);
+	check(ret == 8, "short device descriptor: %d", ret);
+	ret = host_request(0x80, 0x06, 0x0200, 0, 255, buf);
+	check(ret == (int)dev.config_len, "long configuration request: %d", ret);
+}
+
+static void
+test_requests(void)
+{
+	uint8_t buf[64];
+	int ret;
+
+	ret = host_request(0x80, 0x00, 0, 0, 2, buf);
+	check(ret == 2 && buf[0] == 0 && buf[1] == 0,
+			"GET_STATUS: %d, %02x %02x", ret, buf[0], buf[1]);
+	ret = host_request(0x80, 0x08, 0, 0, 1, buf);
+	check(ret == 1 && buf[0] == 1, "GET_CONFIGURATION: %d, %u", ret, buf[0]);
+
+	ret = host_request(0x80, 0x06, 0x0300, 0x0409, 64, buf);
+	check(ret == 4 && buf[2] == 0x09 && buf[3] == 0x04,
+			"language ids: %d", ret);
+	ret = host_request(0x80, 0x06, 0x0302, 0x0409, 64, buf);
+	check(ret == 2 + 2 * 9 && buf[1] == 0x03 && buf[2] == 'G' && buf[18] == '3',
+			"product string: %d", ret);
+
+	/* unknown requests and descriptors stall, and the next one works */
+	ret = host_request(0x80, 0x06, 0x0309, 0, 64, buf);
+	check(ret == SIM_STALL, "unknown string: %d", ret);
+	ret = host_request(0x80, 0x06, 0x0600, 0, 10, buf);
+	check(ret == SIM_STALL, "device qualifier: %d", ret);
+	ret = host_request(0xc0, 0x42, 0, 0, 8, buf);
+	check(ret == SIM_STALL, "vendor request: %d", ret);
+	ret = host_request(0x40, 0x42, 0, 0, 8, buf);
+	check(ret == SIM_STALL, "vendor OUT request: %d", ret);
+	ret = host_request(0x80, 0x00, 0, 0, 2, buf);
+	check(ret == 2, "GET_STATUS after stall: %d", ret);
+
+	ret = host_request(0x01, 0x0b, 0, 1, 0, NULL);
+	check(ret == 0, "SET_INTERFACE: %d", ret);
+	ret = host_request(0x01, 0x0b, 1, 1, 0, NULL);
+	check(ret == SIM_STALL, "SET_INTERFACE alternate 1: %d", ret);
+
+	/* remote wakeup is reported in the device status */
+	ret = host_request(0x00, 0x03, 1, 0, 0, NULL);
+	check(ret == 0, "SET_FEATURE(DEVICE_REMOTE_WAKEUP): %d", ret);
+	ret = host_request(0x80, 0x00, 0, 0, 2, buf);
+	check(ret == 2 && buf[0] == 0x02, "GET_STATUS with remote wakeup: %02x", buf[0]);
+	ret = host_request(0x00, 0x01, 1, 0, 0, NULL);
+	check(ret == 0, "CLEAR_FEATURE(DEVICE_REMOTE_WAKEUP): %d", ret);
+	ret = host_request(0x80, 0x00, 0, 0, 2, buf);
+	check(ret == 2 && buf[0] == 0x00, "GET_STATUS without remote wakeup: %02x", buf[0]);
+}
+
+static void
+test_acm(void)
+{
+	static const uint8_t coding[7] = { 0x00, 0xc2, 0x01, 0x00, 0, 0, 8 };
+	uint8_t buf[7];
+	int ret;
+
+	ret = host_request(0x21, 0x20, 0, CDC_INTERFACE, 7, (void *)coding);
+	check(ret == 7, "SET_LINE_CODING: %d", ret);
+	ret = host_request(0xa1, 0x21, 0, CDC_INTERFACE, 7, buf);
+	check(ret == 7 && memcmp(buf, coding, 7) == 0, "GET_LINE_CODING: %d", ret);
+	/* wrong length */
+	ret = host_request(0xa1, 0x21, 0, CDC_INTERFACE, 6, buf);
+	check(ret == SIM_STALL, "GET_LINE_CODING with wLength 6: %d", ret);
+
+	/* DTR opens the port */
+	ret = host_request(0x21, 0x22, 0x0003, CDC_INTERFACE, 0, NULL);
+	check(ret == 0, "SET_CONTROL_LINE_STATE: %d", ret);
+}
+
+static void
+test_echo(void)
+{
+	static const unsigned int sizes[] = { 1, 3, 63, 64, 65, 128, 200, 512, 1000, 4096 };
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(sizes); i++)
+		echo(sizes[i]);
+	for (unsigned int i = 0; i < 50; i++)
+		echo(1 + test_rand() % 1500);
+}
+
+/* a bus reset must end a read waiting for a packet received into its buffer */
+static void
+test_reset_read(void)
+{
+	static uint8_t out[ACM_PACKETSIZE];
+	unsigned int reads;
+	int ret;
+
+	device_timeout = 100;
+	sleep_ms(10);
+	test_fill(out, sizeof(out));
+	sim_drop_out_complete();
+	ret = host_out(ACM_ENDPOINT, out, sizeof(out));
+	check(ret == 0, "OUT packet: %d", ret);
+	/* without the transfer complete the read waits past its timeout */
+	sleep_ms(150);
+	reads = device_reads;
+	sleep_ms(20);
+	check(device_reads == reads, "read done without transfer complete");
+
+	sim_bus_reset();
+	sleep_ms(20);
+	check(device_reads != reads, "read still waiting after a bus reset");
+
+	device_timeout = 0;
+	test_enumerate();
+	test_acm();
+	echo(100);
+}
+
+static void
+test_halt(void)
+{
+	int ret;
+
+	/* clearing a halt restarts both ends at DATA0 */
+	ret = host_request(0x02, 0x01, 0, 0x80 | ACM_ENDPOINT, 0, NULL);
+	check(ret == 0, "CLEAR_FEATURE(ENDPOINT_HALT) IN: %d", ret);
+	ret = host_request(0x02, 0x01, 0, ACM_ENDPOINT, 0, NULL);
+	check(ret == 0, "CLEAR_FEATURE(ENDPOINT_HALT) OUT: %d", ret);
+	echo(100);
+	echo(1);
+
+	ret = host_request(0x02, 0x01, 0, 0x85, 0, NULL);
+	check(ret == SIM_STALL, "CLEAR_FEATURE(ENDPOINT_HALT) of endpoint 5: %d", ret);
+}
+
+static bool
+wait_for(volatile bool *flag, bool value)
+{
+	for (unsigned int i = 0; i < 1000; i++) {
+		if (*flag == value)
+			return true;
+		sleep_ms(1);
+	}
+	return false;
+}
+
+static void
+test_suspend(void)
+{
+	uint32_t suspends = usbfs_stats.suspends;
+	unsigned int errors;
+	uint8_t c;
+	int ret;
+
+	sim_suspend();
+	check(wait_for(&usbfs_suspended, true), "device didn't suspend");
+	check(usbfs_stats.suspends == suspends + 1, "suspend not counted");
+	sim_resume();
+	check(wait_for(&usbfs_suspended, false), "device didn't resume");
+	echo(10);
+
+	/* without permission the device must not wake the host */
+	sim_suspend();
+	check(wait_for(&usbfs_suspended, true), "device didn't suspend");
+	device_wake = true;
+	sleep_ms(20);
+	check(!sim_remote_wakeup(), "remote wakeup without permission");
+	sim_resume();
+	check(wait_for(&usbfs_suspended, false), "device didn't resume");
+
+	ret = host_request(0x00, 0x03, 1, 0, 0, NULL);
+	check(ret == 0, "SET_FEATURE(DEVICE_REMOTE_WAKEUP): %d", ret);
+	/* asked right away the device must still wait for 5ms of idle bus,
+	 * which the simulator reports as an error */
+	errors = sim_errors();
+	sim_suspend();
+	check(wait_for(&usbfs_suspended, true), "device didn't suspend");
+	device_wake = true;
+	for (unsigned int i = 0; i < 1000 && !sim_remote_wakeup(); i++)
+		sleep_ms(1);
+	check(sim_remote_wakeup(), "no remote wakeup");
+	check(sim_errors() == errors, "remote wakeup too early");
+	check(!usbfs_suspended, "still suspended after remote wakeup");
+	check(usbfs_stats.remote_wakeups == 1, "%u remote wakeups",
+			usbfs_stats.remote_wakeups);
+	ret = host_bulk_in(ACM_ENDPOINT, &c, 1, ACM_PACKETSIZE);
+	check(ret == 1 && c == '!', "data after remote wakeup: %d", ret);
+	ret = host_request(0x00, 0x01, 1, 0, 0, NULL);
+	check(ret == 0, "CLEAR_FEATURE(DEVICE_REMOTE_WAKEUP): %d", ret);
+}
+
+static void
+test_profile(void)
+{
+	struct sim_stats before, after;
+	const unsigned int packets = 64;
+
+	sim_stats(&before);
+	for (unsigned int i = 0; i < packets; i++)
+		echo(ACM_PACKETSIZE);
+	sim_stats(&after);
+
+	printf("usbfs: per echoed %u byte packet: %.1f register reads, "
+			"%.1f writes, %.1f interrupts\n", ACM_PACKETSIZE,
+			(double)(after.reads - before.reads) / packets,
+			(double)(after.writes - before.writes) / packets,
+			(double)(after.irqs - before.irqs) / packets);
+	/* loose bounds, so a change that adds work per packet shows up */
+	check(after.irqs - before.irqs <= 4 * packets, "%u interrupts",
+			after.irqs - before.irqs);
+	check(after.reads - before.reads + after.writes - before.writes <= 60 * packets,
+			"%u register accesses",
+			after.reads - before.reads + after.writes - before.writes);
+}
+
+static uint16_t
+fuzz_pick(const uint16_t *values, unsigned int n)
+{
+	if (test_rand() % 4 == 0)
+		return test_rand();
+	return values[test_rand() % n];
+}
+
+/*
+ * Random SETUP packets rarely match a request the device knows, so
+ * half of them are valid requests with one field changed.
+ */
+static void
+fuzz_setup(struct usb_setup_packet *p)
+{
+	static const struct usb_setup_packet valid[] = {
+		{ .bmRequestType = 0x80, .bRequest = 0x00, .wLength = 2 },
+		{ .bmRequestType = 0x00, .bRequest = 0x01, .wValue = 1 },
+		{ .bmRequestType = 0x00, .bRequest = 0x03, .wValue = 1 },
+		{ .bmRequestType = 0x00, .bRequest = 0x05, .wValue = 1 },
+		{ .bmRequestType = 0x80, .bRequest = 0x06, .wValue = 0x0100, .wLength = 18 },
+		{ .bmRequestType = 0x80, .bRequest = 0x06, .wValue = 0x0200, .wLength = 255 },
+		{ .bmRequestType = 0x80, .bRequest = 0x06, .wValue = 0x0302, .wIndex = 0x0409, .wLength = 255 },
+		{ .bmRequestType = 0x80, .bRequest = 0x08, .wLength = 1 },
+		{ .bmRequestType = 0x00, .bRequest = 0x09, .wValue = 1 },
+		{ .bmRequestType = 0x02, .bRequest = 0x01, .wIndex = 0x81 },
+		{ .bmRequestType = 0x01, .bRequest = 0x0b, .wIndex = 1 },
+		{ .bmRequestType = 0x21, .bRequest = 0x20, .wLength = 7 },
+		{ .bmRequestType = 0xa1, .bRequest = 0x21, .wLength = 7 },
+		{ .bmRequestType = 0x21, .bRequest = 0x22, .wValue = 3 },
+	};
+	static const uint16_t types[] = {
+		0x00, 0x01, 0x02, 0x80, 0x81, 0x82, 0x21, 0xa1, 0x40, 0xc0, 0x23,
+	};
+	static const uint16_t requests[] = {
+		0x00, 0x01, 0x03, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c,
+		0x20, 0x21, 0x22, 0x23, 0xfe, 0xff,
+	};
+	static const uint16_t values[] = {
+		0, 1, 2, 0x0100, 0x0200, 0x0300, 0x0301, 0x0303, 0x0304, 0x0600,
+		0x0f00, 0x2100, 127, 128, 0x00ff, 0x8000, 0xffff,
+	};
+	static const uint16_t indexes[] = {
+		0, 1, 2, 3, 0x0409, 0x80, 0x81, 0x82, 0x83, 0x84, 0x01, 0x7f, 0xffff,
+	};
+	static const uint16_t lengths[] = {
+		0, 1, 2, 7, 8, 9, 18, 63, 64, 65, 128, 255, 0xffff,
+	};
+
+	if (test_rand() % 2 == 0) {
+		*p = valid[test_rand() % ARRAY_SIZE(valid)];
+		switch (test_rand() % 5) {
+		case 0: p->bmRequestType = fuzz_pick(types, ARRAY_SIZE(types)); break;
+		case 1: p->bRequest = fuzz_pick(requests, ARRAY_SIZE(requests)); break;
+		case 2: p->wValue = fuzz_pick(values, ARRAY_SIZE(values)); break;
+		case 3: p->wIndex = fuzz_pick(indexes, ARRAY_SIZE(indexes)); break;
+		case 4: p->wLength = fuzz_pick(lengths, ARRAY_SIZE(lengths)); break;
+		}
+		return;
+	}
+	p->bmRequestType = fuzz_pick(types, ARRAY_SIZE(types));
+	p->bRequest = fuzz_pick(requests, ARRAY_SIZE(requests));
+	p->wValue = fuzz_pick(values, ARRAY_SIZE(values));
+	p->wIndex = fuzz_pick(indexes, ARRAY_SIZE(indexes));
+	p->wLength = fuzz_pick(lengths, ARRAY_SIZE(lengths));
+}
+
+static void
+test_fuzz(void)
+{
+	uint32_t dcfg = sim_reg(USBFS_DCFG) & ~USBFS_DCFG_DAR_Msk;
+	unsigned int timeouts = 0;
+	unsigned int acked = 0;
+	unsigned int stalled = 0;
+	uint8_t buf[512];
+	uint8_t status[2];
+
+	host_timeout = 200;
+	for (unsigned int i = 0; i < 2000; i++) {
+		struct usb_setup_packet p;
+		int ret;
+
+		fuzz_setup(&p);
+		/* the host only has so much buffer for the data stage */
+		if (p.wLength > sizeof(buf))
+			p.wLength = (p.bmRequestType & 0x80) ? sizeof(buf) : 65;
+		test_fill(buf, sizeof(buf));
+
+		ret = host_control(&p, buf);
+		acked += (ret >= 0);
+		stalled += (ret == SIM_STALL);
+		if (ret == HOST_TIMEOUT && timeouts++ < 10)
+			check(0, "request %02x %02x %04x %04x %04x timed out",
+					p.bmRequestType, p.bRequest,
+					p.wValue, p.wIndex, p.wLength);
+		check(ret <= p.wLength, "request %02x %02x returned %d bytes for wLength %u",
+				p.bmRequestType, p.bRequest, ret, p.wLength);
+		check((sim_reg(USBFS_DCFG) & ~USBFS_DCFG_DAR_Msk) == dcfg,
+				"request %02x %02x %04x changed DCFG to 0x%08x",
+				p.bmRequestType, p.bRequest, p.wValue, sim_reg(USBFS_DCFG));
+
+		if (i % 100 == 99) {
+			ret = host_request(0x80, 0x00, 0, 0, 2, status);
+			check(ret == 2, "GET_STATUS after %u fuzzed requests: %d", i + 1, ret);
+		}
+	}
+	host_timeout = 1000;
+	/* make sure both the handlers and the error paths were exercised */
+	check(acked >= 200 && stalled >= 200, "%u requests acked, %u stalled",
+			acked, stalled);
+	check(timeouts == 0, "%u requests timed out", timeouts);
+	check(sim_errors() == 0, "%u simulator errors while fuzzing", sim_errors());
+
+	/* the device must still work after all that */
+	test_enumerate();
+	test_acm();
+	echo(300);
+}
+
+int main(void)
+{
+	sim_start(device);
+
+	test_enumerate();
+	test_requests();
+	test_acm();
+	test_echo();
+	test_reset_read();
+	test_halt();
+	test_suspend();
+	test_profile();
+	test_fuzz();
+
+	check(!sim_reset_requested(), "the device reset itself");
+	check(sim_errors() == 0, "%u simulator errors", sim_errors());
+	return test_done("usbfs");
+}
@@ -0,0 +1,390 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * Host side packer for compressed images accepted by
+ * examples/dfu-bootloader when built with DFU_LZ=1
+ *
+ * Build with
+ *   cc -O2 -o dfu-pack tools/dfu-pack.c
+ * and run with
+ *   ./dfu-pack [-r] build/main.bin main.dfz
+ *   dfu-util -D main.dfz
+ *
+ * The image is padded to a multiple of 4 bytes, its length is stored
+ * in a reserved entry of the vector table and it gets the trailer
+ * described in examples/dfu-bootloader/image.h, with the crc
+ * calculated by the bootloader's software fallback. The result is
+ * compressed as described in examples/dfu-bootloader/lz.h, or written
+ * as is with -r. Before writing anything the crc code is checked
+ * against known values of the CRC unit and the packed image is
+ * decoded again with the bootloader's own decoder, fed in DFU sized
+ * transfers into two page buffers just like on the device, and
+ * compared with the input.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../examples/dfu-bootloader/crc32.c"
+#include "../examples/dfu-bootloader/lz.c"
+
+/* must match DFU_TRANSFERSIZE, PAGE_SIZE, IMAGE_MAGIC and
+ * IMAGE_LENGTH_WORD of the bootloader */
+#define TRANSFERSIZE 1024U
+#define PAGE_SIZE    1024U
+#define IMAGE_MAGIC  0x4d494447U /* "GDIM" */
+#define IMAGE_LENGTH_WORD 4
+#define MAXMATCH     (1U << 16)
+
+/* crcs of the CRC unit after reset and feeding it these words */
+static const struct {
+	uint32_t words[4];
+	size_t len;
+	uint32_t crc;
+} crc_vectors[] = {
+	{ { 0 }, 0, 0xffffffffU },
+	{ { 0x00000000U }, 1, 0xc704dd7bU },
+	{ { 0xffffffffU }, 1, 0x00000000U },
+	{ { 0x12345678U }, 1, 0xdf8a8a2bU },
+	{ { 0x12345678U, 0x9abcdef0U }, 2, 0x7d24a31bU },
+	/* "GD32VF103 image!" read as little endian words */
+	{ { 0x32334447U, 0x30314656U, 0x6d692033U, 0x21656761U }, 4, 0x129b2ca2U },
+};
+
+static int
+crc_check(void)
+{
+	for (size_t i = 0; i < sizeof(crc_vectors)/sizeof(crc_vectors[0]); i++) {
+		uint32_t crc = crc32_update(0xffffffffU,
+				crc_vectors[i].words, crc_vectors[i].len);
+
+		if (crc != crc_vectors[i].crc) {
+			fprintf(stderr, "crc vector %zu: got 0x%08x, expected 0x%08x\n",
+					i, crc, crc_vectors[i].crc);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/*
+ * pad image to whole words, store the length in the vector table
+ * and append the trailer, buf must have room
+ */
+static size_t
+add_trailer(uint8_t *image, size_t size)
+{
+	uint32_t crc = 0xffffffffU;
+
+	while (size % 4)
+		image[size++] = 0xff;
+	put_le32(&image[4*IMAGE_LENGTH_WORD], size);
+
+	for (size_t i = 0; i < size; i += 4) {
+		uint32_t word = image[i] |
+			image[i + 1] << 8 |
+			image[i + 2] << 16 |
+			(uint32_t)image[i + 3] << 24;
+
+		crc = crc32_update(crc, &word, 1);
+	}
+
+	put_le32(&image[size], size);
+	put_le32(&image[size + 4], crc);
+	put_le32(&image[size + 8], IMAGE_MAGIC);
+	return size + 12;
+}
+
+static uint8_t *
+read_file(const char *name, size_t *size)
+{
+	FILE *f = fopen(name, "rb");
+	uint8_t *buf = NULL;
+	size_t len = 0;
+	size_t n;
+
+	if (f == NULL)
+		return NULL;
+	do {
+		uint8_t *nbuf = realloc(buf, len + 65536);
+
+		if (nbuf == NULL) {
+			free(buf);
+			fclose(f);
+			return NULL;
+		}
+		buf = nbuf;
+		n = fread(buf + len, 1, 65536, f);
+		len += n;
+	} while (n == 65536);
+	if (ferror(f)) {
+		free(buf);
+		buf = NULL;
+	}
+	fclose(f);
+	*size = len;
+	return buf;
+}
+
+static uint8_t *
+put_length(uint8_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+static uint8_t *
+put_sequence(uint8_t *op, const uint8_t *lit, size_t litlen,
+		size_t dist, size_t matchlen)
+{
+	uint8_t *token = op++;
+
+	*token = (litlen < 15 ? litlen : 15) << 4;
+	if (litlen >= 15)
+		op = put_length(op, litlen - 15);
+	memcpy(op, lit, litlen);
+	op += litlen;
+
+	if (matchlen == 0)
+		return op;
+
+	*op++ = dist;
+	*op++ = dist >> 8;
+	matchlen -= LZ_MINMATCH;
+	*token |= matchlen < 15 ? matchlen : 15;
+	if (matchlen >= 15)
+		op = put_length(op, matchlen - 15);
+	return op;
+}
+
+/* greedy longest match within the window */
+static size_t
+pack(const uint8_t *in, size_t size, uint8_t *out)
+{
+	uint8_t *op = out + LZ_HEADER;
+	size_t start = 0;
+	size_t i = 0;
+
+	out[0] = 'G';
+	out[1] = 'D';
+	out[2] = 'Z';
+	out[3] = '1';
+	put_le32(&out[4], size);
+
+	while (i < size) {
+		size_t max = size - i;
+		size_t best = 0;
+		size_t dist = 0;
+
+		if (max > MAXMATCH)
+			max = MAXMATCH;
+		for (size_t d = 1; d <= LZ_WINDOW && d <= i; d++) {
+			const uint8_t *a = &in[i];
+			const uint8_t *b = &in[i - d];
+			size_t n = 0;
+
+			while (n < max && a[n] == b[n])
+				n++;
+			if (n > best) {
+				best = n;
+				dist = d;
+				if (n == max)
+					break;
+			}
+		}
+
+		if (best < LZ_MINMATCH) {
+			i++;
+			continue;
+		}
+
+		op = put_sequence(op, &in[start], i - start, dist, best);
+		i += best;
+		start = i;
+	}
+	if (start < size)
+		op = put_sequence(op, &in[start], size - start, 0, 0);
+
+	return op - out;
+}
+
+/* decode like the bootloader does and compare with the original */
+static int
+verify(const uint8_t *packed, size_t len, const uint8_t *image, size_t size)
+{
+	static uint8_t ring[LZ_RING];
+	const uint8_t *p = packed + LZ_HEADER;
+	const uint8_t *end = packed + len;
+	unsigned int head = 0;
+	unsigned int tail = 0;
+	unsigned int offset = 0;
+	size_t done = 0;
+	struct lz z;
+
+	lz_init(&z, size);
+	while (p < end && z.done < z.size) {
+		const uint8_t *tend = p + TRANSFERSIZE;
+
+		if (tend > end)
+			tend = end;
+		while (z.done < z.size) {
+			unsigned int space = (2 - (head - tail)) * PAGE_SIZE - offset;
+			int n;
+
+			if (space == 0) {
+				/* program the oldest page */
+				if (memcmp(&ring[(tail % 2) * PAGE_SIZE], &image[done], PAGE_SIZE))
+					return -1;
+				done += PAGE_SIZE;
+				tail++;
+				continue;
+			}
+			n = lz_decode(&z, &p, tend, ring,
+					(head % 2) * PAGE_SIZE + offset, space);
+			if (n < 0)
+				return -1;
+			offset += n;
+			head += offset / PAGE_SIZE;
+			offset %= PAGE_SIZE;
+			/* the next transfer is needed when out of input */
+			if (p == tend && (unsigned int)n < space)
+				break;
+		}
+	}
+	if (z.done != z.size)
+		return -1;
+
+	/* the remaining pages, the last one possibly partial */
+	for (; tail != head || offset > 0; tail++) {
+		size_t n = size - done < PAGE_SIZE ? size - done : PAGE_SIZE;
+
+		if (memcmp(&ring[(tail % 2) * PAGE_SIZE], &image[done], n))
+			return -1;
+		done += n;
+		if (tail == head)
+			break;
+	}
+	return done == size ? 0 : -1;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *in;
+	const char *out;
+	uint8_t *image;
+	uint8_t *packed;
+	size_t size;
+	size_t len;
+	int raw = 0;
+	FILE *f;
+
+	if (argc == 4 && !strcmp(argv[1], "-r")) {
+		raw = 1;
+		argv++;
+		argc--;
+	}
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s [-r] <image.bin> <image.dfz>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	in = argv[1];
+	out = argv[2];
+
+	if (crc_check())
+		return EXIT_FAILURE;
+
+	image = read_file(in, &size);
+	if (image == NULL) {
+		fprintf(stderr, "%s: %s\n", in, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (size < 4*(IMAGE_LENGTH_WORD + 1) || size > UINT32_MAX - 16) {
+		fprintf(stderr, "%s: bad image size %zu\n", in, size);
+		return EXIT_FAILURE;
+	}
+	for (size_t i = 4*IMAGE_LENGTH_WORD; i < 4*(IMAGE_LENGTH_WORD + 1); i++) {
+		if (image[i] == 0)
+			continue;
+		fprintf(stderr, "%s: reserved vector table entry in use, "
+				"not built with start.S?\n", in);
+		return EXIT_FAILURE;
+	}
+	image = realloc(image, size + 16);
+	if (image == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return EXIT_FAILURE;
+	}
+	size = add_trailer(image, size);
+
+	if (raw) {
+		packed = image;
+		len = size;
+	} else {
+		/* worst case is all literals */
+		packed = malloc(LZ_HEADER + size + size/255 + 16);
+		if (packed == NULL) {
+			fprintf(stderr, "out of memory\n");
+			return EXIT_FAILURE;
+		}
+		len = pack(image, size, packed);
+
+		if (verify(packed, len, image, size)) {
+			fprintf(stderr, "packed image doesn't decode correctly\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	f = fopen(out, "wb");
+	if (f == NULL || fwrite(packed, 1, len, f) != len || fclose(f)) {
+		fprintf(stderr, "%s: %s\n", out, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	printf("%zu -> %zu bytes (%.1f%%), %zu -> %zu transfers\n",
+			size, len, 100.0 * len / size,
+			(size + TRANSFERSIZE - 1) / TRANSFERSIZE,
+			(len + TRANSFERSIZE - 1) / TRANSFERSIZE);
+	if (packed != image)
+		free(packed);
+	free(image);
+	return EXIT_SUCCESS;
+}
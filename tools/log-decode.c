@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * Host side decoder for lib/log.c
+ *
+ * Build with
+ *   cc -O2 -o log-decode tools/log-decode.c
+ * and run with the firmware ELF file and the serial port, eg.
+ *   stty -F /dev/ttyACM0 raw
+ *   ./log-decode build/main.elf < /dev/ttyACM0
+ *
+ * Plain text on the stream is passed through as is.
+ */
+#include <elf.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SLIP_END     0xc0
+#define SLIP_ESC     0xdb
+#define SLIP_ESC_END 0xdc
+#define SLIP_ESC_ESC 0xdd
+#define SLIP_ESC_LF  0xde
+#define SLIP_ESC_CR  0xdf
+
+struct section {
+	uint32_t addr;
+	uint32_t size;
+	const char *data;
+};
+
+static struct section logstr;
+static struct section *loaded;
+static unsigned int nloaded;
+
+static int
+elf_load(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	const Elf32_Ehdr *eh;
+	const Elf32_Shdr *sh;
+	const char *names;
+	char *elf;
+	long size;
+
+	if (f == NULL) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+	elf = malloc(size);
+	if (elf == NULL || fread(elf, 1, size, f) != (size_t)size) {
+		fprintf(stderr, "%s: error reading file\n", path);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	eh = (const Elf32_Ehdr *)elf;
+	if (size < (long)sizeof(*eh) ||
+			memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 ||
+			eh->e_ident[EI_CLASS] != ELFCLASS32 ||
+			eh->e_ident[EI_DATA] != ELFDATA2LSB ||
+			eh->e_shoff + (long)eh->e_shnum * sizeof(*sh) > (unsigned long)size) {
+		fprintf(stderr, "%s: not a 32-bit little-endian ELF file\n", path);
+		return -1;
+	}
+
+	sh = (const Elf32_Shdr *)(elf + eh->e_shoff);
+	names = elf + sh[eh->e_shstrndx].sh_offset;
+	loaded = calloc(eh->e_shnum, sizeof(*loaded));
+	for (unsigned int i = 0; i < eh->e_shnum; i++) {
+		struct section s = {
+			.addr = sh[i].sh_addr,
+			.size = sh[i].sh_size,
+			.data = elf + sh[i].sh_offset,
+		};
+
+		if (sh[i].sh_type != SHT_PROGBITS ||
+				sh[i].sh_offset + sh[i].sh_size > (unsigned long)size)
+			continue;
+		if (strcmp(names + sh[i].sh_name, ".logstr") == 0)
+			logstr = s;
+		else if (sh[i].sh_flags & SHF_ALLOC)
+			loaded[nloaded++] = s;
+	}
+	if (logstr.data == NULL) {
+		fprintf(stderr, "%s: no .logstr section\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+static const char *
+elf_string(const struct section *s, uint32_t addr)
+{
+	if (addr - s->addr >= s->size)
+		return NULL;
+	if (memchr(s->data + (addr - s->addr), '\0', s->size - (addr - s->addr)) == NULL)
+		return NULL;
+	return s->data + (addr - s->addr);
+}
+
+static const char *
+flash_string(uint32_t addr)
+{
+	for (unsigned int i = 0; i < nloaded; i++) {
+		const char *str = elf_string(&loaded[i], addr);
+
+		if (str)
+			return str;
+	}
+	return NULL;
+}
+
+static void
+render(const char *fmt, const uint32_t *args, unsigned int nargs)
+{
+	while (*fmt) {
+		char spec[32];
+		unsigned int len = 0;
+		uint32_t v;
+
+		if (*fmt != '%') {
+			putchar(*fmt++);
+			continue;
+		}
+
+		spec[len++] = *fmt++;
+		while (*fmt && strchr("#0- +", *fmt) && len < 8)
+			spec[len++] = *fmt++;
+		if (*fmt == '*') {
+			fmt++;
+			len += sprintf(spec + len, "%d", nargs ? (int32_t)*args : 0);
+			if (nargs) {
+				args++;
+				nargs--;
+			}
+		}
+		while (*fmt >= '0' && *fmt <= '9' && len < 16)
+			spec[len++] = *fmt++;
+		while (*fmt == 'h' || *fmt == 'l' || *fmt == 'z')
+			fmt++;
+
+		if (*fmt == '\0')
+			break;
+		if (*fmt == '%') {
+			putchar('%');
+			fmt++;
+			continue;
+		}
+		if (nargs == 0) {
+			fputs("<?>", stdout);
+			fmt++;
+			continue;
+		}
+		v = *args++;
+		nargs--;
+
+		spec[len++] = *fmt;
+		spec[len] = '\0';
+		switch (*fmt++) {
+		case 'd':
+		case 'i':
+			printf(spec, (int)(int32_t)v);
+			break;
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'o':
+			printf(spec, (unsigned int)v);
+			break;
+		case 'c':
+			printf(spec, (int)(v & 0xffU));
+			break;
+		case 's': {
+			const char *str = flash_string(v);
+
+			if (str)
+				printf(spec, str);
+			else
+				printf("<0x%08x>", (unsigned int)v);
+			break;
+		}
+		default:
+			printf("<%s 0x%08x>", spec, (unsigned int)v);
+		}
+	}
+}
+
+static void
+decode(const uint8_t *frame, unsigned int len)
+{
+	uint32_t values[1 + 32];
+	unsigned int n = 0;
+	uint32_t v = 0;
+	unsigned int shift = 0;
+	const char *fmt;
+
+	for (unsigned int i = 0; i < len; i++) {
+		if (shift < 32)
+			v |= (uint32_t)(frame[i] & 0x7fU) << shift;
+		shift += 7;
+		if (frame[i] & 0x80U)
+			continue;
+		if (n < sizeof(values)/sizeof(values[0]))
+			values[n++] = v;
+		v = 0;
+		shift = 0;
+	}
+	if (n == 0 || shift != 0) {
+		fputs("<broken log record>\n", stdout);
+		return;
+	}
+
+	fmt = elf_string(&logstr, values[0]);
+	if (fmt == NULL) {
+		printf("<unknown log record 0x%08x>\n", (unsigned int)values[0]);
+		return;
+	}
+	render(fmt, values + 1, n - 1);
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *in = stdin;
+	uint8_t frame[512];
+	unsigned int len = 0;
+	bool inside = false;
+	bool escaped = false;
+	int c;
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: %s <firmware.elf> [input]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (elf_load(argv[1]))
+		return EXIT_FAILURE;
+	if (argc > 2) {
+		in = fopen(argv[2], "rb");
+		if (in == NULL) {
+			fprintf(stderr, "%s: %s\n", argv[2], strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+
+	while ((c = getc(in)) != EOF) {
+		if (!inside) {
+			if (c == SLIP_END) {
+				inside = true;
+				len = 0;
+			} else if (c != '\r') {
+				putchar(c);
+				if (c == '\n')
+					fflush(stdout);
+			}
+			continue;
+		}
+
+		if (c == SLIP_END) {
+			if (len > 0) {
+				decode(frame, len);
+				fflush(stdout);
+				inside = false;
+			}
+			escaped = false;
+			continue;
+		}
+		if (escaped) {
+			switch (c) {
+			case SLIP_ESC_END: c = SLIP_END; break;
+			case SLIP_ESC_ESC: c = SLIP_ESC; break;
+			case SLIP_ESC_LF:  c = '\n'; break;
+			case SLIP_ESC_CR:  c = '\r'; break;
+			}
+			escaped = false;
+		} else if (c == SLIP_ESC) {
+			escaped = true;
+			continue;
+		}
+		if (len < sizeof(frame))
+			frame[len++] = c;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,373 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * Host side of the examples/usbacm-bench firmware
+ *
+ * Build with
+ *   cc -O2 -o usbacm-bench tools/usbacm-bench.c
+ * and run with
+ *   ./usbacm-bench [-d device] [-n megabytes] [-r roundtrips]
+ *
+ * Measures sink, source and echo throughput over the ACM port for a
+ * range of write/read sizes, and round-trip latency percentiles of
+ * echoing single messages of a range of sizes. Only the board
+ * itself is needed.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BUFSIZE 65536
+
+static const unsigned int throughput_sizes[] = { 64, 512, 4096, 65536 };
+static const unsigned int latency_sizes[] = { 1, 16, 63, 64, 256, 1024 };
+
+static uint8_t out[BUFSIZE];
+static uint8_t in[BUFSIZE];
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int
+tty_open(const char *path)
+{
+	struct termios tio;
+	int fd = open(path, O_RDWR | O_NOCTTY);
+
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (tcgetattr(fd, &tio) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	/* no line discipline processing, just bytes */
+	cfmakeraw(&tio);
+	tio.c_cc[VMIN] = 1;
+	tio.c_cc[VTIME] = 0;
+	tcsetattr(fd, TCSANOW, &tio);
+	tcflush(fd, TCIOFLUSH);
+	return fd;
+}
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len > 0) {
+		ssize_t ret = write(fd, p, len);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "error writing: %s\n", strerror(errno));
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int
+read_all(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+
+	while (len > 0) {
+		ssize_t ret = read(fd, p, len);
+
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			fprintf(stderr, "error reading: %s\n",
+					ret ? strerror(errno) : "end of file");
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int
+command(int fd, char cmd, uint32_t len)
+{
+	uint8_t hdr[5] = {
+		cmd,
+		len & 0xFF,
+		(len >> 8) & 0xFF,
+		(len >> 16) & 0xFF,
+		len >> 24,
+	};
+
+	return write_all(fd, hdr, sizeof(hdr));
+}
+
+static double
+sink(int fd, unsigned long total, unsigned int size)
+{
+	double start = now();
+	unsigned long done;
+	char ack;
+
+	if (command(fd, 's', total))
+		return -1;
+	for (done = 0; done < total; done += size) {
+		unsigned int n = (total - done < size) ? total - done : size;
+
+		if (write_all(fd, out, n))
+			return -1;
+	}
+	if (read_all(fd, &ack, 1))
+		return -1;
+	if (ack != 'k') {
+		fprintf(stderr, "sink: expected 'k', got 0x%02x\n", ack);
+		return -1;
+	}
+	return now() - start;
+}
+
+static double
+source(int fd, unsigned long total, unsigned int size)
+{
+	double start = now();
+	unsigned long done;
+
+	if (command(fd, 'o', total))
+		return -1;
+	for (done = 0; done < total;) {
+		unsigned int n = (total - done < size) ? total - done : size;
+		ssize_t ret = read(fd, in, n);
+
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			fprintf(stderr, "error reading: %s\n",
+					ret ? strerror(errno) : "end of file");
+			return -1;
+		}
+		for (ssize_t i = 0; i < ret; i++) {
+			if (in[i] != (uint8_t)(done + i)) {
+				fprintf(stderr, "source: data mismatch at byte %lu\n",
+						done + i);
+				return -1;
+			}
+		}
+		done += ret;
+	}
+	return now() - start;
+}
+
+static double
+echo(int fd, unsigned long total, unsigned int size)
+{
+	double start = now();
+	unsigned long sent = 0;
+	unsigned long got = 0;
+	int flags = fcntl(fd, F_GETFL);
+	double ret = -1;
+
+	if (command(fd, 'e', total))
+		return -1;
+	/* the device stops echoing when we don't read, so never block writing */
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	while (got < total) {
+		struct pollfd pfd = {
+			.fd = fd,
+			.events = POLLIN | (sent < total ? POLLOUT : 0),
+		};
+		ssize_t n;
+
+		if (poll(&pfd, 1, 1000) <= 0) {
+			fprintf(stderr, "echo: timeout\n");
+			goto out;
+		}
+		if (pfd.revents & POLLOUT) {
+			unsigned int off = sent % size;
+			unsigned int len = size - off;
+
+			if (len > total - sent)
+				len = total - sent;
+			n = write(fd, out + off, len);
+			if (n < 0 && errno != EINTR && errno != EAGAIN) {
+				fprintf(stderr, "error writing: %s\n", strerror(errno));
+				goto out;
+			}
+			if (n > 0)
+				sent += n;
+		}
+		if (pfd.revents & POLLIN) {
+			n = read(fd, in, sizeof(in));
+			if (n < 0 && errno != EINTR && errno != EAGAIN) {
+				fprintf(stderr, "error reading: %s\n", strerror(errno));
+				goto out;
+			}
+			if (n > 0)
+				got += n;
+		}
+	}
+	ret = now() - start;
+out:
+	fcntl(fd, F_SETFL, flags);
+	return ret;
+}
+
+static int
+double_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double
+percentile(const double *v, unsigned int n, unsigned int p)
+{
+	unsigned int i = (n * p + 99) / 100;
+
+	return v[i ? i - 1 : 0];
+}
+
+static int
+latency(int fd, unsigned int size, unsigned int rounds)
+{
+	double *t = calloc(rounds, sizeof(*t));
+	unsigned int i;
+
+	if (t == NULL)
+		return -1;
+	for (i = 0; i < rounds; i++) {
+		double start = now();
+
+		if (command(fd, 'e', size) ||
+				write_all(fd, out, size) ||
+				read_all(fd, in, size)) {
+			free(t);
+			return -1;
+		}
+		t[i] = now() - start;
+		if (memcmp(in, out, size) != 0) {
+			fprintf(stderr, "echo: data mismatch\n");
+			free(t);
+			return -1;
+		}
+	}
+	qsort(t, rounds, sizeof(*t), double_cmp);
+	printf("%6u %9.0f %9.0f %9.0f %9.0f\n", size,
+			percentile(t, rounds, 50) * 1e6,
+			percentile(t, rounds, 90) * 1e6,
+			percentile(t, rounds, 99) * 1e6,
+			t[rounds - 1] * 1e6);
+	free(t);
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *dev = "/dev/ttyACM0";
+	unsigned long total = 4UL << 20;
+	unsigned int rounds = 1000;
+	unsigned int i;
+	int fd;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:n:r:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev = optarg;
+			break;
+		case 'n':
+			total = strtoul(optarg, NULL, 0) << 20;
+			if (total == 0 || total > UINT32_MAX)
+				goto usage;
+			break;
+		case 'r':
+			rounds = strtoul(optarg, NULL, 0);
+			if (rounds == 0)
+				goto usage;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	fd = tty_open(dev);
+	if (fd < 0)
+		return EXIT_FAILURE;
+
+	srand(1);
+	for (i = 0; i < sizeof(out); i++)
+		out[i] = rand();
+
+	printf("  size      sink    source      echo (MB/s, %lu MB each)\n",
+			total >> 20);
+	for (i = 0; i < sizeof(throughput_sizes)/sizeof(throughput_sizes[0]); i++) {
+		unsigned int size = throughput_sizes[i];
+		double ts = sink(fd, total, size);
+		double to = (ts < 0) ? -1 : source(fd, total, size);
+		double te = (to < 0) ? -1 : echo(fd, total, size);
+
+		if (te < 0)
+			return EXIT_FAILURE;
+		printf("%6u %9.3f %9.3f %9.3f\n", size,
+				total / ts / 1e6, total / to / 1e6, total / te / 1e6);
+	}
+
+	printf("\n  size       p50       p90       p99       max (us round-trip, %u rounds)\n",
+			rounds);
+	for (i = 0; i < sizeof(latency_sizes)/sizeof(latency_sizes[0]); i++) {
+		if (latency(fd, latency_sizes[i], rounds))
+			return EXIT_FAILURE;
+	}
+
+	close(fd);
+	return EXIT_SUCCESS;
+usage:
+	fprintf(stderr, "usage: %s [-d device] [-n megabytes] [-r roundtrips]\n",
+			argv[0]);
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2020, Emil Renner Berthing
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * Host side loopback test for the vendor bulk interface of
+ * lib/usbfs-vendor.c as used by examples/usbacm-bench
+ *
+ * Build with
+ *   cc -O2 -o usbvendor-loop tools/usbvendor-loop.c
+ * and run with
+ *   ./usbvendor-loop [-d vid:pid] [-i interface] [-e endpoint] [-s chunk] [-n megabytes]
+ *
+ * Chunks of pseudo random data are written to the OUT endpoint and
+ * read back from the IN endpoint, checked and timed. It talks to the
+ * Linux usbfs directly, so libusb is not needed, but the user must
+ * be allowed to open the /dev/bus/usb node of the device.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/usbdevice_fs.h>
+
+/* the usbacm-bench firmware can loop at most this much at a time */
+#define DEVICE_BUFSIZE 4096
+#define PACKETSIZE 64
+
+static unsigned int
+sysfs_read(const char *dev, const char *attr, int base)
+{
+	char path[512];
+	char buf[32];
+	FILE *f;
+	unsigned int ret = 0;
+
+	snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/%s", dev, attr);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+	if (fgets(buf, sizeof(buf), f) != NULL)
+		ret = strtoul(buf, NULL, base);
+	fclose(f);
+	return ret;
+}
+
+static int
+device_open(unsigned int vid, unsigned int pid)
+{
+	DIR *dir = opendir("/sys/bus/usb/devices");
+	struct dirent *de;
+	int fd = -1;
+
+	if (dir == NULL) {
+		fprintf(stderr, "/sys/bus/usb/devices: %s\n", strerror(errno));
+		return -1;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		char path[64];
+
+		/* interfaces have a ':' in their name */
+		if (de->d_name[0] == '.' || strchr(de->d_name, ':'))
+			continue;
+		if (sysfs_read(de->d_name, "idVendor", 16) != vid ||
+				sysfs_read(de->d_name, "idProduct", 16) != pid)
+			continue;
+
+		snprintf(path, sizeof(path), "/dev/bus/usb/%03u/%03u",
+				sysfs_read(de->d_name, "busnum", 10),
+				sysfs_read(de->d_name, "devnum", 10));
+		fd = open(path, O_RDWR);
+		if (fd < 0)
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		break;
+	}
+	closedir(dir);
+	if (de == NULL)
+		fprintf(stderr, "no %04x:%04x device found\n", vid, pid);
+	return fd;
+}
+
+static int
+bulk(int fd, unsigned int ep, void *data, unsigned int len)
+{
+	struct usbdevfs_bulktransfer bt = {
+		.ep = ep,
+		.len = len,
+		.timeout = 1000,
+		.data = data,
+	};
+
+	return ioctl(fd, USBDEVFS_BULK, &bt);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned int vid = 0x1d50;
+	unsigned int pid = 0x613f;
+	unsigned int intf = 2;
+	unsigned int ep = 3;
+	unsigned int chunk = DEVICE_BUFSIZE;
+	unsigned long total = 16UL << 20;
+	unsigned long done;
+	static uint8_t out[DEVICE_BUFSIZE];
+	static uint8_t in[DEVICE_BUFSIZE];
+	uint32_t seed = 1;
+	double start;
+	int fd;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:i:e:s:n:")) != -1) {
+		switch (opt) {
+		case 'd':
+			if (sscanf(optarg, "%x:%x", &vid, &pid) != 2)
+				goto usage;
+			break;
+		case 'i':
+			intf = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			ep = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			chunk = strtoul(optarg, NULL, 0);
+			if (chunk == 0 || chunk > DEVICE_BUFSIZE)
+				goto usage;
+			break;
+		case 'n':
+			total = strtoul(optarg, NULL, 0) << 20;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	fd = device_open(vid, pid);
+	if (fd < 0)
+		return EXIT_FAILURE;
+	if (ioctl(fd, USBDEVFS_CLAIMINTERFACE, &intf) < 0) {
+		fprintf(stderr, "error claiming interface %u: %s\n",
+				intf, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	start = now();
+	for (done = 0; done < total; done += chunk) {
+		unsigned int got;
+
+		for (unsigned int i = 0; i < chunk; i++) {
+			seed = seed * 1103515245 + 12345;
+			out[i] = seed >> 16;
+		}
+
+		if (bulk(fd, ep, out, chunk) != (int)chunk) {
+			fprintf(stderr, "error writing: %s\n", strerror(errno));
+			return EXIT_FAILURE;
+		}
+		/* end the device's transfer early with a zero length packet */
+		if (chunk < DEVICE_BUFSIZE && chunk % PACKETSIZE == 0 &&
+				bulk(fd, ep, out, 0) < 0) {
+			fprintf(stderr, "error writing: %s\n", strerror(errno));
+			return EXIT_FAILURE;
+		}
+
+		for (got = 0; got < chunk;) {
+			int ret = bulk(fd, 0x80 | ep, in + got, chunk - got);
+
+			if (ret < 0) {
+				fprintf(stderr, "error reading: %s\n", strerror(errno));
+				return EXIT_FAILURE;
+			}
+			got += ret;
+		}
+
+		if (memcmp(in, out, chunk) != 0) {
+			fprintf(stderr, "data mismatch after %lu bytes\n", done);
+			return EXIT_FAILURE;
+		}
+	}
+
+	start = now() - start;
+	printf("%lu bytes each way in %.3fs, %.1f kB/s\n",
+			done, start, done / start / 1000.0);
+
+	ioctl(fd, USBDEVFS_RELEASEINTERFACE, &intf);
+	close(fd);
+	return EXIT_SUCCESS;
+usage:
+	fprintf(stderr, "usage: %s [-d vid:pid] [-i interface] [-e endpoint] "
+			"[-s chunk] [-n megabytes]\n", argv[0]);
+	return EXIT_FAILURE;
+}